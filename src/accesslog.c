@@ -0,0 +1,50 @@
+#include <string.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "logger.h"
+#include "metrics.h"
+
+static const access_log_header_t header = {
+	.magic = ACCESS_LOG_MAGIC,
+	.byte_order = ACCESS_LOG_BYTE_ORDER,
+	.record_size = sizeof(access_log_record_t)
+};
+
+static int enabled = 0;
+static __thread int worker_id = 0;
+
+int access_log_init(const char* filename) {
+	if (logger_open_access(filename, &header, sizeof(header)) != 0) return -1;
+	enabled = 1;
+	return 0;
+}
+
+int access_log_enabled(void) {
+	return enabled;
+}
+
+void access_log_attach(int worker) {
+	worker_id = worker;
+}
+
+void access_log_request(const connection_t* conn, const response_t* resp) {
+	if (!enabled) return;
+
+	access_log_record_t record;
+	memset(&record, 0, sizeof(record));
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	record.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	record.uri_id = resp->uri_id;
+	record.body_bytes = resp->body_len + (resp->file_fd >= 0 ? resp->file_end - resp->file_start : 0);
+	memcpy(record.addr, conn->client_addr, sizeof(record.addr));
+	if (resp->start_ns) {
+		uint64_t us = (metrics_now_ns() - resp->start_ns) / 1000;
+		record.latency_us = us > UINT32_MAX ? UINT32_MAX : us;
+	}
+	record.status = resp->status;
+	record.worker = worker_id;
+	record.flags = (conn->ssl ? ACCESS_FLAG_TLS : 0) | (conn->h2 ? ACCESS_FLAG_HTTP2 : 0);
+	logger_access(&record, sizeof(record));
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+
+/*
+ * The access log: one fixed-size binary record per response written, in a
+ * file of its own, batched through the logger's rings. tools/accesslog turns
+ * it back into text or CSV.
+ *
+ * A file starts with an access_log_header_t and records follow it, in order
+ * within each worker. Numbers are in the byte order of the machine that wrote
+ * them; byte_order tells.
+ */
+
+#define ACCESS_LOG_MAGIC "GRGACC01"
+#define ACCESS_LOG_BYTE_ORDER 0x01020304u
+
+typedef struct {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t record_size;
+} access_log_header_t;
+
+#define ACCESS_FLAG_TLS 1
+#define ACCESS_FLAG_HTTP2 2
+
+typedef struct {
+	uint64_t time_ns;      // CLOCK_REALTIME, when the response was done
+	uint64_t uri_id;       // access_log_uri_id() of the request target
+	uint64_t body_bytes;   // of the representation; 0 for built-in error pages
+	uint8_t addr[16];      // IPv6, or IPv4 mapped into it
+	uint32_t latency_us;   // from the request's first byte to its response's last
+	uint16_t status;
+	uint8_t worker;
+	uint8_t flags;         // ACCESS_FLAG_*
+} access_log_record_t;
+
+_Static_assert(sizeof(access_log_record_t) == 48, "access log records are fixed at 48 bytes");
+
+// FNV-1a of the request target as the server looked it up, the same as
+// pack_hash(), so the decoder can name URIs by walking the site.
+static inline uint64_t access_log_uri_id(const char* uri) {
+	uint64_t hash = 14695981039346656037ull;
+	while (*uri) {
+		hash ^= (unsigned char)*uri++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+int access_log_init(const char* filename);
+int access_log_enabled(void);
+void access_log_attach(int worker);
+// Called once a response has been written completely.
+void access_log_request(const connection_t* conn, const response_t* resp);
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+
+#include "affinity.h"
+#include "logger.h"
+
+static int* worker_cpu = NULL;
+static int num_workers = 0;
+static int worker_on_cpu[CPU_SETSIZE];
+
+typedef struct {
+	int cpu;
+	int node;
+	int sibling; // 0 for the first hyperthread of a core
+} cpu_info_t;
+
+// /sys/devices/system/cpu/cpuN has a nodeM link on NUMA kernels; without one
+// everything is node 0.
+int affinity_cpu_node(int cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if (!dir) return 0;
+
+	int node = 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char)entry->d_name[4])) {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+static int is_sibling(int cpu) {
+	char path[96];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	FILE* file = fopen(path, "re");
+	if (!file) return 0;
+	int first = cpu;
+	if (fscanf(file, "%d", &first) != 1) first = cpu;
+	fclose(file);
+	return first != cpu;
+}
+
+static int compare_cpus(const void* a, const void* b) {
+	const cpu_info_t* x = a;
+	const cpu_info_t* y = b;
+	if (x->node != y->node) return x->node - y->node;
+	if (x->sibling != y->sibling) return x->sibling - y->sibling;
+	return x->cpu - y->cpu;
+}
+
+// Every allowed CPU, a node at a time and the first hyperthread of each core
+// before the rest, so a handful of workers neither straddle nodes nor share a
+// core while another sits idle.
+static int auto_cpus(const cpu_set_t* allowed, int* cpus) {
+	cpu_info_t* info = malloc(CPU_SETSIZE * sizeof(cpu_info_t));
+	if (!info) return -1;
+	int count = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, allowed)) continue;
+		info[count].cpu = cpu;
+		info[count].node = affinity_cpu_node(cpu);
+		info[count].sibling = is_sibling(cpu);
+		count++;
+	}
+	qsort(info, count, sizeof(cpu_info_t), compare_cpus);
+	for (int i = 0; i < count; i++) {
+		cpus[i] = info[i].cpu;
+	}
+	free(info);
+	return count;
+}
+
+// "0-3,8,10-11", kept in the order written.
+static int parse_cpu_list(const char* spec, int* cpus) {
+	int count = 0;
+	const char* p = spec;
+	while (*p) {
+		char* end;
+		long first = strtol(p, &end, 10);
+		if (end == p) return -1;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1) return -1;
+			p = end;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+		for (long cpu = first; cpu <= last && count < CPU_SETSIZE; cpu++) {
+			cpus[count++] = (int)cpu;
+		}
+		while (isspace((unsigned char)*p)) p++;
+		if (*p == ',') {
+			p++;
+		} else if (*p) {
+			return -1;
+		}
+		while (isspace((unsigned char)*p)) p++;
+	}
+	return count;
+}
+
+int affinity_init(const server_config* config) {
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		worker_on_cpu[cpu] = -1;
+	}
+	if (!config->worker_cpus) return 0;
+
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		log_message(NULL, "ERROR: sched_getaffinity() failed: %s; workers are not pinned", strerror(errno));
+		return -1;
+	}
+	int* cpus = malloc(CPU_SETSIZE * sizeof(int));
+	if (!cpus) return -1;
+	int count = strcmp(config->worker_cpus, "auto") == 0 ?
+		auto_cpus(&allowed, cpus) : parse_cpu_list(config->worker_cpus, cpus);
+	if (count <= 0) {
+		log_message(NULL, "ERROR: Invalid worker_cpus '%s'; workers are not pinned", config->worker_cpus);
+		free(cpus);
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		if (!CPU_ISSET(cpus[i], &allowed)) {
+			log_message(NULL, "ERROR: worker_cpus names CPU %d, which this process may not use; workers are not pinned", cpus[i]);
+			free(cpus);
+			return -1;
+		}
+	}
+
+	worker_cpu = malloc(config->num_workers * sizeof(int));
+	if (!worker_cpu) {
+		free(cpus);
+		return -1;
+	}
+	num_workers = config->num_workers;
+	for (int i = 0; i < num_workers; i++) {
+		int cpu = cpus[i % count];
+		worker_cpu[i] = cpu;
+		if (worker_on_cpu[cpu] < 0) worker_on_cpu[cpu] = i;
+		log_message(NULL, "Worker %d will run on CPU %d (node %d)", i, cpu, affinity_cpu_node(cpu));
+	}
+	if (num_workers > count) {
+		log_message(NULL, "WARN: %d workers share %d CPUs", num_workers, count);
+	}
+	free(cpus);
+	return 0;
+}
+
+void affinity_destroy(void) {
+	free(worker_cpu);
+	worker_cpu = NULL;
+	num_workers = 0;
+}
+
+bool affinity_enabled(void) {
+	return worker_cpu != NULL;
+}
+
+int affinity_worker_cpu(int worker) {
+	if (!worker_cpu || worker < 0 || worker >= num_workers) return -1;
+	return worker_cpu[worker];
+}
+
+int affinity_worker_on_cpu(int cpu) {
+	if (cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+	return worker_on_cpu[cpu];
+}
+
+int affinity_set_thread_attr(pthread_attr_t* attr, int worker) {
+	int cpu = affinity_worker_cpu(worker);
+	if (cpu < 0) return 0;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	if (err != 0) {
+		log_message(NULL, "WARN: Could not pin worker %d to CPU %d: %s", worker, cpu, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+int affinity_pin_acceptor(const server_config* config) {
+	if (config->acceptor_cpu < 0) return 0;
+	if (config->acceptor_cpu >= CPU_SETSIZE) {
+		log_message(NULL, "WARN: acceptor_cpu %d is out of range; the acceptor is not pinned", config->acceptor_cpu);
+		return -1;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(config->acceptor_cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0) {
+		log_message(NULL, "WARN: Could not pin the acceptor to CPU %d: %s", config->acceptor_cpu, strerror(err));
+		return -1;
+	}
+	log_message(NULL, "Acceptor pinned to CPU %d (node %d)", config->acceptor_cpu, affinity_cpu_node(config->acceptor_cpu));
+	return 0;
+}
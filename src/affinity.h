@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "config.h"
+
+/*
+ * CPU placement of the workers and the acceptor. worker_cpus lists the CPUs
+ * workers are pinned to, one each in turn; "auto" takes every CPU the process
+ * may run on, a NUMA node at a time and one hyperthread per core first. A
+ * worker is pinned before it starts, so its stack and everything it allocates
+ * is first touched, and so placed, on its own node.
+ */
+int affinity_init(const server_config* config);
+void affinity_destroy(void);
+
+bool affinity_enabled(void);
+// -1 when the worker is not pinned, or no worker runs on the CPU.
+int affinity_worker_cpu(int worker);
+int affinity_worker_on_cpu(int cpu);
+int affinity_cpu_node(int cpu);
+
+// Pins a worker thread before it exists; a no-op when it is not pinned.
+int affinity_set_thread_attr(pthread_attr_t* attr, int worker);
+// Pins the calling thread to acceptor_cpu, if one is set.
+int affinity_pin_acceptor(const server_config* config);
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cache.h"
+#include "logger.h"
+
+#define CACHE_HASH_BUCKETS 4096
+// Buckets are spread over shards by their low bits, each shard with its own
+// lock and LRU list, so workers hitting different files rarely meet.
+#define CACHE_SHARDS 64
+
+typedef struct {
+	_Alignas(64) pthread_mutex_t lock;
+	cache_entry_t* lru_head;
+	cache_entry_t* lru_tail;
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static cache_entry_t* buckets[CACHE_HASH_BUCKETS];
+static atomic_size_t total_bytes = 0;
+static atomic_uint evict_cursor = 0;
+static size_t max_bytes = 0;
+static size_t max_file_size = 0;
+static atomic_ulong generation = 0;
+
+static unsigned int hash_uri(const char* uri) {
+	unsigned int hash = 2166136261u;
+	while (*uri) {
+		hash ^= (unsigned char)*uri++;
+		hash *= 16777619u;
+	}
+	return hash & (CACHE_HASH_BUCKETS - 1);
+}
+
+static unsigned int entry_bucket(const char* uri, int encodings) {
+	return (hash_uri(uri) + encodings) & (CACHE_HASH_BUCKETS - 1);
+}
+
+static cache_shard_t* bucket_shard(unsigned int bucket) {
+	return &shards[bucket & (CACHE_SHARDS - 1)];
+}
+
+static void free_entry(cache_entry_t* entry) {
+	free(entry->uri);
+	free(entry->path);
+	free(entry->header);
+	free(entry);
+}
+
+static void lru_unlink(cache_shard_t* shard, cache_entry_t* entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else shard->lru_head = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else shard->lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_shard_t* shard, cache_entry_t* entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = shard->lru_head;
+	if (shard->lru_head) shard->lru_head->lru_prev = entry;
+	shard->lru_head = entry;
+	if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+// The cache's own reference is the one a linked entry holds.
+static void entry_put(cache_entry_t* entry) {
+	if (atomic_fetch_sub(&entry->refcount, 1) == 1) {
+		free_entry(entry);
+	}
+}
+
+// caller holds the shard's lock
+static void unlink_entry(cache_shard_t* shard, cache_entry_t* entry) {
+	cache_entry_t** pp = &buckets[entry_bucket(entry->uri, entry->encodings)];
+	while (*pp && *pp != entry) {
+		pp = &(*pp)->hash_next;
+	}
+	if (*pp) *pp = entry->hash_next;
+
+	lru_unlink(shard, entry);
+	atomic_fetch_sub(&total_bytes, entry->charge);
+	entry_put(entry);
+}
+
+// A changed sidecar invalidates everything served for its source file.
+void cache_invalidate_path(const char* path) {
+	char base[4096];
+	snprintf(base, sizeof(base), "%s", path);
+	size_t len = strlen(base);
+	if (len > 3 && (strcmp(base + len - 3, ".br") == 0 || strcmp(base + len - 3, ".gz") == 0)) {
+		base[len - 3] = '\0';
+	}
+
+	// Bumped before any shard is searched, so an insert that read the file
+	// before the change either sees the new generation or is found below.
+	atomic_fetch_add(&generation, 1);
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_t* shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		cache_entry_t* current = shard->lru_head;
+		while (current) {
+			cache_entry_t* next = current->lru_next;
+			if (strcmp(current->path, base) == 0) {
+				unlink_entry(shard, current);
+			}
+			current = next;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void cache_flush(void) {
+	atomic_fetch_add(&generation, 1);
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_t* shard = &shards[i];
+		pthread_mutex_lock(&shard->lock);
+		while (shard->lru_head) {
+			unlink_entry(shard, shard->lru_head);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+int cache_init(server_config* config) {
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+	}
+	max_bytes = config->cache_max_bytes;
+	max_file_size = config->cache_max_file_size;
+	if (max_bytes == 0) {
+		log_message(NULL, "Response cache disabled.");
+		return 0;
+	}
+
+	log_message(NULL, "Response cache enabled: %zu bytes budget, %zu bytes max per file.", max_bytes, max_file_size);
+	return 0;
+}
+
+void cache_destroy(void) {
+	cache_flush();
+}
+
+cache_entry_t* cache_lookup(const char* uri, int encodings) {
+	if (max_bytes == 0) return NULL;
+
+	unsigned int bucket = entry_bucket(uri, encodings);
+	cache_shard_t* shard = bucket_shard(bucket);
+	pthread_mutex_lock(&shard->lock);
+	cache_entry_t* entry = buckets[bucket];
+	while (entry && (entry->encodings != encodings || strcmp(entry->uri, uri) != 0)) {
+		entry = entry->hash_next;
+	}
+	if (entry) {
+		if (shard->lru_head != entry) {
+			lru_unlink(shard, entry);
+			lru_push_front(shard, entry);
+		}
+		atomic_fetch_add(&entry->refcount, 1);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return entry;
+}
+
+void cache_release(cache_entry_t* entry) {
+	if (!entry) return;
+	entry_put(entry);
+}
+
+unsigned long cache_generation(void) {
+	return atomic_load(&generation);
+}
+
+// Evict least recently used entries until charge more bytes fit, starting
+// with the shard about to take them and going round the others from a shared
+// cursor. One shard lock is held at a time. Gives up after a pass that freed
+// nothing, which only happens when in-flight inserts hold the rest.
+static void make_room(size_t charge, unsigned int own) {
+	unsigned int idle = 0;
+	unsigned int next = own;
+	while (atomic_load(&total_bytes) + charge > max_bytes && idle < CACHE_SHARDS) {
+		cache_shard_t* shard = &shards[next];
+		pthread_mutex_lock(&shard->lock);
+		int evicted = 0;
+		while (shard->lru_tail && atomic_load(&total_bytes) + charge > max_bytes) {
+			unlink_entry(shard, shard->lru_tail);
+			evicted = 1;
+		}
+		pthread_mutex_unlock(&shard->lock);
+		idle = evicted ? 0 : idle + 1;
+		next = atomic_fetch_add(&evict_cursor, 1) & (CACHE_SHARDS - 1);
+	}
+}
+
+cache_entry_t* cache_insert(const char* uri, int encodings, const char* path, const cache_headers_t* headers,
+		int file_fd, size_t body_len, unsigned long expected_generation) {
+	if (max_bytes == 0 || body_len > max_file_size) return NULL;
+
+	size_t uri_len = strlen(uri);
+	size_t path_len = strlen(path);
+	size_t etag_len = strlen(headers->etag);
+	size_t header_len = headers->header_len + headers->not_modified_len + etag_len + 1;
+	size_t charge = sizeof(cache_entry_t) + uri_len + path_len + header_len + body_len + 2;
+	if (charge > max_bytes) return NULL;
+
+	cache_entry_t* entry = calloc(1, sizeof(cache_entry_t));
+	if (!entry) return NULL;
+	entry->uri = strdup(uri);
+	entry->path = strdup(path);
+	entry->header = malloc(header_len + body_len);
+	if (!entry->uri || !entry->path || !entry->header) {
+		free_entry(entry);
+		return NULL;
+	}
+	// One allocation: 200 header, 304 header, ETag, then the body.
+	entry->encodings = encodings;
+	memcpy(entry->header, headers->header, headers->header_len);
+	entry->header_len = headers->header_len;
+	entry->not_modified = entry->header + entry->header_len;
+	memcpy(entry->not_modified, headers->not_modified, headers->not_modified_len);
+	entry->not_modified_len = headers->not_modified_len;
+	entry->etag = entry->not_modified + entry->not_modified_len;
+	memcpy(entry->etag, headers->etag, etag_len + 1);
+	entry->last_modified = headers->last_modified;
+	entry->body = entry->header + header_len;
+	entry->body_len = body_len;
+	entry->charge = charge;
+
+	size_t got = 0;
+	while (got < body_len) {
+		ssize_t n = pread(file_fd, entry->body + got, body_len - got, got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			free_entry(entry);
+			return NULL;
+		}
+		got += n;
+	}
+
+	unsigned int bucket = entry_bucket(uri, encodings);
+	cache_shard_t* shard = bucket_shard(bucket);
+	make_room(charge, bucket & (CACHE_SHARDS - 1));
+
+	pthread_mutex_lock(&shard->lock);
+	if (atomic_load(&generation) != expected_generation) {
+		// The document root changed while we were reading; don't cache a possibly stale body.
+		pthread_mutex_unlock(&shard->lock);
+		free_entry(entry);
+		return NULL;
+	}
+
+	cache_entry_t* existing = buckets[bucket];
+	while (existing && (existing->encodings != encodings || strcmp(existing->uri, uri) != 0)) {
+		existing = existing->hash_next;
+	}
+	if (existing) {
+		unlink_entry(shard, existing);
+	}
+
+	entry->hash_next = buckets[bucket];
+	buckets[bucket] = entry;
+	lru_push_front(shard, entry);
+	atomic_fetch_add(&total_bytes, charge);
+	// One reference for the cache, one for the caller.
+	atomic_init(&entry->refcount, 2);
+	pthread_mutex_unlock(&shard->lock);
+
+	return entry;
+}
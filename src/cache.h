@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "config.h"
+
+// Content codings a file may have a precompressed sidecar for (file.br, file.gz).
+#define ENCODING_BR 1
+#define ENCODING_GZIP 2
+
+typedef struct cache_entry_s {
+	struct cache_entry_s* hash_next;
+	struct cache_entry_s* lru_prev;
+	struct cache_entry_s* lru_next;
+	char* uri;
+	int encodings; // Accept-Encoding set the entry was negotiated for
+	char* path;    // source file, even when a sidecar was served
+	char* header;
+	size_t header_len;
+	char* not_modified; // header for a 304 answering the same request
+	size_t not_modified_len;
+	char* etag;
+	time_t last_modified;
+	char* body;
+	size_t body_len;
+	size_t charge;
+	atomic_int refcount; // one held by the cache while the entry is linked
+} cache_entry_t;
+
+// Everything about a response that is known before its body is read.
+typedef struct {
+	const char* header;
+	size_t header_len;
+	const char* not_modified;
+	size_t not_modified_len;
+	const char* etag;
+	time_t last_modified;
+} cache_headers_t;
+
+// Entries are only as fresh as the invalidation they get: the route watcher
+// calls cache_invalidate_path() and cache_flush() as document_root changes.
+// Lookups lock one of the cache's shards; releases and cache_generation() take
+// no lock at all.
+int cache_init(server_config* config);
+void cache_destroy(void);
+void cache_invalidate_path(const char* path);
+void cache_flush(void);
+
+cache_entry_t* cache_lookup(const char* uri, int encodings);
+void cache_release(cache_entry_t* entry);
+
+unsigned long cache_generation(void);
+cache_entry_t* cache_insert(const char* uri, int encodings, const char* path, const cache_headers_t* headers,
+		int file_fd, size_t body_len, unsigned long generation);
@@ -26,11 +26,86 @@ static void trim_whitespace(char* str) {
 	}
 }
 
+static size_t parse_size(const char* str) {
+	char* end;
+	unsigned long long value = strtoull(str, &end, 10);
+	switch (toupper((unsigned char)*end)) {
+		case 'G': value <<= 10; /* fall through */
+		case 'M': value <<= 10; /* fall through */
+		case 'K': value <<= 10; break;
+		default: break;
+	}
+	return (size_t)value;
+}
+
 void config_init_defaults(server_config* config) {
 	config->port = 8080;
 	config->num_workers = 4;
 	config->document_root = strdup("./ssg_output");
+	config->document_pack = NULL;
 	config->log_file = strdup("server.log");
+	config->access_log = NULL;
+	config->cache_max_bytes = 64 << 20;
+	config->cache_max_file_size = 1 << 20;
+	config->use_sendfile = 1;
+	config->listen_mode = LISTEN_ACCEPTOR;
+	config->dispatch_policy = DISPATCH_ROUND_ROBIN;
+	config->rebalance_threshold = 0;
+	config->io_backend = IO_BACKEND_EPOLL;
+	config->reuseport_cbpf = 0;
+	config->log_ring_size = 256 << 10;
+	config->log_block_when_full = 0;
+	config->header_timeout = 10;
+	config->keepalive_timeout = 60;
+	config->write_timeout = 30;
+	config->drain_timeout = 30;
+	config->precompress = 0;
+	config->cache_control_rules = NULL;
+	config->num_cache_control_rules = 0;
+	config->metrics_uri = NULL;
+	config->worker_cpus = NULL;
+	config->acceptor_cpu = -1;
+	config->steer_incoming_cpu = 0;
+	config->busy_poll = 0;
+	config->busy_poll_budget = 8;
+	config->tls_certificate = NULL;
+	config->tls_certificate_key = NULL;
+	config->tls_ticket_key_file = NULL;
+	config->tls_ktls = 1;
+	config->http2 = 1;
+	config->per_ip_max_connections = 0;
+	config->per_ip_request_rate = 0;
+	config->per_ip_request_burst = 50;
+	config->per_ip_table_size = 65536;
+}
+
+
+// "cache_control = <prefix> <value>", one line per rule.
+static int add_cache_control_rule(server_config* config, char* value) {
+	char* split = value;
+	while (*split && !isspace((unsigned char)*split)) split++;
+	if (*split == '\0' || split == value) {
+		fprintf(stderr, "Warning: cache_control needs a path prefix and a value, ignoring '%s'.\n", value);
+		return 0;
+	}
+	*split++ = '\0';
+	trim_whitespace(split);
+
+	cache_control_rule_t* rules = realloc(config->cache_control_rules,
+			(config->num_cache_control_rules + 1) * sizeof(cache_control_rule_t));
+	if (!rules) return -1;
+	config->cache_control_rules = rules;
+
+	cache_control_rule_t* rule = &rules[config->num_cache_control_rules];
+	rule->prefix = strdup(value);
+	rule->value = strdup(split);
+	if (!rule->prefix || !rule->value) {
+		free(rule->prefix);
+		free(rule->value);
+		return -1;
+	}
+	config->num_cache_control_rules++;
+	return 0;
 }
 
 int load_config(const char *filename, server_config *config) {
@@ -65,6 +140,14 @@ int load_config(const char *filename, server_config *config) {
 				fclose(file);
 				return -1;
 			}
+		} else if (strcmp(key, "document_pack") == 0) {
+			free(config->document_pack);
+			config->document_pack = strdup(value);
+			if (!config->document_pack) {
+				perror("Error: strdup failed for document_pack");
+				fclose(file);
+				return -1;
+			}
 		} else if (strcmp(key, "log_file") == 0) {
 			free(config->log_file);
 			config->log_file = strdup(value);
@@ -73,6 +156,146 @@ int load_config(const char *filename, server_config *config) {
 				fclose(file);
 				return -1;
 			}
+		} else if (strcmp(key, "access_log") == 0) {
+			free(config->access_log);
+			config->access_log = strdup(value);
+			if (!config->access_log) {
+				perror("Error: strdup failed for access_log");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "cache_max_bytes") == 0) {
+			config->cache_max_bytes = parse_size(value);
+		} else if (strcmp(key, "cache_max_file_size") == 0) {
+			config->cache_max_file_size = parse_size(value);
+		} else if (strcmp(key, "send_mode") == 0) {
+			if (strcmp(value, "sendfile") == 0) {
+				config->use_sendfile = 1;
+			} else if (strcmp(value, "copy") == 0) {
+				config->use_sendfile = 0;
+			} else {
+				fprintf(stderr, "Warning: unknown send_mode '%s', keeping default.\n", value);
+			}
+		} else if (strcmp(key, "listen_mode") == 0) {
+			if (strcmp(value, "acceptor") == 0) {
+				config->listen_mode = LISTEN_ACCEPTOR;
+			} else if (strcmp(value, "reuseport") == 0) {
+				config->listen_mode = LISTEN_REUSEPORT;
+			} else {
+				fprintf(stderr, "Warning: unknown listen_mode '%s', keeping default.\n", value);
+			}
+		} else if (strcmp(key, "dispatch") == 0) {
+			if (strcmp(value, "round_robin") == 0) {
+				config->dispatch_policy = DISPATCH_ROUND_ROBIN;
+			} else if (strcmp(value, "least_conn") == 0) {
+				config->dispatch_policy = DISPATCH_LEAST_CONN;
+			} else if (strcmp(value, "p2c") == 0) {
+				config->dispatch_policy = DISPATCH_P2C;
+			} else {
+				fprintf(stderr, "Warning: unknown dispatch '%s', keeping default.\n", value);
+			}
+		} else if (strcmp(key, "rebalance_threshold") == 0) {
+			config->rebalance_threshold = atoi(value);
+		} else if (strcmp(key, "io_backend") == 0) {
+			if (strcmp(value, "epoll") == 0) {
+				config->io_backend = IO_BACKEND_EPOLL;
+			} else if (strcmp(value, "io_uring") == 0) {
+				config->io_backend = IO_BACKEND_URING;
+			} else {
+				fprintf(stderr, "Warning: unknown io_backend '%s', keeping default.\n", value);
+			}
+		} else if (strcmp(key, "reuseport_cbpf") == 0) {
+			config->reuseport_cbpf = atoi(value);
+		} else if (strcmp(key, "log_ring_size") == 0) {
+			config->log_ring_size = parse_size(value);
+		} else if (strcmp(key, "log_full_policy") == 0) {
+			if (strcmp(value, "drop") == 0) {
+				config->log_block_when_full = 0;
+			} else if (strcmp(value, "block") == 0) {
+				config->log_block_when_full = 1;
+			} else {
+				fprintf(stderr, "Warning: unknown log_full_policy '%s', keeping default.\n", value);
+			}
+		} else if (strcmp(key, "header_timeout") == 0) {
+			config->header_timeout = atoi(value);
+		} else if (strcmp(key, "keepalive_timeout") == 0) {
+			config->keepalive_timeout = atoi(value);
+		} else if (strcmp(key, "write_timeout") == 0) {
+			config->write_timeout = atoi(value);
+		} else if (strcmp(key, "drain_timeout") == 0) {
+			config->drain_timeout = atoi(value);
+		} else if (strcmp(key, "precompress") == 0) {
+			config->precompress = atoi(value);
+		} else if (strcmp(key, "cache_control") == 0) {
+			if (add_cache_control_rule(config, value) != 0) {
+				perror("Error: could not store cache_control rule");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "metrics_uri") == 0) {
+			if (value[0] != '/') {
+				fprintf(stderr, "Warning: metrics_uri must start with '/', ignoring '%s'.\n", value);
+				continue;
+			}
+			free(config->metrics_uri);
+			config->metrics_uri = strdup(value);
+			if (!config->metrics_uri) {
+				perror("Error: strdup failed for metrics_uri");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "worker_cpus") == 0) {
+			free(config->worker_cpus);
+			config->worker_cpus = strdup(value);
+			if (!config->worker_cpus) {
+				perror("Error: strdup failed for worker_cpus");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "acceptor_cpu") == 0) {
+			config->acceptor_cpu = atoi(value);
+		} else if (strcmp(key, "steer_incoming_cpu") == 0) {
+			config->steer_incoming_cpu = atoi(value);
+		} else if (strcmp(key, "busy_poll") == 0) {
+			config->busy_poll = atoi(value);
+		} else if (strcmp(key, "busy_poll_budget") == 0) {
+			config->busy_poll_budget = atoi(value);
+		} else if (strcmp(key, "tls_certificate") == 0) {
+			free(config->tls_certificate);
+			config->tls_certificate = strdup(value);
+			if (!config->tls_certificate) {
+				perror("Error: strdup failed for tls_certificate");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "tls_certificate_key") == 0) {
+			free(config->tls_certificate_key);
+			config->tls_certificate_key = strdup(value);
+			if (!config->tls_certificate_key) {
+				perror("Error: strdup failed for tls_certificate_key");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "tls_ticket_key_file") == 0) {
+			free(config->tls_ticket_key_file);
+			config->tls_ticket_key_file = strdup(value);
+			if (!config->tls_ticket_key_file) {
+				perror("Error: strdup failed for tls_ticket_key_file");
+				fclose(file);
+				return -1;
+			}
+		} else if (strcmp(key, "tls_ktls") == 0) {
+			config->tls_ktls = atoi(value);
+		} else if (strcmp(key, "http2") == 0) {
+			config->http2 = atoi(value);
+		} else if (strcmp(key, "per_ip_max_connections") == 0) {
+			config->per_ip_max_connections = atoi(value);
+		} else if (strcmp(key, "per_ip_request_rate") == 0) {
+			config->per_ip_request_rate = atoi(value);
+		} else if (strcmp(key, "per_ip_request_burst") == 0) {
+			config->per_ip_request_burst = atoi(value);
+		} else if (strcmp(key, "per_ip_table_size") == 0) {
+			config->per_ip_table_size = parse_size(value);
 		}
 	}
 
@@ -83,7 +306,19 @@ int load_config(const char *filename, server_config *config) {
 void free_config(server_config *config) {
 	if (config) {
 		free(config->document_root);
+		free(config->document_pack);
 		free(config->log_file);
+		free(config->access_log);
+		for (int i = 0; i < config->num_cache_control_rules; i++) {
+			free(config->cache_control_rules[i].prefix);
+			free(config->cache_control_rules[i].value);
+		}
+		free(config->cache_control_rules);
+		free(config->metrics_uri);
+		free(config->worker_cpus);
+		free(config->tls_certificate);
+		free(config->tls_certificate_key);
+		free(config->tls_ticket_key_file);
 	}
 }
 
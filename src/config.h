@@ -1,10 +1,79 @@
 #pragma once
 
+#include <stddef.h>
+
+typedef enum {
+	LISTEN_ACCEPTOR,
+	LISTEN_REUSEPORT
+} listen_mode_t;
+
+// How the acceptor picks a worker for a new connection.
+typedef enum {
+	DISPATCH_ROUND_ROBIN,
+	DISPATCH_LEAST_CONN,
+	DISPATCH_P2C
+} dispatch_policy_t;
+
+typedef enum {
+	IO_BACKEND_EPOLL,
+	IO_BACKEND_URING
+} io_backend_t;
+
+// Cache-Control value sent for URIs starting with prefix; the longest match wins.
+typedef struct {
+	char* prefix;
+	char* value;
+} cache_control_rule_t;
+
 typedef struct {
 	int port;
 	int num_workers;
 	char *document_root;
+	char* document_pack; // NULL: serve document_root as it is on disk
 	char* log_file;
+	char* access_log; // NULL: no access log
+	size_t cache_max_bytes;
+	size_t cache_max_file_size;
+	int use_sendfile;
+	listen_mode_t listen_mode;
+	dispatch_policy_t dispatch_policy;
+	// Move idle keep-alive connections off a worker holding this many more
+	// than the average; 0 never moves them.
+	int rebalance_threshold;
+	io_backend_t io_backend;
+	int reuseport_cbpf;
+	size_t log_ring_size;
+	int log_block_when_full;
+	// Per-phase deadlines, in seconds.
+	int header_timeout;
+	int keepalive_timeout;
+	int write_timeout;
+	// How long a graceful stop or upgrade waits for open connections, in seconds.
+	int drain_timeout;
+	int precompress;
+	cache_control_rule_t* cache_control_rules;
+	int num_cache_control_rules;
+	char* metrics_uri; // NULL: no metrics endpoint
+	char* worker_cpus; // NULL: unpinned, "auto", or a list such as "0-3,8"
+	int acceptor_cpu; // -1: unpinned
+	// Hand connections to the worker pinned where their packets arrive.
+	int steer_incoming_cpu;
+	// Busy polling, in microseconds per poll; 0 leaves it to the sysctls.
+	int busy_poll;
+	int busy_poll_budget;
+	// HTTPS on port when a certificate is set. The key may sit in the same file.
+	char* tls_certificate;
+	char* tls_certificate_key;
+	char* tls_ticket_key_file; // NULL: random keys, lost on restart
+	int tls_ktls;
+	// HTTP/2 by prior knowledge, "Upgrade: h2c", or ALPN "h2" over TLS.
+	int http2;
+	// Per client address (IPv6: per /64); 0 turns a limit off. The rate is in
+	// requests per second, with bursts of up to burst requests.
+	int per_ip_max_connections;
+	int per_ip_request_rate;
+	int per_ip_request_burst;
+	size_t per_ip_table_size; // addresses tracked at once
 } server_config;
 
 void config_init_defaults(server_config* config);
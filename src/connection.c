@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "connection.h"
+#include "h2.h"
+
+connection_pools_t* connection_pools_create(void) {
+	connection_pools_t* pools = malloc(sizeof(connection_pools_t));
+	if (!pools) return NULL;
+
+	pools->connections = pool_create("connections", sizeof(connection_t), 64);
+	pools->small_buffers = pool_create("small_buffers", SMALL_BUFFER_SIZE, 64);
+	pools->large_buffers = pool_create("large_buffers", REQUEST_BUFFER_SIZE, 16);
+	pools->response_blocks = pool_create("response_blocks", sizeof(response_t) * MAX_PIPELINE, 16);
+	pools->h2_sessions = pool_create("h2_sessions", sizeof(h2_session_t), 4);
+	if (!pools->connections || !pools->small_buffers || !pools->large_buffers || !pools->response_blocks ||
+			!pools->h2_sessions) {
+		connection_pools_destroy(pools);
+		return NULL;
+	}
+	return pools;
+}
+
+void connection_pools_destroy(connection_pools_t* pools) {
+	if (!pools) return;
+	pool_destroy(pools->connections);
+	pool_destroy(pools->small_buffers);
+	pool_destroy(pools->large_buffers);
+	pool_destroy(pools->response_blocks);
+	pool_destroy(pools->h2_sessions);
+	free(pools);
+}
+
+static connection_t* connection_alloc(connection_pools_t* pools, int fd) {
+	connection_t* conn = pool_alloc(pools->connections);
+	if (!conn) return NULL;
+	memset(conn, 0, sizeof(connection_t));
+
+	conn->fd = fd;
+	timer_node_init(&conn->timer, conn);
+	return conn;
+}
+
+connection_t* connection_create(connection_pools_t* pools, const accepted_conn_t* accepted) {
+	connection_t* conn = connection_alloc(pools, accepted->fd);
+	if (!conn) return NULL;
+	conn->limit = accepted->limit;
+
+	connection_format_address(&accepted->addr, conn->client_ip, sizeof(conn->client_ip));
+	if (accepted->addr.ss_family == AF_INET) {
+		conn->client_addr[10] = 0xff;
+		conn->client_addr[11] = 0xff;
+		memcpy(conn->client_addr + 12, &((const struct sockaddr_in*)&accepted->addr)->sin_addr, 4);
+	} else {
+		memcpy(conn->client_addr, &((const struct sockaddr_in6*)&accepted->addr)->sin6_addr, 16);
+	}
+	return conn;
+}
+
+void connection_format_address(const struct sockaddr_storage* addr, char* out, size_t len) {
+	if (addr->ss_family == AF_INET) {
+		inet_ntop(AF_INET, &(((const struct sockaddr_in*)addr)->sin_addr), out, len);
+	} else {
+		inet_ntop(AF_INET6, &(((const struct sockaddr_in6*)addr)->sin6_addr), out, len);
+	}
+}
+
+connection_t* connection_adopt(connection_pools_t* pools, int fd, const char* client_ip, const uint8_t* client_addr) {
+	connection_t* conn = connection_alloc(pools, fd);
+	if (!conn) return NULL;
+	memcpy(conn->client_ip, client_ip, INET_ADDRSTRLEN);
+	memcpy(conn->client_addr, client_addr, sizeof(conn->client_addr));
+	// Only idle HTTP/1.1 connections are moved between workers.
+	conn->protocol_known = 1;
+	return conn;
+}
+
+static void release_input(connection_pools_t* pools, connection_t* conn) {
+	if (!conn->in_buf) return;
+	pool_free(conn->in_cap == SMALL_BUFFER_SIZE ? pools->small_buffers : pools->large_buffers, conn->in_buf);
+	conn->in_buf = NULL;
+	conn->in_cap = 0;
+}
+
+void connection_destroy(connection_pools_t* pools, connection_t* conn) {
+	release_input(pools, conn);
+	pool_free(pools->response_blocks, conn->responses);
+	pool_free(pools->h2_sessions, conn->h2);
+	pool_free(pools->connections, conn);
+}
+
+// Make room for at least one more byte of input, moving up to the large size
+// class when the small buffer is full. Callers stop reading at
+// REQUEST_BUFFER_SIZE, so a large buffer never needs to grow further.
+int connection_reserve_input(connection_pools_t* pools, connection_t* conn) {
+	if (conn->in_len < conn->in_cap) return 0;
+
+	if (!conn->in_buf) {
+		conn->in_buf = pool_alloc(pools->small_buffers);
+		if (!conn->in_buf) return -1;
+		conn->in_cap = SMALL_BUFFER_SIZE;
+		return 0;
+	}
+
+	char* large = pool_alloc(pools->large_buffers);
+	if (!large) return -1;
+	memcpy(large, conn->in_buf, conn->in_len);
+	pool_free(pools->small_buffers, conn->in_buf);
+	conn->in_buf = large;
+	conn->in_cap = REQUEST_BUFFER_SIZE;
+	return 0;
+}
+
+int connection_reserve_responses(connection_pools_t* pools, connection_t* conn) {
+	if (conn->responses) return 0;
+	conn->responses = pool_alloc(pools->response_blocks);
+	if (!conn->responses) return -1;
+	conn->resp_head = 0;
+	return 0;
+}
+
+// Give back whatever an idle keep-alive connection is not using.
+void connection_release_idle(connection_pools_t* pools, connection_t* conn) {
+	if (conn->in_len == 0) {
+		release_input(pools, conn);
+	}
+	if (conn->resp_count == 0 && conn->responses) {
+		pool_free(pools->response_blocks, conn->responses);
+		conn->responses = NULL;
+	}
+}
@@ -1,11 +1,137 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <stdint.h>
 #include "timer.h"
+#include "cache.h"
+#include "parser.h"
+#include "pool.h"
+
+#define RESPONSE_HEADER_SIZE 768
+#define REQUEST_BUFFER_SIZE HTTP_MAX_HEAD_SIZE
+#define SMALL_BUFFER_SIZE 2048
+#define MAX_PIPELINE 16
+// A header and an in-memory body for each queued response.
+#define RESPONSE_IOV_MAX (MAX_PIPELINE * 2)
+
+// One queued response: header bytes first, then an in-memory body or a file range.
+typedef struct {
+	char header_buf[RESPONSE_HEADER_SIZE];
+	const char* header;
+	size_t header_len;
+	size_t header_sent;
+	cache_entry_t* cache_entry;
+	const char* body;
+	size_t body_len;
+	size_t body_sent;
+	int file_fd;
+	off_t file_offset;
+	off_t file_start;
+	off_t file_end;
+	int use_sendfile;
+	char* owned_body;   // freed with the response, for generated bodies
+	struct pack_s* pack; // holds a reference while body or file_fd point into it
+	int status;         // counted once this slot is written; 0 for a non-final slot
+	uint64_t start_ns;  // when the request's first byte was read
+	uint64_t uri_id;    // for the access log; 0 when no URI was parsed
+} response_t;
+
+// What the connection is waiting for, which decides how long it may wait.
+typedef enum {
+	PHASE_HEADER,
+	PHASE_IDLE,
+	PHASE_WRITE
+} conn_phase_t;
 
 typedef struct connection_s {
 	int fd;
-	timer_node_t* timer_node;
+	timer_node_t timer;
+	conn_phase_t phase;
 	char client_ip[INET_ADDRSTRLEN];
+	uint8_t client_addr[16]; // IPv6, or IPv4 mapped into it
+
+	// Bytes read but not yet consumed by a complete request. The buffer comes
+	// from a pool and is only attached while there is something in it.
+	char* in_buf;
+	size_t in_cap;
+	size_t in_len;
+	http_parser_t parser;
+	size_t body_left;          // of the last request's body, still to be skipped
+	int protocol_known;        // the first bytes were not the HTTP/2 preface
+	uint64_t request_start_ns; // when the first byte of in_buf was read
+	uint64_t request_uri_id;   // of the request being answered
+
+	// Responses waiting to go out, in request order. A block of MAX_PIPELINE
+	// slots is attached from a pool while any are queued.
+	response_t* responses;
+	int resp_head;
+	int resp_count;
+	int close_after_write;
+	int write_pending;
+
+	// HTTPS only. Once the kernel holds the send keys (kTLS), responses are
+	// written to fd as for plain HTTP; until then they go through ssl.
+	struct ssl_st* ssl;
+	int tls_handshaking;
+	int tls_kernel_send;
+
+	// Set once the connection speaks HTTP/2; from then on its streams hold the
+	// responses and the response ring is only used for the 101 of an upgrade.
+	struct h2_session_s* h2;
+
+	// The client's entry in the per-address limits, held until close.
+	struct ratelimit_entry_s* limit;
+
+	// The worker's list of open connections.
+	struct connection_s* prev_conn;
+	struct connection_s* next_conn;
+
+	// io_uring backend only. Data the ring received that does not fit in in_buf
+	// yet stays in its provided buffers, chained through the worker's held_next.
+	int held_count;
+	unsigned short held_head;
+	unsigned short held_tail;
+	unsigned held_off;
+	int io_inflight; // operations that will still post a completion for conn
+	int recv_armed;
+	// A ring send of the queued in-memory parts; send_iov and send_msg must stay
+	// put, and so must the responses they point into, until it completes.
+	int send_armed;
+	struct iovec send_iov[RESPONSE_IOV_MAX];
+	struct msghdr send_msg;
+	int peer_closed;
+	int closing;     // closed, waiting for io_inflight to drain before it is freed
+	struct connection_s* next_starved;
 } connection_t;
 
+// What the acceptor hands a worker; the worker builds the connection itself.
+typedef struct {
+	int fd;
+	struct sockaddr_storage addr;
+	struct ratelimit_entry_s* limit;
+} accepted_conn_t;
+
+// Per-worker pools, so the steady-state request path never touches malloc.
+// Input buffers come in two size classes: most requests fit in the small one.
+typedef struct {
+	pool_t* connections;
+	pool_t* small_buffers;
+	pool_t* large_buffers;
+	pool_t* response_blocks;
+	pool_t* h2_sessions;
+} connection_pools_t;
+
+connection_pools_t* connection_pools_create(void);
+void connection_pools_destroy(connection_pools_t* pools);
+
+connection_t* connection_create(connection_pools_t* pools, const accepted_conn_t* accepted);
+// For a connection another worker set up: only its socket and peer address carry over.
+connection_t* connection_adopt(connection_pools_t* pools, int fd, const char* client_ip, const uint8_t* client_addr);
+void connection_destroy(connection_pools_t* pools, connection_t* conn);
+// The peer address as text, for logging.
+void connection_format_address(const struct sockaddr_storage* addr, char* out, size_t len);
+int connection_reserve_input(connection_pools_t* pools, connection_t* conn);
+int connection_reserve_responses(connection_pools_t* pools, connection_t* conn);
+void connection_release_idle(connection_pools_t* pools, connection_t* conn);
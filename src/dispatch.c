@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "dispatch.h"
+#include "logger.h"
+#include "ratelimit.h"
+
+#define INBOX_SIZE 256
+
+typedef struct {
+	_Alignas(CACHE_LINE_SIZE) atomic_int load;
+
+	_Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+	bool open;
+	int head;
+	int count;
+	migrated_conn_t inbox[INBOX_SIZE];
+	spsc_queue_t* queue; // its event_fd wakes the worker
+} worker_slot_t;
+
+static worker_slot_t* slots = NULL;
+static int num_slots = 0;
+
+// Acceptor state.
+static int next_scan = 0;
+static uint64_t rng_state;
+
+int dispatch_init(int num_workers, spsc_queue_t** queues) {
+	slots = aligned_alloc(CACHE_LINE_SIZE, num_workers * sizeof(worker_slot_t));
+	if (!slots) return -1;
+	memset(slots, 0, num_workers * sizeof(worker_slot_t));
+	for (int i = 0; i < num_workers; i++) {
+		atomic_init(&slots[i].load, 0);
+		pthread_mutex_init(&slots[i].lock, NULL);
+		slots[i].open = true;
+		slots[i].queue = queues[i];
+	}
+	num_slots = num_workers;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rng_state = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ 0x9e3779b97f4a7c15ULL;
+	return 0;
+}
+
+// Called once every worker has exited.
+void dispatch_destroy(void) {
+	for (int i = 0; i < num_slots; i++) {
+		dispatch_close_inbox(i);
+		pthread_mutex_destroy(&slots[i].lock);
+	}
+	free(slots);
+	slots = NULL;
+	num_slots = 0;
+}
+
+void dispatch_load_add(int worker, int delta) {
+	if (!slots) return;
+	atomic_fetch_add_explicit(&slots[worker].load, delta, memory_order_relaxed);
+}
+
+static inline int load_of(int worker) {
+	return atomic_load_explicit(&slots[worker].load, memory_order_relaxed);
+}
+
+static uint64_t next_random(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+int dispatch_pick(dispatch_policy_t policy) {
+	if (num_slots <= 1) return 0;
+
+	if (policy == DISPATCH_P2C) {
+		int a = next_random() % num_slots;
+		int b = next_random() % (num_slots - 1);
+		if (b >= a) b++;
+		return load_of(b) < load_of(a) ? b : a;
+	}
+
+	// Least connections. The scan starts one further each time, so ties are
+	// shared out rather than always going to the lowest index.
+	int best = next_scan;
+	int best_load = load_of(best);
+	for (int i = 1; i < num_slots && best_load > 0; i++) {
+		int worker = (next_scan + i) % num_slots;
+		int load = load_of(worker);
+		if (load < best_load) {
+			best = worker;
+			best_load = load;
+		}
+	}
+	next_scan = (next_scan + 1) % num_slots;
+	return best;
+}
+
+int dispatch_excess(int worker, int threshold) {
+	if (!slots || num_slots <= 1) return 0;
+	long total = 0;
+	for (int i = 0; i < num_slots; i++) {
+		total += load_of(i);
+	}
+	int excess = load_of(worker) - (int)(total / num_slots);
+	return excess > threshold ? excess : 0;
+}
+
+int dispatch_least_loaded(int worker) {
+	int best = -1;
+	int best_load = load_of(worker) - 1;
+	for (int i = 0; i < num_slots; i++) {
+		if (i == worker) continue;
+		int load = load_of(i);
+		if (load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+bool dispatch_migrate(int from, int to, const migrated_conn_t* conn) {
+	worker_slot_t* slot = &slots[to];
+	pthread_mutex_lock(&slot->lock);
+	if (!slot->open || slot->count == INBOX_SIZE) {
+		pthread_mutex_unlock(&slot->lock);
+		return false;
+	}
+	slot->inbox[(slot->head + slot->count) % INBOX_SIZE] = *conn;
+	slot->count++;
+	dispatch_load_add(to, 1);
+	dispatch_load_add(from, -1);
+	// Still under the lock: an open inbox means the worker, and its queue, are alive.
+	spsc_queue_notify(slot->queue);
+	pthread_mutex_unlock(&slot->lock);
+	return true;
+}
+
+bool dispatch_take(int worker, migrated_conn_t* conn) {
+	worker_slot_t* slot = &slots[worker];
+	pthread_mutex_lock(&slot->lock);
+	bool taken = slot->count > 0;
+	if (taken) {
+		*conn = slot->inbox[slot->head];
+		slot->head = (slot->head + 1) % INBOX_SIZE;
+		slot->count--;
+	}
+	pthread_mutex_unlock(&slot->lock);
+	return taken;
+}
+
+void dispatch_close_inbox(int worker) {
+	worker_slot_t* slot = &slots[worker];
+	pthread_mutex_lock(&slot->lock);
+	slot->open = false;
+	while (slot->count > 0) {
+		close(slot->inbox[slot->head].fd);
+		ratelimit_release(slot->inbox[slot->head].limit);
+		slot->head = (slot->head + 1) % INBOX_SIZE;
+		slot->count--;
+		atomic_fetch_sub_explicit(&slot->load, 1, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&slot->lock);
+}
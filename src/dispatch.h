@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "connection.h"
+#include "queue.h"
+
+/*
+ * Shared view of how loaded each worker is, and the inboxes workers use to
+ * hand each other idle keep-alive connections.
+ *
+ * A worker's load is the connections it holds plus those on their way to it.
+ * Whoever hands a connection over adds it to the receiver's load (the acceptor,
+ * or a worker moving one), and the receiver takes it off again when it closes
+ * the connection or moves it on.
+ */
+
+// An idle keep-alive connection on its way to another worker: the socket and
+// what is left of its keep-alive timeout.
+typedef struct {
+	int fd;
+	char client_ip[INET_ADDRSTRLEN];
+	uint8_t client_addr[16];
+	struct ratelimit_entry_s* limit;
+	uint64_t idle_deadline_ms; // CLOCK_MONOTONIC
+} migrated_conn_t;
+
+int dispatch_init(int num_workers, spsc_queue_t** queues);
+void dispatch_destroy(void);
+
+void dispatch_load_add(int worker, int delta);
+
+// Acceptor only: the worker policy picks for the next connection.
+int dispatch_pick(dispatch_policy_t policy);
+
+// How many connections worker holds above the average, if that is more than
+// threshold; 0 otherwise.
+int dispatch_excess(int worker, int threshold);
+// The least loaded other worker, if moving one connection there evens things
+// out; -1 otherwise.
+int dispatch_least_loaded(int worker);
+
+// Queue conn for worker to adopt and wake it. Fails once the worker has
+// closed its inbox to drain, or while the inbox is full.
+bool dispatch_migrate(int from, int to, const migrated_conn_t* conn);
+bool dispatch_take(int worker, migrated_conn_t* conn);
+// Refuse further connections and close any still waiting.
+void dispatch_close_inbox(int worker);
@@ -0,0 +1,1003 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "h2.h"
+#include "logger.h"
+#include "metrics.h"
+#include "parser.h"
+
+#define FRAME_HEADER_LEN 9
+// The most we accept, which is the least a peer may assume (RFC 9113 4.2).
+#define MAX_FRAME_SIZE 16384
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+// The connection window is topped up once this much DATA has been discarded.
+#define WINDOW_UPDATE_AFTER 32768
+#define RST_STREAM_LEN (FRAME_HEADER_LEN + 4)
+
+enum {
+	FRAME_DATA = 0,
+	FRAME_HEADERS = 1,
+	FRAME_PRIORITY = 2,
+	FRAME_RST_STREAM = 3,
+	FRAME_SETTINGS = 4,
+	FRAME_PUSH_PROMISE = 5,
+	FRAME_PING = 6,
+	FRAME_GOAWAY = 7,
+	FRAME_WINDOW_UPDATE = 8,
+	FRAME_CONTINUATION = 9
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum {
+	SETTINGS_HEADER_TABLE_SIZE = 1,
+	SETTINGS_ENABLE_PUSH = 2,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 4,
+	SETTINGS_MAX_FRAME_SIZE = 5,
+	SETTINGS_MAX_HEADER_LIST_SIZE = 6
+};
+
+enum {
+	ERROR_NO_ERROR = 0x0,
+	ERROR_PROTOCOL = 0x1,
+	ERROR_INTERNAL = 0x2,
+	ERROR_FLOW_CONTROL = 0x3,
+	ERROR_STREAM_CLOSED = 0x5,
+	ERROR_FRAME_SIZE = 0x6,
+	ERROR_REFUSED_STREAM = 0x7,
+	ERROR_COMPRESSION = 0x9,
+	ERROR_ENHANCE_YOUR_CALM = 0xb
+};
+
+static uint32_t get_u32(const uint8_t* p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+	return p + 4;
+}
+
+static size_t out_room(const h2_session_t* session) {
+	return H2_OUT_SIZE - session->out_len;
+}
+
+static uint8_t* write_frame_header(uint8_t* p, size_t len, int type, int flags, uint32_t stream_id) {
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	return put_u32(p + 5, stream_id);
+}
+
+// Append a frame and return where its payload goes. Callers make sure of the
+// room: processing input stops short of H2_OUT_RESERVE, and no one frame is
+// answered with more than that.
+static uint8_t* put_frame(h2_session_t* session, size_t len, int type, int flags, uint32_t stream_id) {
+	uint8_t* p = write_frame_header(session->out + session->out_len, len, type, flags, stream_id);
+	session->out_len += FRAME_HEADER_LEN + len;
+	return p;
+}
+
+// Move what is still to be written to the front of out.
+static void compact_out(h2_session_t* session) {
+	if (session->out_sent == 0) return;
+	memmove(session->out, session->out + session->out_sent, session->out_len - session->out_sent);
+	session->out_len -= session->out_sent;
+	if (session->frame_stream) session->frame_at -= session->out_sent;
+	session->out_sent = 0;
+}
+
+static void put_rst_stream(h2_session_t* session, uint32_t stream_id, uint32_t code) {
+	put_u32(put_frame(session, 4, FRAME_RST_STREAM, 0, stream_id), code);
+}
+
+static void put_window_update(h2_session_t* session, uint32_t stream_id, uint32_t increment) {
+	put_u32(put_frame(session, 4, FRAME_WINDOW_UPDATE, 0, stream_id), increment);
+}
+
+static h2_stream_t* find_stream(h2_session_t* session, uint32_t id) {
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		if (session->streams[i].id == id) return &session->streams[i];
+	}
+	return NULL;
+}
+
+static size_t stream_left(const response_t* resp) {
+	return (resp->header_len - resp->header_sent) + (resp->body_len - resp->body_sent) +
+			(size_t)(resp->file_end - resp->file_offset);
+}
+
+// sent_on: the connection the whole response went out on, so it counts in the
+// metrics and the access log; NULL when it did not.
+static void release_stream(h2_session_t* session, h2_stream_t* stream, connection_t* sent_on) {
+	if (stream->resp.header) {
+		http_response_release(sent_on, &stream->resp, sent_on != NULL);
+	}
+	stream->id = 0;
+	session->num_streams--;
+}
+
+// A stream whose frame is halfway out stays until the frame is complete.
+static void drop_stream(h2_session_t* session, h2_stream_t* stream) {
+	if (stream == session->frame_stream) {
+		stream->reset = 1;
+		return;
+	}
+	release_stream(session, stream, NULL);
+}
+
+// A connection error (RFC 9113 5.4.1): GOAWAY, then close once it is written.
+// Nothing can follow half a DATA frame, so then it closes with what is out.
+// The streams go with the connection.
+static void connection_error(connection_t* conn, uint32_t code) {
+	h2_session_t* session = conn->h2;
+	log_info(conn->client_ip, "HTTP/2 connection error %u", code);
+	if (session->frame_stream) {
+		session->frame_stream = NULL;
+		session->out_len = session->out_sent;
+	} else {
+		uint8_t* p = put_frame(session, 8, FRAME_GOAWAY, 0, 0);
+		put_u32(put_u32(p, session->last_stream_id), code);
+	}
+	conn->close_after_write = 1;
+}
+
+static void stream_error(h2_session_t* session, h2_stream_t* stream, uint32_t id, uint32_t code) {
+	put_rst_stream(session, id, code);
+	if (stream) drop_stream(session, stream);
+}
+
+// The whole response is out, or copied into out.
+static void finish_stream(connection_t* conn, h2_session_t* session, h2_stream_t* stream) {
+	// The request may still have a body coming; it is not wanted (RFC 9113 8.1).
+	if (!stream->remote_closed) {
+		put_rst_stream(session, stream->id, ERROR_NO_ERROR);
+	}
+	release_stream(session, stream, conn);
+	if (session->goaway_received && session->num_streams == 0) {
+		conn->close_after_write = 1;
+	}
+}
+
+static void put_settings(h2_session_t* session) {
+	static const uint32_t settings[][2] = {
+		{ SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+		{ SETTINGS_ENABLE_PUSH, 0 },
+		{ SETTINGS_MAX_HEADER_LIST_SIZE, HTTP_MAX_HEAD_SIZE }
+	};
+	int count = sizeof(settings) / sizeof(settings[0]);
+	uint8_t* p = put_frame(session, count * 6, FRAME_SETTINGS, 0, 0);
+	for (int i = 0; i < count; i++) {
+		p[0] = settings[i][0] >> 8;
+		p[1] = settings[i][0];
+		p = put_u32(p + 2, settings[i][1]);
+	}
+}
+
+static void session_init(connection_t* conn, h2_session_t* session) {
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		session->streams[i].id = 0;
+	}
+	session->num_streams = 0;
+	session->next_stream = 0;
+	session->last_stream_id = 0;
+	session->continuation_id = 0;
+	session->continuation_end_stream = 0;
+	session->preface_received = 0;
+	session->settings_received = 0;
+	session->goaway_received = 0;
+	session->conn_window = DEFAULT_WINDOW;
+	session->peer_initial_window = DEFAULT_WINDOW;
+	session->peer_max_frame = MAX_FRAME_SIZE;
+	session->recv_unacked = 0;
+	session->skip_left = 0;
+	hpack_table_init(&session->decoder);
+	hpack_table_init(&session->encoder);
+	session->frame_stream = NULL;
+	session->frame_left = 0;
+	session->out_len = 0;
+	session->out_sent = 0;
+	session->block_len = 0;
+	session->current = NULL;
+
+	conn->h2 = session;
+	// A client waiting for a window's worth of DATA before it sends
+	// WINDOW_UPDATE would otherwise wait out Nagle and its own delayed ACK for
+	// the window's last segment. Header and payload still go together: the
+	// header is written with MSG_MORE.
+	int one = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	put_settings(session);
+	metrics_http2_connection();
+}
+
+void h2_start(connection_t* conn, h2_session_t* session) {
+	session_init(conn, session);
+}
+
+// Apply a SETTINGS payload. Returns 0, or the error code for the connection.
+static uint32_t apply_settings(h2_session_t* session, const uint8_t* p, size_t len) {
+	for (; len >= 6; p += 6, len -= 6) {
+		int id = p[0] << 8 | p[1];
+		uint32_t value = get_u32(p + 2);
+		switch (id) {
+			case SETTINGS_HEADER_TABLE_SIZE:
+				hpack_encoder_set_limit(&session->encoder, value);
+				break;
+			case SETTINGS_ENABLE_PUSH:
+				if (value > 1) return ERROR_PROTOCOL;
+				break;
+			case SETTINGS_INITIAL_WINDOW_SIZE: {
+				if (value > MAX_WINDOW) return ERROR_FLOW_CONTROL;
+				// Every open stream's window moves by the difference (RFC 9113 6.9.2).
+				int64_t delta = (int64_t)value - session->peer_initial_window;
+				for (int i = 0; i < H2_MAX_STREAMS; i++) {
+					h2_stream_t* stream = &session->streams[i];
+					if (!stream->id) continue;
+					stream->window += delta;
+					if (stream->window > MAX_WINDOW) return ERROR_FLOW_CONTROL;
+				}
+				session->peer_initial_window = value;
+				break;
+			}
+			case SETTINGS_MAX_FRAME_SIZE:
+				if (value < MAX_FRAME_SIZE || value > 0xffffff) return ERROR_PROTOCOL;
+				session->peer_max_frame = value;
+				break;
+			default:
+				break;
+		}
+	}
+	return 0;
+}
+
+static int base64url_value(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '-') return 62;
+	if (c == '_') return 63;
+	return -1;
+}
+
+// HTTP2-Settings is a SETTINGS payload in unpadded base64url (RFC 7540 3.2.1).
+static int decode_settings_header(const char* value, uint8_t* out, size_t room, size_t* out_len) {
+	size_t n = 0;
+	uint32_t bits = 0;
+	int count = 0;
+	for (; *value && *value != '='; value++) {
+		int v = base64url_value(*value);
+		if (v < 0) return -1;
+		bits = bits << 6 | v;
+		count += 6;
+		if (count >= 8) {
+			if (n == room) return -1;
+			count -= 8;
+			out[n++] = bits >> count;
+		}
+	}
+	if (n % 6 != 0) return -1;
+	*out_len = n;
+	return 0;
+}
+
+response_t* h2_stream_response(connection_t* conn) {
+	return &conn->h2->current->resp;
+}
+
+static int is_no_index(const char* name) {
+	// Different on nearly every response, so not worth a table entry.
+	static const char* const names[] = { "content-length", "content-range", "etag", "last-modified" };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) == 0) return 1;
+	}
+	return 0;
+}
+
+static int is_connection_specific(const char* name, size_t len) {
+	static const char* const names[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strlen(names[i]) == len && strncasecmp(name, names[i], len) == 0) return 1;
+	}
+	return 0;
+}
+
+// Turn the HTTP/1.1 header text the response was queued with into a HEADERS
+// frame. What follows the blank line, an error page, is left to go out as DATA.
+static int put_response_headers(connection_t* conn, h2_session_t* session, h2_stream_t* stream) {
+	response_t* resp = &stream->resp;
+	const char* text = resp->header;
+	const char* text_end = text + resp->header_len;
+	const char* head_end = memmem(text, resp->header_len, "\r\n\r\n", 4);
+	if (!head_end || resp->header_len < 12) return -1;
+
+	uint8_t* frame = session->out + session->out_len;
+	uint8_t* p = frame + FRAME_HEADER_LEN;
+	uint8_t* end = session->out + H2_OUT_SIZE;
+	int n = hpack_encode_begin(&session->encoder, p, end - p);
+	if (n < 0) return -1;
+	p += n;
+	n = hpack_encode_status(p, end - p, atoi(text + 9));
+	if (n < 0) return -1;
+	p += n;
+
+	const char* line = memchr(text, '\n', head_end - text) + 1;
+	while (line < head_end + 2) {
+		const char* line_end = memchr(line, '\r', text_end - line);
+		const char* colon = memchr(line, ':', line_end - line);
+		if (colon && !is_connection_specific(line, colon - line)) {
+			char name[64];
+			size_t name_len = colon - line;
+			if (name_len >= sizeof(name)) return -1;
+			for (size_t i = 0; i < name_len; i++) {
+				name[i] = line[i] >= 'A' && line[i] <= 'Z' ? line[i] + 32 : line[i];
+			}
+			name[name_len] = '\0';
+			const char* value = colon + 1;
+			while (value < line_end && *value == ' ') value++;
+
+			n = hpack_encode_field(&session->encoder, p, end - p, name, name_len, value, line_end - value, !is_no_index(name));
+			if (n < 0) return -1;
+			p += n;
+		}
+		line = line_end + 2;
+	}
+
+	resp->header_sent = head_end + 4 - text;
+	int end_stream = stream_left(resp) == 0;
+	put_frame(session, p - frame - FRAME_HEADER_LEN, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0), stream->id);
+	stream->headers_sent = 1;
+	if (end_stream) {
+		finish_stream(conn, session, stream);
+	}
+	return 0;
+}
+
+// Builds the HTTP/1.1 head of a request from the fields of its header block.
+// Pseudo-header fields come first (RFC 9113 8.3), so the request line can be
+// written as soon as the first regular field turns up.
+typedef struct {
+	h2_session_t* session;
+	char method[16];
+	char path[HTTP_MAX_URI_SIZE];
+	char authority[256];
+	size_t method_len;
+	size_t path_len;
+	size_t authority_len;
+	int scheme;
+	int started;
+	int malformed;
+	int too_large;
+} request_builder_t;
+
+static void append_head(request_builder_t* builder, const char* str, size_t len) {
+	h2_session_t* session = builder->session;
+	if (session->head_len + len > sizeof(session->head)) {
+		builder->too_large = 1;
+		return;
+	}
+	memcpy(session->head + session->head_len, str, len);
+	session->head_len += len;
+}
+
+static void start_head(request_builder_t* builder) {
+	builder->started = 1;
+	if (!builder->method_len || !builder->path_len || !builder->scheme) {
+		builder->malformed = 1;
+		return;
+	}
+	append_head(builder, builder->method, builder->method_len);
+	append_head(builder, " ", 1);
+	append_head(builder, builder->path, builder->path_len);
+	append_head(builder, " HTTP/1.1\r\n", 11);
+	if (builder->authority_len) {
+		append_head(builder, "Host: ", 6);
+		append_head(builder, builder->authority, builder->authority_len);
+		append_head(builder, "\r\n", 2);
+	}
+}
+
+static int set_pseudo(char* dest, size_t size, size_t* dest_len, const char* value, size_t len) {
+	if (*dest_len || len == 0 || len >= size) return -1;
+	memcpy(dest, value, len);
+	*dest_len = len;
+	return 0;
+}
+
+static void collect_field(void* arg, const char* name, size_t name_len, const char* value, size_t value_len) {
+	request_builder_t* builder = arg;
+	if (builder->malformed) return;
+
+	// Nothing that could end a line may reach the HTTP/1.1 parser.
+	for (size_t i = 0; i < name_len; i++) {
+		if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= ' ' || (name[i] == ':' && i > 0)) {
+			builder->malformed = 1;
+			return;
+		}
+	}
+	if (memchr(value, '\r', value_len) || memchr(value, '\n', value_len) || memchr(value, '\0', value_len) || name_len == 0) {
+		builder->malformed = 1;
+		return;
+	}
+
+	if (name[0] == ':') {
+		int result = -1;
+		if (builder->started) {
+			result = -1;
+		} else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+			result = set_pseudo(builder->method, sizeof(builder->method), &builder->method_len, value, value_len);
+		} else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+			result = set_pseudo(builder->path, sizeof(builder->path), &builder->path_len, value, value_len);
+		} else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+			result = set_pseudo(builder->authority, sizeof(builder->authority), &builder->authority_len, value, value_len);
+		} else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0 && !builder->scheme) {
+			builder->scheme = 1;
+			result = 0;
+		}
+		if (result != 0) builder->malformed = 1;
+		return;
+	}
+
+	if (is_connection_specific(name, name_len) ||
+			(name_len == 2 && memcmp(name, "te", 2) == 0 && !(value_len == 8 && memcmp(value, "trailers", 8) == 0))) {
+		builder->malformed = 1;
+		return;
+	}
+	if (!builder->started) {
+		start_head(builder);
+		if (builder->malformed) return;
+	}
+	// :authority stands in for Host, and the parser takes the first.
+	if (builder->authority_len && name_len == 4 && memcmp(name, "host", 4) == 0) return;
+
+	append_head(builder, name, name_len);
+	append_head(builder, ": ", 2);
+	append_head(builder, value, value_len);
+	append_head(builder, "\r\n", 2);
+}
+
+// Send the HEADERS of what was queued for stream, or of a 500 if nothing was.
+static void queue_headers(connection_t* conn, h2_session_t* session, h2_stream_t* stream) {
+	session->current = stream;
+	if (!stream->resp.header) {
+		send_error_response(conn, 500);
+	}
+	session->current = NULL;
+	if (put_response_headers(conn, session, stream) != 0) {
+		log_message(conn->client_ip, "ERROR: Response header does not fit in an HTTP/2 HEADERS frame");
+		connection_error(conn, ERROR_INTERNAL);
+	}
+}
+
+static void answer_stream(connection_t* conn, h2_session_t* session, h2_stream_t* stream, int too_large, server_config* config) {
+	session->current = stream;
+	conn->request_start_ns = metrics_now_ns();
+	http_parser_reset(&conn->parser);
+
+	parse_result_t result = too_large ? PARSE_HEADERS_TOO_LARGE : http_parser_execute(&conn->parser, session->head, session->head_len);
+	if (result == PARSE_DONE) {
+		http_answer(conn, session->head, config);
+	} else {
+		metrics_parse_error();
+		send_error_response(conn, result == PARSE_INCOMPLETE ? 400 : http_parse_error_status(result));
+	}
+	http_parser_reset(&conn->parser);
+	session->current = NULL;
+	queue_headers(conn, session, stream);
+}
+
+int h2_upgrade(connection_t* conn, h2_session_t* session, const char* head, server_config* config) {
+	const http_slice_t* settings_header = http_find_header(&conn->parser, head, "HTTP2-Settings");
+	uint8_t settings[256];
+	size_t settings_len;
+	if (!settings_header || decode_settings_header(head + settings_header->off, settings, sizeof(settings), &settings_len) != 0) {
+		return -1;
+	}
+
+	send_switching_protocols(conn);
+	session_init(conn, session);
+	if (apply_settings(session, settings, settings_len) != 0) {
+		connection_error(conn, ERROR_PROTOCOL);
+		return 0;
+	}
+
+	// The request is stream 1, already half-closed by the client (RFC 7540 3.2).
+	h2_stream_t* stream = &session->streams[0];
+	stream->id = 1;
+	stream->remote_closed = 1;
+	stream->headers_sent = 0;
+	stream->reset = 0;
+	stream->window = session->peer_initial_window;
+	stream->resp.header = NULL;
+	session->num_streams = 1;
+	session->last_stream_id = 1;
+	metrics_http2_stream();
+
+	session->current = stream;
+	http_answer(conn, head, config);
+	session->current = NULL;
+	http_parser_reset(&conn->parser);
+	queue_headers(conn, session, stream);
+	return 0;
+}
+
+static void handle_header_block(connection_t* conn, h2_session_t* session, uint32_t id, int end_stream,
+		const uint8_t* block, size_t len, server_config* config) {
+	request_builder_t builder;
+	builder.session = session;
+	builder.method_len = 0;
+	builder.path_len = 0;
+	builder.authority_len = 0;
+	builder.scheme = 0;
+	builder.started = 0;
+	builder.malformed = 0;
+	builder.too_large = 0;
+	session->head_len = 0;
+
+	// Every block is decoded, even one that is refused, to keep the table in step.
+	if (hpack_decode(&session->decoder, block, len, collect_field, &builder) != 0) {
+		connection_error(conn, ERROR_COMPRESSION);
+		return;
+	}
+
+	h2_stream_t* stream = find_stream(session, id);
+	if (stream) {
+		// Trailers, which have to end the stream (RFC 9113 8.1).
+		if (stream->remote_closed) {
+			connection_error(conn, ERROR_STREAM_CLOSED);
+		} else if (!end_stream) {
+			stream_error(session, stream, id, ERROR_PROTOCOL);
+		} else {
+			stream->remote_closed = 1;
+		}
+		return;
+	}
+	if (id <= session->last_stream_id) {
+		connection_error(conn, ERROR_STREAM_CLOSED);
+		return;
+	}
+	session->last_stream_id = id;
+
+	if (session->num_streams == H2_MAX_STREAMS || session->goaway_received) {
+		put_rst_stream(session, id, ERROR_REFUSED_STREAM);
+		return;
+	}
+	if (!builder.started) start_head(&builder);
+	if (builder.malformed) {
+		put_rst_stream(session, id, ERROR_PROTOCOL);
+		return;
+	}
+	append_head(&builder, "\r\n", 2);
+
+	stream = find_stream(session, 0);
+	stream->id = id;
+	stream->remote_closed = end_stream;
+	stream->headers_sent = 0;
+	stream->reset = 0;
+	stream->window = session->peer_initial_window;
+	stream->resp.header = NULL;
+	session->num_streams++;
+	metrics_http2_stream();
+
+	answer_stream(conn, session, stream, builder.too_large, config);
+}
+
+// HEADERS and CONTINUATION. A block that ends in this frame is decoded where it
+// lies; one that does not is gathered in session->block first.
+static void handle_headers(connection_t* conn, h2_session_t* session, int type, int flags, uint32_t id,
+		const uint8_t* p, size_t len, server_config* config) {
+	if (type == FRAME_HEADERS) {
+		if (id == 0 || id % 2 == 0) {
+			connection_error(conn, ERROR_PROTOCOL);
+			return;
+		}
+		size_t pad = 0;
+		if (flags & FLAG_PADDED) {
+			if (len < 1) {
+				connection_error(conn, ERROR_FRAME_SIZE);
+				return;
+			}
+			pad = p[0];
+			p++;
+			len--;
+		}
+		// Priority is deprecated (RFC 9113 5.3.2); streams simply take turns.
+		if (flags & FLAG_PRIORITY) {
+			if (len < 5) {
+				connection_error(conn, ERROR_FRAME_SIZE);
+				return;
+			}
+			p += 5;
+			len -= 5;
+		}
+		if (pad > len) {
+			connection_error(conn, ERROR_PROTOCOL);
+			return;
+		}
+		len -= pad;
+
+		if (flags & FLAG_END_HEADERS) {
+			handle_header_block(conn, session, id, flags & FLAG_END_STREAM, p, len, config);
+			return;
+		}
+		session->continuation_id = id;
+		session->continuation_end_stream = flags & FLAG_END_STREAM;
+		session->block_len = 0;
+	}
+
+	if (session->block_len + len > sizeof(session->block)) {
+		// Without all of it the decoder falls out of step with the client's encoder.
+		connection_error(conn, ERROR_ENHANCE_YOUR_CALM);
+		return;
+	}
+	memcpy(session->block + session->block_len, p, len);
+	session->block_len += len;
+	if (flags & FLAG_END_HEADERS) {
+		session->continuation_id = 0;
+		handle_header_block(conn, session, id, session->continuation_end_stream, session->block, session->block_len, config);
+	}
+}
+
+// DATA is never wanted, so only its header is looked at; the payload is skipped
+// as it arrives and handed back to the connection window.
+static void handle_data(connection_t* conn, h2_session_t* session, int flags, uint32_t id, size_t len) {
+	if (id == 0) {
+		connection_error(conn, ERROR_PROTOCOL);
+		return;
+	}
+	session->recv_unacked += len;
+	if (session->recv_unacked > DEFAULT_WINDOW) {
+		connection_error(conn, ERROR_FLOW_CONTROL);
+		return;
+	}
+
+	h2_stream_t* stream = find_stream(session, id);
+	if (!stream) {
+		if (id > session->last_stream_id) connection_error(conn, ERROR_PROTOCOL);
+		return;
+	}
+	if (stream->remote_closed) {
+		stream_error(session, stream, id, ERROR_STREAM_CLOSED);
+		return;
+	}
+	if (flags & FLAG_END_STREAM) {
+		stream->remote_closed = 1;
+	}
+}
+
+static void handle_window_update(connection_t* conn, h2_session_t* session, uint32_t id, const uint8_t* p, size_t len) {
+	if (len != 4) {
+		connection_error(conn, ERROR_FRAME_SIZE);
+		return;
+	}
+	uint32_t increment = get_u32(p) & 0x7fffffff;
+	if (id == 0) {
+		session->conn_window += increment;
+		if (increment == 0 || session->conn_window > MAX_WINDOW) {
+			connection_error(conn, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+		}
+		return;
+	}
+
+	h2_stream_t* stream = find_stream(session, id);
+	if (!stream) {
+		if (id > session->last_stream_id) connection_error(conn, ERROR_PROTOCOL);
+		return;
+	}
+	stream->window += increment;
+	if (increment == 0 || stream->window > MAX_WINDOW) {
+		stream_error(session, stream, id, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+	}
+}
+
+static void handle_frame(connection_t* conn, h2_session_t* session, int type, int flags, uint32_t id,
+		const uint8_t* p, size_t len, server_config* config) {
+	switch (type) {
+		case FRAME_HEADERS:
+		case FRAME_CONTINUATION:
+			handle_headers(conn, session, type, flags, id, p, len, config);
+			break;
+
+		case FRAME_PRIORITY:
+			if (id == 0) connection_error(conn, ERROR_PROTOCOL);
+			else if (len != 5) stream_error(session, find_stream(session, id), id, ERROR_FRAME_SIZE);
+			break;
+
+		case FRAME_RST_STREAM: {
+			if (id == 0 || id > session->last_stream_id) {
+				connection_error(conn, ERROR_PROTOCOL);
+				break;
+			}
+			if (len != 4) {
+				connection_error(conn, ERROR_FRAME_SIZE);
+				break;
+			}
+			h2_stream_t* stream = find_stream(session, id);
+			if (stream) drop_stream(session, stream);
+			break;
+		}
+
+		case FRAME_SETTINGS: {
+			if (id != 0) {
+				connection_error(conn, ERROR_PROTOCOL);
+				break;
+			}
+			if ((flags & FLAG_ACK) ? len != 0 : len % 6 != 0) {
+				connection_error(conn, ERROR_FRAME_SIZE);
+				break;
+			}
+			if (flags & FLAG_ACK) break;
+			uint32_t code = apply_settings(session, p, len);
+			if (code) {
+				connection_error(conn, code);
+				break;
+			}
+			session->settings_received = 1;
+			put_frame(session, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+			break;
+		}
+
+		case FRAME_PING:
+			if (id != 0) {
+				connection_error(conn, ERROR_PROTOCOL);
+			} else if (len != 8) {
+				connection_error(conn, ERROR_FRAME_SIZE);
+			} else if (!(flags & FLAG_ACK)) {
+				memcpy(put_frame(session, 8, FRAME_PING, FLAG_ACK, 0), p, 8);
+			}
+			break;
+
+		case FRAME_GOAWAY:
+			if (id != 0) {
+				connection_error(conn, ERROR_PROTOCOL);
+				break;
+			}
+			// Finish what is open, then close.
+			session->goaway_received = 1;
+			if (session->num_streams == 0) conn->close_after_write = 1;
+			break;
+
+		case FRAME_WINDOW_UPDATE:
+			handle_window_update(conn, session, id, p, len);
+			break;
+
+		default:
+			// We never enable push, so a PUSH_PROMISE is a protocol error.
+			connection_error(conn, ERROR_PROTOCOL);
+			break;
+	}
+}
+
+void h2_process_input(connection_t* conn, server_config* config) {
+	h2_session_t* session = conn->h2;
+	const uint8_t* in = (const uint8_t*)conn->in_buf;
+	size_t pos = 0;
+
+	compact_out(session);
+	if (!session->preface_received) {
+		size_t n = conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN;
+		if (memcmp(in, H2_PREFACE, n) != 0) {
+			connection_error(conn, ERROR_PROTOCOL);
+			conn->in_len = 0;
+			return;
+		}
+		if (n < H2_PREFACE_LEN) return;
+		session->preface_received = 1;
+		pos = H2_PREFACE_LEN;
+	}
+
+	while (!conn->close_after_write && out_room(session) >= H2_OUT_RESERVE) {
+		if (session->skip_left > 0) {
+			size_t n = conn->in_len - pos;
+			if (n > session->skip_left) n = session->skip_left;
+			pos += n;
+			session->skip_left -= n;
+			if (session->skip_left > 0) break;
+			continue;
+		}
+		if (conn->in_len - pos < FRAME_HEADER_LEN) break;
+
+		const uint8_t* p = in + pos;
+		size_t len = (size_t)p[0] << 16 | p[1] << 8 | p[2];
+		int type = p[3];
+		int flags = p[4];
+		uint32_t id = get_u32(p + 5) & 0x7fffffff;
+
+		if (len > MAX_FRAME_SIZE) {
+			connection_error(conn, ERROR_FRAME_SIZE);
+			break;
+		}
+		if ((!session->settings_received && type != FRAME_SETTINGS) ||
+				(session->continuation_id && (type != FRAME_CONTINUATION || id != session->continuation_id)) ||
+				(!session->continuation_id && type == FRAME_CONTINUATION)) {
+			connection_error(conn, ERROR_PROTOCOL);
+			break;
+		}
+
+		// A client may open more streams than allowed before it has our
+		// SETTINGS. Rather than refuse them, wait for open ones to finish, as
+		// long as any can still send.
+		if (type == FRAME_HEADERS && session->num_streams == H2_MAX_STREAMS && !find_stream(session, id) &&
+				h2_output_ready(conn)) {
+			break;
+		}
+
+		// Payloads that are not needed, DATA and frame types we do not know,
+		// are skipped however large they are.
+		if (type == FRAME_DATA || type > FRAME_CONTINUATION) {
+			if (type == FRAME_DATA) handle_data(conn, session, flags, id, len);
+			pos += FRAME_HEADER_LEN;
+			session->skip_left = len;
+			continue;
+		}
+		if (FRAME_HEADER_LEN + len > conn->in_len - pos) {
+			if (FRAME_HEADER_LEN + len > REQUEST_BUFFER_SIZE) {
+				// Could never be held whole; what the frame carries has to be,
+				// so this is the most it can get.
+				connection_error(conn, ERROR_ENHANCE_YOUR_CALM);
+			}
+			break;
+		}
+		handle_frame(conn, session, type, flags, id, p + FRAME_HEADER_LEN, len, config);
+		pos += FRAME_HEADER_LEN + len;
+	}
+
+	if (session->recv_unacked >= WINDOW_UPDATE_AFTER && !conn->close_after_write) {
+		put_window_update(session, 0, session->recv_unacked);
+		session->recv_unacked = 0;
+	}
+	if (pos > 0) {
+		memmove(conn->in_buf, conn->in_buf + pos, conn->in_len - pos);
+		conn->in_len -= pos;
+		conn->phase = PHASE_IDLE;
+	}
+}
+
+// Append DATA frames for streams with something to send and the window to send
+// it, in turn, until out is full or a frame has to come from a file. Returns
+// false if there was nothing to add.
+static int put_data_frames(connection_t* conn, h2_session_t* session) {
+	int added = 0;
+	int idle_turns = 0;
+
+	while (idle_turns < H2_MAX_STREAMS && session->conn_window > 0 && out_room(session) > FRAME_HEADER_LEN + RST_STREAM_LEN) {
+		h2_stream_t* stream = &session->streams[session->next_stream];
+		session->next_stream = (session->next_stream + 1) % H2_MAX_STREAMS;
+		if (!stream->id || !stream->headers_sent || stream->window <= 0) {
+			idle_turns++;
+			continue;
+		}
+		idle_turns = 0;
+
+		response_t* resp = &stream->resp;
+		size_t left = stream_left(resp);
+		const char* memory = NULL;
+		size_t available;
+		if (resp->header_sent < resp->header_len) {
+			memory = resp->header + resp->header_sent;
+			available = resp->header_len - resp->header_sent;
+		} else if (resp->body_sent < resp->body_len) {
+			memory = resp->body + resp->body_sent;
+			available = resp->body_len - resp->body_sent;
+		} else {
+			available = resp->file_end - resp->file_offset;
+		}
+
+		size_t len = available;
+		if (len > session->peer_max_frame) len = session->peer_max_frame;
+		if ((int64_t)len > stream->window) len = stream->window;
+		if ((int64_t)len > session->conn_window) len = session->conn_window;
+		// Leaving room for the RST_STREAM finish_stream() may add.
+		size_t room = out_room(session) - FRAME_HEADER_LEN - RST_STREAM_LEN;
+		if (memory && len > room) len = room;
+		int end_stream = len == left;
+
+		uint8_t* payload = write_frame_header(session->out + session->out_len, len, FRAME_DATA,
+				end_stream ? FLAG_END_STREAM : 0, stream->id);
+		session->out_len += FRAME_HEADER_LEN;
+		stream->window -= len;
+		session->conn_window -= len;
+		added = 1;
+
+		if (!memory) {
+			session->frame_stream = stream;
+			session->frame_left = len;
+			session->frame_at = session->out_len;
+			session->frame_end_stream = end_stream;
+			break;
+		}
+		memcpy(payload, memory, len);
+		session->out_len += len;
+		if (resp->header_sent < resp->header_len) resp->header_sent += len;
+		else resp->body_sent += len;
+		if (end_stream) finish_stream(conn, session, stream);
+	}
+	return added;
+}
+
+static send_status_t write_out(connection_t* conn, h2_session_t* session, size_t end, int flags) {
+	while (session->out_sent < end) {
+		struct iovec iov = { session->out + session->out_sent, end - session->out_sent };
+		size_t written;
+		send_status_t status = http_writev(conn, &iov, 1, flags, &written);
+		if (status != SEND_DONE) return status;
+		session->out_sent += written;
+	}
+	return SEND_DONE;
+}
+
+send_status_t h2_send_pending(connection_t* conn) {
+	h2_session_t* session = conn->h2;
+
+	while (1) {
+		h2_stream_t* stream = session->frame_stream;
+		if (stream) {
+			response_t* resp = &stream->resp;
+			// MSG_MORE keeps the frame header in the same segment as the payload.
+			send_status_t status = write_out(conn, session, session->frame_at, resp->use_sendfile ? MSG_MORE : 0);
+			if (status != SEND_DONE) return status;
+
+			off_t before = resp->file_offset;
+			status = http_send_file(conn, resp->file_fd, &resp->file_offset, before + session->frame_left, resp->use_sendfile);
+			session->frame_left -= resp->file_offset - before;
+			if (status != SEND_DONE) return status;
+
+			session->frame_stream = NULL;
+			if (stream->reset) release_stream(session, stream, NULL);
+			else if (session->frame_end_stream) finish_stream(conn, session, stream);
+			continue;
+		}
+
+		send_status_t status = write_out(conn, session, session->out_len, 0);
+		if (status != SEND_DONE) return status;
+		session->out_len = 0;
+		session->out_sent = 0;
+
+		if (conn->close_after_write || !put_data_frames(conn, session)) return SEND_DONE;
+	}
+}
+
+int h2_output_ready(const connection_t* conn) {
+	const h2_session_t* session = conn->h2;
+	if (session->out_sent < session->out_len || session->frame_stream) return 1;
+	if (conn->close_after_write || session->conn_window <= 0) return 0;
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		const h2_stream_t* stream = &session->streams[i];
+		if (stream->id && stream->headers_sent && stream->window > 0) return 1;
+	}
+	return 0;
+}
+
+int h2_is_idle(const connection_t* conn) {
+	const h2_session_t* session = conn->h2;
+	return session->num_streams == 0 && session->out_sent == session->out_len && !session->frame_stream;
+}
+
+void h2_reset(connection_t* conn) {
+	h2_session_t* session = conn->h2;
+	session->frame_stream = NULL;
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		if (session->streams[i].id) release_stream(session, &session->streams[i], NULL);
+	}
+	session->out_len = 0;
+	session->out_sent = 0;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "config.h"
+#include "hpack.h"
+#include "http.h"
+
+/*
+ * HTTP/2 (RFC 9113) on a connection that either opened with the client
+ * preface (prior knowledge, or ALPN "h2" over TLS) or upgraded from HTTP/1.1
+ * with "Upgrade: h2c".
+ *
+ * Each request stream is turned back into an HTTP/1.1 head and answered by the
+ * same code as HTTP/1.1, into a response_t of the stream's own. Its header text
+ * is re-encoded with HPACK when the stream is answered, and its body, whether a
+ * cache entry, a pack mapping or a file, goes out as DATA frames, one stream
+ * after another in turn, as far as each stream's flow-control window allows.
+ * Payloads in memory are copied behind their frame headers, so the frames of
+ * many small responses leave in one write; file payloads are sent from the
+ * file, with sendfile() where the connection allows it.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+// Streams a client may have open at once, as SETTINGS_MAX_CONCURRENT_STREAMS says.
+#define H2_MAX_STREAMS 32
+// Frames waiting to be written.
+#define H2_OUT_SIZE 16384
+// Frames are only taken off the input while this much of out is free, enough
+// for the largest HEADERS a response can turn into.
+#define H2_OUT_RESERVE 1536
+
+typedef struct {
+	uint32_t id;             // 0: slot free
+	int remote_closed;
+	int headers_sent;
+	int reset;               // by the peer, while one of its frames is going out
+	int64_t window;          // what the peer lets us send on it
+	response_t resp;
+} h2_stream_t;
+
+typedef struct h2_session_s {
+	h2_stream_t streams[H2_MAX_STREAMS];
+	int num_streams;
+	int next_stream;         // round-robin cursor
+	uint32_t last_stream_id;
+	uint32_t continuation_id; // a header block still wants CONTINUATION
+	int continuation_end_stream;
+	int preface_received;
+	int settings_received;
+	int goaway_received;
+	int64_t conn_window;
+	int64_t peer_initial_window;
+	uint32_t peer_max_frame;
+	size_t recv_unacked;     // DATA taken in since the last connection WINDOW_UPDATE
+	size_t skip_left;        // payload still to discard, of DATA or an unknown frame
+
+	hpack_table_t decoder;
+	hpack_table_t encoder;
+
+	// A DATA frame whose payload comes from a file: its stream, how much of the
+	// payload is left, and where in out the payload belongs.
+	h2_stream_t* frame_stream;
+	size_t frame_left;
+	size_t frame_at;
+	int frame_end_stream;
+
+	uint8_t out[H2_OUT_SIZE];
+	size_t out_len;
+	size_t out_sent;
+
+	// A header block split over CONTINUATION frames is gathered here.
+	uint8_t block[HTTP_MAX_HEAD_SIZE];
+	size_t block_len;
+	// The request the current stream is answered from, as HTTP/1.1.
+	char head[HTTP_MAX_HEAD_SIZE];
+	size_t head_len;
+	h2_stream_t* current;    // the stream responses are being queued for
+} h2_session_t;
+
+// Start a connection whose input begins with the client preface.
+void h2_start(connection_t* conn, h2_session_t* session);
+// Answer an HTTP/1.1 request asking for "Upgrade: h2c" with a 101 and switch
+// the connection over. conn->parser still holds the request, parsed from head;
+// it becomes stream 1. Returns -1, with nothing queued, when its HTTP2-Settings
+// cannot be decoded.
+int h2_upgrade(connection_t* conn, h2_session_t* session, const char* head, server_config* config);
+// Consume as many whole frames from conn->in_buf as there is room to answer.
+void h2_process_input(connection_t* conn, server_config* config);
+send_status_t h2_send_pending(connection_t* conn);
+// Bytes are waiting to be written, or a stream is allowed to send more.
+int h2_output_ready(const connection_t* conn);
+int h2_is_idle(const connection_t* conn);
+// The slot a response for the current stream goes into.
+response_t* h2_stream_response(connection_t* conn);
+// Drop every stream, as when the connection is closed.
+void h2_reset(connection_t* conn);
@@ -0,0 +1,439 @@
+#include <string.h>
+
+#include "hpack.h"
+
+typedef struct {
+	const char* name;
+	const char* value;
+} static_field_t;
+
+// RFC 7541 Appendix A; index 0 is unused.
+static const static_field_t static_table[] = {
+	{ NULL, NULL },
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+#define STATIC_ENTRIES 61
+
+// Symbols of the canonical code in order of (code length, symbol), and how
+// many codes there are of each length (RFC 7541 Appendix B).
+static const uint16_t huffman_symbols[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256,
+};
+static const uint8_t huffman_counts[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+void hpack_table_init(hpack_table_t* table) {
+	table->oldest = 0;
+	table->count = 0;
+	table->size = 0;
+	table->max_size = HPACK_TABLE_SIZE;
+	table->data_end = 0;
+	table->size_update = 0;
+	table->size_update_min = HPACK_TABLE_SIZE;
+}
+
+// Dynamic entry i, counting from the newest at 0.
+static const hpack_entry_t* dynamic_entry(const hpack_table_t* table, int i) {
+	return &table->entries[(table->oldest + table->count - 1 - i) % HPACK_MAX_ENTRIES];
+}
+
+static void evict_oldest(hpack_table_t* table) {
+	const hpack_entry_t* entry = &table->entries[table->oldest];
+	table->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+	table->oldest = (table->oldest + 1) % HPACK_MAX_ENTRIES;
+	table->count--;
+	if (table->count == 0) table->data_end = 0;
+}
+
+static void shrink_to(hpack_table_t* table, size_t max_size) {
+	while (table->size > max_size) {
+		evict_oldest(table);
+	}
+	table->max_size = max_size;
+}
+
+// An entry larger than the whole table empties it and is not added (RFC 7541 4.4).
+static void insert(hpack_table_t* table, const char* name, size_t name_len, const char* value, size_t value_len) {
+	size_t cost = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+	if (cost > table->max_size) {
+		while (table->count > 0) {
+			evict_oldest(table);
+		}
+		return;
+	}
+	while (table->size + cost > table->max_size) {
+		evict_oldest(table);
+	}
+
+	size_t bytes = name_len + value_len;
+	if (table->data_end + bytes > sizeof(table->data)) {
+		// The live run fits, since it and the new entry fit in max_size.
+		size_t start = table->count > 0 ? table->entries[table->oldest].offset : table->data_end;
+		memmove(table->data, table->data + start, table->data_end - start);
+		for (int i = 0; i < table->count; i++) {
+			table->entries[(table->oldest + i) % HPACK_MAX_ENTRIES].offset -= start;
+		}
+		table->data_end -= start;
+	}
+
+	hpack_entry_t* entry = &table->entries[(table->oldest + table->count) % HPACK_MAX_ENTRIES];
+	entry->offset = table->data_end;
+	entry->name_len = name_len;
+	entry->value_len = value_len;
+	memcpy(table->data + table->data_end, name, name_len);
+	memcpy(table->data + table->data_end + name_len, value, value_len);
+	table->data_end += bytes;
+	table->count++;
+	table->size += cost;
+}
+
+// Resolve an index into the static or dynamic table. Returns -1 for one that
+// does not exist.
+static int lookup(const hpack_table_t* table, uint64_t index, const char** name, size_t* name_len,
+		const char** value, size_t* value_len) {
+	if (index == 0) return -1;
+	if (index <= STATIC_ENTRIES) {
+		*name = static_table[index].name;
+		*name_len = strlen(*name);
+		*value = static_table[index].value;
+		*value_len = strlen(*value);
+		return 0;
+	}
+	index -= STATIC_ENTRIES + 1;
+	if (index >= (uint64_t)table->count) return -1;
+	const hpack_entry_t* entry = dynamic_entry(table, index);
+	*name = table->data + entry->offset;
+	*name_len = entry->name_len;
+	*value = *name + entry->name_len;
+	*value_len = entry->value_len;
+	return 0;
+}
+
+// Integer with an N-bit prefix (RFC 7541 5.1).
+static int decode_integer(const uint8_t** p, const uint8_t* end, int prefix_bits, uint64_t* out) {
+	uint64_t max_prefix = (1u << prefix_bits) - 1;
+	uint64_t value = **p & max_prefix;
+	(*p)++;
+	if (value < max_prefix) {
+		*out = value;
+		return 0;
+	}
+	for (int shift = 0; shift <= 28; shift += 7) {
+		if (*p == end) return -1;
+		uint8_t byte = *(*p)++;
+		value += (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*out = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Canonical decoding a bit at a time, as zlib's puff does it: the codes of
+// one length are consecutive, so a code is complete once it falls within the
+// run its length owns.
+static int huffman_decode(const uint8_t* in, size_t len, char* out, size_t room, size_t* out_len) {
+	size_t n = 0;
+	int code = 0, first = 0, index = 0, bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			code |= (in[i] >> b) & 1;
+			bits++;
+			int count = huffman_counts[bits];
+			if (code - count < first) {
+				int symbol = huffman_symbols[index + code - first];
+				if (symbol == 256 || n == room) return -1;
+				out[n++] = (char)symbol;
+				code = first = index = bits = 0;
+				continue;
+			}
+			if (bits == 30) return -1;
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+	}
+	// What is left must be padding: under a byte of the EOS code's leading ones.
+	if (bits > 7 || (code >> 1) != (1 << bits) - 1) return -1;
+	*out_len = n;
+	return 0;
+}
+
+// A string literal (RFC 7541 5.2), decoded into scratch when it is Huffman
+// coded and pointed at where it lies otherwise.
+static int decode_string(const uint8_t** p, const uint8_t* end, char* scratch, size_t room,
+		const char** out, size_t* out_len) {
+	if (*p == end) return -1;
+	int huffman = **p & 0x80;
+	uint64_t len;
+	if (decode_integer(p, end, 7, &len) != 0 || len > (uint64_t)(end - *p)) return -1;
+
+	if (huffman) {
+		if (huffman_decode(*p, len, scratch, room, out_len) != 0) return -1;
+		*out = scratch;
+	} else {
+		if (len > room) return -1;
+		*out = (const char*)*p;
+		*out_len = len;
+	}
+	*p += len;
+	return 0;
+}
+
+int hpack_decode(hpack_table_t* table, const uint8_t* block, size_t len, hpack_emit_fn emit, void* arg) {
+	const uint8_t* p = block;
+	const uint8_t* end = block + len;
+	char name_buf[HPACK_MAX_FIELD];
+	char value_buf[HPACK_MAX_FIELD];
+	int fields = 0;
+
+	while (p < end) {
+		uint8_t first = *p;
+		uint64_t index;
+		const char* name;
+		const char* value;
+		size_t name_len, value_len;
+
+		if (first & 0x80) {
+			if (decode_integer(&p, end, 7, &index) != 0 ||
+					lookup(table, index, &name, &name_len, &value, &value_len) != 0) {
+				return -1;
+			}
+			emit(arg, name, name_len, value, value_len);
+			fields++;
+			continue;
+		}
+		if ((first & 0xe0) == 0x20) {
+			// Size updates may only open a block (RFC 7541 4.2).
+			uint64_t size;
+			if (fields > 0 || decode_integer(&p, end, 5, &size) != 0 || size > HPACK_TABLE_SIZE) return -1;
+			shrink_to(table, size);
+			continue;
+		}
+
+		int indexing = (first & 0xc0) == 0x40;
+		if (decode_integer(&p, end, indexing ? 6 : 4, &index) != 0) return -1;
+		if (index > 0) {
+			const char* unused;
+			size_t unused_len;
+			if (lookup(table, index, &name, &name_len, &unused, &unused_len) != 0) return -1;
+			if (indexing) {
+				// Adding the entry may evict the one the name came from.
+				memcpy(name_buf, name, name_len);
+				name = name_buf;
+			}
+		} else if (decode_string(&p, end, name_buf, sizeof(name_buf), &name, &name_len) != 0) {
+			return -1;
+		}
+		if (decode_string(&p, end, value_buf, sizeof(value_buf), &value, &value_len) != 0 ||
+				name_len + value_len > HPACK_MAX_FIELD) {
+			return -1;
+		}
+
+		if (indexing) {
+			insert(table, name, name_len, value, value_len);
+		}
+		emit(arg, name, name_len, value, value_len);
+		fields++;
+	}
+	return 0;
+}
+
+void hpack_encoder_set_limit(hpack_table_t* table, size_t limit) {
+	if (limit > HPACK_TABLE_SIZE) limit = HPACK_TABLE_SIZE;
+	if (limit == table->max_size && !table->size_update) return;
+	// Every size the table passed through down to the smallest has to be
+	// signalled, or the peer could not have evicted what we did (RFC 7541 4.2).
+	if (!table->size_update || limit < table->size_update_min) {
+		table->size_update_min = limit;
+	}
+	table->size_update = 1;
+	shrink_to(table, limit);
+}
+
+static int encode_integer(uint8_t* out, size_t room, uint8_t flags, int prefix_bits, uint64_t value) {
+	uint64_t max_prefix = (1u << prefix_bits) - 1;
+	size_t n = 0;
+	if (room == 0) return -1;
+	if (value < max_prefix) {
+		out[n++] = flags | value;
+		return n;
+	}
+	out[n++] = flags | max_prefix;
+	value -= max_prefix;
+	while (value >= 0x80) {
+		if (n == room) return -1;
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	if (n == room) return -1;
+	out[n++] = value;
+	return n;
+}
+
+static int encode_string(uint8_t* out, size_t room, const char* str, size_t len) {
+	int n = encode_integer(out, room, 0, 7, len);
+	if (n < 0 || room - n < len) return -1;
+	memcpy(out + n, str, len);
+	return n + len;
+}
+
+int hpack_encode_begin(hpack_table_t* table, uint8_t* out, size_t room) {
+	if (!table->size_update) return 0;
+	int n = 0;
+	if (table->size_update_min < table->max_size) {
+		n = encode_integer(out, room, 0x20, 5, table->size_update_min);
+		if (n < 0) return -1;
+	}
+	int m = encode_integer(out + n, room - n, 0x20, 5, table->max_size);
+	if (m < 0) return -1;
+	table->size_update = 0;
+	return n + m;
+}
+
+int hpack_encode_status(uint8_t* out, size_t room, int status) {
+	char value[4] = {
+		'0' + status / 100 % 10,
+		'0' + status / 10 % 10,
+		'0' + status % 10,
+		'\0'
+	};
+	// Statuses 200 to 500 sit at indices 8 to 14.
+	for (int i = 8; i <= 14; i++) {
+		if (strcmp(static_table[i].value, value) == 0) {
+			return encode_integer(out, room, 0x80, 7, i);
+		}
+	}
+	int n = encode_integer(out, room, 0x00, 4, 8);
+	if (n < 0) return -1;
+	int m = encode_string(out + n, room - n, value, 3);
+	return m < 0 ? -1 : n + m;
+}
+
+// Index of an entry matching name and value, else one matching the name alone
+// as a negative number, else 0. The static table is searched first, and
+// scanning it stops at the first name match: same names are adjacent there.
+static int find(const hpack_table_t* table, const char* name, size_t name_len, const char* value, size_t value_len) {
+	int name_match = 0;
+	for (int i = 1; i <= STATIC_ENTRIES; i++) {
+		const static_field_t* field = &static_table[i];
+		if (strncmp(field->name, name, name_len) != 0 || field->name[name_len] != '\0') {
+			if (name_match) break;
+			continue;
+		}
+		if (!name_match) name_match = -i;
+		if (strlen(field->value) == value_len && memcmp(field->value, value, value_len) == 0) return i;
+	}
+	for (int i = 0; i < table->count; i++) {
+		const hpack_entry_t* entry = dynamic_entry(table, i);
+		const char* entry_name = table->data + entry->offset;
+		if (entry->name_len != name_len || memcmp(entry_name, name, name_len) != 0) continue;
+		int index = STATIC_ENTRIES + 1 + i;
+		if (entry->value_len == value_len && memcmp(entry_name + name_len, value, value_len) == 0) return index;
+		if (!name_match) name_match = -index;
+	}
+	return name_match;
+}
+
+int hpack_encode_field(hpack_table_t* table, uint8_t* out, size_t room, const char* name, size_t name_len,
+		const char* value, size_t value_len, int index) {
+	int found = find(table, name, name_len, value, value_len);
+	if (found > 0) {
+		return encode_integer(out, room, 0x80, 7, found);
+	}
+
+	// Literal with incremental indexing, or without indexing (RFC 7541 6.2).
+	int n = index ? encode_integer(out, room, 0x40, 6, -found) : encode_integer(out, room, 0x00, 4, -found);
+	if (n < 0) return -1;
+	if (found == 0) {
+		int m = encode_string(out + n, room - n, name, name_len);
+		if (m < 0) return -1;
+		n += m;
+	}
+	int m = encode_string(out + n, room - n, value, value_len);
+	if (m < 0) return -1;
+	n += m;
+
+	if (index) {
+		insert(table, name, name_len, value, value_len);
+	}
+	return n;
+}
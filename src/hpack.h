@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HPACK (RFC 7541), the header compression of HTTP/2. One table per direction:
+ * the decoder's follows what the client's encoder does, the encoder's is ours.
+ *
+ * Both look the 61-entry static table up by index first, which is all most
+ * request and response fields need; the dynamic table only has to be searched
+ * for what a connection repeats. Responses are encoded without Huffman coding,
+ * and only fields whose values recur across responses are indexed.
+ */
+
+// The dynamic table size both ends start with, and the most we let a client's
+// encoder use, since we never raise it in SETTINGS.
+#define HPACK_TABLE_SIZE 4096
+// What an entry costs beyond its name and value (RFC 7541 4.1).
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+// Longest name plus value a decoded field may have.
+#define HPACK_MAX_FIELD 8192
+
+typedef struct {
+	uint16_t offset; // into data
+	uint16_t name_len;
+	uint16_t value_len;
+} hpack_entry_t;
+
+// Entries form a ring, oldest first. Their bytes lie in data in the same order,
+// so evicting from the front leaves one live run that is moved down when the
+// next entry does not fit behind it.
+typedef struct {
+	hpack_entry_t entries[HPACK_MAX_ENTRIES];
+	int oldest;
+	int count;
+	size_t size;     // as RFC 7541 counts it
+	size_t max_size;
+	size_t data_end;
+	// Encoder only: size updates owed at the start of the next block.
+	int size_update;
+	size_t size_update_min;
+	char data[HPACK_TABLE_SIZE];
+} hpack_table_t;
+
+void hpack_table_init(hpack_table_t* table);
+
+// Called for each field of a block in order. The strings are only valid during
+// the call and are not NUL-terminated.
+typedef void (*hpack_emit_fn)(void* arg, const char* name, size_t name_len, const char* value, size_t value_len);
+
+// Decodes one complete header block. Returns -1 if it is malformed, which is a
+// COMPRESSION_ERROR for the whole connection: the table can no longer be trusted.
+int hpack_decode(hpack_table_t* table, const uint8_t* block, size_t len, hpack_emit_fn emit, void* arg);
+
+// The peer's SETTINGS_HEADER_TABLE_SIZE, capped at HPACK_TABLE_SIZE.
+void hpack_encoder_set_limit(hpack_table_t* table, size_t limit);
+// The encoders append to out and return the bytes written, or -1 when room is
+// too small. hpack_encode_begin() opens every block.
+int hpack_encode_begin(hpack_table_t* table, uint8_t* out, size_t room);
+int hpack_encode_status(uint8_t* out, size_t room, int status);
+// index: keep the field in the dynamic table for later blocks. name must be
+// lowercase.
+int hpack_encode_field(hpack_table_t* table, uint8_t* out, size_t room, const char* name, size_t name_len,
+		const char* value, size_t value_len, int index);
@@ -1,157 +1,959 @@
+#define _GNU_SOURCE
+
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <strings.h>
+#include <time.h>
 
 #include "http.h"
 #include "logger.h"
+#include "cache.h"
+#include "routes.h"
+#include "parser.h"
+#include "range.h"
+#include "metrics.h"
+#include "pack.h"
+#include "tls.h"
+#include "h2.h"
+#include "ratelimit.h"
+#include "accesslog.h"
+
+// On an HTTP/2 connection the response belongs to the stream being answered.
+static response_t* push_response(connection_t* conn) {
+	response_t* resp;
+	if (conn->h2) {
+		resp = h2_stream_response(conn);
+	} else {
+		resp = &conn->responses[(conn->resp_head + conn->resp_count) % MAX_PIPELINE];
+		conn->resp_count++;
+	}
 
-static const char* get_mime_type(const char* filename) {
-	if (strstr(filename, ".html")) return "text/html";
-	if (strstr(filename, ".css")) return "text/css";
-	if (strstr(filename, ".js")) return "application/javascript";
-	if (strstr(filename, ".png")) return "image/png";
-	if (strstr(filename, ".jpg")) return "image/jpeg";
-	if (strstr(filename, ".gif")) return "image/gif";
-	return "application/octet-stream";
+	resp->header = resp->header_buf;
+	resp->header_len = 0;
+	resp->header_sent = 0;
+	resp->cache_entry = NULL;
+	resp->body = NULL;
+	resp->body_len = 0;
+	resp->body_sent = 0;
+	resp->file_fd = -1;
+	resp->file_offset = 0;
+	resp->file_start = 0;
+	resp->file_end = 0;
+	resp->use_sendfile = 0;
+	resp->owned_body = NULL;
+	resp->pack = NULL;
+	resp->status = 0;
+	resp->start_ns = conn->request_start_ns;
+	resp->uri_id = conn->request_uri_id;
+	return resp;
 }
 
-int parse_http_request(char *buffer, http_request_t *req) {
-	char* saveptr;
-	char* method = strtok_r(buffer, " ", &saveptr);
-	if (!method) return -1;
-	req->method = strdup(method);
+void http_response_release(connection_t* conn, response_t* resp, int sent) {
+	if (sent && resp->status) {
+		metrics_request_done(resp->status, resp->start_ns);
+		access_log_request(conn, resp);
+	}
+	if (resp->pack) {
+		// file_fd, if set, is the pack's own.
+		pack_release(resp->pack);
+	} else if (resp->file_fd >= 0) {
+		close(resp->file_fd);
+	}
+	cache_release(resp->cache_entry);
+	free(resp->owned_body);
+}
 
-	char* uri = strtok_r(NULL, " ", &saveptr);
-	if (!uri) return -1;
-	req->uri = strdup(uri);
+// sent is false when the response is dropped with its connection.
+static void pop_response(connection_t* conn, int sent) {
+	http_response_release(conn, &conn->responses[conn->resp_head], sent);
+	conn->resp_head = (conn->resp_head + 1) % MAX_PIPELINE;
+	conn->resp_count--;
+}
 
-	if (strstr(req->uri, "..")) {
-		return -1;
+void http_response_reset(connection_t* conn) {
+	while (conn->resp_count > 0) {
+		pop_response(conn, 0);
+	}
+	conn->resp_head = 0;
+	if (conn->h2) {
+		h2_reset(conn);
 	}
+}
 
-	return 0;
+int http_parse_error_status(parse_result_t result) {
+	switch (result) {
+		case PARSE_URI_TOO_LONG: return 414;
+		case PARSE_HEADERS_TOO_LARGE: return 431;
+		default: return 400;
+	}
 }
 
-void free_http_request(http_request_t *req) {
-	free(req->method);
-	free(req->uri);
+static int header_name_is(const char* head, const http_header_t* header, const char* name) {
+	size_t len = strlen(name);
+	return header->name.len == len && strncasecmp(head + header->name.off, name, len) == 0;
 }
 
-void send_error_response(int client_fd, int status_code) {
+// RFC 9112 6.3: a Content-Length body is skipped to find the next request.
+// Transfer-Encoding is refused rather than decoded, and so is a length that is
+// malformed or given twice with different values, since a proxy in front might
+// read either one and see a different next request.
+int http_request_body(const http_parser_t* parser, const char* head, size_t* length) {
+	int have_length = 0;
+	*length = 0;
+	for (int i = 0; i < parser->num_headers; i++) {
+		const http_header_t* header = &parser->headers[i];
+		if (header_name_is(head, header, "Transfer-Encoding")) return 400;
+		if (!header_name_is(head, header, "Content-Length")) continue;
+
+		const char* value = head + header->value.off;
+		if (header->value.len == 0) return 400;
+		size_t n = 0;
+		for (size_t j = 0; j < header->value.len; j++) {
+			if (value[j] < '0' || value[j] > '9') return 400;
+			if (n > HTTP_MAX_BODY_SIZE) return 413;
+			n = n * 10 + (value[j] - '0');
+		}
+		if (have_length && n != *length) return 400;
+		have_length = 1;
+		*length = n;
+	}
+	return *length > HTTP_MAX_BODY_SIZE ? 413 : 0;
+}
+
+void send_error_response(connection_t* conn, int status_code) {
 	const char* status_message;
 	char body[128];
-	char response[512];
 
 	switch (status_code) {
 		case 400: status_message = "Bad Request"; break;
 		case 403: status_message = "Forbidden"; break;
 		case 404: status_message = "Not Found"; break;
 		case 405: status_message = "Method Not Allowed"; break;
+		case 413: status_message = "Content Too Large"; break;
+		case 414: status_message = "URI Too Long"; break;
+		case 429: status_message = "Too Many Requests"; break;
+		case 431: status_message = "Request Header Fields Too Large"; break;
 		default: status_message = "Internal Server Error"; break;
 	}
 
 	sprintf(body, "<html><body><h1>%d %s</h1></body></html>", status_code, status_message);
 
-	snprintf(response, sizeof(response),
+	// A 429 asks to come back once a request token has refilled; at any rate
+	// worth setting, that is within a second.
+	response_t* resp = push_response(conn);
+	snprintf(resp->header_buf, sizeof(resp->header_buf),
 			"HTTP/1.1 %d %s\r\n"
 			"Content-Type: text/html\r\n"
 			"Content-Length: %ld\r\n"
+			"%s"
 			"X-Content-Type-Options: nosniff\r\n"
 			"X-Frame-Options: DENY\r\n"
 			"Connection: close\r\n\r\n%s",
-			status_code, status_message, strlen(body), body);
+			status_code, status_message, strlen(body),
+			status_code == 429 ? "Retry-After: 1\r\n" : "", body);
 
-	write(client_fd, response, strlen(response));
+	resp->header_len = strlen(resp->header_buf);
+	resp->status = status_code;
+	// Over HTTP/2 only the stream ends.
+	if (!conn->h2) {
+		conn->close_after_write = 1;
+	}
 }
 
-int serve_static_file(int client_fd, const char *request_uri, server_config *config) {
-	char filepath[256];
+void send_switching_protocols(connection_t* conn) {
+	response_t* resp = push_response(conn);
+	static const char header[] =
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Connection: Upgrade\r\n"
+			"Upgrade: h2c\r\n\r\n";
+	resp->header = header;
+	resp->header_len = sizeof(header) - 1;
+}
 
-	if (strcmp(request_uri, "/") == 0) {
-		snprintf(filepath, sizeof(filepath), "%s/index.html", config->document_root);
-	} else if (strncmp(request_uri, "/images/", 8) == 0 || strncmp(request_uri, "/static/", 8) == 0) {
-		snprintf(filepath, sizeof(filepath), "%s%s", config->document_root, request_uri);
+// Encrypted by OpenSSL rather than by the kernel, so nothing can bypass it:
+// bodies are copied through SSL_write() instead of sent with sendfile().
+static inline int tls_in_userspace(const connection_t* conn) {
+	return conn->ssl && !conn->tls_kernel_send;
+}
+
+send_status_t http_writev(connection_t* conn, struct iovec* iov, int iovcnt, int flags, size_t* written) {
+	ssize_t result;
+	if (tls_in_userspace(conn)) {
+		result = tls_writev(conn->ssl, iov, iovcnt);
 	} else {
-		const char* last_dot = strrchr(request_uri, '.');
-		if (last_dot && (strcmp(last_dot, ".html") == 0 || strcmp(last_dot, ".css") == 0 || strcmp(last_dot, ".js") == 0)) {
-			snprintf(filepath, sizeof(filepath), "%s%s", config->document_root, request_uri);
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+		do {
+			result = sendmsg(conn->fd, &msg, flags | MSG_NOSIGNAL);
+		} while (result < 0 && errno == EINTR);
+	}
+
+	if (result < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return SEND_AGAIN;
+		log_message(NULL, "ERROR: Failed to write to socket: %s", strerror(errno));
+		return SEND_ERROR;
+	}
+
+	metrics_bytes_sent(result);
+	*written = result;
+	return SEND_DONE;
+}
+
+int http_gather_memory(const connection_t* conn, struct iovec* iov, int* flags) {
+	int iovcnt = 0;
+	*flags = 0;
+
+	for (int i = 0; i < conn->resp_count; i++) {
+		const response_t* resp = &conn->responses[(conn->resp_head + i) % MAX_PIPELINE];
+		if (resp->header_sent < resp->header_len) {
+			iov[iovcnt].iov_base = (char*)resp->header + resp->header_sent;
+			iov[iovcnt].iov_len = resp->header_len - resp->header_sent;
+			iovcnt++;
+		}
+		if (resp->body_sent < resp->body_len) {
+			iov[iovcnt].iov_base = (char*)resp->body + resp->body_sent;
+			iov[iovcnt].iov_len = resp->body_len - resp->body_sent;
+			iovcnt++;
+		}
+		if (resp->file_offset < resp->file_end) {
+			// MSG_MORE holds the header back so it leaves in the same segment train as the sendfile body.
+			if (resp->use_sendfile) *flags |= MSG_MORE;
+			break;
+		}
+	}
+	return iovcnt;
+}
+
+void http_memory_sent(connection_t* conn, size_t left) {
+	while (conn->resp_count > 0) {
+		response_t* resp = &conn->responses[conn->resp_head];
+		size_t n = resp->header_len - resp->header_sent;
+		if (n > left) n = left;
+		resp->header_sent += n;
+		left -= n;
+
+		n = resp->body_len - resp->body_sent;
+		if (n > left) n = left;
+		resp->body_sent += n;
+		left -= n;
+
+		if (resp->header_sent < resp->header_len || resp->body_sent < resp->body_len ||
+				resp->file_offset < resp->file_end) {
+			break;
+		}
+		pop_response(conn, 1);
+	}
+}
+
+// Write the gathered in-memory parts with a single sendmsg().
+static send_status_t send_memory_parts(connection_t* conn) {
+	struct iovec iov[RESPONSE_IOV_MAX];
+	int flags;
+	int iovcnt = http_gather_memory(conn, iov, &flags);
+	if (iovcnt == 0) return SEND_DONE;
+
+	size_t written;
+	send_status_t status = http_writev(conn, iov, iovcnt, flags, &written);
+	if (status == SEND_DONE) {
+		http_memory_sent(conn, written);
+	}
+	return status;
+}
+
+send_status_t http_send_file(connection_t* conn, int file_fd, off_t* offset, off_t end, int use_sendfile) {
+	// One full TLS record at a time when copying through OpenSSL.
+	char buffer[16384];
+	int userspace_tls = tls_in_userspace(conn);
+
+	while (*offset < end) {
+		ssize_t result;
+		if (use_sendfile && !userspace_tls) {
+			result = sendfile(conn->fd, file_fd, offset, end - *offset);
 		} else {
-			snprintf(filepath, sizeof(filepath), "%s%s.html", config->document_root, request_uri);
+			size_t chunk = sizeof(buffer);
+			if ((off_t)chunk > end - *offset) {
+				chunk = end - *offset;
+			}
+			ssize_t bytes_read = pread(file_fd, buffer, chunk, *offset);
+			if (bytes_read <= 0) {
+				log_message(NULL, "ERROR: Failed to read file: %s", bytes_read < 0 ? strerror(errno) : "unexpected end of file");
+				return SEND_ERROR;
+			}
+			result = userspace_tls ? tls_write(conn->ssl, buffer, bytes_read) : write(conn->fd, buffer, bytes_read);
+			if (result > 0) {
+				*offset += result;
+			}
+		}
+
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return SEND_AGAIN;
+			log_message(NULL, "ERROR: Failed to send file: %s", strerror(errno));
+			return SEND_ERROR;
 		}
+		if (result == 0) {
+			log_message(NULL, "ERROR: sendfile hit unexpected end of file");
+			return SEND_ERROR;
+		}
+		metrics_bytes_sent(result);
 	}
+	return SEND_DONE;
+}
 
-	char real_filepath[PATH_MAX];
-	if (realpath(filepath, real_filepath) == NULL) {
-		log_message(NULL, "INFO: File not found for URI '%s', mapped to '%s'", request_uri, filepath);
-		send_error_response(client_fd, 404);
-		return -1;
+send_status_t http_send_pending(connection_t* conn) {
+	while (conn->resp_count > 0) {
+		response_t* head = &conn->responses[conn->resp_head];
+		send_status_t status;
+
+		if (head->header_sent < head->header_len || head->body_sent < head->body_len) {
+			status = send_memory_parts(conn);
+		} else {
+			status = http_send_file(conn, head->file_fd, &head->file_offset, head->file_end, head->use_sendfile);
+			if (status == SEND_DONE) {
+				pop_response(conn, 1);
+			}
+		}
+		if (status != SEND_DONE) return status;
 	}
+	// A 101 goes out before the first HTTP/2 frame.
+	if (conn->h2) {
+		return h2_send_pending(conn);
+	}
+	return SEND_DONE;
+}
 
-	if (strncmp(real_filepath, config->document_root, strlen(config->document_root)) != 0) {
-		log_message(NULL, "WARN: Path Traversal attempt blocked. URI: '%s', Resolved: '%s'", request_uri, real_filepath);
-		send_error_response(client_fd, 403);
-		return -1;
+int http_output_ready(const connection_t* conn) {
+	return conn->resp_count > 0 || (conn->h2 && h2_output_ready(conn));
+}
+
+// A qvalue of zero means "not acceptable" (RFC 9110 12.4.2).
+static int qvalue_is_zero(const char* params, const char* end) {
+	const char* q = params;
+	while ((q = memchr(q, ';', end - q)) != NULL) {
+		q++;
+		while (q < end && (*q == ' ' || *q == '\t')) q++;
+		if (end - q >= 2 && (*q == 'q' || *q == 'Q') && q[1] == '=') {
+			q += 2;
+			if (q == end || *q != '0') return 0;
+			for (q++; q < end && *q != ';' && *q != ' ' && *q != '\t'; q++) {
+				if (*q != '.' && *q != '0') return 0;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Which of the codings we keep sidecars for the client will take.
+static int parse_accept_encoding(const char* value) {
+	int accepted = 0;
+	int refused = 0;
+
+	while (*value) {
+		while (*value == ' ' || *value == '\t' || *value == ',') value++;
+		const char* name = value;
+		while (*value && *value != ',' && *value != ';' && *value != ' ' && *value != '\t') value++;
+		size_t name_len = value - name;
+		const char* params = value;
+		while (*value && *value != ',') value++;
+
+		int coding = 0;
+		if (name_len == 2 && strncasecmp(name, "br", 2) == 0) coding = ENCODING_BR;
+		else if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0) coding = ENCODING_GZIP;
+		else if (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0) coding = ENCODING_GZIP;
+		else if (name_len == 1 && *name == '*') coding = ENCODING_BR | ENCODING_GZIP;
+
+		if (qvalue_is_zero(params, value)) refused |= coding;
+		else accepted |= coding;
+	}
+	return accepted & ~refused;
+}
+
+// If-None-Match uses the weak comparison (RFC 9110 13.1.2), so a W/ prefix is ignored.
+static int etag_list_matches(const char* list, const char* etag) {
+	size_t etag_len = strlen(etag);
+	while (*list) {
+		while (*list == ' ' || *list == '\t' || *list == ',') list++;
+		if (*list == '*') return 1;
+		if (strncmp(list, "W/", 2) == 0) list += 2;
+		const char* end = list;
+		if (*end == '"') {
+			end = strchr(end + 1, '"');
+			end = end ? end + 1 : list + strlen(list);
+		} else {
+			while (*end && *end != ',') end++;
+		}
+		if ((size_t)(end - list) == etag_len && memcmp(list, etag, etag_len) == 0) return 1;
+		list = end;
 	}
+	return 0;
+}
 
-	struct stat file_stat;
-	if (stat(real_filepath, &file_stat) < 0) {
-		log_message(NULL, "ERROR: stat error for %s: %s", real_filepath, strerror(errno));
-		send_error_response(client_fd, 500);
+static int is_not_modified(connection_t* conn, const char* head, const char* etag, time_t last_modified) {
+	const http_slice_t* if_none_match = http_find_header(&conn->parser, head, "If-None-Match");
+	if (if_none_match) {
+		// If-Modified-Since is ignored when If-None-Match is present (RFC 9110 13.2.2).
+		return etag_list_matches(head + if_none_match->off, etag);
+	}
+
+	const http_slice_t* if_modified_since = http_find_header(&conn->parser, head, "If-Modified-Since");
+	if (if_modified_since) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		const char* end = strptime(head + if_modified_since->off, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		if (end && *end == '\0') {
+			return last_modified <= timegm(&tm);
+		}
+	}
+	return 0;
+}
+
+static const char* cache_control_for(const char* uri, server_config* config) {
+	const char* value = NULL;
+	size_t best_len = 0;
+	for (int i = 0; i < config->num_cache_control_rules; i++) {
+		const cache_control_rule_t* rule = &config->cache_control_rules[i];
+		size_t len = strlen(rule->prefix);
+		if (len >= best_len && strncmp(uri, rule->prefix, len) == 0) {
+			value = rule->value;
+			best_len = len;
+		}
+	}
+	return value;
+}
+
+static void use_not_modified(response_t* resp, cache_entry_t* entry) {
+	resp->cache_entry = entry;
+	resp->header = entry->not_modified;
+	resp->header_len = entry->not_modified_len;
+}
+
+static void use_cache_entry(response_t* resp, cache_entry_t* entry) {
+	resp->cache_entry = entry;
+	resp->header = entry->header;
+	resp->header_len = entry->header_len;
+	resp->body = entry->body;
+	resp->body_len = entry->body_len;
+}
+
+// One representation ready to go out: its prebuilt 200 and 304 headers, and a
+// body either in memory (a cache entry or a mapped pack) or in a file.
+typedef struct {
+	const char* header;
+	size_t header_len;
+	const char* not_modified;
+	size_t not_modified_len;
+	const char* etag;
+	time_t last_modified;
+	cache_entry_t* entry; // holds a reference
+	int file_fd;          // owned, unless it is the pack's
+	off_t size;
+	int use_sendfile;
+	const char* body;     // the whole body, when it is in memory
+	off_t file_base;      // where the body starts in file_fd
+	pack_t* pack;         // holds a reference
+} representation_t;
+
+static void representation_from_entry(representation_t* rep, cache_entry_t* entry) {
+	rep->header = entry->header;
+	rep->header_len = entry->header_len;
+	rep->not_modified = entry->not_modified;
+	rep->not_modified_len = entry->not_modified_len;
+	rep->etag = entry->etag;
+	rep->last_modified = entry->last_modified;
+	rep->entry = entry;
+	rep->file_fd = -1;
+	rep->size = entry->body_len;
+	rep->use_sendfile = 0;
+	rep->body = entry->body;
+	rep->file_base = 0;
+	rep->pack = NULL;
+}
+
+static void set_body_range(response_t* resp, const representation_t* rep, int file_fd, off_t start, off_t end) {
+	if (rep->body) {
+		resp->body = rep->body + start;
+		resp->body_len = end - start;
+	} else {
+		resp->file_fd = file_fd;
+		resp->file_offset = rep->file_base + start;
+		resp->file_start = resp->file_offset;
+		resp->file_end = rep->file_base + end;
+		resp->use_sendfile = rep->use_sendfile;
+	}
+	if (rep->pack) {
+		resp->pack = pack_acquire(rep->pack);
+	}
+}
+
+// If-Range only lets a client resume an unchanged representation: anything but
+// an exact strong ETag or Last-Modified match gets the whole thing (RFC 9110 13.1.5).
+static int if_range_allows(connection_t* conn, const char* head, const representation_t* rep) {
+	const http_slice_t* if_range = http_find_header(&conn->parser, head, "If-Range");
+	if (!if_range) return 1;
+
+	const char* value = head + if_range->off;
+	if (*value == '"') return strcmp(value, rep->etag) == 0;
+	if (strncmp(value, "W/", 2) == 0) return 0;
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	const char* end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return end && *end == '\0' && timegm(&tm) == rep->last_modified;
+}
+
+// Pull the Content-Type value and the lines after Content-Length out of a
+// prebuilt 200 header, so a 206 can be derived from a cached or a fresh one.
+static int split_full_header(const representation_t* rep, const char** type, int* type_len, const char** rest, int* rest_len) {
+	const char* end = rep->header + rep->header_len;
+	const char* type_start = memmem(rep->header, rep->header_len, "Content-Type: ", 14);
+	const char* length_line = memmem(rep->header, rep->header_len, "Content-Length: ", 16);
+	if (!type_start || !length_line) return -1;
+
+	type_start += 14;
+	const char* type_end = memchr(type_start, '\r', end - type_start);
+	const char* length_end = memchr(length_line, '\n', end - length_line);
+	if (!type_end || !length_end) return -1;
+
+	*type = type_start;
+	*type_len = type_end - type_start;
+	*rest = length_end + 1;
+	*rest_len = end - *rest;
+	return 0;
+}
+
+#define PART_HEADER_SIZE 192
+
+static int queue_ranges(connection_t* conn, representation_t* rep, const byte_range_t* ranges, int count) {
+	const char* type;
+	const char* rest;
+	int type_len, rest_len;
+	if (split_full_header(rep, &type, &type_len, &rest, &rest_len) != 0) return -1;
+
+	char header[RESPONSE_HEADER_SIZE];
+	int header_len;
+	char content_range[CONTENT_RANGE_SIZE];
+
+	if (count == 1) {
+		format_content_range(content_range, sizeof(content_range), &ranges[0], rep->size);
+		header_len = snprintf(header, sizeof(header),
+				"HTTP/1.1 206 Partial Content\r\n"
+				"Content-Type: %.*s\r\n"
+				"Content-Range: %s\r\n"
+				"Content-Length: %ld\r\n"
+				"%.*s",
+				type_len, type, content_range,
+				(long)(ranges[0].end - ranges[0].start), rest_len, rest);
+		if (header_len >= (int)sizeof(header)) return -1;
+
+		response_t* resp = push_response(conn);
+		memcpy(resp->header_buf, header, header_len);
+		resp->header_len = header_len;
+		resp->cache_entry = rep->entry;
+		resp->status = 206;
+		set_body_range(resp, rep, rep->file_fd, ranges[0].start, ranges[0].end);
+		rep->entry = NULL;
+		rep->file_fd = -1;
+		return 0;
+	}
+
+	// multipart/byteranges: one queued response per part, each carrying its
+	// part header, plus a last one for the closing boundary that owns the body.
+	char boundary[24];
+	snprintf(boundary, sizeof(boundary), "%08lx%08lx", (unsigned long)random(), (unsigned long)random());
+
+	char parts[HTTP_MAX_RANGES][PART_HEADER_SIZE];
+	int part_len[HTTP_MAX_RANGES];
+	int part_fd[HTTP_MAX_RANGES];
+	off_t total = 0;
+	for (int i = 0; i < count; i++) {
+		format_content_range(content_range, sizeof(content_range), &ranges[i], rep->size);
+		part_len[i] = snprintf(parts[i], PART_HEADER_SIZE,
+				"%s--%s\r\n"
+				"Content-Type: %.*s\r\n"
+				"Content-Range: %s\r\n\r\n",
+				i > 0 ? "\r\n" : "", boundary, type_len, type, content_range);
+		if (part_len[i] >= PART_HEADER_SIZE) return -1;
+		total += part_len[i] + (ranges[i].end - ranges[i].start);
+	}
+	char closing[48];
+	int closing_len = snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", boundary);
+	total += closing_len;
+
+	header_len = snprintf(header, sizeof(header),
+			"HTTP/1.1 206 Partial Content\r\n"
+			"Content-Type: multipart/byteranges; boundary=%s\r\n"
+			"Content-Length: %ld\r\n"
+			"%.*s%s",
+			boundary, (long)total, rest_len, rest, parts[0]);
+	if (header_len >= (int)sizeof(header)) return -1;
+
+	// Every file part reads through its own descriptor, since each queued
+	// response closes what it holds when it is done. A pack's is never closed.
+	for (int i = 0; i < count; i++) {
+		part_fd[i] = rep->pack ? rep->file_fd : -1;
+		if (rep->body || rep->pack) continue;
+		part_fd[i] = fcntl(rep->file_fd, F_DUPFD_CLOEXEC, 0);
+		if (part_fd[i] < 0) {
+			while (i-- > 0) close(part_fd[i]);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		response_t* resp = push_response(conn);
+		if (i == 0) {
+			memcpy(resp->header_buf, header, header_len);
+			resp->header_len = header_len;
+		} else {
+			memcpy(resp->header_buf, parts[i], part_len[i]);
+			resp->header_len = part_len[i];
+		}
+		set_body_range(resp, rep, part_fd[i], ranges[i].start, ranges[i].end);
+	}
+
+	response_t* resp = push_response(conn);
+	memcpy(resp->header_buf, closing, closing_len);
+	resp->header_len = closing_len;
+	resp->status = 206;
+	resp->cache_entry = rep->entry;
+	if (!rep->pack) {
+		resp->file_fd = rep->file_fd;
+		rep->file_fd = -1;
+	}
+	rep->entry = NULL;
+	return 0;
+}
+
+// Queue the answer to a GET for rep: a 304, a 206 or 416 for a Range request,
+// or the full 200. Takes over rep's references and file descriptor.
+static void queue_representation(connection_t* conn, const char* head, representation_t* rep) {
+	if (is_not_modified(conn, head, rep->etag, rep->last_modified)) {
+		response_t* resp = push_response(conn);
+		resp->status = 304;
+		if (rep->entry) {
+			use_not_modified(resp, rep->entry);
+			rep->entry = NULL;
+		} else if (rep->pack) {
+			resp->header = rep->not_modified;
+			resp->header_len = rep->not_modified_len;
+			resp->pack = pack_acquire(rep->pack);
+		} else {
+			memcpy(resp->header_buf, rep->not_modified, rep->not_modified_len);
+			resp->header_len = rep->not_modified_len;
+		}
+	} else {
+		const http_slice_t* range = http_find_header(&conn->parser, head, "Range");
+		int count = RANGE_IGNORE;
+		byte_range_t ranges[HTTP_MAX_RANGES];
+		if (range && if_range_allows(conn, head, rep)) {
+			count = parse_ranges(head + range->off, rep->size, ranges);
+		}
+		// A stream has room for one response, so several ranges get the whole body.
+		if (conn->h2 && count > 1) {
+			count = RANGE_IGNORE;
+		}
+
+		if (count == RANGE_UNSATISFIABLE) {
+			char content_range[CONTENT_RANGE_SIZE];
+			format_content_range(content_range, sizeof(content_range), NULL, rep->size);
+			response_t* resp = push_response(conn);
+			resp->status = 416;
+			resp->header_len = snprintf(resp->header_buf, sizeof(resp->header_buf),
+					"HTTP/1.1 416 Range Not Satisfiable\r\n"
+					"Content-Range: %s\r\n"
+					"Content-Length: 0\r\n"
+					"Connection: keep-alive\r\n\r\n",
+					content_range);
+		} else if (count == RANGE_IGNORE || queue_ranges(conn, rep, ranges, count) != 0) {
+			response_t* resp = push_response(conn);
+			resp->status = 200;
+			if (rep->entry) {
+				use_cache_entry(resp, rep->entry);
+				rep->entry = NULL;
+			} else {
+				// A pack's header is used where it lies, under the reference set_body_range() takes.
+				if (rep->pack) {
+					resp->header = rep->header;
+				} else {
+					memcpy(resp->header_buf, rep->header, rep->header_len);
+				}
+				resp->header_len = rep->header_len;
+				set_body_range(resp, rep, rep->file_fd, 0, rep->size);
+				rep->file_fd = -1;
+			}
+		}
+	}
+
+	cache_release(rep->entry);
+	if (rep->pack) {
+		pack_release(rep->pack);
+	} else if (rep->file_fd >= 0) {
+		close(rep->file_fd);
+	}
+}
+
+// Pack mode: headers, validators and every coding were settled when the pack
+// was built. Small bodies go out of the mapping in the same sendmsg() as their
+// header, the same cut-off the response cache uses; larger ones are sent from
+// the pack's descriptor.
+static int serve_from_pack(connection_t* conn, pack_t* pack, const char* request_uri, const char* head,
+		int accepted, server_config* config) {
+	const pack_route_t* route = pack_lookup(pack, request_uri);
+	if (!route) {
+		log_debug(NULL, "No route for URI '%s'", request_uri);
+		send_error_response(conn, 404);
 		return -1;
 	}
 
-	if (!S_ISREG(file_stat.st_mode)) {
-		send_error_response(client_fd, 403);;
-		log_message(NULL, "DEBUG: Not a regular file. Returning -1.");
+	int chosen = (accepted & route->encodings & ENCODING_BR) ? PACK_BR :
+		(accepted & route->encodings & ENCODING_GZIP) ? PACK_GZIP : PACK_IDENTITY;
+	const pack_variant_t* variant = &route->variants[chosen];
+
+	representation_t rep = {
+		pack_string(pack, variant->header), variant->header_len,
+		pack_string(pack, variant->not_modified), variant->not_modified_len,
+		pack_string(pack, variant->etag), route->last_modified,
+		NULL, pack->fd, variant->body_len, config->use_sendfile,
+		NULL, variant->body_offset, pack_acquire(pack)
+	};
+	if (variant->body_len <= config->cache_max_file_size) {
+		rep.body = pack->base + variant->body_offset;
+	}
+	queue_representation(conn, head, &rep);
+	return 0;
+}
+
+int serve_static_file(connection_t* conn, const char *request_uri, const char* head, server_config *config) {
+	// Range requests are answered from the identity representation, so a
+	// multipart body never has to describe a content coding.
+	const http_slice_t* accept_encoding = http_find_header(&conn->parser, head, "Accept-Encoding");
+	int accepted = 0;
+	if (accept_encoding && !http_find_header(&conn->parser, head, "Range")) {
+		accepted = parse_accept_encoding(head + accept_encoding->off);
+	}
+
+	pack_t* pack = routes_pack();
+	if (pack) {
+		return serve_from_pack(conn, pack, request_uri, head, accepted, config);
+	}
+
+	representation_t rep;
+	cache_entry_t* cached = cache_lookup(request_uri, accepted);
+	if (cached) {
+		representation_from_entry(&rep, cached);
+		queue_representation(conn, head, &rep);
+		return 0;
+	}
+	unsigned long generation = cache_generation();
+
+	const route_t* route = routes_lookup(request_uri);
+	if (!route) {
+		log_debug(NULL, "No route for URI '%s'", request_uri);
+		send_error_response(conn, 404);
 		return -1;
 	}
 
-	int file_fd = open(real_filepath, O_RDONLY);
+	const mime_type_t* mime = route->mime;
+	int sidecars = route->sidecars;
+	int file_fd = -1;
+	const char* content_encoding = NULL;
+	struct stat body_stat;
+
+	int chosen = (accepted & sidecars & ENCODING_BR) ? ENCODING_BR : (accepted & sidecars & ENCODING_GZIP);
+	if (chosen) {
+		char sidecar_path[PATH_MAX + 4];
+		snprintf(sidecar_path, sizeof(sidecar_path), "%s.%s", route->path, chosen == ENCODING_BR ? "br" : "gz");
+		file_fd = open(sidecar_path, O_RDONLY | O_CLOEXEC);
+		// A sidecar older than its source is left over from a previous deploy.
+		if (file_fd >= 0 && fstat(file_fd, &body_stat) == 0 && S_ISREG(body_stat.st_mode) &&
+				body_stat.st_mtime >= route->mtime) {
+			content_encoding = chosen == ENCODING_BR ? "br" : "gzip";
+		} else if (file_fd >= 0) {
+			close(file_fd);
+			file_fd = -1;
+		}
+	}
+
 	if (file_fd < 0) {
-		send_error_response(client_fd, 403);
-		log_message(NULL, "DEBUG: Permission denied. Returning -1.");
-		return -1;
+		file_fd = open(route->path, O_RDONLY | O_CLOEXEC);
+		if (file_fd < 0) {
+			// The file went away before the route table caught up.
+			int status = errno == ENOENT ? 404 : 403;
+			log_info(NULL, "Cannot open '%s' for URI '%s': %s", route->path, request_uri, strerror(errno));
+			send_error_response(conn, status);
+			return -1;
+		}
+		if (fstat(file_fd, &body_stat) < 0) {
+			log_message(NULL, "ERROR: fstat error for %s: %s", route->path, strerror(errno));
+			close(file_fd);
+			send_error_response(conn, 500);
+			return -1;
+		}
+		if (!S_ISREG(body_stat.st_mode)) {
+			close(file_fd);
+			send_error_response(conn, 403);
+			return -1;
+		}
 	}
+	time_t source_mtime = content_encoding ? route->mtime : body_stat.st_mtime;
+
+	// The ETag comes from the file actually sent, so each coding has its own;
+	// Last-Modified is always the source's.
+	char etag[64];
+	snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"", (unsigned long)body_stat.st_ino, (unsigned long)body_stat.st_size,
+			(unsigned long)body_stat.st_mtim.tv_sec * 1000000000ul + body_stat.st_mtim.tv_nsec);
+	char last_modified[64];
+	struct tm mtime_tm;
+	gmtime_r(&source_mtime, &mtime_tm);
+	strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &mtime_tm);
 
-	char header[512];
-	const char* mime_type = get_mime_type(real_filepath);
+	// Headers shared by the 200 and the 304. Vary goes on every response for a
+	// file that has sidecars, whichever one was picked.
+	char validators[384];
+	const char* cache_control = cache_control_for(request_uri, config);
+	snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s",
+			etag, last_modified,
+			cache_control ? "Cache-Control: " : "", cache_control ? cache_control : "", cache_control ? "\r\n" : "",
+			sidecars ? "Vary: Accept-Encoding\r\n" : "");
 
-	snprintf(header, sizeof(header),
+	char encoding_header[48] = "";
+	if (content_encoding) {
+		snprintf(encoding_header, sizeof(encoding_header), "Content-Encoding: %s\r\n", content_encoding);
+	}
+
+	char header[RESPONSE_HEADER_SIZE];
+	char not_modified[RESPONSE_HEADER_SIZE];
+	cache_headers_t headers = { header, 0, not_modified, 0, etag, source_mtime };
+	headers.header_len = snprintf(header, sizeof(header),
 			"HTTP/1.1 200 OK\r\n"
 			"Content-Type: %s\r\n"
 			"Content-Length: %ld\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"%s%s"
 			"X-Content-Type-Options: nosniff\r\n"
 			"X-Frame-Options: DENY\r\n"
 			"Connection: keep-alive\r\n\r\n",
-			mime_type, file_stat.st_size);
-
-	write(client_fd, header, strlen(header));
-
-	char buffer[4096];
-	ssize_t bytes_read;
-	while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
-		ssize_t bytes_written = 0;
-		while (bytes_written < bytes_read) {
-			ssize_t result = write(client_fd, buffer + bytes_written, bytes_read - bytes_written);
-			if (result < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					continue;
-				}
-				log_message(NULL, "ERROR: Failed to write to socket: %s", strerror(errno));
-				close(file_fd);
-				return -1;
-			}
-			bytes_written += result;
-		}
+			mime->type, body_stat.st_size, encoding_header, validators);
+	headers.not_modified_len = snprintf(not_modified, sizeof(not_modified),
+			"HTTP/1.1 304 Not Modified\r\n"
+			"%s"
+			"Connection: keep-alive\r\n\r\n",
+			validators);
+	if (headers.header_len >= sizeof(header) || headers.not_modified_len >= sizeof(not_modified)) {
+		log_message(NULL, "ERROR: Response header for '%s' does not fit in %d bytes", request_uri, RESPONSE_HEADER_SIZE);
+		close(file_fd);
+		send_error_response(conn, 500);
+		return -1;
+	}
+
+	cached = cache_insert(request_uri, accepted, route->path, &headers, file_fd, body_stat.st_size, generation);
+	if (cached) {
+		close(file_fd);
+		representation_from_entry(&rep, cached);
+	} else {
+		rep = (representation_t){ header, headers.header_len, not_modified, headers.not_modified_len,
+				etag, source_mtime, NULL, file_fd, body_stat.st_size, config->use_sendfile, NULL, 0, NULL };
 	}
+	queue_representation(conn, head, &rep);
+	return 0;
+}
 
-	close(file_fd);
-	log_message(NULL, "DEBUG: File sent successfully. Returning 0.");
+int serve_metrics(connection_t* conn) {
+	char* body;
+	size_t body_len;
+	if (metrics_render(&body, &body_len) != 0) {
+		send_error_response(conn, 500);
+		return -1;
+	}
+
+	response_t* resp = push_response(conn);
+	resp->header_len = snprintf(resp->header_buf, sizeof(resp->header_buf),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Cache-Control: no-store\r\n"
+			"X-Content-Type-Options: nosniff\r\n"
+			"Connection: keep-alive\r\n\r\n",
+			body_len);
+	resp->body = body;
+	resp->body_len = body_len;
+	resp->owned_body = body;
+	resp->status = 200;
 	return 0;
 }
 
+static int answer(connection_t* conn, const char* head, const char* uri, server_config* config) {
+	const char* method = head + conn->parser.method.off;
+	if (!ratelimit_take(conn->limit)) {
+		send_error_response(conn, 429);
+		return 0;
+	}
+	if (strstr(uri, "..")) {
+		send_error_response(conn, 400);
+		return 0;
+	}
+	if (strcmp(method, "GET") != 0) {
+		send_error_response(conn, 405);
+		return 0;
+	}
+	if (config->metrics_uri && strcmp(uri, config->metrics_uri) == 0) {
+		return serve_metrics(conn);
+	}
+	return serve_static_file(conn, uri, head, config);
+}
+
+// HTTP/1.1 keeps the connection unless the client says close; HTTP/1.0 only
+// keeps it when the client asks to (RFC 9112 9.3).
+static int wants_close(const connection_t* conn, const char* head) {
+	const http_slice_t* connection = http_find_header(&conn->parser, head, "Connection");
+	if (connection && http_list_contains(head + connection->off, "close")) return 1;
+	if (!http_slice_equals(head, conn->parser.version, "HTTP/1.0")) return 0;
+	return !connection || !http_list_contains(head + connection->off, "keep-alive");
+}
+
+// Prebuilt headers all say keep-alive. The copy that says close is made in the
+// response's own buffer; a header too long for it keeps the line, and the
+// connection is closed after it all the same.
+static void announce_close(response_t* resp) {
+	static const char keep_alive[] = "\r\nConnection: keep-alive\r\n";
+	static const char close_line[] = "\r\nConnection: close\r\n";
+	const char* line = memmem(resp->header, resp->header_len, keep_alive, sizeof(keep_alive) - 1);
+	if (!line || resp->header_len > sizeof(resp->header_buf)) return;
+
+	size_t prefix = line - resp->header;
+	size_t suffix = resp->header_len - prefix - (sizeof(keep_alive) - 1);
+	if (resp->header != resp->header_buf) {
+		memcpy(resp->header_buf, resp->header, resp->header_len);
+		resp->header = resp->header_buf;
+	}
+	memmove(resp->header_buf + prefix + sizeof(close_line) - 1, resp->header_buf + prefix + sizeof(keep_alive) - 1, suffix);
+	memcpy(resp->header_buf + prefix, close_line, sizeof(close_line) - 1);
+	resp->header_len = prefix + sizeof(close_line) - 1 + suffix;
+}
+
+int http_answer(connection_t* conn, const char* head, server_config* config) {
+	const char* uri = head + conn->parser.uri.off;
+	int first = conn->resp_count;
+	// Responses queued meanwhile carry the URI's id into the access log.
+	conn->request_uri_id = access_log_enabled() ? access_log_uri_id(uri) : 0;
+	int result = answer(conn, head, uri, config);
+	conn->request_uri_id = 0;
+
+	if (!conn->h2 && wants_close(conn, head)) {
+		conn->close_after_write = 1;
+		// The request's first response carries its status line.
+		if (conn->resp_count > first) {
+			announce_close(&conn->responses[(conn->resp_head + first) % MAX_PIPELINE]);
+		}
+	}
+	return result;
+}
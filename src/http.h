@@ -1,14 +1,54 @@
 #pragma once
 
+#include <sys/uio.h>
+
 #include "server.h"
+#include "connection.h"
+#include "range.h"
+
+// Most response slots one request can take: a multipart/byteranges reply uses
+// one per part plus one for the closing boundary.
+#define HTTP_MAX_RESPONSE_SLOTS (HTTP_MAX_RANGES + 1)
+
+// Request bodies are skipped, never read; larger ones are refused with 413.
+#define HTTP_MAX_BODY_SIZE 65536
+
+typedef enum {
+	SEND_DONE,
+	SEND_AGAIN,
+	SEND_ERROR,
+	SEND_QUEUED  // handed to the io_uring ring; its completion carries on
+} send_status_t;
 
-typedef struct {
-	char* method;
-	char* uri;
-} http_request_t;
+void send_error_response(connection_t* conn, int status_code);
+int http_parse_error_status(parse_result_t result);
+// Where a parsed request ends: *length bytes of body follow its head. Returns
+// 0, or the status to refuse the request with when its body cannot be framed.
+int http_request_body(const http_parser_t* parser, const char* head, size_t* length);
+void send_switching_protocols(connection_t* conn);
+// Route a parsed request and queue its answer. -1 when the answer was an error
+// the connection should not outlive.
+int http_answer(connection_t* conn, const char* head, server_config* config);
+// head is the buffer the request was parsed from, for header lookups.
+int serve_static_file(connection_t* conn, const char* request_uri, const char* head, server_config* config);
+// Metrics of every worker, rendered at request time; never from document_root.
+int serve_metrics(connection_t* conn);
+send_status_t http_send_pending(connection_t* conn);
+// Something is queued that the socket could take now.
+int http_output_ready(const connection_t* conn);
+void http_response_reset(connection_t* conn);
+// Close what a response holds; sent counts it in the metrics and the access
+// log, and conn is only looked at then.
+void http_response_release(connection_t* conn, response_t* resp, int sent);
 
-int parse_http_request(char* buffer, http_request_t* req);
-void free_http_request(http_request_t* req);
-void send_error_response(int client_fd, int status_code);
-int serve_static_file(int client_fd, const char* request_uri, server_config* config);
+// For ring sends on io_uring: the in-memory parts of queued responses, from
+// the head up to the first one still holding a file range, as at most
+// RESPONSE_IOV_MAX iovecs. *flags gets MSG_MORE when a sendfile() body follows.
+int http_gather_memory(const connection_t* conn, struct iovec* iov, int* flags);
+// Count written bytes of those parts as sent, retiring responses that are done.
+void http_memory_sent(connection_t* conn, size_t written);
 
+// The writers under http_send_pending(), for HTTP/2 framing: MSG_NOSIGNAL is
+// always added to flags, and TLS is handled as for any response.
+send_status_t http_writev(connection_t* conn, struct iovec* iov, int iovcnt, int flags, size_t* written);
+send_status_t http_send_file(connection_t* conn, int file_fd, off_t* offset, off_t end, int use_sendfile);
@@ -1,53 +1,391 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #include "logger.h"
 
-static FILE* log_file = NULL;
+#define LOG_LINE_MAX 1024
+#define FLUSH_INTERVAL_MS 100
+#define MAX_RINGS 256
+
+/*
+ * Every thread formats into its own single-producer/single-consumer byte ring;
+ * a background thread collects all rings with one writev() per cycle. Logging
+ * threads never take a lock or make a syscall unless their ring is full and
+ * the policy is to block.
+ *
+ * The text log and the binary access log are two sinks with rings of their
+ * own, flushed by the same thread.
+ */
+typedef struct log_ring_s {
+	char* buf;
+	size_t mask;
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+} log_ring_t;
+
+typedef struct {
+	int fd;
+	char* path;
+	// Written first to a file opened empty, so every file can be read alone.
+	const void* header;
+	size_t header_len;
+	log_ring_t* rings[MAX_RINGS];
+	atomic_int num_rings;
+	atomic_ulong dropped;
+} log_sink_t;
+
+static log_sink_t text_sink = { .fd = -1 };
+static log_sink_t access_sink = { .fd = -1 };
+static size_t ring_size = 0;
+static int block_when_full = 0;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool flusher_running = false;
+static volatile sig_atomic_t reopen_requested = 0;
+
+static __thread log_ring_t* thread_ring = NULL;
+static __thread log_ring_t* thread_access_ring = NULL;
+static __thread time_t cached_second = 0;
+static __thread char cached_timestamp[20];
+
+static log_ring_t* get_thread_ring(log_sink_t* sink, log_ring_t** slot) {
+	if (*slot) return *slot;
+
+	log_ring_t* ring = aligned_alloc(64, sizeof(log_ring_t));
+	if (!ring) return NULL;
+	ring->buf = malloc(ring_size);
+	if (!ring->buf) {
+		free(ring);
+		return NULL;
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->mask = ring_size - 1;
+
+	pthread_mutex_lock(&registry_lock);
+	int index = atomic_load(&sink->num_rings);
+	if (index == MAX_RINGS) {
+		pthread_mutex_unlock(&registry_lock);
+		free(ring->buf);
+		free(ring);
+		return NULL;
+	}
+	sink->rings[index] = ring;
+	atomic_store_explicit(&sink->num_rings, index + 1, memory_order_release);
+	pthread_mutex_unlock(&registry_lock);
+
+	*slot = ring;
+	return ring;
+}
+
+static void wake_flusher(void) {
+	pthread_mutex_lock(&flusher_lock);
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&flusher_lock);
+}
+
+// Whole entries or nothing: a flush never sees half a line or record.
+static void ring_push(log_sink_t* sink, log_ring_t* ring, const char* data, size_t len) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	while (1) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (ring->mask + 1 - (head - tail) >= len) break;
+
+		if (!block_when_full || !atomic_load(&flusher_running)) {
+			atomic_fetch_add_explicit(&sink->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		wake_flusher();
+		struct timespec pause = { 0, 100000 };
+		nanosleep(&pause, NULL);
+	}
+
+	size_t pos = head & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > len) first = len;
+	memcpy(ring->buf + pos, data, first);
+	memcpy(ring->buf, data + first, len - first);
+	atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+static void write_fully(int fd, struct iovec* iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+// Collect whatever every ring of sink holds and write it out in a single batch.
+static void flush_rings(log_sink_t* sink) {
+	struct iovec iov[MAX_RINGS * 2];
+	size_t heads[MAX_RINGS];
+	int iovcnt = 0;
+	int count = atomic_load_explicit(&sink->num_rings, memory_order_acquire);
+
+	for (int i = 0; i < count; i++) {
+		log_ring_t* ring = sink->rings[i];
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		heads[i] = head;
+		if (head == tail) continue;
+
+		size_t pos = tail & ring->mask;
+		size_t len = head - tail;
+		size_t first = ring->mask + 1 - pos;
+		if (first > len) first = len;
+		iov[iovcnt].iov_base = ring->buf + pos;
+		iov[iovcnt].iov_len = first;
+		iovcnt++;
+		if (len > first) {
+			iov[iovcnt].iov_base = ring->buf;
+			iov[iovcnt].iov_len = len - first;
+			iovcnt++;
+		}
+	}
+
+	for (int start = 0; start < iovcnt; start += IOV_MAX) {
+		int n = iovcnt - start < IOV_MAX ? iovcnt - start : IOV_MAX;
+		if (sink->fd >= 0) write_fully(sink->fd, iov + start, n);
+	}
+
+	for (int i = 0; i < count; i++) {
+		atomic_store_explicit(&sink->rings[i]->tail, heads[i], memory_order_release);
+	}
+}
+
+static int open_sink_file(log_sink_t* sink, const char* path) {
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || !sink->header) return fd;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		struct iovec iov = { (void*)sink->header, sink->header_len };
+		write_fully(fd, &iov, 1);
+	}
+	return fd;
+}
+
+static void reopen_log_file(log_sink_t* sink) {
+	if (sink->fd < 0) return;
+	int fd = open_sink_file(sink, sink->path);
+	if (fd < 0) {
+		log_message(NULL, "ERROR: Failed to reopen log file %s: %s", sink->path, strerror(errno));
+		return;
+	}
+	int old_fd = sink->fd;
+	sink->fd = fd;
+	close(old_fd);
+	log_message(NULL, "Log file %s reopened.", sink->path);
+}
+
+static void* flusher_main(void* arg) {
+	(void)arg;
+	unsigned long reported_drops = 0;
+	unsigned long reported_record_drops = 0;
 
-int logger_init(const char* filename) {
-	log_file = fopen(filename, "a");
-	if (!log_file) {
+	while (atomic_load(&flusher_running)) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&flusher_lock);
+		pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline);
+		pthread_mutex_unlock(&flusher_lock);
+
+		unsigned long drops = atomic_load_explicit(&text_sink.dropped, memory_order_relaxed);
+		if (drops != reported_drops) {
+			log_message(NULL, "WARN: Logger dropped %lu lines (ring full)", drops - reported_drops);
+			reported_drops = drops;
+		}
+		unsigned long record_drops = atomic_load_explicit(&access_sink.dropped, memory_order_relaxed);
+		if (record_drops != reported_record_drops) {
+			log_message(NULL, "WARN: Access log dropped %lu records (ring full)", record_drops - reported_record_drops);
+			reported_record_drops = record_drops;
+		}
+
+		flush_rings(&access_sink);
+		flush_rings(&text_sink);
+
+		if (reopen_requested) {
+			reopen_requested = 0;
+			reopen_log_file(&access_sink);
+			reopen_log_file(&text_sink);
+		}
+	}
+	return NULL;
+}
+
+int logger_init(const char* filename, int inherited_fd, size_t ring_bytes, int block) {
+	if (inherited_fd >= 0) {
+		text_sink.fd = inherited_fd;
+		fcntl(text_sink.fd, F_SETFD, FD_CLOEXEC);
+	} else {
+		text_sink.fd = open_sink_file(&text_sink, filename);
+	}
+	if (text_sink.fd < 0) {
 		perror("Error: could not open log file");
 		return -1;
 	}
+	text_sink.path = strdup(filename);
+
+	ring_size = 4096;
+	while (ring_size < ring_bytes) ring_size <<= 1;
+	block_when_full = block;
+
+	atomic_store(&flusher_running, true);
+	if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+		perror("Error: could not start log flusher thread");
+		atomic_store(&flusher_running, false);
+		close(text_sink.fd);
+		text_sink.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int logger_open_access(const char* filename, const void* header, size_t header_len) {
+	access_sink.header = header;
+	access_sink.header_len = header_len;
+	access_sink.fd = open_sink_file(&access_sink, filename);
+	if (access_sink.fd < 0) {
+		log_message(NULL, "ERROR: Could not open access log %s: %s", filename, strerror(errno));
+		return -1;
+	}
+	access_sink.path = strdup(filename);
 	return 0;
 }
 
 void log_message(const char* client_ip, const char *format, ...) {
-	if (!log_file) {
+	if (text_sink.fd < 0) {
 		fprintf(stderr, "Logger not initialized.\n");
 		return;
 	}
 
-	time_t now = time(NULL);
-	struct tm t;
-	char time_buf[20];
+	log_ring_t* ring = get_thread_ring(&text_sink, &thread_ring);
+	if (!ring) {
+		atomic_fetch_add_explicit(&text_sink.dropped, 1, memory_order_relaxed);
+		return;
+	}
 
-	localtime_r(&now, &t);
-	strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", &t);
+	time_t now = time(NULL);
+	if (now != cached_second) {
+		struct tm t;
+		localtime_r(&now, &t);
+		strftime(cached_timestamp, sizeof(cached_timestamp), "%Y-%m-%d %H:%M:%S", &t);
+		cached_second = now;
+	}
 
-	fprintf(log_file, "[%s] ", time_buf);
+	char line[LOG_LINE_MAX];
+	int len;
 	if (client_ip) {
-		fprintf(log_file, "[%s] ", client_ip);
+		len = snprintf(line, sizeof(line), "[%s] [%s] ", cached_timestamp, client_ip);
+	} else {
+		len = snprintf(line, sizeof(line), "[%s] ", cached_timestamp);
 	}
 
 	va_list args;
 	va_start(args, format);
-	vfprintf(log_file, format, args);
+	int body = vsnprintf(line + len, sizeof(line) - len - 1, format, args);
 	va_end(args);
 
-	fprintf(log_file, "\n");
+	if (body > 0) {
+		len += body;
+		if (len > LOG_LINE_MAX - 2) len = LOG_LINE_MAX - 2;
+	}
+	line[len++] = '\n';
 
-	fflush(log_file);
+	ring_push(&text_sink, ring, line, len);
 }
 
-void logger_close() {
-	if (log_file) {
-		fclose(log_file);
-		log_file = NULL;
+void logger_access(const void* record, size_t len) {
+	if (access_sink.fd < 0) return;
+
+	log_ring_t* ring = get_thread_ring(&access_sink, &thread_access_ring);
+	if (!ring) {
+		atomic_fetch_add_explicit(&access_sink.dropped, 1, memory_order_relaxed);
+		return;
 	}
+	ring_push(&access_sink, ring, record, len);
+}
+
+void logger_request_reopen(void) {
+	reopen_requested = 1;
+}
+
+int logger_fd(void) {
+	return text_sink.fd;
+}
+
+unsigned long logger_dropped_lines(void) {
+	return atomic_load_explicit(&text_sink.dropped, memory_order_relaxed);
 }
 
+unsigned long logger_dropped_records(void) {
+	return atomic_load_explicit(&access_sink.dropped, memory_order_relaxed);
+}
+
+static void close_sink(log_sink_t* sink) {
+	if (sink->fd >= 0) {
+		flush_rings(sink);
+		close(sink->fd);
+		sink->fd = -1;
+	}
+
+	int count = atomic_load(&sink->num_rings);
+	for (int i = 0; i < count; i++) {
+		free(sink->rings[i]->buf);
+		free(sink->rings[i]);
+		sink->rings[i] = NULL;
+	}
+	atomic_store(&sink->num_rings, 0);
+	free(sink->path);
+	sink->path = NULL;
+}
+
+void logger_close() {
+	if (atomic_load(&flusher_running)) {
+		atomic_store(&flusher_running, false);
+		wake_flusher();
+		pthread_join(flusher_thread, NULL);
+	}
+	close_sink(&access_sink);
+	close_sink(&text_sink);
+	thread_ring = NULL;
+	thread_access_ring = NULL;
+}
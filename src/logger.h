@@ -1,8 +1,33 @@
 #pragma once
 
 #include <stdarg.h>
+#include <stddef.h>
 
-int logger_init(const char* filename);
+// Compile-time log levels. Calls below LOG_LEVEL compile away entirely, their
+// arguments included; the Makefile sets it, and without it DEBUG is left out.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define log_debug(client_ip, format, ...) do { \
+		if (LOG_LEVEL <= LOG_LEVEL_DEBUG) log_message(client_ip, "DEBUG: " format, ##__VA_ARGS__); \
+	} while (0)
+#define log_info(client_ip, format, ...) do { \
+		if (LOG_LEVEL <= LOG_LEVEL_INFO) log_message(client_ip, "INFO: " format, ##__VA_ARGS__); \
+	} while (0)
+
+// inherited_fd, when not -1, is an already open log file to write to instead
+// of opening filename, as handed over by a binary upgrade.
+int logger_init(const char* filename, int inherited_fd, size_t ring_bytes, int block_when_full);
+int logger_fd(void);
 void log_message(const char* client_ip, const char* format, ...);
+// A second sink for fixed-size binary records, batched like the text log.
+// header starts every file the sink opens empty, and must outlive the logger.
+int logger_open_access(const char* filename, const void* header, size_t header_len);
+void logger_access(const void* record, size_t len);
+void logger_request_reopen(void);
+unsigned long logger_dropped_lines(void);
+unsigned long logger_dropped_records(void);
 void logger_close();
-
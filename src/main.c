@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +10,7 @@
 #include <signal.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <linux/limits.h>
 #include <pwd.h>
 #include <grp.h>
@@ -17,24 +20,209 @@
 #include "server.h"
 #include "worker.h"
 #include "connection.h"
+#include "cache.h"
+#include "parser.h"
+#include "queue.h"
+#include "precompress.h"
+#include "tls.h"
+#include "routes.h"
+#include "metrics.h"
+#include "upgrade.h"
+#include "affinity.h"
+#include "dispatch.h"
+#include "ratelimit.h"
+#include "accesslog.h"
 
+// running: keep accepting. graceful: let open connections finish on the way out.
 static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t shutdown_signal = 0;
+static volatile sig_atomic_t graceful = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
 
+static void close_listeners(int* listen_fds, int count) {
+	for (int i = 0; i < count; i++) {
+		close(listen_fds[i]);
+	}
+}
+
+// Only async-signal-safe work here: the logger's per-thread rings must not be
+// re-entered from a handler.
 static void signal_handler(int signum) {
-	log_message(NULL, "Signal %d received, initiating shutdown...", signum);
+	shutdown_signal = signum;
+	running = 0;
+}
+
+static void graceful_handler(int signum) {
+	shutdown_signal = signum;
+	graceful = 1;
+	running = 0;
+}
+
+static void upgrade_handler(int signum) {
 	(void)signum;
+	upgrade_requested = 1;
 	running = 0;
 }
 
+static void reopen_handler(int signum) {
+	(void)signum;
+	logger_request_reopen();
+}
+
+// Root drops to www-data once the listeners are bound. A server started
+// unprivileged, as one exec'd by an upgrade is, has nothing left to drop.
+static int drop_privileges(void) {
+	if (getuid() != 0) {
+		log_info(NULL, "Running as uid %d; not dropping privileges.", (int)getuid());
+		return 0;
+	}
+
+	const char* drop_user = "www-data";
+	struct passwd* pw = getpwnam(drop_user);
+	if (pw == NULL) {
+		log_message(NULL, "FATAL: Could not find user '%s' to drop privileges.", drop_user);
+		return -1;
+	}
+	if (setgid(pw->pw_gid) != 0) {
+		log_message(NULL, "FATAL: setgid failed: %s", strerror(errno));
+		return -1;
+	}
+	if (setuid(pw->pw_uid) != 0) {
+		log_message(NULL, "FATAL: setuid failed: %s", strerror(errno));
+		return -1;
+	}
+	log_message(NULL, "Successfully dropped privileges to user '%s'.", drop_user);
+	return 0;
+}
+
+#define ACCEPT_BATCH 64
+#define HANDOFF_QUEUE_SIZE 1024
+
+static bool push_connection(spsc_queue_t** queues, bool* pending, int worker, const accepted_conn_t* accepted) {
+	if (!spsc_queue_push(queues[worker], accepted)) return false;
+	dispatch_load_add(worker, 1);
+	pending[worker] = true;
+	log_debug(NULL, "Main: Dispatched fd %d to worker %d", accepted->fd, worker);
+	return true;
+}
+
+// With steer_incoming_cpu, the worker pinned to the CPU that receives the
+// connection's packets gets it first, so its socket is only ever touched there.
+// Otherwise the dispatch policy picks, and a full queue falls back to the next
+// worker round the ring.
+static bool dispatch_connection(spsc_queue_t** queues, bool* pending, server_config* config, int* next_worker, bool steer, const accepted_conn_t* accepted) {
+	int num_workers = config->num_workers;
+	if (steer) {
+		int cpu = -1;
+		socklen_t len = sizeof(cpu);
+		if (getsockopt(accepted->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+			int worker = affinity_worker_on_cpu(cpu);
+			if (worker >= 0 && push_connection(queues, pending, worker, accepted)) return true;
+		}
+	}
+	if (config->dispatch_policy != DISPATCH_ROUND_ROBIN) {
+		int worker = dispatch_pick(config->dispatch_policy);
+		if (push_connection(queues, pending, worker, accepted)) return true;
+	}
+	for (int attempt = 0; attempt < num_workers; attempt++) {
+		int worker = *next_worker;
+		*next_worker = (*next_worker + 1) % num_workers;
+		if (push_connection(queues, pending, worker, accepted)) return true;
+	}
+	return false;
+}
+
+// Take up to a batch of connections off one listening socket.
+static void accept_batch(int listen_fd, spsc_queue_t** queues, bool* pending, server_config* config, int* next_worker, bool steer) {
+	for (int n = 0; n < ACCEPT_BATCH; n++) {
+		accepted_conn_t accepted;
+		socklen_t addr_len = sizeof(accepted.addr);
+		accepted.fd = accept4(listen_fd, (struct sockaddr*)&accepted.addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (accepted.fd < 0) {
+			if (errno == EINTR && running) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				log_message(NULL, "ERROR: accept4() failed in main loop: %s", strerror(errno));
+			}
+			break;
+		}
+		// Refused before a worker, or a connection_t, is spent on it.
+		if (!ratelimit_admit(&accepted.addr, &accepted.limit)) {
+			if (LOG_LEVEL <= LOG_LEVEL_DEBUG) {
+				char client_ip[INET6_ADDRSTRLEN];
+				connection_format_address(&accepted.addr, client_ip, sizeof(client_ip));
+				log_debug(client_ip, "Main: Refused fd %d over the per-address connection limit", accepted.fd);
+			}
+			close(accepted.fd);
+			continue;
+		}
+
+		if (!dispatch_connection(queues, pending, config, next_worker, steer, &accepted)) {
+			log_message(NULL, "ERROR: All worker queues full, dropping fd %d", accepted.fd);
+			close(accepted.fd);
+			ratelimit_release(accepted.limit);
+		}
+	}
+}
+
+// Drain the accept backlog in batches and wake each worker at most once per batch.
+static void run_acceptor(const int* listen_fds, int num_fds, spsc_queue_t** queues, server_config* config) {
+	int num_workers = config->num_workers;
+	bool steer = config->steer_incoming_cpu && affinity_enabled();
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event, events[num_fds];
+	if (config->busy_poll > 0 && server_busy_poll_epoll(epoll_fd, config) != 0) {
+		log_message(NULL, "WARN: Acceptor: epoll busy poll unavailable: %s", strerror(errno));
+	}
+
+	for (int i = 0; i < num_fds; i++) {
+		event.events = EPOLLIN;
+		event.data.fd = listen_fds[i];
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fds[i], &event);
+	}
+
+	bool pending[num_workers];
+	memset(pending, 0, sizeof(pending));
+
+	int next_worker = 0;
+	while(running) {
+		int n_events = epoll_wait(epoll_fd, events, num_fds, 1000);
+		if (n_events < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		for (int e = 0; e < n_events; e++) {
+			accept_batch(events[e].data.fd, queues, pending, config, &next_worker, steer);
+		}
+
+		for (int i = 0; i < num_workers; i++) {
+			if (pending[i]) {
+				spsc_queue_notify(queues[i]);
+				pending[i] = false;
+			}
+		}
+	}
+	close(epoll_fd);
+}
+
 int main(int argc, char* argv[]) {
 	int is_daemon_mode = 0;
+	int precompress_only = 0;
 	if (argc > 1 && strcmp(argv[1], "-d") == 0) {
 		is_daemon_mode = 1;
+	} else if (argc > 1 && strcmp(argv[1], "--precompress") == 0) {
+		precompress_only = 1;
 	}
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, reopen_handler);
+	signal(SIGUSR2, upgrade_handler);
+	signal(SIGQUIT, graceful_handler);
+
+	// Before any thread exists: this reads and clears what an upgrade handed over.
+	upgrade_init();
 
 	server_config config;
 	config_init_defaults(&config);
@@ -43,172 +231,269 @@ int main(int argc, char* argv[]) {
 		fprintf(stderr, "Failed to load configuration, using defaults.");
 	}
 
-	char absolute_doc_root[PATH_MAX];
-	if (realpath(config.document_root, absolute_doc_root) == NULL) {
-		fprintf(stderr, "Invalid document_root: %s\n", config.document_root);
-		perror("realpath failed");
-		free_config(&config);
-		return 1;
-	}
+	// A pack carries the whole site, so document_root need not exist beside it.
+	if (!config.document_pack || precompress_only) {
+		char absolute_doc_root[PATH_MAX];
+		if (realpath(config.document_root, absolute_doc_root) == NULL) {
+			fprintf(stderr, "Invalid document_root: %s\n", config.document_root);
+			perror("realpath failed");
+			free_config(&config);
+			return 1;
+		}
 
-	free(config.document_root);
-	config.document_root = strdup(absolute_doc_root);
-	if (config.document_root == NULL) {
-		fprintf(stderr, "Failed to allocate memory for docuemnt_root\n");
-		free_config(&config);
-		return 1;
+		free(config.document_root);
+		config.document_root = strdup(absolute_doc_root);
+		if (config.document_root == NULL) {
+			fprintf(stderr, "Failed to allocate memory for docuemnt_root\n");
+			free_config(&config);
+			return 1;
+		}
 	}
 
-	if (logger_init(config.log_file) != 0) {
+	if (logger_init(config.log_file, upgrade_inherited_log_fd(), config.log_ring_size, config.log_block_when_full) != 0) {
 		fprintf(stderr, "Failed to initialize logger.\n");
 		free_config(&config);
 		return 1;
 	}
-	log_message(NULL, "Server starting...");
-	int listen_fd = init_server(&config);
-	if (listen_fd < 0) {
-		log_message(NULL, "FATAL: Server initialization failed.");
+	if (precompress_only) {
+		int result = precompress_tree(config.document_root);
 		logger_close();
 		free_config(&config);
-		return 1;
+		return result == 0 ? 0 : 1;
 	}
 
-	const char* drop_user = "www-data";
-	struct passwd* pw = getpwnam(drop_user);
-	if (pw == NULL) {
-		log_message(NULL, "FATAL: Could not find user '%s' to drop privileges.", drop_user);
-		close(listen_fd);
-		logger_close();
-		free_config(&config);
-		return 1;
+	log_message(NULL, "Server starting...");
+	if (config.access_log && access_log_init(config.access_log) != 0) {
+		log_message(NULL, "WARN: Not writing an access log.");
+	}
+	http_parser_init();
+	affinity_init(&config);
+	// In reuseport mode every worker gets its own listening socket. They are all
+	// bound here, before privileges are dropped, so low ports keep working. After
+	// an upgrade the old server's sockets are taken over instead.
+	int num_worker_listeners = config.listen_mode == LISTEN_REUSEPORT ? config.num_workers : 1;
+	int* inherited;
+	int num_inherited = upgrade_inherited_listeners(&inherited);
+	// A server with more reuseport sockets hands over all of them. Closing one
+	// would reset the connections queued on it, so the main thread accepts on
+	// the ones no worker takes for as long as this server runs.
+	int listen_fds[num_inherited > num_worker_listeners ? num_inherited : num_worker_listeners];
+	int num_listeners = 0;
+	for (int i = 0; i < num_worker_listeners || i < num_inherited; i++) {
+		int fd = -1;
+		if (i < num_inherited) {
+			fd = server_adopt_listener(inherited[i], &config);
+		}
+		if (fd < 0 && i < num_worker_listeners) {
+			fd = init_server(&config);
+			if (fd < 0) {
+				log_message(NULL, "FATAL: Server initialization failed.");
+				close_listeners(listen_fds, num_listeners);
+				logger_close();
+				free_config(&config);
+				return 1;
+			}
+		}
+		if (fd >= 0) listen_fds[num_listeners++] = fd;
+	}
+	if (config.listen_mode == LISTEN_REUSEPORT) {
+		int socket_cpus[num_worker_listeners];
+		for (int i = 0; i < num_worker_listeners; i++) {
+			socket_cpus[i] = affinity_worker_cpu(i);
+			if (config.steer_incoming_cpu && socket_cpus[i] >= 0) {
+				server_set_incoming_cpu(listen_fds[i], socket_cpus[i]);
+			}
+		}
+		if (config.reuseport_cbpf) {
+			server_attach_cpu_steering(listen_fds[0], num_worker_listeners, affinity_enabled() ? socket_cpus : NULL);
+		}
 	}
 
-	if (setgid(pw->pw_gid) != 0) {
-		log_message(NULL, "FATAL: setgid failed: %s", strerror(errno));
-		close(listen_fd);
+	if (config.document_pack) {
+		// Opened before privileges are dropped; a replacement must be readable by the server user.
+		if (routes_init_pack(config.document_pack, config.num_workers) != 0) {
+			log_message(NULL, "FATAL: Could not load the site pack %s", config.document_pack);
+			close_listeners(listen_fds, num_listeners);
+			logger_close();
+			free_config(&config);
+			return 1;
+		}
+		// The mapped pack already is a cache of the whole site.
+		config.cache_max_bytes = 0;
+		if (routes_watch() != 0) {
+			log_message(NULL, "WARN: Not watching the site pack; a new one needs a restart.");
+		}
+	} else {
+		// Sidecars are written while we still own document_root, and before the
+		// cache starts watching it.
+		if (config.precompress) {
+			precompress_tree(config.document_root);
+		}
+
+		if (routes_init(config.document_root, config.num_workers) != 0) {
+			log_message(NULL, "FATAL: Could not build the route table for %s", config.document_root);
+			close_listeners(listen_fds, num_listeners);
+			logger_close();
+			free_config(&config);
+			return 1;
+		}
+		// Cached responses can only be trusted while something invalidates them.
+		if (routes_watch() != 0) {
+			log_message(NULL, "WARN: Not watching document_root; changes need a restart and the response cache is off.");
+			config.cache_max_bytes = 0;
+		}
+	}
+
+	if (cache_init(&config) != 0) {
+		log_message(NULL, "WARN: Response cache unavailable, serving from disk only.");
+	}
+	// Certificates are read while we may still be root.
+	if (tls_init(&config) != 0) {
+		log_message(NULL, "FATAL: Could not set up TLS");
+		close_listeners(listen_fds, num_listeners);
 		logger_close();
 		free_config(&config);
 		return 1;
 	}
-	if (setuid(pw->pw_uid) != 0) {
-		log_message(NULL, "FATAL: setuid failed: %s", strerror(errno));
-		close(listen_fd);
+	if (tls_enabled() && config.io_backend == IO_BACKEND_URING) {
+		log_message(NULL, "WARN: TLS connections are served on the epoll backend; ignoring io_backend = io_uring.");
+		config.io_backend = IO_BACKEND_EPOLL;
+	}
+	if (metrics_init(config.num_workers) != 0) {
+		log_message(NULL, "WARN: Could not allocate per-worker metrics; the metrics endpoint will be empty.");
+	}
+	if (ratelimit_init(&config) != 0) {
+		log_message(NULL, "WARN: Could not allocate the per-address limit table; clients are not limited.");
+	}
+
+	if (drop_privileges() != 0) {
+		close_listeners(listen_fds, num_listeners);
 		logger_close();
 		free_config(&config);
 		return 1;
 	}
 
-	log_message(NULL, "Successfully dropped privileges to user '%s'.", drop_user);
-
 	pthread_t workers[config.num_workers];
-	int pipe_fds[config.num_workers][2];
+	spsc_queue_t* queues[config.num_workers];
 
-	log_message(NULL, "Creating %d worker threads...", config.num_workers);
 	for (int i = 0; i < config.num_workers; i++) {
-		if (pipe(pipe_fds[i]) == -1) {
-			log_message(NULL, "FATAL: Failed to create pipe for worker %d", i);
-
-			for (int j = 0; j < i; j++) {
-				close(pipe_fds[j][0]);
-				close(pipe_fds[j][1]);
-			}
+		queues[i] = spsc_queue_create(HANDOFF_QUEUE_SIZE, sizeof(accepted_conn_t));
+		if (!queues[i]) {
+			log_message(NULL, "FATAL: Failed to create handoff queue for worker %d", i);
 			return 1;
 		}
+	}
+	// Every worker's inbox exists before any worker can move a connection to it.
+	if (dispatch_init(config.num_workers, queues) != 0) {
+		log_message(NULL, "FATAL: Failed to allocate dispatch state");
+		return 1;
+	}
 
+	log_message(NULL, "Creating %d worker threads...", config.num_workers);
+	for (int i = 0; i < config.num_workers; i++) {
 		worker_init_t* init_data = malloc(sizeof(worker_init_t));
 		if (!init_data) {
 			log_message(NULL, "FATAL: Failed to malloc for worker_init_t");
-			for (int j = 0; j < i; j++) {
-				close(pipe_fds[j][0]);
-				close(pipe_fds[j][1]);
-			}
 			return 1;
 		}
 		init_data->worker_id = i;
-		init_data->pipe_read_fd = pipe_fds[i][0];
+		init_data->queue = queues[i];
+		init_data->listen_fd = config.listen_mode == LISTEN_REUSEPORT ? listen_fds[i] : -1;
 		init_data->config = &config;
 
-		if (pthread_create(&workers[i], NULL, worker_thread_main, init_data) != 0) {
+		// Pinned from the start, so the worker's stack and allocations land on its node.
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		affinity_set_thread_attr(&attr, i);
+		int created = pthread_create(&workers[i], &attr, worker_thread_main, init_data);
+		pthread_attr_destroy(&attr);
+		if (created != 0) {
 			log_message(NULL, "FATAL: Failed to create worker thread %d", i);
 			free(init_data);
 			// need cleanup logic
 			return 1;
 		}
 	}
+	// Only now, so unpinned workers did not inherit the acceptor's CPU.
+	if (config.listen_mode == LISTEN_ACCEPTOR) {
+		affinity_pin_acceptor(&config);
+	}
+
+	// Tell an upgrading parent that this server is taking over.
+	upgrade_notify_ready();
 
-	log_message(NULL, "Main thread is now running as an Acceptor.");
 	if (!is_daemon_mode) {
 		printf("Server is running. Press Ctrl+C to exit.\n");
 	}
-	struct sockaddr_storage client_addr;
-	socklen_t addr_len = sizeof(client_addr);
-
-	int epoll_fd = epoll_create1(0);
-	struct epoll_event event, events[1];
-
-	event.events = EPOLLIN;
-	event.data.fd = listen_fd;
-	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
-
-	int next_worker = 0;
-	while(running) {
-		int n_events = epoll_wait(epoll_fd, events, 1, 1000);
-		if (n_events < 0) {
-			if (errno == EINTR) continue;
-			break;
-		}
-
-		if (n_events > 0) {
-			int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &addr_len);
-			if (client_fd < 0) {
-				if (errno == EINTR && !running) break;
-				if (errno == EINTR) continue;
-				log_message(NULL, "ERROR: accept() failed in main loop: %s", strerror(errno));
-				continue;
-			}
-
-			connection_t* conn = malloc(sizeof(connection_t));
-			if (!conn) {
-				log_message(NULL, "ERROR: malloc for connection_t failed");
-				close(client_fd);
-				continue;
-			}
-			conn->fd = client_fd;
-			conn->timer_node = NULL;
-
-			if (client_addr.ss_family == AF_INET) {
-				inet_ntop(AF_INET, &(((struct sockaddr_in*)&client_addr)->sin_addr), conn->client_ip, INET_ADDRSTRLEN);
-			} else {
-				inet_ntop(AF_INET6, &(((struct sockaddr_in6*)&client_addr)->sin6_addr), conn->client_ip, INET_ADDRSTRLEN);
-			}
 
-			int pipe_write_fd = pipe_fds[next_worker][1];
-			if (write(pipe_write_fd, &conn, sizeof(connection_t*)) < 0) {
-				log_message(conn->client_ip, "ERROR: Failed to dispatch fd %d to worker %d", client_fd, next_worker);
-				free(conn);
-				close(client_fd);
-			} else {
-				log_message(conn->client_ip, "Main: Dispatched fd %d to worker %d", client_fd, next_worker);
+	// In reuseport mode the acceptor only takes sockets left over from an upgrade.
+	int first_accepted = config.listen_mode == LISTEN_REUSEPORT ? num_worker_listeners : 0;
+	if (config.listen_mode == LISTEN_ACCEPTOR) {
+		log_message(NULL, "Main thread is now running as an Acceptor.");
+	} else if (num_listeners > first_accepted) {
+		log_message(NULL, "Workers accept on their own SO_REUSEPORT sockets; main thread accepts on the %d the old server had beyond those.",
+				num_listeners - first_accepted);
+	} else {
+		log_message(NULL, "Workers accept on their own SO_REUSEPORT sockets; main thread is idle.");
+	}
+	while (1) {
+		if (num_listeners > first_accepted) {
+			run_acceptor(listen_fds + first_accepted, num_listeners - first_accepted, queues, &config);
+		} else {
+			while (running) {
+				sleep(1);
 			}
+		}
+		if (!upgrade_requested || shutdown_signal) break;
 
-			next_worker = (next_worker + 1) % config.num_workers;
+		// The listening sockets stay open while the new binary starts, so
+		// connections arriving meanwhile wait in the backlog for whichever
+		// server accepts next.
+		upgrade_requested = 0;
+		log_message(NULL, "SIGUSR2 received, upgrading binary...");
+		if (upgrade_spawn(argv, listen_fds, num_listeners, logger_fd()) == 0) {
+			graceful = 1;
+			break;
 		}
+		running = 1;
 	}
-	if (!is_daemon_mode) {
+
+	if (!is_daemon_mode && shutdown_signal) {
 		printf("\nCtrl+C triggered. Terminating server...\n");
 	}
+	if (shutdown_signal) {
+		log_message(NULL, "Signal %d received, initiating shutdown...", (int)shutdown_signal);
+	}
 	log_message(NULL, "Server shutting down...");
 
+	// Closing a handoff queue is what stops a worker; it then drains for up to
+	// drain_timeout, or closes everything at once on a hard stop.
+	worker_set_drain_timeout(graceful ? config.drain_timeout : 0);
+	if (graceful) {
+		log_message(NULL, "Draining open connections for up to %d seconds...", config.drain_timeout);
+	}
 	for (int i = 0; i < config.num_workers; i++) {
-		close(pipe_fds[i][1]);
+		spsc_queue_close(queues[i]);
 	}
 
 	for (int i = 0; i < config.num_workers; i++) {
 		pthread_join(workers[i], NULL);
 		log_message(NULL, "Worker thread %d joined.", i);
 	}
+	// Only once every worker is gone: a draining worker may still wake another
+	// through its queue until that one closes its inbox.
+	dispatch_destroy();
+	for (int i = 0; i < config.num_workers; i++) {
+		spsc_queue_destroy(queues[i]);
+	}
 
-	close(listen_fd);
+	close_listeners(listen_fds, num_listeners);
+	routes_destroy();
+	cache_destroy();
+	tls_destroy();
+	metrics_destroy();
+	ratelimit_destroy();
+	affinity_destroy();
 	free_config(&config);
 	log_message(NULL, "Server shutdown complete.");
 	logger_close();
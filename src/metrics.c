@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "logger.h"
+#include "ratelimit.h"
+
+// Latency is kept in microseconds, in HDR-style log-linear buckets: exact below
+// LATENCY_EXACT, then LATENCY_SUB buckets per power of two, so every bucket is
+// within 25% of its value, up to about 35 minutes.
+#define LATENCY_SUB_BITS 2
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_EXACT (2 * LATENCY_SUB)
+#define LATENCY_MAX_EXP 31
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+
+#define METRICS_POOLS 5
+
+static const int tracked_status[] = { 200, 206, 304, 400, 403, 404, 405, 413, 414, 416, 429, 431, 500 };
+#define NUM_STATUS (sizeof(tracked_status) / sizeof(tracked_status[0]))
+
+// One worker's block. Only its owner writes it; the aligned first member keeps
+// the blocks of different workers off each other's cache lines.
+typedef struct {
+	_Alignas(64) atomic_ulong accepted;
+	atomic_ulong closed;
+	atomic_ulong timed_out;
+	atomic_ulong migrated;
+	atomic_ulong parse_errors;
+	atomic_ulong tls_handshakes;
+	atomic_ulong tls_resumed;
+	atomic_ulong tls_kernel;
+	atomic_ulong tls_failed;
+	atomic_ulong h2_connections;
+	atomic_ulong h2_streams;
+	atomic_ulong bytes_sent;
+	atomic_ulong latency_sum_us;
+	atomic_ulong status[NUM_STATUS + 1]; // the last one counts everything else
+	atomic_ulong latency[LATENCY_BUCKETS];
+	atomic_int num_pools;
+	const char* pool_name[METRICS_POOLS];
+	atomic_ulong pool_in_use[METRICS_POOLS];
+	atomic_ulong pool_capacity[METRICS_POOLS];
+} worker_metrics_t;
+
+static worker_metrics_t* blocks = NULL;
+static int num_blocks = 0;
+
+static __thread worker_metrics_t* local = NULL;
+
+// Single writer, so a plain load and store is enough; the atomics only keep
+// the readers' loads from tearing.
+static inline void bump(atomic_ulong* counter, unsigned long n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned long read_counter(atomic_ulong* counter) {
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+int metrics_init(int num_workers) {
+	blocks = aligned_alloc(64, num_workers * sizeof(worker_metrics_t));
+	if (!blocks) return -1;
+	memset(blocks, 0, num_workers * sizeof(worker_metrics_t));
+	num_blocks = num_workers;
+	return 0;
+}
+
+void metrics_destroy(void) {
+	free(blocks);
+	blocks = NULL;
+	num_blocks = 0;
+}
+
+void metrics_attach(int worker) {
+	if (blocks && worker >= 0 && worker < num_blocks) {
+		local = &blocks[worker];
+	}
+}
+
+void metrics_connection_opened(void) {
+	if (local) bump(&local->accepted, 1);
+}
+
+void metrics_connection_closed(void) {
+	if (local) bump(&local->closed, 1);
+}
+
+void metrics_connection_timed_out(void) {
+	if (local) bump(&local->timed_out, 1);
+}
+
+void metrics_connection_migrated(void) {
+	if (local) bump(&local->migrated, 1);
+}
+
+void metrics_parse_error(void) {
+	if (local) bump(&local->parse_errors, 1);
+}
+
+void metrics_tls_handshake(int resumed, int kernel_send) {
+	if (!local) return;
+	bump(&local->tls_handshakes, 1);
+	if (resumed) bump(&local->tls_resumed, 1);
+	if (kernel_send) bump(&local->tls_kernel, 1);
+}
+
+void metrics_tls_failed(void) {
+	if (local) bump(&local->tls_failed, 1);
+}
+
+void metrics_http2_connection(void) {
+	if (local) bump(&local->h2_connections, 1);
+}
+
+void metrics_http2_stream(void) {
+	if (local) bump(&local->h2_streams, 1);
+}
+
+void metrics_bytes_sent(size_t bytes) {
+	if (local) bump(&local->bytes_sent, bytes);
+}
+
+static int latency_bucket(uint64_t us) {
+	if (us < LATENCY_EXACT) return (int)us;
+	int exp = 63 - __builtin_clzll(us);
+	if (exp > LATENCY_MAX_EXP) return LATENCY_BUCKETS - 1;
+	int sub = (us >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1);
+	return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB + sub;
+}
+
+// Exclusive upper bound of a bucket, in microseconds.
+static uint64_t latency_bucket_limit(int bucket) {
+	if (bucket < LATENCY_EXACT) return bucket + 1;
+	int exp = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+	int sub = bucket % LATENCY_SUB;
+	return (uint64_t)(LATENCY_SUB + sub + 1) << (exp - LATENCY_SUB_BITS);
+}
+
+void metrics_request_done(int status, uint64_t start_ns) {
+	if (!local) return;
+
+	size_t slot = 0;
+	while (slot < NUM_STATUS && tracked_status[slot] != status) slot++;
+	bump(&local->status[slot], 1);
+
+	if (start_ns == 0) return;
+	uint64_t us = (metrics_now_ns() - start_ns) / 1000;
+	bump(&local->latency[latency_bucket(us)], 1);
+	bump(&local->latency_sum_us, us);
+}
+
+void metrics_publish_pools(pool_t* const* pools, int count) {
+	if (!local) return;
+	if (count > METRICS_POOLS) count = METRICS_POOLS;
+	for (int i = 0; i < count; i++) {
+		atomic_store_explicit(&local->pool_in_use[i], pools[i]->in_use, memory_order_relaxed);
+		atomic_store_explicit(&local->pool_capacity[i], pools[i]->capacity, memory_order_relaxed);
+	}
+	// The names are written once, before the release that lets readers see them.
+	if (atomic_load_explicit(&local->num_pools, memory_order_relaxed) == 0) {
+		for (int i = 0; i < count; i++) {
+			local->pool_name[i] = pools[i]->name;
+		}
+		atomic_store_explicit(&local->num_pools, count, memory_order_release);
+	}
+}
+
+typedef struct {
+	char* buf;
+	size_t len;
+	size_t cap;
+	int failed;
+} text_t;
+
+static void appendf(text_t* text, const char* format, ...) {
+	if (text->failed) return;
+	while (1) {
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(text->buf + text->len, text->cap - text->len, format, args);
+		va_end(args);
+		if (n < 0) {
+			text->failed = 1;
+			return;
+		}
+		if ((size_t)n < text->cap - text->len) {
+			text->len += n;
+			return;
+		}
+		size_t cap = text->cap * 2 + n;
+		char* buf = realloc(text->buf, cap);
+		if (!buf) {
+			text->failed = 1;
+			return;
+		}
+		text->buf = buf;
+		text->cap = cap;
+	}
+}
+
+static void describe(text_t* text, const char* name, const char* type, const char* help) {
+	appendf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One line per worker for a counter kept in every block.
+static void per_worker(text_t* text, const char* name, size_t offset) {
+	for (int i = 0; i < num_blocks; i++) {
+		atomic_ulong* counter = (atomic_ulong*)((char*)&blocks[i] + offset);
+		appendf(text, "%s{worker=\"%d\"} %lu\n", name, i, read_counter(counter));
+	}
+}
+
+int metrics_render(char** out, size_t* out_len) {
+	text_t text = { .buf = malloc(8192), .len = 0, .cap = 8192, .failed = 0 };
+	if (!text.buf) return -1;
+
+	describe(&text, "garage_connections_accepted_total", "counter", "Connections handed to a worker, including ones moved from another worker.");
+	per_worker(&text, "garage_connections_accepted_total", offsetof(worker_metrics_t, accepted));
+
+	describe(&text, "garage_connections_active", "gauge", "Connections a worker currently holds open.");
+	for (int i = 0; i < num_blocks; i++) {
+		// closed is read first, so a racing close can only make this high, never wrap.
+		unsigned long closed = read_counter(&blocks[i].closed);
+		appendf(&text, "garage_connections_active{worker=\"%d\"} %lu\n", i, read_counter(&blocks[i].accepted) - closed);
+	}
+
+	describe(&text, "garage_connections_timed_out_total", "counter", "Connections closed by a header, keep-alive or write timeout.");
+	per_worker(&text, "garage_connections_timed_out_total", offsetof(worker_metrics_t, timed_out));
+
+	describe(&text, "garage_connections_migrated_total", "counter", "Idle keep-alive connections a worker handed to a less loaded one.");
+	per_worker(&text, "garage_connections_migrated_total", offsetof(worker_metrics_t, migrated));
+
+	describe(&text, "garage_parse_errors_total", "counter", "Requests rejected before they could be parsed.");
+	per_worker(&text, "garage_parse_errors_total", offsetof(worker_metrics_t, parse_errors));
+
+	describe(&text, "garage_tls_handshakes_total", "counter", "TLS handshakes completed.");
+	per_worker(&text, "garage_tls_handshakes_total", offsetof(worker_metrics_t, tls_handshakes));
+
+	describe(&text, "garage_tls_resumed_total", "counter", "TLS handshakes that resumed an earlier session.");
+	per_worker(&text, "garage_tls_resumed_total", offsetof(worker_metrics_t, tls_resumed));
+
+	describe(&text, "garage_tls_kernel_send_total", "counter", "TLS connections whose sends the kernel encrypts (kTLS).");
+	per_worker(&text, "garage_tls_kernel_send_total", offsetof(worker_metrics_t, tls_kernel));
+
+	describe(&text, "garage_tls_handshake_failures_total", "counter", "TLS handshakes that failed.");
+	per_worker(&text, "garage_tls_handshake_failures_total", offsetof(worker_metrics_t, tls_failed));
+
+	describe(&text, "garage_http2_connections_total", "counter", "Connections that switched to HTTP/2.");
+	per_worker(&text, "garage_http2_connections_total", offsetof(worker_metrics_t, h2_connections));
+
+	describe(&text, "garage_http2_streams_total", "counter", "HTTP/2 request streams answered.");
+	per_worker(&text, "garage_http2_streams_total", offsetof(worker_metrics_t, h2_streams));
+
+	describe(&text, "garage_ratelimit_refused_connections_total", "counter", "Connections closed at accept for holding the per-address limit.");
+	appendf(&text, "garage_ratelimit_refused_connections_total %lu\n", ratelimit_refused_connections());
+
+	describe(&text, "garage_response_bytes_total", "counter", "Bytes written to clients.");
+	per_worker(&text, "garage_response_bytes_total", offsetof(worker_metrics_t, bytes_sent));
+
+	describe(&text, "garage_requests_total", "counter", "Responses completely written, by status code.");
+	for (size_t slot = 0; slot <= NUM_STATUS; slot++) {
+		unsigned long total = 0;
+		for (int i = 0; i < num_blocks; i++) total += read_counter(&blocks[i].status[slot]);
+		if (slot < NUM_STATUS) {
+			appendf(&text, "garage_requests_total{code=\"%d\"} %lu\n", tracked_status[slot], total);
+		} else {
+			appendf(&text, "garage_requests_total{code=\"other\"} %lu\n", total);
+		}
+	}
+
+	describe(&text, "garage_request_duration_seconds", "histogram", "From the first byte of a request read to the last byte of its response written.");
+	unsigned long cumulative = 0;
+	for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		for (int i = 0; i < num_blocks; i++) cumulative += read_counter(&blocks[i].latency[bucket]);
+		if (bucket == LATENCY_BUCKETS - 1) break;
+		appendf(&text, "garage_request_duration_seconds_bucket{le=\"%g\"} %lu\n",
+				latency_bucket_limit(bucket) / 1e6, cumulative);
+	}
+	unsigned long sum_us = 0;
+	for (int i = 0; i < num_blocks; i++) sum_us += read_counter(&blocks[i].latency_sum_us);
+	appendf(&text, "garage_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n", cumulative);
+	appendf(&text, "garage_request_duration_seconds_sum %.6f\n", sum_us / 1e6);
+	appendf(&text, "garage_request_duration_seconds_count %lu\n", cumulative);
+
+	describe(&text, "garage_pool_objects_in_use", "gauge", "Objects handed out by a worker's pool.");
+	for (int i = 0; i < num_blocks; i++) {
+		int count = atomic_load_explicit(&blocks[i].num_pools, memory_order_acquire);
+		for (int p = 0; p < count; p++) {
+			appendf(&text, "garage_pool_objects_in_use{worker=\"%d\",pool=\"%s\"} %lu\n",
+					i, blocks[i].pool_name[p], read_counter(&blocks[i].pool_in_use[p]));
+		}
+	}
+	describe(&text, "garage_pool_objects_capacity", "gauge", "Objects a worker's pool has slabs for.");
+	for (int i = 0; i < num_blocks; i++) {
+		int count = atomic_load_explicit(&blocks[i].num_pools, memory_order_acquire);
+		for (int p = 0; p < count; p++) {
+			appendf(&text, "garage_pool_objects_capacity{worker=\"%d\",pool=\"%s\"} %lu\n",
+					i, blocks[i].pool_name[p], read_counter(&blocks[i].pool_capacity[p]));
+		}
+	}
+
+	describe(&text, "garage_log_dropped_lines_total", "counter", "Log lines dropped because a ring was full.");
+	appendf(&text, "garage_log_dropped_lines_total %lu\n", logger_dropped_lines());
+
+	describe(&text, "garage_access_log_dropped_records_total", "counter", "Access log records dropped because a ring was full.");
+	appendf(&text, "garage_access_log_dropped_records_total %lu\n", logger_dropped_records());
+
+	if (text.failed) {
+		free(text.buf);
+		log_message(NULL, "ERROR: Out of memory rendering metrics");
+		return -1;
+	}
+	*out = text.buf;
+	*out_len = text.len;
+	return 0;
+}
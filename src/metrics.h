@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pool.h"
+
+/*
+ * Per-worker counters and a request latency histogram. A worker only ever
+ * writes its own block, which starts on its own cache line, so recording is a
+ * relaxed load and store with no locked instruction and no shared line. The
+ * metrics URI sums every block when it is asked for.
+ *
+ * The recording calls act on the calling thread's block and do nothing on a
+ * thread that never called metrics_attach().
+ */
+int metrics_init(int num_workers);
+void metrics_destroy(void);
+void metrics_attach(int worker);
+
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_connection_timed_out(void);
+// Counted by the worker that gave the connection up.
+void metrics_connection_migrated(void);
+void metrics_parse_error(void);
+void metrics_tls_handshake(int resumed, int kernel_send);
+void metrics_tls_failed(void);
+// A connection that switched to HTTP/2, and each request stream opened on one.
+void metrics_http2_connection(void);
+void metrics_http2_stream(void);
+void metrics_bytes_sent(size_t bytes);
+// start_ns is when the request's first byte was read, from metrics_now_ns().
+void metrics_request_done(int status, uint64_t start_ns);
+void metrics_publish_pools(pool_t* const* pools, int count);
+
+// Prometheus text exposition of every worker's counters, in a malloc'd buffer.
+int metrics_render(char** out, size_t* out_len);
+
+static inline uint64_t metrics_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,39 @@
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+
+static const mime_type_t mime_types[] = {
+	{ "html", "text/html", 1 },
+	{ "htm", "text/html", 1 },
+	{ "css", "text/css", 1 },
+	{ "js", "application/javascript", 1 },
+	{ "mjs", "application/javascript", 1 },
+	{ "json", "application/json", 1 },
+	{ "xml", "application/xml", 1 },
+	{ "txt", "text/plain", 1 },
+	{ "svg", "image/svg+xml", 1 },
+	{ "ico", "image/x-icon", 1 },
+	{ "png", "image/png", 0 },
+	{ "jpg", "image/jpeg", 0 },
+	{ "jpeg", "image/jpeg", 0 },
+	{ "gif", "image/gif", 0 },
+	{ "webp", "image/webp", 0 },
+	{ "woff2", "font/woff2", 0 },
+};
+
+static const mime_type_t default_type = { "", "application/octet-stream", 0 };
+
+// Match on the final extension only, so "app.css.map" is not served as CSS.
+const mime_type_t* mime_lookup(const char* path) {
+	const char* slash = strrchr(path, '/');
+	const char* dot = strrchr(slash ? slash : path, '.');
+	if (!dot) return &default_type;
+
+	for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+		if (strcasecmp(dot + 1, mime_types[i].extension) == 0) {
+			return &mime_types[i];
+		}
+	}
+	return &default_type;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+typedef struct {
+	const char* extension;
+	const char* type;
+	int compressible;
+} mime_type_t;
+
+const mime_type_t* mime_lookup(const char* path);
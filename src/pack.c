@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+#include "logger.h"
+
+static int range_ok(uint64_t offset, uint64_t len, uint64_t limit) {
+	return offset <= limit && len <= limit - offset;
+}
+
+// Everything a lookup or a response will follow is checked once here, so a
+// truncated or foreign file is refused at load rather than faulting later.
+static const char* check_pack(const pack_t* pack) {
+	const pack_header_t* header = pack->header;
+	if (pack->size < sizeof(pack_header_t) || memcmp(header->magic, PACK_MAGIC, 8) != 0) return "not a site pack";
+	if (header->byte_order != PACK_BYTE_ORDER) return "built on a machine of the other byte order";
+	if (header->version != PACK_VERSION) return "unsupported version";
+	if (header->file_size != pack->size) return "truncated";
+
+	uint32_t num_slots = header->num_slots;
+	if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0 || header->num_routes >= num_slots) return "bad index size";
+	if (!range_ok(header->routes_offset, (uint64_t)header->num_routes * sizeof(pack_route_t), pack->size) ||
+			!range_ok(header->slots_offset, (uint64_t)num_slots * sizeof(uint32_t), pack->size) ||
+			!range_ok(header->strings_offset, header->strings_size, pack->size) ||
+			header->routes_offset % _Alignof(pack_route_t) != 0 || header->slots_offset % sizeof(uint32_t) != 0) {
+		return "index out of bounds";
+	}
+	uint64_t strings_size = header->strings_size;
+	if (strings_size == 0 || pack->strings[strings_size - 1] != '\0') return "unterminated strings";
+
+	// A lookup stops at the first empty slot, so there has to be one.
+	uint32_t empty = 0;
+	for (uint32_t i = 0; i < num_slots; i++) {
+		if (pack->slots[i] > header->num_routes) return "bad slot";
+		if (pack->slots[i] == 0) empty++;
+	}
+	if (empty == 0) return "bad index size";
+	for (uint32_t i = 0; i < header->num_routes; i++) {
+		const pack_route_t* route = &pack->routes[i];
+		if (route->uri >= strings_size) return "bad route";
+		for (int v = 0; v < PACK_VARIANTS; v++) {
+			const pack_variant_t* variant = &route->variants[v];
+			if (!range_ok(variant->body_offset, variant->body_len, pack->size) ||
+					!range_ok(variant->header, variant->header_len, strings_size) ||
+					!range_ok(variant->not_modified, variant->not_modified_len, strings_size) ||
+					variant->etag >= strings_size) {
+				return "bad route";
+			}
+		}
+	}
+	return NULL;
+}
+
+pack_t* pack_open(const char* path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_message(NULL, "ERROR: Cannot open site pack %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(pack_header_t)) {
+		log_message(NULL, "ERROR: Site pack %s is not a pack file", path);
+		close(fd);
+		return NULL;
+	}
+
+	void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		log_message(NULL, "ERROR: Cannot map site pack %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	pack_t* pack = malloc(sizeof(pack_t));
+	if (!pack) {
+		munmap(base, st.st_size);
+		close(fd);
+		return NULL;
+	}
+	atomic_init(&pack->refs, 1);
+	pack->fd = fd;
+	pack->base = base;
+	pack->size = st.st_size;
+	pack->header = base;
+	pack->routes = (const pack_route_t*)(pack->base + pack->header->routes_offset);
+	pack->slots = (const uint32_t*)(pack->base + pack->header->slots_offset);
+	pack->strings = pack->base + pack->header->strings_offset;
+
+	const char* problem = check_pack(pack);
+	if (problem) {
+		log_message(NULL, "ERROR: Site pack %s: %s", path, problem);
+		pack_release(pack);
+		return NULL;
+	}
+	// Start reading it in now rather than on the first requests.
+	madvise(base, st.st_size, MADV_WILLNEED);
+	return pack;
+}
+
+pack_t* pack_acquire(pack_t* pack) {
+	atomic_fetch_add_explicit(&pack->refs, 1, memory_order_relaxed);
+	return pack;
+}
+
+void pack_release(pack_t* pack) {
+	if (!pack || atomic_fetch_sub_explicit(&pack->refs, 1, memory_order_acq_rel) != 1) return;
+	munmap((void*)pack->base, pack->size);
+	close(pack->fd);
+	free(pack);
+}
+
+const pack_route_t* pack_lookup(const pack_t* pack, const char* uri) {
+	uint32_t mask = pack->header->num_slots - 1;
+	for (uint32_t slot = pack_hash(uri) & mask; pack->slots[slot]; slot = (slot + 1) & mask) {
+		const pack_route_t* route = &pack->routes[pack->slots[slot] - 1];
+		if (strcmp(pack_string(pack, route->uri), uri) == 0) return route;
+	}
+	return NULL;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * A site pack: everything document_root would serve, in one file built
+ * offline by tools/sitepack and mapped read-only by the server.
+ *
+ *   offset 0                 pack_header_t, padded to PACK_ALIGN
+ *   PACK_ALIGN ...           bodies, each starting on a PACK_ALIGN boundary
+ *   routes_offset            pack_route_t[num_routes]
+ *   slots_offset             uint32_t[num_slots]: route index + 1, 0 = empty
+ *   strings_offset           NUL-terminated URIs, headers and ETags
+ *
+ * The slots are open addressing on pack_hash(uri), at most half full. Every
+ * route carries its ready-made 200 and 304 headers per coding, so serving one
+ * is a lookup plus a sendfile() from the pack's descriptor. Numbers are in the
+ * byte order of the machine that built the pack; byte_order tells.
+ */
+
+#define PACK_MAGIC "GRGPACK1"
+#define PACK_VERSION 1
+#define PACK_BYTE_ORDER 0x01020304u
+#define PACK_ALIGN 4096
+
+// Index into pack_route_t.variants.
+enum {
+	PACK_IDENTITY,
+	PACK_BR,
+	PACK_GZIP,
+	PACK_VARIANTS
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t num_routes;
+	uint32_t num_slots;
+	uint64_t routes_offset;
+	uint64_t slots_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t file_size;
+} pack_header_t;
+
+// String fields are offsets into the strings area.
+typedef struct {
+	uint64_t body_offset; // from the start of the pack
+	uint64_t body_len;
+	uint32_t header;
+	uint32_t header_len;
+	uint32_t not_modified;
+	uint32_t not_modified_len;
+	uint32_t etag;
+	uint32_t reserved;
+} pack_variant_t;
+
+typedef struct {
+	uint32_t uri;
+	uint32_t encodings; // ENCODING_* variants present besides the identity one
+	int64_t last_modified;
+	pack_variant_t variants[PACK_VARIANTS];
+} pack_route_t;
+
+static inline uint64_t pack_hash(const char* uri) {
+	uint64_t hash = 14695981039346656037ull;
+	while (*uri) {
+		hash ^= (unsigned char)*uri++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+ * A mapped pack. Whoever queues a response pointing into it holds a
+ * reference; the mapping and descriptor go once the last one is dropped, so a
+ * pack replaced mid-transfer stays readable until its responses are done.
+ */
+typedef struct pack_s {
+	atomic_long refs;
+	int fd;
+	const char* base;
+	size_t size;
+	const pack_header_t* header;
+	const pack_route_t* routes;
+	const uint32_t* slots;
+	const char* strings;
+} pack_t;
+
+// Opens and checks a pack, with one reference held by the caller.
+pack_t* pack_open(const char* path);
+pack_t* pack_acquire(pack_t* pack);
+void pack_release(pack_t* pack);
+
+const pack_route_t* pack_lookup(const pack_t* pack, const char* uri);
+
+static inline const char* pack_string(const pack_t* pack, uint32_t offset) {
+	return pack->strings + offset;
+}
@@ -0,0 +1,229 @@
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARSER_HAVE_X86 1
+#endif
+
+#include "parser.h"
+
+/*
+ * Scanning primitive: return the first byte in [p, end) that is a control
+ * character (< 0x20 except HTAB, or DEL), or end if there is none. A line ends
+ * at such a byte, and anything other than CRLF/LF there is a malformed request,
+ * so line splitting and byte validation happen in one pass.
+ */
+typedef const char* (*scan_fn)(const char* p, const char* end);
+
+static inline int is_ctl(unsigned char c) {
+	return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+static const char* scan_ctl_scalar(const char* p, const char* end) {
+	while (p < end && !is_ctl((unsigned char)*p)) {
+		p++;
+	}
+	return p;
+}
+
+#ifdef PARSER_HAVE_X86
+__attribute__((target("sse2")))
+static const char* scan_ctl_sse2(const char* p, const char* end) {
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i del = _mm_set1_epi8(0x7f);
+
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		// unsigned v < 0x20  <=>  max(v, 0x20) != v
+		__m128i not_lt = _mm_cmpeq_epi8(_mm_max_epu8(v, space), v);
+		__m128i is_tab = _mm_cmpeq_epi8(v, tab);
+		__m128i is_del = _mm_cmpeq_epi8(v, del);
+		unsigned int mask = ~_mm_movemask_epi8(_mm_or_si128(not_lt, is_tab)) & 0xffff;
+		mask |= _mm_movemask_epi8(is_del);
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return scan_ctl_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_ctl_avx2(const char* p, const char* end) {
+	const __m256i space = _mm256_set1_epi8(0x20);
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i not_lt = _mm256_cmpeq_epi8(_mm256_max_epu8(v, space), v);
+		__m256i is_tab = _mm256_cmpeq_epi8(v, tab);
+		__m256i is_del = _mm256_cmpeq_epi8(v, del);
+		unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(not_lt, is_tab));
+		mask |= (unsigned int)_mm256_movemask_epi8(is_del);
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+	return scan_ctl_sse2(p, end);
+}
+#endif
+
+static scan_fn scan_ctl = scan_ctl_scalar;
+
+void http_parser_init(void) {
+#ifdef PARSER_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_ctl = scan_ctl_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan_ctl = scan_ctl_sse2;
+	}
+#endif
+}
+
+void http_parser_reset(http_parser_t* parser) {
+	parser->in_headers = 0;
+	parser->line_start = 0;
+	parser->scan_pos = 0;
+	parser->num_headers = 0;
+	parser->head_len = 0;
+}
+
+static inline http_slice_t make_slice(const char* buf, const char* from, const char* to) {
+	http_slice_t slice = { (uint16_t)(from - buf), (uint16_t)(to - from) };
+	return slice;
+}
+
+static parse_result_t parse_request_line(http_parser_t* parser, char* buf, char* line, char* line_end) {
+	char* sp1 = memchr(line, ' ', line_end - line);
+	if (!sp1 || sp1 == line) return PARSE_BAD_REQUEST;
+	char* sp2 = memchr(sp1 + 1, ' ', line_end - sp1 - 1);
+	if (!sp2 || sp2 == sp1 + 1) return PARSE_BAD_REQUEST;
+	if (memchr(sp2 + 1, ' ', line_end - sp2 - 1)) return PARSE_BAD_REQUEST;
+
+	if (sp2 - sp1 - 1 > HTTP_MAX_URI_SIZE) return PARSE_URI_TOO_LONG;
+	if (line_end - sp2 - 1 != 8 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0) return PARSE_BAD_REQUEST;
+
+	parser->method = make_slice(buf, line, sp1);
+	parser->uri = make_slice(buf, sp1 + 1, sp2);
+	parser->version = make_slice(buf, sp2 + 1, line_end);
+	return PARSE_DONE;
+}
+
+static parse_result_t parse_header_line(http_parser_t* parser, char* buf, char* line, char* line_end) {
+	if (parser->num_headers == HTTP_MAX_HEADERS) return PARSE_HEADERS_TOO_LARGE;
+
+	char* colon = memchr(line, ':', line_end - line);
+	if (!colon || colon == line) return PARSE_BAD_REQUEST;
+	for (char* c = line; c < colon; c++) {
+		// No whitespace allowed in or around a field name (RFC 9112 5.1).
+		if (*c == ' ' || *c == '\t') return PARSE_BAD_REQUEST;
+	}
+
+	char* value = colon + 1;
+	while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+	char* value_end = line_end;
+	while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+	http_header_t* header = &parser->headers[parser->num_headers++];
+	header->name = make_slice(buf, line, colon);
+	header->value = make_slice(buf, value, value_end);
+	return PARSE_DONE;
+}
+
+// Views are NUL-terminated in place once the whole head is in, so callers can
+// also use them as C strings without copying.
+static void terminate_slices(http_parser_t* parser, char* buf) {
+	buf[parser->method.off + parser->method.len] = '\0';
+	buf[parser->uri.off + parser->uri.len] = '\0';
+	buf[parser->version.off + parser->version.len] = '\0';
+	for (int i = 0; i < parser->num_headers; i++) {
+		buf[parser->headers[i].name.off + parser->headers[i].name.len] = '\0';
+		buf[parser->headers[i].value.off + parser->headers[i].value.len] = '\0';
+	}
+}
+
+parse_result_t http_parser_execute(http_parser_t* parser, char* buf, size_t len) {
+	if (len > HTTP_MAX_HEAD_SIZE) {
+		len = HTTP_MAX_HEAD_SIZE;
+	}
+
+	while (1) {
+		char* line = buf + parser->line_start;
+		char* stop = (char*)scan_ctl(buf + parser->scan_pos, buf + len);
+
+		if (stop == buf + len) {
+			parser->scan_pos = len;
+			if (len == HTTP_MAX_HEAD_SIZE) {
+				return parser->in_headers ? PARSE_HEADERS_TOO_LARGE : PARSE_URI_TOO_LONG;
+			}
+			return PARSE_INCOMPLETE;
+		}
+
+		char* line_end = stop;
+		char* next;
+		if (*stop == '\n') {
+			next = stop + 1;
+		} else if (*stop == '\r') {
+			if (stop + 1 == buf + len) {
+				parser->scan_pos = stop - buf;
+				return PARSE_INCOMPLETE;
+			}
+			if (stop[1] != '\n') return PARSE_BAD_REQUEST;
+			next = stop + 2;
+		} else {
+			return PARSE_BAD_REQUEST;
+		}
+
+		parse_result_t result;
+		if (!parser->in_headers) {
+			if (line_end == line) {
+				// Tolerate empty lines before the request line (RFC 9112 2.2).
+				result = PARSE_DONE;
+			} else {
+				result = parse_request_line(parser, buf, line, line_end);
+				parser->in_headers = 1;
+			}
+		} else if (line_end == line) {
+			parser->head_len = next - buf;
+			terminate_slices(parser, buf);
+			return PARSE_DONE;
+		} else {
+			result = parse_header_line(parser, buf, line, line_end);
+		}
+		if (result != PARSE_DONE) return result;
+
+		parser->line_start = parser->scan_pos = next - buf;
+	}
+}
+
+const http_slice_t* http_find_header(const http_parser_t* parser, const char* buf, const char* name) {
+	size_t name_len = strlen(name);
+	for (int i = 0; i < parser->num_headers; i++) {
+		const http_header_t* header = &parser->headers[i];
+		if (header->name.len == name_len && strncasecmp(buf + header->name.off, name, name_len) == 0) {
+			return &header->value;
+		}
+	}
+	return NULL;
+}
+
+int http_slice_equals(const char* buf, http_slice_t slice, const char* str) {
+	return strlen(str) == slice.len && memcmp(buf + slice.off, str, slice.len) == 0;
+}
+
+int http_list_contains(const char* value, const char* token) {
+	size_t len = strlen(token);
+	while (*value) {
+		while (*value == ' ' || *value == '\t' || *value == ',') value++;
+		const char* end = value;
+		while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+		if ((size_t)(end - value) == len && strncasecmp(value, token, len) == 0) return 1;
+		value = end;
+	}
+	return 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_HEAD_SIZE 8192
+#define HTTP_MAX_URI_SIZE 2048
+
+// Offset/length view into the buffer the request was parsed from.
+typedef struct {
+	uint16_t off;
+	uint16_t len;
+} http_slice_t;
+
+typedef struct {
+	http_slice_t name;
+	http_slice_t value;
+} http_header_t;
+
+typedef enum {
+	PARSE_INCOMPLETE,
+	PARSE_DONE,
+	PARSE_BAD_REQUEST,
+	PARSE_URI_TOO_LONG,
+	PARSE_HEADERS_TOO_LARGE
+} parse_result_t;
+
+typedef struct {
+	// Resume state, so bytes already scanned are not looked at again.
+	int in_headers;
+	size_t line_start;
+	size_t scan_pos;
+
+	http_slice_t method;
+	http_slice_t uri;
+	http_slice_t version;
+	http_header_t headers[HTTP_MAX_HEADERS];
+	int num_headers;
+	size_t head_len;
+} http_parser_t;
+
+void http_parser_init(void);
+void http_parser_reset(http_parser_t* parser);
+parse_result_t http_parser_execute(http_parser_t* parser, char* buf, size_t len);
+
+const http_slice_t* http_find_header(const http_parser_t* parser, const char* buf, const char* name);
+int http_slice_equals(const char* buf, http_slice_t slice, const char* str);
+// Whether a comma-separated header value, such as Connection's, lists token.
+int http_list_contains(const char* value, const char* token);
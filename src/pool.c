@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN 64
+
+pool_t* pool_create(const char* name, size_t obj_size, size_t objs_per_slab) {
+	pool_t* pool = calloc(1, sizeof(pool_t));
+	if (!pool) return NULL;
+
+	pool->name = name;
+	pool->obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	pool->objs_per_slab = objs_per_slab;
+	return pool;
+}
+
+void pool_destroy(pool_t* pool) {
+	if (!pool) return;
+
+	pool_slab_t* slab = pool->slabs;
+	while (slab) {
+		pool_slab_t* next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	free(pool);
+}
+
+static int pool_grow(pool_t* pool) {
+	pool_slab_t* slab = aligned_alloc(POOL_ALIGN, POOL_ALIGN + pool->obj_size * pool->objs_per_slab);
+	if (!slab) return -1;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	char* objs = (char*)slab + POOL_ALIGN;
+	for (size_t i = 0; i < pool->objs_per_slab; i++) {
+		void* obj = objs + i * pool->obj_size;
+		*(void**)obj = pool->free_list;
+		pool->free_list = obj;
+	}
+	pool->capacity += pool->objs_per_slab;
+	return 0;
+}
+
+void* pool_alloc(pool_t* pool) {
+	if (!pool->free_list && pool_grow(pool) != 0) {
+		return NULL;
+	}
+
+	void* obj = pool->free_list;
+	pool->free_list = *(void**)obj;
+	pool->in_use++;
+	return obj;
+}
+
+void pool_free(pool_t* pool, void* obj) {
+	if (!obj) return;
+
+	*(void**)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->in_use--;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fixed-size object pool. Memory is carved from slabs that are never returned
+// to malloc, so once a worker has warmed up, allocation is a free-list pop.
+// Not thread-safe: each worker owns its pools.
+typedef struct pool_slab_s {
+	struct pool_slab_s* next;
+} pool_slab_t;
+
+typedef struct {
+	const char* name;
+	size_t obj_size;
+	size_t objs_per_slab;
+	void* free_list;
+	pool_slab_t* slabs;
+	size_t in_use;
+	size_t capacity;
+} pool_t;
+
+pool_t* pool_create(const char* name, size_t obj_size, size_t objs_per_slab);
+void pool_destroy(pool_t* pool);
+void* pool_alloc(pool_t* pool);
+void pool_free(pool_t* pool, void* obj);
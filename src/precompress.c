@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_PRECOMPRESS
+#include <zlib.h>
+#include <brotli/encode.h>
+#endif
+
+#include "precompress.h"
+#include "logger.h"
+#include "mime.h"
+
+#ifdef HAVE_PRECOMPRESS
+
+// Below this, the Content-Encoding header costs about as much as it saves.
+#define PRECOMPRESS_MIN_SIZE 256
+
+static int files_written;
+static int files_failed;
+
+static size_t compress_gzip(const char* in, size_t in_len, char* out, size_t out_cap) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// windowBits 15 + 16 selects the gzip wrapper rather than zlib.
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 0;
+	}
+	zs.next_in = (Bytef*)in;
+	zs.avail_in = in_len;
+	zs.next_out = (Bytef*)out;
+	zs.avail_out = out_cap;
+	int result = deflate(&zs, Z_FINISH);
+	size_t out_len = zs.total_out;
+	deflateEnd(&zs);
+	return result == Z_STREAM_END ? out_len : 0;
+}
+
+static size_t compress_brotli(const char* in, size_t in_len, char* out, size_t out_cap) {
+	size_t out_len = out_cap;
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+			in_len, (const uint8_t*)in, &out_len, (uint8_t*)out)) {
+		return 0;
+	}
+	return out_len;
+}
+
+static int write_sidecar(const char* path, const char* data, size_t len) {
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	size_t written = 0;
+	while (written < len) {
+		ssize_t n = write(fd, data + written, len - written);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			close(fd);
+			unlink(tmp_path);
+			return -1;
+		}
+		written += n;
+	}
+	close(fd);
+
+	// rename() so a concurrent reader never sees a half-written sidecar.
+	if (rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+static int is_sidecar_current(const char* path, const struct stat* source) {
+	struct stat st;
+	if (stat(path, &st) != 0) return 0;
+	return st.st_mtim.tv_sec > source->st_mtim.tv_sec ||
+		(st.st_mtim.tv_sec == source->st_mtim.tv_sec && st.st_mtim.tv_nsec >= source->st_mtim.tv_nsec);
+}
+
+static char* read_file(const char* path, size_t len) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	char* data = malloc(len);
+	size_t got = 0;
+	while (data && got < len) {
+		ssize_t n = pread(fd, data + got, len - got, got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			free(data);
+			data = NULL;
+			break;
+		}
+		got += n;
+	}
+	close(fd);
+	return data;
+}
+
+static void precompress_file(const char* path, const struct stat* sb) {
+	char br_path[PATH_MAX];
+	char gz_path[PATH_MAX];
+	snprintf(br_path, sizeof(br_path), "%s.br", path);
+	snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+
+	int need_br = !is_sidecar_current(br_path, sb);
+	int need_gz = !is_sidecar_current(gz_path, sb);
+	if (!need_br && !need_gz) return;
+
+	size_t len = sb->st_size;
+	char* data = read_file(path, len);
+	size_t out_cap = BrotliEncoderMaxCompressedSize(len);
+	if (out_cap < compressBound(len) + 32) out_cap = compressBound(len) + 32;
+	char* out = malloc(out_cap);
+	if (!data || !out) {
+		log_message(NULL, "WARN: Precompress: could not read %s", path);
+		files_failed++;
+		free(data);
+		free(out);
+		return;
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		const char* sidecar = pass == 0 ? br_path : gz_path;
+		if (!(pass == 0 ? need_br : need_gz)) continue;
+
+		size_t out_len = pass == 0 ? compress_brotli(data, len, out, out_cap) : compress_gzip(data, len, out, out_cap);
+		if (out_len == 0 || out_len >= len) {
+			// Not worth serving; make sure an outdated copy cannot be picked either.
+			unlink(sidecar);
+			continue;
+		}
+		if (write_sidecar(sidecar, out, out_len) != 0) {
+			log_message(NULL, "WARN: Precompress: could not write %s: %s", sidecar, strerror(errno));
+			files_failed++;
+			continue;
+		}
+		files_written++;
+	}
+
+	free(data);
+	free(out);
+}
+
+static int precompress_cb(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+	(void)ftwbuf;
+	if (typeflag != FTW_F || !S_ISREG(sb->st_mode) || sb->st_size < PRECOMPRESS_MIN_SIZE) {
+		return 0;
+	}
+	size_t len = strlen(fpath);
+	if (len > 3 && (strcmp(fpath + len - 3, ".br") == 0 || strcmp(fpath + len - 3, ".gz") == 0)) {
+		return 0;
+	}
+	if (mime_lookup(fpath)->compressible) {
+		precompress_file(fpath, sb);
+	}
+	return 0;
+}
+
+int precompress_tree(const char* root) {
+	files_written = 0;
+	files_failed = 0;
+	if (nftw(root, precompress_cb, 16, FTW_PHYS) != 0) {
+		log_message(NULL, "ERROR: Precompress: could not walk %s: %s", root, strerror(errno));
+		return -1;
+	}
+	log_message(NULL, "Precompress: wrote %d sidecars under %s (%d failures).", files_written, root, files_failed);
+	return files_failed ? -1 : 0;
+}
+
+#else
+
+int precompress_tree(const char* root) {
+	(void)root;
+	log_message(NULL, "WARN: Built without zlib/brotli (PRECOMPRESS=0); not generating sidecars.");
+	return -1;
+}
+
+#endif
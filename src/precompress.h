@@ -0,0 +1,4 @@
+#pragma once
+
+// Write missing or outdated .br/.gz sidecars for compressible files under root.
+int precompress_tree(const char* root);
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "queue.h"
+
+spsc_queue_t* spsc_queue_create(size_t capacity, size_t elem_size) {
+	size_t size = 1;
+	while (size < capacity) size <<= 1;
+
+	spsc_queue_t* q = aligned_alloc(CACHE_LINE_SIZE, sizeof(spsc_queue_t));
+	if (!q) return NULL;
+
+	q->slots = calloc(size, elem_size);
+	q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (!q->slots || q->event_fd == -1) {
+		free(q->slots);
+		if (q->event_fd != -1) close(q->event_fd);
+		free(q);
+		return NULL;
+	}
+
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->closed, false);
+	q->mask = size - 1;
+	q->elem_size = elem_size;
+	return q;
+}
+
+void spsc_queue_destroy(spsc_queue_t* q) {
+	if (!q) return;
+	close(q->event_fd);
+	free(q->slots);
+	free(q);
+}
+
+bool spsc_queue_push(spsc_queue_t* q, const void* item) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail - head > q->mask) {
+		return false;
+	}
+	memcpy(q->slots + (tail & q->mask) * q->elem_size, item, q->elem_size);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool spsc_queue_pop(spsc_queue_t* q, void* item) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	memcpy(item, q->slots + (head & q->mask) * q->elem_size, q->elem_size);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+void spsc_queue_notify(spsc_queue_t* q) {
+	uint64_t one = 1;
+	write(q->event_fd, &one, sizeof(one));
+}
+
+void spsc_queue_close(spsc_queue_t* q) {
+	atomic_store_explicit(&q->closed, true, memory_order_release);
+	spsc_queue_notify(q);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE_SIZE 64
+
+// Single-producer/single-consumer ring used to hand accepted connections from
+// the acceptor to one worker. Items are fixed-size records copied in and out,
+// so the producer never allocates on the consumer's behalf. The consumer
+// sleeps on event_fd; the producer signals it once per batch rather than once
+// per item.
+typedef struct {
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+	_Alignas(CACHE_LINE_SIZE) size_t mask;
+	size_t elem_size;
+	char* slots;
+	int event_fd;
+	atomic_bool closed;
+} spsc_queue_t;
+
+spsc_queue_t* spsc_queue_create(size_t capacity, size_t elem_size);
+void spsc_queue_destroy(spsc_queue_t* q);
+bool spsc_queue_push(spsc_queue_t* q, const void* item);
+bool spsc_queue_pop(spsc_queue_t* q, void* item);
+void spsc_queue_notify(spsc_queue_t* q);
+void spsc_queue_close(spsc_queue_t* q);
@@ -0,0 +1,119 @@
+#include <ctype.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <strings.h>
+
+#include "range.h"
+
+#define OFF_T_MAX ((off_t)(((unsigned long long)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+static const char* skip_space(const char* p) {
+	while (*p == ' ' || *p == '\t') p++;
+	return p;
+}
+
+// Reads a non-negative decimal; returns NULL on no digits or overflow.
+static const char* parse_offset(const char* p, off_t* out) {
+	if (!isdigit((unsigned char)*p)) return NULL;
+	off_t value = 0;
+	while (isdigit((unsigned char)*p)) {
+		int digit = *p - '0';
+		if (value > (OFF_T_MAX - digit) / 10) return NULL;
+		value = value * 10 + digit;
+		p++;
+	}
+	*out = value;
+	return p;
+}
+
+// Add range to the count already in ranges, folding it into every one it
+// overlaps or touches so no byte is sent twice. Parts stay in the order they
+// were first asked for (RFC 9110 14.2). Returns the new count, or -1 when a
+// range would be one too many.
+static int add_range(byte_range_t* ranges, int count, byte_range_t range) {
+	int into = -1;
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		byte_range_t other = ranges[i];
+		if (other.start <= range.end && range.start <= other.end) {
+			if (other.start < range.start) range.start = other.start;
+			if (other.end > range.end) range.end = other.end;
+			if (into < 0) into = kept++;
+			continue;
+		}
+		ranges[kept++] = other;
+	}
+	if (into >= 0) {
+		ranges[into] = range;
+		return kept;
+	}
+	if (kept == HTTP_MAX_RANGES) return -1;
+	ranges[kept++] = range;
+	return kept;
+}
+
+/*
+ * Parse a Range header value (RFC 9110 14.1.2) against a representation of
+ * size bytes. Returns the number of satisfiable ranges written to ranges,
+ * RANGE_UNSATISFIABLE if the header is valid but none can be served, or
+ * RANGE_IGNORE if the header is malformed or asks for too many ranges, in
+ * which case the full representation should be sent. Overlapping and adjacent
+ * ranges are coalesced, so no more than the representation is ever sent.
+ */
+int parse_ranges(const char* value, off_t size, byte_range_t* ranges) {
+	value = skip_space(value);
+	if (strncasecmp(value, "bytes", 5) != 0) return RANGE_IGNORE;
+	value = skip_space(value + 5);
+	if (*value != '=') return RANGE_IGNORE;
+	value++;
+
+	int count = 0;
+	int specs = 0;
+	while (1) {
+		value = skip_space(value);
+		if (*value == ',') {
+			value++;
+			continue;
+		}
+		if (*value == '\0') break;
+
+		off_t first, last;
+		byte_range_t range;
+		if (*value == '-') {
+			value = parse_offset(value + 1, &last);
+			if (!value) return RANGE_IGNORE;
+			// Suffix range: the final `last` bytes.
+			range.start = last < size ? size - last : 0;
+			range.end = last > 0 ? size : 0;
+		} else {
+			value = parse_offset(value, &first);
+			if (!value || *value != '-') return RANGE_IGNORE;
+			value++;
+			if (isdigit((unsigned char)*value)) {
+				value = parse_offset(value, &last);
+				if (!value || last < first) return RANGE_IGNORE;
+				range.end = last < size ? last + 1 : size;
+			} else {
+				range.end = size;
+			}
+			range.start = first;
+		}
+
+		value = skip_space(value);
+		if (*value != ',' && *value != '\0') return RANGE_IGNORE;
+		specs++;
+
+		if (range.start < range.end) {
+			count = add_range(ranges, count, range);
+			if (count < 0) return RANGE_IGNORE;
+		}
+	}
+
+	if (specs == 0) return RANGE_IGNORE;
+	return count > 0 ? count : RANGE_UNSATISFIABLE;
+}
+
+int format_content_range(char* out, size_t len, const byte_range_t* range, off_t size) {
+	if (!range) return snprintf(out, len, "bytes */%ld", (long)size);
+	return snprintf(out, len, "bytes %ld-%ld/%ld", (long)range->start, (long)range->end - 1, (long)size);
+}
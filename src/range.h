@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// More ranges than this in one request, once overlapping ones are merged, are
+// ignored and the whole file is sent.
+#define HTTP_MAX_RANGES 8
+
+// Half-open byte range [start, end) within a representation.
+typedef struct {
+	off_t start;
+	off_t end;
+} byte_range_t;
+
+#define RANGE_IGNORE 0
+#define RANGE_UNSATISFIABLE -1
+
+int parse_ranges(const char* value, off_t size, byte_range_t* ranges);
+
+// Room for the longest Content-Range value, "bytes a-b/size" in off_t digits.
+#define CONTENT_RANGE_SIZE 72
+
+// The Content-Range value for range of a representation of size bytes, or
+// for a 416 when range is NULL. Returns what snprintf() does.
+int format_content_range(char* out, size_t len, const byte_range_t* range, off_t size);
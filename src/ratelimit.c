@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+#include "metrics.h"
+#include "queue.h"
+
+// Entries per shard: three cache lines, scanned in full on every lookup.
+#define SHARD_WAYS 8
+// Claiming an entry only fails this often when others keep taking it first.
+#define CLAIM_ATTEMPTS 4
+
+/*
+ * connections is -1 while an entry changes hands, which keeps anyone from
+ * counting a connection against the old address in the meantime.
+ *
+ * Requests follow the token bucket as GCRA does: tat is when the bucket will
+ * be full again. A request is let through while that stays within burst
+ * intervals of now, and each one moves it an interval on. A tat in the past
+ * is a full bucket, whatever address it was left by.
+ */
+struct ratelimit_entry_s {
+	atomic_ullong key; // 0: never used
+	atomic_ullong tat; // CLOCK_MONOTONIC, ns
+	atomic_int connections;
+};
+
+static ratelimit_entry_t* table = NULL;
+static size_t shard_mask;
+static int max_connections;
+static uint64_t interval_ns;
+static uint64_t burst_ns;
+static atomic_ulong refused;
+
+int ratelimit_init(const server_config* config) {
+	max_connections = config->per_ip_max_connections;
+	interval_ns = config->per_ip_request_rate > 0 ? 1000000000ull / config->per_ip_request_rate : 0;
+	int burst = config->per_ip_request_burst > 0 ? config->per_ip_request_burst : 1;
+	burst_ns = interval_ns * burst;
+	if (max_connections <= 0 && interval_ns == 0) return 0;
+
+	size_t shards = 1;
+	while (shards * SHARD_WAYS < config->per_ip_table_size) shards <<= 1;
+	size_t bytes = shards * SHARD_WAYS * sizeof(ratelimit_entry_t);
+	table = aligned_alloc(CACHE_LINE_SIZE, (bytes + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+	if (!table) return -1;
+	memset(table, 0, bytes);
+	shard_mask = shards - 1;
+	return 0;
+}
+
+void ratelimit_destroy(void) {
+	free(table);
+	table = NULL;
+}
+
+// IPv4, also when mapped into IPv6, keeps its whole address; IPv6 keeps its /64.
+static uint64_t address_key(const struct sockaddr_storage* addr) {
+	uint64_t key = 0;
+	if (addr->ss_family == AF_INET) {
+		key = 0xffff00000000ull | ntohl(((const struct sockaddr_in*)addr)->sin_addr.s_addr);
+	} else if (addr->ss_family == AF_INET6) {
+		const struct in6_addr* a6 = &((const struct sockaddr_in6*)addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(a6)) {
+			key = 0xffff00000000ull | ((uint64_t)a6->s6_addr[12] << 24) | ((uint64_t)a6->s6_addr[13] << 16) |
+					((uint64_t)a6->s6_addr[14] << 8) | a6->s6_addr[15];
+		} else {
+			for (int i = 0; i < 8; i++) key = (key << 8) | a6->s6_addr[i];
+		}
+	}
+	// 0 marks a free entry; "::/64" holds nothing but loopback anyway.
+	return key ? key : 1;
+}
+
+static ratelimit_entry_t* shard_of(uint64_t key) {
+	uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+	return &table[((hash >> 32) & shard_mask) * SHARD_WAYS];
+}
+
+static bool refilled(ratelimit_entry_t* entry, uint64_t now) {
+	return atomic_load_explicit(&entry->tat, memory_order_relaxed) <= now;
+}
+
+// The entry holding key, or a free or aged one made over to it.
+static ratelimit_entry_t* find_entry(uint64_t key, uint64_t now) {
+	ratelimit_entry_t* shard = shard_of(key);
+	for (int i = 0; i < SHARD_WAYS; i++) {
+		if (atomic_load(&shard[i].key) == key) return &shard[i];
+	}
+	for (int i = 0; i < SHARD_WAYS; i++) {
+		unsigned long long expected = 0;
+		if (atomic_compare_exchange_strong(&shard[i].key, &expected, key) || expected == key) return &shard[i];
+	}
+	for (int i = 0; i < SHARD_WAYS; i++) {
+		ratelimit_entry_t* entry = &shard[i];
+		int idle = 0;
+		if (!refilled(entry, now) || !atomic_compare_exchange_strong(&entry->connections, &idle, -1)) continue;
+		if (refilled(entry, now)) {
+			atomic_store(&entry->key, key);
+			atomic_store(&entry->connections, 0);
+			return entry;
+		}
+		atomic_store(&entry->connections, 0);
+	}
+	return NULL;
+}
+
+bool ratelimit_admit(const struct sockaddr_storage* addr, ratelimit_entry_t** entry) {
+	*entry = NULL;
+	if (!table) return true;
+
+	uint64_t key = address_key(addr);
+	uint64_t now = metrics_now_ns();
+	for (int attempt = 0; attempt < CLAIM_ATTEMPTS; attempt++) {
+		ratelimit_entry_t* found = find_entry(key, now);
+		if (!found) return true;
+
+		int count = atomic_load(&found->connections);
+		bool counted = false;
+		while (count >= 0 && (max_connections <= 0 || count < max_connections)) {
+			if (atomic_compare_exchange_weak(&found->connections, &count, count + 1)) {
+				counted = true;
+				break;
+			}
+		}
+		// Whatever was seen only counts if the entry still belongs to key.
+		if (atomic_load(&found->key) != key) {
+			if (counted) atomic_fetch_sub(&found->connections, 1);
+			continue;
+		}
+		if (counted) {
+			*entry = found;
+			return true;
+		}
+		if (count >= 0) {
+			atomic_fetch_add_explicit(&refused, 1, memory_order_relaxed);
+			return false;
+		}
+	}
+	return true;
+}
+
+void ratelimit_release(ratelimit_entry_t* entry) {
+	if (entry) atomic_fetch_sub(&entry->connections, 1);
+}
+
+bool ratelimit_take(ratelimit_entry_t* entry) {
+	if (!entry || interval_ns == 0) return true;
+
+	uint64_t now = metrics_now_ns();
+	unsigned long long tat = atomic_load_explicit(&entry->tat, memory_order_relaxed);
+	while (1) {
+		uint64_t next = (tat > now ? tat : now) + interval_ns;
+		if (next - now > burst_ns) return false;
+		if (atomic_compare_exchange_weak_explicit(&entry->tat, &tat, next, memory_order_relaxed, memory_order_relaxed)) {
+			return true;
+		}
+	}
+}
+
+unsigned long ratelimit_refused_connections(void) {
+	return atomic_load_explicit(&refused, memory_order_relaxed);
+}
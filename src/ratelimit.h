@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+/*
+ * Per-client limits: how many connections one address may hold open, and how
+ * fast it may send requests. IPv6 clients are counted per /64, since one host
+ * usually holds a whole prefix.
+ *
+ * Every thread shares one table, split into shards of a few entries that an
+ * address hashes to. Entries are claimed and updated with compare-and-swap
+ * only, so the acceptor and the workers never wait on each other. An entry
+ * stays with its address while any of its connections is open; after that it
+ * is reused as soon as its request bucket has refilled, so the table ages
+ * without a sweep.
+ *
+ * A connection holds its entry from accept to close, so a request costs one
+ * compare-and-swap on it. When a shard has no room for a new address, that
+ * address goes unlimited.
+ */
+
+typedef struct ratelimit_entry_s ratelimit_entry_t;
+
+// Nothing is allocated, and everything is let through, when no limit is set.
+int ratelimit_init(const server_config* config);
+void ratelimit_destroy(void);
+
+// Count a connection just accepted from addr. Returns false, counting nothing,
+// when the address already holds its limit. *entry is what the connection
+// gives back to ratelimit_release() when it closes, and may be NULL.
+bool ratelimit_admit(const struct sockaddr_storage* addr, ratelimit_entry_t** entry);
+void ratelimit_release(ratelimit_entry_t* entry);
+
+// Take a token for one request. False when the client is over its rate.
+bool ratelimit_take(ratelimit_entry_t* entry);
+
+unsigned long ratelimit_refused_connections(void);
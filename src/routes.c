@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ftw.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "routes.h"
+#include "cache.h"
+#include "logger.h"
+#include "site.h"
+#include "pack.h"
+
+#define ROUTES_MAX_WATCHES 4096
+#define ROUTES_MAX_PENDING 64
+#define ROUTES_SETTLE_MS 100
+#define READER_OFFLINE ULONG_MAX
+#define PACK_INOTIFY_MASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+#define INOTIFY_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Open addressing at most half full, with the strings packed after the slots,
+// so a whole table is one allocation.
+typedef struct route_table_s {
+	size_t mask;
+	size_t count;
+	route_t slots[];
+} route_table_t;
+
+typedef struct {
+	_Alignas(64) atomic_ulong epoch;
+} route_reader_t;
+
+static _Atomic(route_table_t*) current_table = NULL;
+static route_reader_t* readers = NULL;
+static int num_readers = 0;
+static char* root = NULL;
+static size_t root_len = 0;
+
+// Pack mode: the whole site comes from one mapped pack, which is replaced when
+// a new one is renamed over pack_path.
+static _Atomic(pack_t*) current_pack = NULL;
+static char* pack_path = NULL;
+static char* pack_dir = NULL;
+static const char* pack_name = NULL;
+
+static int inotify_fd = -1;
+static int stop_pipe[2] = {-1, -1};
+static pthread_t watcher_thread;
+static int watcher_running = 0;
+static char* watch_paths[ROUTES_MAX_WATCHES];
+
+// Paths that changed since the last rebuild. Their cache entries are dropped
+// again once the new table is in, in case one was built from the old table.
+static char* pending_paths[ROUTES_MAX_PENDING];
+static int num_pending = 0;
+static int pending_flush = 0;
+
+typedef struct {
+	char* uri;
+	char* path;
+	const mime_type_t* mime;
+	int sidecars;
+	time_t mtime;
+} walk_route_t;
+
+// Routes found by the walk in progress. nftw() takes no user pointer, and only
+// one walk runs at a time: at startup, then on the watcher thread.
+static struct {
+	walk_route_t* routes;
+	size_t count;
+	size_t capacity;
+	int failed;
+} walk;
+
+static size_t hash_uri(const char* uri) {
+	size_t hash = 14695981039346656037ul;
+	while (*uri) {
+		hash ^= (unsigned char)*uri++;
+		hash *= 1099511628211ul;
+	}
+	return hash;
+}
+
+static int probe_sidecars(const char* path) {
+	char sidecar[PATH_MAX + 4];
+	struct stat st;
+	int encodings = 0;
+
+	snprintf(sidecar, sizeof(sidecar), "%s.br", path);
+	if (stat(sidecar, &st) == 0 && S_ISREG(st.st_mode)) encodings |= ENCODING_BR;
+	snprintf(sidecar, sizeof(sidecar), "%s.gz", path);
+	if (stat(sidecar, &st) == 0 && S_ISREG(st.st_mode)) encodings |= ENCODING_GZIP;
+	return encodings;
+}
+
+static void add_route(const char* uri, size_t uri_len, const char* path, const mime_type_t* mime, int sidecars, time_t mtime) {
+	if (walk.failed) return;
+
+	if (walk.count == walk.capacity) {
+		size_t capacity = walk.capacity ? walk.capacity * 2 : 256;
+		walk_route_t* routes = realloc(walk.routes, capacity * sizeof(walk_route_t));
+		if (!routes) {
+			walk.failed = 1;
+			return;
+		}
+		walk.routes = routes;
+		walk.capacity = capacity;
+	}
+
+	walk_route_t* route = &walk.routes[walk.count];
+	route->uri = strndup(uri, uri_len);
+	route->path = strdup(path);
+	if (!route->uri || !route->path) {
+		free(route->uri);
+		free(route->path);
+		walk.failed = 1;
+		return;
+	}
+	route->mime = mime;
+	route->sidecars = sidecars;
+	route->mtime = mtime;
+	walk.count++;
+}
+
+typedef struct {
+	const char* path;
+	const mime_type_t* mime;
+	int sidecars;
+	time_t mtime;
+} walk_file_t;
+
+static void emit_route(const char* uri, size_t len, void* arg) {
+	const walk_file_t* file = arg;
+	add_route(uri, len, file->path, file->mime, file->sidecars, file->mtime);
+}
+
+static void add_file_routes(const char* rel, const char* path, const struct stat* st) {
+	const mime_type_t* mime = mime_lookup(path);
+	walk_file_t file = { path, mime, mime->compressible ? probe_sidecars(path) : 0, st->st_mtime };
+	site_file_uris(rel, emit_route, &file);
+}
+
+static int walk_cb(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+	(void)ftwbuf;
+	if (typeflag == FTW_F && S_ISREG(sb->st_mode)) {
+		add_file_routes(fpath + root_len, fpath, sb);
+	} else if (typeflag == FTW_SL) {
+		// A symlink is served only if it leads to a regular file inside document_root.
+		char target[PATH_MAX];
+		struct stat st;
+		if (realpath(fpath, target) && strncmp(target, root, root_len) == 0 && target[root_len] == '/' &&
+				stat(target, &st) == 0 && S_ISREG(st.st_mode)) {
+			add_file_routes(fpath + root_len, target, &st);
+		}
+	}
+	return walk.failed;
+}
+
+static route_table_t* layout_table(void) {
+	size_t num_slots = 16;
+	while (num_slots < walk.count * 2) num_slots <<= 1;
+
+	size_t string_bytes = 0;
+	for (size_t i = 0; i < walk.count; i++) {
+		string_bytes += strlen(walk.routes[i].uri) + strlen(walk.routes[i].path) + 2;
+	}
+
+	route_table_t* table = calloc(1, sizeof(route_table_t) + num_slots * sizeof(route_t) + string_bytes);
+	if (!table) return NULL;
+	table->mask = num_slots - 1;
+
+	char* strings = (char*)&table->slots[num_slots];
+	for (size_t i = 0; i < walk.count; i++) {
+		const walk_route_t* route = &walk.routes[i];
+		size_t slot = hash_uri(route->uri) & table->mask;
+		while (table->slots[slot].uri && strcmp(table->slots[slot].uri, route->uri) != 0) {
+			slot = (slot + 1) & table->mask;
+		}
+		if (table->slots[slot].uri) continue;
+
+		size_t uri_len = strlen(route->uri) + 1;
+		size_t path_len = strlen(route->path) + 1;
+		memcpy(strings, route->uri, uri_len);
+		memcpy(strings + uri_len, route->path, path_len);
+		table->slots[slot] = (route_t){ strings, strings + uri_len, route->mime, route->sidecars, route->mtime };
+		strings += uri_len + path_len;
+		table->count++;
+	}
+	return table;
+}
+
+static route_table_t* build_table(void) {
+	memset(&walk, 0, sizeof(walk));
+	route_table_t* table = NULL;
+
+	if (nftw(root, walk_cb, 16, FTW_PHYS) != 0 || walk.failed) {
+		log_message(NULL, "ERROR: Failed to walk document_root %s: %s", root, walk.failed ? "out of memory" : strerror(errno));
+	} else {
+		table = layout_table();
+		if (!table) log_message(NULL, "ERROR: Out of memory for route table");
+	}
+
+	for (size_t i = 0; i < walk.count; i++) {
+		free(walk.routes[i].uri);
+		free(walk.routes[i].path);
+	}
+	free(walk.routes);
+	memset(&walk, 0, sizeof(walk));
+	return table;
+}
+
+// Wait until every online reader has passed a quiescent point; after that none
+// can still hold a route from a table that has been swapped out.
+static void wait_for_readers(void) {
+	for (int i = 0; i < num_readers; i++) {
+		unsigned long seen = atomic_load(&readers[i].epoch);
+		while (seen != READER_OFFLINE && atomic_load(&readers[i].epoch) == seen) {
+			struct timespec pause = { 0, 1000000 };
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+static void rebuild_routes(void) {
+	route_table_t* table = build_table();
+	if (table) {
+		route_table_t* old = atomic_exchange(&current_table, table);
+		wait_for_readers();
+		free(old);
+		log_info(NULL, "Route table rebuilt: %zu URIs", table->count);
+	} else {
+		log_message(NULL, "WARN: Keeping the previous route table");
+	}
+
+	if (pending_flush) {
+		cache_flush();
+	}
+	for (int i = 0; i < num_pending; i++) {
+		if (!pending_flush) cache_invalidate_path(pending_paths[i]);
+		free(pending_paths[i]);
+	}
+	num_pending = 0;
+	pending_flush = 0;
+}
+
+static void reload_pack(void) {
+	pack_t* pack = pack_open(pack_path);
+	if (!pack) {
+		log_message(NULL, "WARN: Keeping the previous site pack");
+		return;
+	}
+	pack_t* old = atomic_exchange(&current_pack, pack);
+	wait_for_readers();
+	// Responses still sending from the old pack hold their own references.
+	pack_release(old);
+	log_info(NULL, "Site pack reloaded: %u URIs", pack->header->num_routes);
+}
+
+static void note_changed(const char* path) {
+	if (!path || num_pending == ROUTES_MAX_PENDING) {
+		pending_flush = 1;
+		return;
+	}
+	pending_paths[num_pending] = strdup(path);
+	if (pending_paths[num_pending]) {
+		num_pending++;
+	} else {
+		pending_flush = 1;
+	}
+}
+
+static int add_watch(const char* dir) {
+	int wd = inotify_add_watch(inotify_fd, dir, INOTIFY_MASK);
+	if (wd < 0) {
+		log_message(NULL, "WARN: inotify_add_watch failed for %s: %s", dir, strerror(errno));
+		return -1;
+	}
+	if (wd >= ROUTES_MAX_WATCHES) {
+		log_message(NULL, "WARN: Too many watched directories, ignoring %s", dir);
+		inotify_rm_watch(inotify_fd, wd);
+		return -1;
+	}
+	free(watch_paths[wd]);
+	watch_paths[wd] = strdup(dir);
+	return 0;
+}
+
+static int add_watch_cb(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+	(void)sb;
+	(void)ftwbuf;
+	if (typeflag == FTW_D) {
+		add_watch(fpath);
+	}
+	return 0;
+}
+
+// Returns 1 if the event may change what the route table should hold.
+static int handle_inotify_event(const struct inotify_event* ev) {
+	if (pack_path) {
+		// Only the pack's own name in its directory matters.
+		return ev->len > 0 && strcmp(ev->name, pack_name) == 0;
+	}
+	if (ev->mask & IN_Q_OVERFLOW) {
+		log_message(NULL, "WARN: inotify queue overflow, flushing response cache");
+		cache_flush();
+		note_changed(NULL);
+		return 1;
+	}
+	if (ev->mask & IN_IGNORED) {
+		if (ev->wd >= 0 && ev->wd < ROUTES_MAX_WATCHES) {
+			free(watch_paths[ev->wd]);
+			watch_paths[ev->wd] = NULL;
+		}
+		return 0;
+	}
+	if (ev->wd < 0 || ev->wd >= ROUTES_MAX_WATCHES || !watch_paths[ev->wd]) {
+		return 0;
+	}
+
+	if (ev->len == 0 || (ev->mask & IN_ISDIR)) {
+		// A directory appeared, vanished or moved: anything below it may have changed.
+		if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len > 0) {
+			char dir[4096];
+			snprintf(dir, sizeof(dir), "%s/%s", watch_paths[ev->wd], ev->name);
+			nftw(dir, add_watch_cb, 16, FTW_PHYS);
+		}
+		cache_flush();
+		note_changed(NULL);
+		return 1;
+	}
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", watch_paths[ev->wd], ev->name);
+	cache_invalidate_path(path);
+	note_changed(path);
+	return 1;
+}
+
+// A deploy arrives as a burst of events; rebuild once it has been quiet for
+// ROUTES_SETTLE_MS rather than once per file.
+static void* watcher_main(void* arg) {
+	(void)arg;
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int rebuild_pending = 0;
+
+	struct pollfd fds[2] = {
+		{ .fd = inotify_fd, .events = POLLIN },
+		{ .fd = stop_pipe[0], .events = POLLIN },
+	};
+
+	while (1) {
+		int ready = poll(fds, 2, rebuild_pending ? ROUTES_SETTLE_MS : -1);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents) break;
+		if (ready == 0) {
+			if (pack_path) {
+				reload_pack();
+			} else {
+				rebuild_routes();
+			}
+			rebuild_pending = 0;
+			continue;
+		}
+
+		ssize_t len = read(inotify_fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+			break;
+		}
+
+		for (char* p = buf; p < buf + len; ) {
+			const struct inotify_event* ev = (const struct inotify_event*)p;
+			rebuild_pending |= handle_inotify_event(ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return NULL;
+}
+
+static int init_readers(int reader_count) {
+	readers = aligned_alloc(64, reader_count * sizeof(route_reader_t));
+	if (!readers) return -1;
+	num_readers = reader_count;
+	for (int i = 0; i < num_readers; i++) {
+		atomic_init(&readers[i].epoch, READER_OFFLINE);
+	}
+	return 0;
+}
+
+int routes_init(const char* document_root, int reader_count) {
+	root = strdup(document_root);
+	if (!root || init_readers(reader_count) != 0) {
+		log_message(NULL, "ERROR: Out of memory for route table");
+		routes_destroy();
+		return -1;
+	}
+	root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+
+	route_table_t* table = build_table();
+	if (!table) {
+		routes_destroy();
+		return -1;
+	}
+	atomic_store(&current_table, table);
+	log_message(NULL, "Route table built: %zu URIs under %s", table->count, root);
+	return 0;
+}
+
+int routes_init_pack(const char* path, int reader_count) {
+	pack_path = strdup(path);
+	pack_dir = strdup(path);
+	if (!pack_path || !pack_dir || init_readers(reader_count) != 0) {
+		log_message(NULL, "ERROR: Out of memory for route table");
+		routes_destroy();
+		return -1;
+	}
+	// The directory is what gets watched: a deploy renames a new pack over the
+	// old name rather than touching the old file.
+	char* slash = strrchr(pack_dir, '/');
+	if (!slash) {
+		strcpy(pack_dir, ".");
+		pack_name = pack_path;
+	} else {
+		*slash = '\0';
+		if (slash == pack_dir) strcpy(pack_dir, "/");
+		pack_name = pack_path + (slash - pack_dir) + 1;
+	}
+
+	pack_t* pack = pack_open(pack_path);
+	if (!pack) {
+		routes_destroy();
+		return -1;
+	}
+	atomic_store(&current_pack, pack);
+	log_message(NULL, "Site pack loaded: %u URIs from %s", pack->header->num_routes, pack_path);
+	return 0;
+}
+
+int routes_watch(void) {
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		log_message(NULL, "ERROR: inotify_init1 failed: %s", strerror(errno));
+		return -1;
+	}
+	if (pipe2(stop_pipe, O_CLOEXEC) == -1) {
+		log_message(NULL, "ERROR: pipe for route watcher failed: %s", strerror(errno));
+		close(inotify_fd);
+		inotify_fd = -1;
+		return -1;
+	}
+
+	if (pack_path) {
+		if (inotify_add_watch(inotify_fd, pack_dir, PACK_INOTIFY_MASK) < 0) {
+			log_message(NULL, "ERROR: inotify_add_watch failed for %s: %s", pack_dir, strerror(errno));
+			close(stop_pipe[0]);
+			close(stop_pipe[1]);
+			stop_pipe[0] = stop_pipe[1] = -1;
+			close(inotify_fd);
+			inotify_fd = -1;
+			return -1;
+		}
+	} else {
+		nftw(root, add_watch_cb, 16, FTW_PHYS);
+	}
+
+	if (pthread_create(&watcher_thread, NULL, watcher_main, NULL) != 0) {
+		log_message(NULL, "ERROR: Failed to create route watcher thread");
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+		close(inotify_fd);
+		inotify_fd = -1;
+		return -1;
+	}
+	watcher_running = 1;
+	return 0;
+}
+
+// Readers must be offline (their threads joined) by now.
+void routes_destroy(void) {
+	if (watcher_running) {
+		write(stop_pipe[1], "x", 1);
+		pthread_join(watcher_thread, NULL);
+		watcher_running = 0;
+	}
+	if (stop_pipe[0] != -1) {
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
+	if (inotify_fd != -1) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	for (int i = 0; i < ROUTES_MAX_WATCHES; i++) {
+		free(watch_paths[i]);
+		watch_paths[i] = NULL;
+	}
+	for (int i = 0; i < num_pending; i++) {
+		free(pending_paths[i]);
+	}
+	num_pending = 0;
+
+	free(atomic_exchange(&current_table, NULL));
+	pack_release(atomic_exchange(&current_pack, NULL));
+	free(pack_path);
+	free(pack_dir);
+	pack_path = NULL;
+	pack_dir = NULL;
+	pack_name = NULL;
+	free(readers);
+	readers = NULL;
+	num_readers = 0;
+	free(root);
+	root = NULL;
+}
+
+void routes_reader_online(int reader) {
+	atomic_store(&readers[reader].epoch, 0);
+}
+
+void routes_reader_offline(int reader) {
+	atomic_store(&readers[reader].epoch, READER_OFFLINE);
+}
+
+void routes_quiescent(int reader) {
+	atomic_store(&readers[reader].epoch, atomic_load_explicit(&readers[reader].epoch, memory_order_relaxed) + 1);
+}
+
+const route_t* routes_lookup(const char* uri) {
+	const route_table_t* table = atomic_load(&current_table);
+	if (!table) return NULL;
+
+	for (size_t slot = hash_uri(uri) & table->mask; table->slots[slot].uri; slot = (slot + 1) & table->mask) {
+		if (strcmp(table->slots[slot].uri, uri) == 0) return &table->slots[slot];
+	}
+	return NULL;
+}
+
+pack_t* routes_pack(void) {
+	return atomic_load(&current_pack);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <time.h>
+
+#include "mime.h"
+#include "pack.h"
+
+// A servable URI, resolved once when the table is built.
+typedef struct {
+	const char* uri;
+	const char* path;     // absolute file path inside document_root
+	const mime_type_t* mime;
+	int sidecars;         // ENCODING_* set of .br/.gz files next to it
+	time_t mtime;         // of the source, as of the last rebuild
+} route_t;
+
+/*
+ * Immutable URI -> file table built by walking document_root. A URI that is not
+ * in it is a 404, so requests never touch paths the walk did not produce.
+ *
+ * When document_root changes, a new table is built and swapped in. Readers are
+ * the workers: a route_t stays valid until that worker's next
+ * routes_quiescent(), and a replaced table is freed only once every online
+ * reader has passed one.
+ */
+int routes_init(const char* document_root, int num_readers);
+// Serve from a site pack instead; routes_watch() then reloads it whenever a
+// new one is renamed over path, under the same reader rules.
+int routes_init_pack(const char* path, int num_readers);
+int routes_watch(void);
+void routes_destroy(void);
+
+void routes_reader_online(int reader);
+void routes_reader_offline(int reader);
+void routes_quiescent(int reader);
+
+const route_t* routes_lookup(const char* uri);
+// The current pack in pack mode, NULL otherwise. Pointers into it obey the
+// route_t rules unless a reference is taken with pack_acquire().
+pack_t* routes_pack(void);
@@ -3,15 +3,48 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <linux/filter.h>
 
 #include "server.h"
 #include "logger.h"
 
+// Per-instance epoll busy polling arrived in Linux 6.9, after most libc headers.
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// Accepted sockets inherit these from the listener. Raising them past the
+// sysctls needs CAP_NET_ADMIN, so this runs before privileges are dropped.
+static void set_busy_poll(int listen_fd, server_config* config) {
+	int usecs = config->busy_poll;
+	int prefer = 1;
+	int budget = config->busy_poll_budget;
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+		log_message(NULL, "WARN: setsockopt(SO_BUSY_POLL) failed: %s", strerror(errno));
+		return;
+	}
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0 ||
+			setsockopt(listen_fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0) {
+		log_message(NULL, "WARN: Busy poll preference/budget not set: %s", strerror(errno));
+	}
+}
+
 int init_server(server_config *config) {
 	int listen_fd;
 	struct sockaddr_in server_addr;
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (listen_fd < 0) {
 		log_message(NULL, "ERROR: socket() failed: %s", strerror(errno));
 		return -1;
@@ -24,6 +57,17 @@ int init_server(server_config *config) {
 		return -1;
 	}
 
+	if (config->listen_mode == LISTEN_REUSEPORT &&
+			setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		log_message(NULL, "ERROR: setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+		close(listen_fd);
+		return -1;
+	}
+
+	if (config->busy_poll > 0) {
+		set_busy_poll(listen_fd, config);
+	}
+
 	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -45,3 +89,72 @@ int init_server(server_config *config) {
 	return listen_fd;
 }
 
+int server_adopt_listener(int fd, server_config* config) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int listening = 0;
+	socklen_t opt_len = sizeof(listening);
+
+	if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0 || addr.sin_family != AF_INET ||
+			getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &opt_len) != 0 || !listening) {
+		log_message(NULL, "WARN: Inherited fd %d is not a listening socket", fd);
+		close(fd);
+		return -1;
+	}
+	if (ntohs(addr.sin_port) != config->port) {
+		log_message(NULL, "WARN: Inherited socket listens on port %d, not %d", ntohs(addr.sin_port), config->port);
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	log_message(NULL, "Server listening on port %d (inherited fd %d)", config->port, fd);
+	return fd;
+}
+
+int server_set_incoming_cpu(int listen_fd, int cpu) {
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+		log_message(NULL, "WARN: setsockopt(SO_INCOMING_CPU, %d) failed: %s", cpu, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int server_busy_poll_epoll(int epoll_fd, server_config* config) {
+	struct epoll_params params = {
+		.busy_poll_usecs = (uint32_t)config->busy_poll,
+		.busy_poll_budget = (uint16_t)config->busy_poll_budget,
+		.prefer_busy_poll = 1,
+	};
+	return ioctl(epoll_fd, EPIOCSPARAMS, &params);
+}
+
+// Steer each new connection to the reuseport socket of the worker pinned to
+// the CPU that received the packet. Without pinning, or for a CPU no worker
+// runs on, the socket index is simply the CPU number modulo the socket count.
+int server_attach_cpu_steering(int listen_fd, int num_sockets, const int* socket_cpus) {
+	int num_checks = socket_cpus ? num_sockets : 0;
+	struct sock_filter* code = calloc(2 * num_checks + 3, sizeof(struct sock_filter));
+	if (!code) return -1;
+
+	int n = 0;
+	code[n++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+	for (int i = 0; i < num_checks; i++) {
+		// On a match fall through to the return below; otherwise skip it.
+		code[n++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (unsigned int)socket_cpus[i] };
+		code[n++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (unsigned int)i };
+	}
+	code[n++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)num_sockets };
+	code[n++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+	struct sock_fprog prog = { .len = (unsigned short)n, .filter = code };
+
+	int result = setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+	free(code);
+	if (result < 0) {
+		log_message(NULL, "WARN: setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed: %s", strerror(errno));
+		return -1;
+	}
+	log_message(NULL, "Attached CPU steering program to %d reuseport sockets", num_sockets);
+	return 0;
+}
@@ -3,4 +3,12 @@
 #include "config.h"
 
 int init_server(server_config* config);
-
+// Take over a listening socket inherited from a binary upgrade. Closes it and
+// returns -1 if it is not listening on the configured port.
+int server_adopt_listener(int fd, server_config* config);
+// socket_cpus, when not NULL, holds the CPU each socket's worker is pinned to.
+int server_attach_cpu_steering(int listen_fd, int num_sockets, const int* socket_cpus);
+// Prefer this socket for connections whose packets arrive on cpu.
+int server_set_incoming_cpu(int listen_fd, int cpu);
+// Busy-poll an epoll instance with busy_poll/busy_poll_budget (Linux 6.9+).
+int server_busy_poll_epoll(int epoll_fd, server_config* config);
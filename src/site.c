@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "site.h"
+
+// The extension of the last path segment of uri[0, len), dot included.
+static const char* extension_of(const char* uri, size_t len) {
+	for (size_t i = len; i-- > 0; ) {
+		if (uri[i] == '/') return NULL;
+		if (uri[i] == '.') return uri + i;
+	}
+	return NULL;
+}
+
+static int is_page_asset(const char* ext, size_t len) {
+	return (len == 5 && memcmp(ext, ".html", 5) == 0) ||
+		(len == 4 && memcmp(ext, ".css", 4) == 0) ||
+		(len == 3 && memcmp(ext, ".js", 3) == 0);
+}
+
+// Anything under /images/ or /static/ and any .html, .css or .js file by its
+// own path, pages also without their .html (a clean URL), and /index.html as /.
+void site_file_uris(const char* rel, site_uri_cb emit, void* arg) {
+	size_t len = strlen(rel);
+
+	if (strncmp(rel, "/images/", 8) == 0 || strncmp(rel, "/static/", 8) == 0) {
+		emit(rel, len, arg);
+		return;
+	}
+	if (strcmp(rel, "/index.html") == 0) {
+		emit("/", 1, arg);
+	}
+
+	const char* ext = extension_of(rel, len);
+	if (!ext || !is_page_asset(ext, rel + len - ext)) return;
+	emit(rel, len, arg);
+
+	if (strcmp(ext, ".html") == 0) {
+		// "/notes.css.html" would be asked for as "/notes.css", which is a file of its own.
+		size_t alias_len = len - 5;
+		const char* alias_ext = extension_of(rel, alias_len);
+		if (!alias_ext || !is_page_asset(alias_ext, rel + alias_len - alias_ext)) {
+			emit(rel, alias_len, arg);
+		}
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+// Called once for each URI a file answers to; uri is not NUL-terminated.
+typedef void (*site_uri_cb)(const char* uri, size_t len, void* arg);
+
+/*
+ * The URIs a file answers to, given its path relative to document_root
+ * ("/posts/hello.html"). The route table and the offline packer both go
+ * through here, so a pack answers exactly what the live tree would.
+ */
+void site_file_uris(const char* rel, site_uri_cb emit, void* arg);
@@ -1,66 +1,117 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 
 #include "timer.h"
 
-timer_wheel_t* timer_wheel_create(int num_slots, int slot_interval) {
-	timer_wheel_t* tw = malloc(sizeof(timer_wheel_t));
+#define LEVEL_MASK (TIMER_LEVEL_SLOTS - 1)
+#define MAX_SPAN (((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+static uint64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+timer_wheel_t* timer_wheel_create(void) {
+	timer_wheel_t* tw = calloc(1, sizeof(timer_wheel_t));
 	if (!tw) return NULL;
 
-	tw->slots = calloc(num_slots, sizeof(timer_node_t*));
-	if (!tw->slots) {
+	tw->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tw->timer_fd == -1) {
 		free(tw);
 		return NULL;
 	}
 
-	tw->num_slots = num_slots;
-	tw->slot_interval = slot_interval;
-	tw->current_slot = 0;
+	struct itimerspec interval = {
+		.it_interval = { 0, TIMER_TICK_MS * 1000000L },
+		.it_value = { 0, TIMER_TICK_MS * 1000000L }
+	};
+	if (timerfd_settime(tw->timer_fd, 0, &interval, NULL) == -1) {
+		close(tw->timer_fd);
+		free(tw);
+		return NULL;
+	}
 
+	tw->start_ms = monotonic_ms();
+	tw->now = 0;
 	return tw;
 }
 
 void timer_wheel_destroy(timer_wheel_t* tw) {
 	if (!tw) return;
 
-	for (int i = 0; i < tw->num_slots; i++) {
-		timer_node_t* current = tw->slots[i];
-		while (current) {
-			timer_node_t* to_free = current;
-			current = current->next;
-			free(to_free);
-		}
-	}
-	free(tw->slots);
+	close(tw->timer_fd);
 	free(tw);
 }
 
-timer_node_t* timer_node_add(timer_wheel_t* tw, void* conn, int timeout_sec) {
-	timer_node_t* node = malloc(sizeof(timer_node_t));
-	if (!node) return NULL;
-
+// Nodes are embedded in their owner, so scheduling never allocates.
+void timer_node_init(timer_node_t* node, void* conn) {
+	node->next = NULL;
+	node->prev = NULL;
 	node->conn = conn;
-	node->expiration = time(NULL) + timeout_sec;
+	node->deadline = 0;
+	node->scheduled = 0;
+	node->slot_index = -1;
+}
 
-	int ticks_to_expire = timeout_sec / tw->slot_interval;
-	if(ticks_to_expire == 0) ticks_to_expire = 1;
+// A node goes on the lowest level whose slot for its tick has not come round yet.
+static void wheel_insert(timer_wheel_t* tw, timer_node_t* node, uint64_t tick) {
+	if (tick < tw->now) tick = tw->now;
+	if (tick - tw->now > MAX_SPAN) tick = tw->now + MAX_SPAN;
 
-	int target_slot = (tw->current_slot + ticks_to_expire) % tw->num_slots;
-	node->slot_index = target_slot;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 &&
+			(tick >> (level * TIMER_LEVEL_BITS)) - (tw->now >> (level * TIMER_LEVEL_BITS)) >= TIMER_LEVEL_SLOTS) {
+		level++;
+	}
+	int slot = level * TIMER_LEVEL_SLOTS + ((tick >> (level * TIMER_LEVEL_BITS)) & LEVEL_MASK);
 
-	node->next = tw->slots[target_slot];
+	node->scheduled = tick;
+	node->slot_index = slot;
 	node->prev = NULL;
-	if (tw->slots[target_slot]) {
-		tw->slots[target_slot]->prev = node;
+	node->next = tw->slots[slot];
+	if (tw->slots[slot]) {
+		tw->slots[slot]->prev = node;
 	}
-	tw->slots[target_slot] = node;
+	tw->slots[slot] = node;
+}
+
+void timer_node_touch(timer_wheel_t* tw, timer_node_t* node, int timeout_sec) {
+	uint64_t now_tick = (monotonic_ms() - tw->start_ms) / TIMER_TICK_MS;
+	uint64_t ticks = ((uint64_t)timeout_sec * 1000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	if (ticks == 0) ticks = 1;
+	if (now_tick < tw->now) now_tick = tw->now;
+	// One extra tick so a timeout never fires early because now_tick was rounded down.
+	node->deadline = now_tick + ticks + 1;
+
+	if (node->slot_index >= 0) {
+		if (node->scheduled <= node->deadline) return;
+		timer_node_remove(tw, node);
+	}
+	wheel_insert(tw, node, node->deadline);
+}
 
-	return node;
+uint64_t timer_node_deadline_ms(const timer_wheel_t* tw, const timer_node_t* node) {
+	return tw->start_ms + node->deadline * TIMER_TICK_MS;
+}
+
+void timer_node_set_deadline_ms(timer_wheel_t* tw, timer_node_t* node, uint64_t deadline_ms) {
+	uint64_t tick = deadline_ms > tw->start_ms ? (deadline_ms - tw->start_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0;
+	if (tick <= tw->now) tick = tw->now + 1;
+	node->deadline = tick;
+
+	if (node->slot_index >= 0) {
+		if (node->scheduled <= node->deadline) return;
+		timer_node_remove(tw, node);
+	}
+	wheel_insert(tw, node, node->deadline);
 }
 
 void timer_node_remove(timer_wheel_t* tw, timer_node_t* node) {
-	if (!node) return;
+	if (!node || node->slot_index < 0) return;
 
 	if (node->prev) {
 		node->prev->next = node->next;
@@ -73,20 +124,59 @@ void timer_node_remove(timer_wheel_t* tw, timer_node_t* node) {
 		tw->slots[node->slot_index] = node->next;
 	}
 
-	free(node);
+	node->next = NULL;
+	node->prev = NULL;
+	node->slot_index = -1;
+}
+
+static timer_node_t* detach_slot(timer_wheel_t* tw, int slot) {
+	timer_node_t* list = tw->slots[slot];
+	tw->slots[slot] = NULL;
+	return list;
+}
+
+static void cascade(timer_wheel_t* tw, int level) {
+	timer_node_t* node = detach_slot(tw, level * TIMER_LEVEL_SLOTS + ((tw->now >> (level * TIMER_LEVEL_BITS)) & LEVEL_MASK));
+	while (node) {
+		timer_node_t* next = node->next;
+		wheel_insert(tw, node, node->deadline);
+		node = next;
+	}
 }
 
-timer_node_t* timer_wheel_tick(timer_wheel_t* tw) {
-	tw->current_slot = (tw->current_slot + 1) % tw->num_slots;
-	timer_node_t* expired_list = tw->slots[tw->current_slot];
-	tw->slots[tw->current_slot] = NULL;
+// Catch the wheel up with the monotonic clock and return the nodes whose
+// deadlines have passed. Nodes that were pushed back since they were scheduled
+// are re-inserted at their new deadline instead.
+timer_node_t* timer_wheel_advance(timer_wheel_t* tw) {
+	uint64_t expirations;
+	while (read(tw->timer_fd, &expirations, sizeof(expirations)) > 0) {
+	}
+
+	uint64_t target = (monotonic_ms() - tw->start_ms) / TIMER_TICK_MS;
+	timer_node_t* expired_list = NULL;
 
-	timer_node_t* current = expired_list;
-	while(current) {
-		current->prev = NULL;
-		current = current->next;
+	while (tw->now < target) {
+		tw->now++;
+		for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+			if ((tw->now & (((uint64_t)1 << (level * TIMER_LEVEL_BITS)) - 1)) == 0) {
+				cascade(tw, level);
+			}
+		}
+
+		timer_node_t* node = detach_slot(tw, tw->now & LEVEL_MASK);
+		while (node) {
+			timer_node_t* next = node->next;
+			if (node->deadline > tw->now) {
+				wheel_insert(tw, node, node->deadline);
+			} else {
+				node->slot_index = -1;
+				node->prev = NULL;
+				node->next = expired_list;
+				expired_list = node;
+			}
+			node = next;
+		}
 	}
 
 	return expired_list;
 }
-
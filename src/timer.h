@@ -1,25 +1,43 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 250
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
 
 typedef struct timer_node_s {
 	struct timer_node_s* next;
 	struct timer_node_s* prev;
 	void *conn;
-	size_t expiration;
-	int slot_index;
+	uint64_t deadline;  // tick the owner actually wants to expire at
+	uint64_t scheduled; // tick the node currently sits in the wheel for
+	int slot_index;     // -1 while not scheduled
 } timer_node_t;
 
+/*
+ * Hierarchical timing wheel driven by CLOCK_MONOTONIC. Each level covers 64
+ * times the span of the one below; nodes cascade down as their level comes
+ * round. timer_fd fires every tick and belongs in the owner's epoll set.
+ *
+ * Re-arming is lazy: pushing a deadline later only records it, and the node is
+ * moved when its old slot comes due. Only an earlier deadline moves it at once.
+ */
 typedef struct timer_wheel_s {
-	timer_node_t** slots;
-	int num_slots;
-	int slot_interval;
-	int current_slot;
+	timer_node_t* slots[TIMER_LEVELS * TIMER_LEVEL_SLOTS];
+	uint64_t now;
+	uint64_t start_ms;
+	int timer_fd;
 } timer_wheel_t;
 
-timer_wheel_t* timer_wheel_create(int num_slots, int slot_interval);
+timer_wheel_t* timer_wheel_create(void);
 void timer_wheel_destroy(timer_wheel_t* tw);
-timer_node_t* timer_node_add(timer_wheel_t* tw, void* conn, int timeout_sec);
+void timer_node_init(timer_node_t* node, void* conn);
+void timer_node_touch(timer_wheel_t* tw, timer_node_t* node, int timeout_sec);
 void timer_node_remove(timer_wheel_t* tw, timer_node_t* node);
-timer_node_t* timer_wheel_tick(timer_wheel_t* tw);
-
+// Deadlines as CLOCK_MONOTONIC milliseconds, for moving a node between wheels.
+uint64_t timer_node_deadline_ms(const timer_wheel_t* tw, const timer_node_t* node);
+void timer_node_set_deadline_ms(timer_wheel_t* tw, timer_node_t* node, uint64_t deadline_ms);
+timer_node_t* timer_wheel_advance(timer_wheel_t* tw);
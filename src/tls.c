@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "tls.h"
+#include "logger.h"
+
+#ifdef HAVE_TLS
+
+// The largest plaintext a TLS record carries.
+#define TLS_RECORD_SIZE 16384
+// SSL_CTX_set_tlsext_ticket_keys(): a 16-byte key name, then HMAC and AES keys.
+#define TICKET_KEYS_SIZE 80
+
+static SSL_CTX* ctx = NULL;
+
+static void log_tls_error(const char* what) {
+	char reason[256] = "unknown error";
+	unsigned long err = ERR_get_error();
+	if (err) ERR_error_string_n(err, reason, sizeof(reason));
+	log_message(NULL, "ERROR: TLS: %s: %s", what, reason);
+	ERR_clear_error();
+}
+
+// h2 when the client offers it and http2 is on, else HTTP/1.1; a client offering
+// neither gets no ALPN. An h2 connection opens with the preface, which the
+// worker recognises as it would on plain text.
+static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+		const unsigned char* in, unsigned int in_len, void* arg) {
+	(void)ssl;
+	static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+	const unsigned char* offered = arg ? protocols : protocols + 3;
+	unsigned int offered_len = sizeof(protocols) - 1 - (offered - protocols);
+	if (SSL_select_next_proto((unsigned char**)out, out_len, offered, offered_len, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static int load_ticket_keys(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		log_message(NULL, "ERROR: TLS: cannot open tls_ticket_key_file %s: %s", path, strerror(errno));
+		return -1;
+	}
+	unsigned char keys[TICKET_KEYS_SIZE];
+	size_t n = fread(keys, 1, sizeof(keys), file);
+	fclose(file);
+	if (n != sizeof(keys)) {
+		log_message(NULL, "ERROR: TLS: tls_ticket_key_file %s must hold %d bytes", path, TICKET_KEYS_SIZE);
+		return -1;
+	}
+	int result = SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys)) == 1 ? 0 : -1;
+	memset(keys, 0, sizeof(keys));
+	if (result != 0) log_tls_error("setting session ticket keys");
+	return result;
+}
+
+int tls_init(const server_config* config) {
+	if (!config->tls_certificate) return 0;
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx) {
+		log_tls_error("SSL_CTX_new");
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+	if (config->tls_ktls) options |= SSL_OP_ENABLE_KTLS;
+	SSL_CTX_set_options(ctx, options);
+	// Partial writes and a retry from a rebuilt buffer are how the send path
+	// uses SSL_write(); idle keep-alive connections give their buffers back.
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+	const char* key = config->tls_certificate_key ? config->tls_certificate_key : config->tls_certificate;
+	if (SSL_CTX_use_certificate_chain_file(ctx, config->tls_certificate) != 1) {
+		log_tls_error(config->tls_certificate);
+		tls_destroy();
+		return -1;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+		log_tls_error(key);
+		tls_destroy();
+		return -1;
+	}
+
+	static const unsigned char session_context[] = "garage";
+	SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	// One ticket is enough for a browser to resume; each one costs a write.
+	SSL_CTX_set_num_tickets(ctx, 1);
+	if (config->tls_ticket_key_file && load_ticket_keys(config->tls_ticket_key_file) != 0) {
+		tls_destroy();
+		return -1;
+	}
+	SSL_CTX_set_alpn_select_cb(ctx, select_alpn, config->http2 ? (void*)1 : NULL);
+
+	log_message(NULL, "TLS enabled with %s (kernel TLS %s)", config->tls_certificate, config->tls_ktls ? "when available" : "off");
+	return 0;
+}
+
+void tls_destroy(void) {
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+}
+
+bool tls_enabled(void) {
+	return ctx != NULL;
+}
+
+SSL* tls_new(int fd) {
+	SSL* ssl = SSL_new(ctx);
+	if (!ssl) {
+		log_tls_error("SSL_new");
+		return NULL;
+	}
+	if (SSL_set_fd(ssl, fd) != 1) {
+		log_tls_error("SSL_set_fd");
+		SSL_free(ssl);
+		return NULL;
+	}
+	SSL_set_accept_state(ssl);
+	// Handshake flights and the tail record of a response are small writes
+	// that must not wait on Nagle for the peer's delayed ACK.
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return ssl;
+}
+
+void tls_free(SSL* ssl) {
+	if (!ssl) return;
+	if (SSL_is_init_finished(ssl)) {
+		ERR_clear_error();
+		SSL_shutdown(ssl);
+	}
+	ERR_clear_error();
+	SSL_free(ssl);
+}
+
+tls_status_t tls_handshake(SSL* ssl) {
+	ERR_clear_error();
+	int result = SSL_do_handshake(ssl);
+	if (result == 1) return TLS_DONE;
+	switch (SSL_get_error(ssl, result)) {
+		case SSL_ERROR_WANT_READ: return TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE: return TLS_WANT_WRITE;
+		default:
+			ERR_clear_error();
+			return TLS_FAILED;
+	}
+}
+
+bool tls_session_reused(SSL* ssl) {
+	return SSL_session_reused(ssl) == 1;
+}
+
+bool tls_kernel_send(SSL* ssl) {
+	return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+static ssize_t io_failed(SSL* ssl, int result, bool reading) {
+	switch (SSL_get_error(ssl, result)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			if (reading) return 0;
+			errno = EPIPE;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			// errno is the socket's, unless the peer just went away.
+			if (errno == 0) errno = EPIPE;
+			ERR_clear_error();
+			return -1;
+		default:
+			ERR_clear_error();
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+ssize_t tls_read(SSL* ssl, void* buf, size_t len) {
+	ERR_clear_error();
+	errno = 0;
+	int result = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+	return result > 0 ? result : io_failed(ssl, result, true);
+}
+
+ssize_t tls_write(SSL* ssl, const void* buf, size_t len) {
+	ERR_clear_error();
+	errno = 0;
+	int result = SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+	return result > 0 ? result : io_failed(ssl, result, false);
+}
+
+// A retry after EAGAIN rebuilds the buffer from the same unsent bytes, and
+// possibly more behind them, which SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER allows.
+ssize_t tls_writev(SSL* ssl, const struct iovec* iov, int iovcnt) {
+	char record[TLS_RECORD_SIZE];
+	size_t len = 0;
+	for (int i = 0; i < iovcnt && len < sizeof(record); i++) {
+		size_t n = iov[i].iov_len;
+		if (n > sizeof(record) - len) n = sizeof(record) - len;
+		memcpy(record + len, iov[i].iov_base, n);
+		len += n;
+	}
+	return tls_write(ssl, record, len);
+}
+
+#else
+
+int tls_init(const server_config* config) {
+	if (!config->tls_certificate) return 0;
+	log_message(NULL, "ERROR: Built without OpenSSL (TLS=0); cannot serve HTTPS.");
+	return -1;
+}
+
+void tls_destroy(void) {}
+
+bool tls_enabled(void) {
+	return false;
+}
+
+struct ssl_st* tls_new(int fd) {
+	(void)fd;
+	return NULL;
+}
+
+void tls_free(struct ssl_st* ssl) {
+	(void)ssl;
+}
+
+tls_status_t tls_handshake(struct ssl_st* ssl) {
+	(void)ssl;
+	return TLS_FAILED;
+}
+
+bool tls_session_reused(struct ssl_st* ssl) {
+	(void)ssl;
+	return false;
+}
+
+bool tls_kernel_send(struct ssl_st* ssl) {
+	(void)ssl;
+	return false;
+}
+
+ssize_t tls_read(struct ssl_st* ssl, void* buf, size_t len) {
+	(void)ssl;
+	(void)buf;
+	(void)len;
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t tls_write(struct ssl_st* ssl, const void* buf, size_t len) {
+	(void)ssl;
+	(void)buf;
+	(void)len;
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t tls_writev(struct ssl_st* ssl, const struct iovec* iov, int iovcnt) {
+	(void)ssl;
+	(void)iov;
+	(void)iovcnt;
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "config.h"
+
+struct ssl_st;
+
+/*
+ * HTTPS termination. One SSL_CTX serves every worker, so its session cache
+ * and session ticket keys are shared: a client resumes on whichever worker it
+ * lands on. With tls_ticket_key_file they also survive restarts and upgrades.
+ *
+ * OpenSSL runs the handshake. When it completes, the send side of the record
+ * layer is handed to the kernel (kTLS) where the kernel and cipher allow it;
+ * the socket is then written with plain sendmsg() and sendfile(), which the
+ * kernel encrypts. Otherwise responses go through tls_write().
+ */
+int tls_init(const server_config* config);
+void tls_destroy(void);
+bool tls_enabled(void);
+
+typedef enum {
+	TLS_DONE,
+	TLS_WANT_READ,
+	TLS_WANT_WRITE,
+	TLS_FAILED
+} tls_status_t;
+
+struct ssl_st* tls_new(int fd);
+// Sends close_notify if the socket takes it at once.
+void tls_free(struct ssl_st* ssl);
+tls_status_t tls_handshake(struct ssl_st* ssl);
+bool tls_session_reused(struct ssl_st* ssl);
+bool tls_kernel_send(struct ssl_st* ssl);
+
+// read()/write() conventions: -1 with errno EAGAIN when it would block, 0 from
+// tls_read() once the peer has closed.
+ssize_t tls_read(struct ssl_st* ssl, void* buf, size_t len);
+ssize_t tls_write(struct ssl_st* ssl, const void* buf, size_t len);
+// Up to one full record's worth of iov in a single tls_write().
+ssize_t tls_writev(struct ssl_st* ssl, const struct iovec* iov, int iovcnt);
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "upgrade.h"
+#include "config.h"
+#include "logger.h"
+
+#define ENV_LISTEN_FDS "GARAGE_LISTEN_FDS"
+#define ENV_LOG_FD "GARAGE_LOG_FD"
+#define ENV_READY_FD "GARAGE_READY_FD"
+#define UPGRADE_READY_TIMEOUT_MS 15000
+
+extern char** environ;
+
+static char exe_path[PATH_MAX];
+static int* inherited_fds = NULL;
+static int num_inherited = 0;
+static int inherited_log_fd = -1;
+static int ready_fd = -1;
+
+static int parse_fd(const char* value) {
+	char* end;
+	long fd = strtol(value, &end, 10);
+	if (end == value || fd < 0 || fd > INT_MAX) return -1;
+	return (int)fd;
+}
+
+// Runs before any thread starts, so the environment can still be changed
+// safely. The variables are consumed here so they never reach a later upgrade.
+int upgrade_init(void) {
+	ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	if (len < 0) {
+		exe_path[0] = '\0';
+		return -1;
+	}
+	exe_path[len] = '\0';
+
+	const char* listen_fds = getenv(ENV_LISTEN_FDS);
+	if (listen_fds && *listen_fds) {
+		int count = 1;
+		for (const char* p = listen_fds; *p; p++) {
+			if (*p == ',') count++;
+		}
+		inherited_fds = malloc(count * sizeof(int));
+		if (inherited_fds) {
+			const char* p = listen_fds;
+			while (num_inherited < count) {
+				int fd = parse_fd(p);
+				if (fd >= 0) inherited_fds[num_inherited++] = fd;
+				p = strchr(p, ',');
+				if (!p) break;
+				p++;
+			}
+		}
+	}
+	const char* log_fd = getenv(ENV_LOG_FD);
+	if (log_fd) inherited_log_fd = parse_fd(log_fd);
+	const char* ready = getenv(ENV_READY_FD);
+	if (ready) {
+		ready_fd = parse_fd(ready);
+		if (ready_fd >= 0) fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	unsetenv(ENV_LISTEN_FDS);
+	unsetenv(ENV_LOG_FD);
+	unsetenv(ENV_READY_FD);
+	return 0;
+}
+
+int upgrade_inherited_listeners(int** fds) {
+	*fds = inherited_fds;
+	return num_inherited;
+}
+
+int upgrade_inherited_log_fd(void) {
+	return inherited_log_fd;
+}
+
+void upgrade_notify_ready(void) {
+	if (ready_fd < 0) return;
+	char ok = '1';
+	if (write(ready_fd, &ok, 1) != 1) {
+		log_message(NULL, "WARN: Could not report readiness to the old server: %s", strerror(errno));
+	}
+	close(ready_fd);
+	ready_fd = -1;
+	free(inherited_fds);
+	inherited_fds = NULL;
+	num_inherited = 0;
+}
+
+// The child may only make async-signal-safe calls between fork() and exec(),
+// so the whole environment is built beforehand. The variables added are the
+// only allocated entries and start at envp[*own].
+static char** build_environment(const int* listen_fds, int count, int log_fd, int ready, size_t* own) {
+	size_t n = 0;
+	while (environ[n]) n++;
+	*own = n;
+
+	char** envp = calloc(n + 4, sizeof(char*));
+	char* listen_var = malloc(sizeof(ENV_LISTEN_FDS) + (size_t)count * 12);
+	char* log_var = malloc(sizeof(ENV_LOG_FD) + 12);
+	char* ready_var = malloc(sizeof(ENV_READY_FD) + 12);
+	if (!envp || !listen_var || !log_var || !ready_var) {
+		free(envp);
+		free(listen_var);
+		free(log_var);
+		free(ready_var);
+		return NULL;
+	}
+
+	int len = sprintf(listen_var, "%s=", ENV_LISTEN_FDS);
+	for (int i = 0; i < count; i++) {
+		len += sprintf(listen_var + len, "%s%d", i > 0 ? "," : "", listen_fds[i]);
+	}
+	sprintf(log_var, "%s=%d", ENV_LOG_FD, log_fd);
+	sprintf(ready_var, "%s=%d", ENV_READY_FD, ready);
+
+	size_t k = 0;
+	for (size_t i = 0; i < n; i++) {
+		envp[k++] = environ[i];
+	}
+	envp[k++] = listen_var;
+	envp[k++] = log_var;
+	envp[k++] = ready_var;
+	envp[k] = NULL;
+	return envp;
+}
+
+static void free_environment(char** envp, size_t own) {
+	for (size_t i = own; envp[i]; i++) {
+		free(envp[i]);
+	}
+	free(envp);
+}
+
+// Wait for the new process to write its ready byte, or to die trying. A child
+// that could not exec at all sends 'E' and its errno instead.
+static int wait_ready(int fd) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= UPGRADE_READY_TIMEOUT_MS) return -1;
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int result = poll(&pfd, 1, UPGRADE_READY_TIMEOUT_MS - elapsed);
+		if (result < 0 && errno == EINTR) continue;
+		if (result <= 0) return -1;
+
+		char reply[1 + sizeof(int)];
+		ssize_t n = read(fd, reply, sizeof(reply));
+		if (n < 0 && errno == EINTR) continue;
+		if (n == (ssize_t)sizeof(reply) && reply[0] == 'E') {
+			int err;
+			memcpy(&err, reply + 1, sizeof(err));
+			log_message(NULL, "ERROR: Upgrade: cannot exec %s: %s", exe_path, strerror(err));
+			return -1;
+		}
+		return n >= 1 && reply[0] == '1' ? 0 : -1;
+	}
+}
+
+static int check_readable(const char* path, const char* key) {
+	if (!path || access(path, R_OK) == 0) return 0;
+	log_message(NULL, "ERROR: Upgrade refused: %s %s is not readable by uid %d, which the new server runs as: %s. "
+			"Make it readable by that user, or restart the server instead.", key, path, (int)getuid(), strerror(errno));
+	return -1;
+}
+
+// The new server starts with this process's uid, which is no longer root once
+// privileges were dropped. Refuse what it could not do instead of letting it
+// fail halfway: join more sockets to a reuseport group bound by another user,
+// or read TLS files only root may read.
+static int check_new_config(const int* listen_fds, int count) {
+	server_config config;
+	config_init_defaults(&config);
+	// The new process reads the same file, from the same working directory.
+	if (load_config("server.conf", &config) != 0) {
+		free_config(&config);
+		return 0;
+	}
+
+	int result = 0;
+	int needed = config.listen_mode == LISTEN_REUSEPORT ? config.num_workers : 1;
+	struct stat st;
+	if (needed > count && count > 0 && fstat(listen_fds[0], &st) == 0 && st.st_uid != geteuid()) {
+		log_message(NULL, "ERROR: Upgrade refused: server.conf asks for %d listening sockets but only %d can be handed over, "
+				"and uid %d cannot add sockets to the group uid %d bound. Restart the server to add workers.",
+				needed, count, (int)geteuid(), (int)st.st_uid);
+		result = -1;
+	}
+	if (check_readable(config.tls_certificate, "tls_certificate") != 0 ||
+			check_readable(config.tls_certificate_key, "tls_certificate_key") != 0 ||
+			check_readable(config.tls_ticket_key_file, "tls_ticket_key_file") != 0) {
+		result = -1;
+	}
+	free_config(&config);
+	return result;
+}
+
+int upgrade_spawn(char* const argv[], const int* listen_fds, int count, int log_fd) {
+	if (exe_path[0] == '\0') {
+		log_message(NULL, "ERROR: Upgrade: executable path unknown");
+		return -1;
+	}
+	if (check_new_config(listen_fds, count) != 0) {
+		return -1;
+	}
+
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) != 0) {
+		log_message(NULL, "ERROR: Upgrade: pipe2() failed: %s", strerror(errno));
+		return -1;
+	}
+	size_t own;
+	char** envp = build_environment(listen_fds, count, log_fd, ready[1], &own);
+	if (!envp) {
+		log_message(NULL, "ERROR: Upgrade: out of memory");
+		close(ready[0]);
+		close(ready[1]);
+		return -1;
+	}
+
+	log_message(NULL, "Upgrade: starting %s", exe_path);
+	pid_t pid = fork();
+	if (pid == 0) {
+		for (int i = 0; i < count; i++) {
+			fcntl(listen_fds[i], F_SETFD, 0);
+		}
+		if (log_fd >= 0) fcntl(log_fd, F_SETFD, 0);
+		fcntl(ready[1], F_SETFD, 0);
+		execve(exe_path, argv, envp);
+		char reply[1 + sizeof(int)] = { 'E' };
+		int err = errno;
+		memcpy(reply + 1, &err, sizeof(err));
+		write(ready[1], reply, sizeof(reply));
+		_exit(127);
+	}
+
+	free_environment(envp, own);
+	close(ready[1]);
+	if (pid < 0) {
+		log_message(NULL, "ERROR: Upgrade: fork() failed: %s", strerror(errno));
+		close(ready[0]);
+		return -1;
+	}
+
+	int result = wait_ready(ready[0]);
+	close(ready[0]);
+	if (result != 0) {
+		log_message(NULL, "ERROR: Upgrade: new server (pid %d) did not come up; keeping this one", (int)pid);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	log_message(NULL, "Upgrade: new server (pid %d) is ready", (int)pid);
+	return 0;
+}
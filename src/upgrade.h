@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * Binary upgrade on SIGUSR2. The running server forks and execs the executable
+ * path it was started from, which by then holds the new build, with its
+ * listening sockets and log file left open across exec and named in the
+ * environment. The new process adopts them instead of binding, and writes to a
+ * pipe once its workers are running. Only then does the old process stop
+ * accepting and drain; if the new one fails to report in, the old one keeps
+ * serving as if nothing happened.
+ *
+ * The new process runs as the old one's uid. Before starting it, the old one
+ * reads the new server.conf and refuses an upgrade that would need root again:
+ * more reuseport sockets than it can hand over, or unreadable TLS files.
+ */
+int upgrade_init(void);
+
+// What an upgrading parent handed over; nothing (0 / -1) on a normal start.
+int upgrade_inherited_listeners(int** fds);
+int upgrade_inherited_log_fd(void);
+void upgrade_notify_ready(void);
+
+// Returns 0 once the new process reports ready; every socket in listen_fds is
+// handed over, whether or not the new configuration has a worker for it.
+int upgrade_spawn(char* const argv[], const int* listen_fds, int count, int log_fd);
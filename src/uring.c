@@ -0,0 +1,201 @@
+#ifdef HAVE_IO_URING
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "logger.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int setup_buffers(uring_t* ring, unsigned num_bufs, unsigned buf_size) {
+	ring->buf_ring_len = num_bufs * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		return -1;
+	}
+	ring->bufs = malloc((size_t)num_bufs * buf_size);
+	if (!ring->bufs) return -1;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->buf_ring;
+	reg.ring_entries = num_bufs;
+	reg.bgid = URING_BUF_GROUP;
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		log_message(NULL, "WARN: io_uring provided buffer ring unavailable: %s", strerror(errno));
+		return -1;
+	}
+
+	ring->buf_size = buf_size;
+	ring->buf_mask = num_bufs - 1;
+	ring->buf_tail = 0;
+	for (unsigned bid = 0; bid < num_bufs; bid++) {
+		uring_recycle_buffer(ring, bid);
+	}
+	return 0;
+}
+
+// num_bufs must be a power of two.
+int uring_init(uring_t* ring, unsigned entries, unsigned num_bufs, unsigned buf_size) {
+	memset(ring, 0, sizeof(*ring));
+	ring->ring_fd = -1;
+
+	// SINGLE_ISSUER and multishot receive both arrived in 6.0, so a kernel that
+	// accepts these flags has everything the worker loop relies on.
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 8;
+	ring->ring_fd = sys_io_uring_setup(entries, &params);
+	if (ring->ring_fd < 0) {
+		log_message(NULL, "WARN: io_uring_setup failed: %s", strerror(errno));
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		log_message(NULL, "WARN: io_uring lacks SINGLE_MMAP/NODROP");
+		uring_destroy(ring);
+		return -1;
+	}
+
+	size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	ring->ring_mem = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->ring_mem == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->ring_mem == MAP_FAILED) ring->ring_mem = NULL;
+		if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+		log_message(NULL, "WARN: io_uring mmap failed: %s", strerror(errno));
+		uring_destroy(ring);
+		return -1;
+	}
+
+	char* mem = ring->ring_mem;
+	ring->sq_head = (unsigned*)(mem + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(mem + params.sq_off.tail);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->sq_mask = *(unsigned*)(mem + params.sq_off.ring_mask);
+	unsigned* sq_array = (unsigned*)(mem + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++) {
+		sq_array[i] = i;
+	}
+	ring->cq_head = (unsigned*)(mem + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(mem + params.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(mem + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(mem + params.cq_off.cqes);
+
+	// Registering the ring fd itself spares every io_uring_enter() a file lookup.
+	struct io_uring_rsrc_update update = { .offset = -1U, .data = (unsigned long)ring->ring_fd };
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+		ring->ring_fd_registered = update.offset;
+		ring->enter_flags |= IORING_ENTER_REGISTERED_RING;
+	} else {
+		ring->ring_fd_registered = -1;
+	}
+
+	if (setup_buffers(ring, num_bufs, buf_size) != 0) {
+		uring_destroy(ring);
+		return -1;
+	}
+	return 0;
+}
+
+void uring_destroy(uring_t* ring) {
+	if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_len);
+	free(ring->bufs);
+	if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+	if (ring->ring_mem) munmap(ring->ring_mem, ring->ring_len);
+	if (ring->ring_fd >= 0) close(ring->ring_fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->ring_fd = -1;
+}
+
+static int enter(uring_t* ring, unsigned to_submit, unsigned wait_nr, unsigned flags) {
+	int fd = (ring->enter_flags & IORING_ENTER_REGISTERED_RING) ? ring->ring_fd_registered : ring->ring_fd;
+	return sys_io_uring_enter(fd, to_submit, wait_nr, flags | ring->enter_flags);
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+	while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+		uring_submit_and_wait(ring, 0);
+	}
+	struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqe_tail++;
+	return sqe;
+}
+
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr) {
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while (1) {
+		unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (enter(ring, to_submit, wait_nr, flags) >= 0) return 0;
+		if (errno == EINTR) {
+			if (wait_nr > 0) return 0;
+			continue;
+		}
+		// Completions are backed up; the caller drains them and retries.
+		if (errno == EAGAIN || errno == EBUSY) return 0;
+		return -1;
+	}
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef IORING_REGISTER_NAPI
+#define IORING_REGISTER_NAPI 27
+struct io_uring_napi {
+	__u32 busy_poll_to;
+	__u8 prefer_busy_poll;
+	__u8 pad[3];
+	__u64 resv;
+};
+#endif
+
+int uring_busy_poll(uring_t* ring, unsigned usecs) {
+	struct io_uring_napi napi = { .busy_poll_to = usecs, .prefer_busy_poll = 1 };
+	return sys_io_uring_register(ring->ring_fd, IORING_REGISTER_NAPI, &napi, 1) < 0 ? -1 : 0;
+}
+
+char* uring_buffer(uring_t* ring, unsigned bid) {
+	return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void uring_recycle_buffer(uring_t* ring, unsigned bid) {
+	struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & ring->buf_mask];
+	buf->addr = (unsigned long)uring_buffer(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+#endif
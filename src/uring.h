@@ -0,0 +1,61 @@
+#pragma once
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Just enough of io_uring for the worker loop, on raw syscalls: one ring per
+ * worker, set up single-issuer with deferred task work, plus one provided
+ * buffer ring that multishot receives pick their buffers from.
+ *
+ * Not thread-safe: each worker owns its ring.
+ */
+typedef struct {
+	int ring_fd;
+	int ring_fd_registered; // index for IORING_ENTER_REGISTERED_RING
+	unsigned enter_flags;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sqe_tail; // SQEs handed out; published to sq_tail on submit
+	struct io_uring_sqe* sqes;
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void* ring_mem;
+	size_t ring_len;
+	size_t sqes_len;
+
+	struct io_uring_buf_ring* buf_ring;
+	size_t buf_ring_len;
+	char* bufs;
+	unsigned buf_size;
+	unsigned buf_mask;
+	unsigned short buf_tail;
+} uring_t;
+
+#define URING_BUF_GROUP 0
+
+int uring_init(uring_t* ring, unsigned entries, unsigned num_bufs, unsigned buf_size);
+void uring_destroy(uring_t* ring);
+
+// Never NULL: a full submission queue is flushed to the kernel first.
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr);
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);
+
+// Busy-poll the NAPI contexts of the ring's sockets while waiting (Linux 6.9+).
+int uring_busy_poll(uring_t* ring, unsigned usecs);
+
+char* uring_buffer(uring_t* ring, unsigned bid);
+void uring_recycle_buffer(uring_t* ring, unsigned bid);
+
+#endif
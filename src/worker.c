@@ -1,64 +1,145 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/epoll.h>
-#include <fcntl.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
 
 #include "logger.h"
 #include "worker.h"
 #include "connection.h"
 #include "timer.h"
 #include "http.h"
+#include "routes.h"
+#include "uring.h"
+#include "metrics.h"
+#include "dispatch.h"
+#include "tls.h"
+#include "h2.h"
+#include "ratelimit.h"
+#include "accesslog.h"
 
 #define MAX_EVENTS 64
-#define REQUEST_BUFFER_SIZE 8192
-#define CONNECTION_TIMEOUT 60
+#define POOL_STATS_INTERVAL 300
+#define REBALANCE_BATCH 32
 
 typedef struct {
 	int worker_id;
 	int epoll_fd;
+	int listen_fd;
+	spsc_queue_t* queue;
 	timer_wheel_t* tw;
+	connection_pools_t* pools;
+	time_t next_stats;
 	server_config* config;
+	struct worker_uring_s* uring; // NULL when running on epoll
+
+	// Every open connection, so a drain can find the idle ones.
+	connection_t* connections;
+	int num_connections;
+	bool draining;
+	time_t drain_deadline;
+
+	// Set by the timer, acted on between event batches so no event still
+	// waiting in the current batch can refer to a connection moved away.
+	bool rebalance_due;
 } worker_context_t;
 
-static int make_socket_non_blocking(int fd);
+static atomic_int drain_timeout = 0;
+
+void worker_set_drain_timeout(int seconds) {
+	atomic_store(&drain_timeout, seconds);
+}
+
 static void close_connection(worker_context_t* ctx, connection_t* conn);
-static void handle_client_event(worker_context_t* ctx, connection_t* conn);
-static bool handle_pipe_event(worker_context_t* ctx, int pipe_read_fd);
+static void handle_client_event(worker_context_t* ctx, connection_t* conn, uint32_t events);
+static void handle_queue_event(worker_context_t* ctx);
+static void handle_listen_event(worker_context_t* ctx);
+static void handle_timer_event(worker_context_t* ctx);
+static void log_pool_stats(worker_context_t* ctx);
+static void add_connection(worker_context_t* ctx, const accepted_conn_t* accepted);
+static void adopt_connection(worker_context_t* ctx, const migrated_conn_t* moved);
+static void rebalance_connections(worker_context_t* ctx);
+static void service_connection(worker_context_t* ctx, connection_t* conn);
+static bool resume_write(worker_context_t* ctx, connection_t* conn);
+static bool start_uring(worker_context_t* ctx);
+static void run_uring_loop(worker_context_t* ctx);
+static void stop_uring(worker_context_t* ctx);
+static void uring_arm_recv(worker_context_t* ctx, connection_t* conn);
+static void uring_arm_pollout(worker_context_t* ctx, connection_t* conn);
+static send_status_t uring_send_pending(worker_context_t* ctx, connection_t* conn);
+static void uring_forget_connection(worker_context_t* ctx, connection_t* conn);
+static void uring_stop_accepting(worker_context_t* ctx);
+static int uring_fill_input(worker_context_t* ctx, connection_t* conn, bool* drained, bool* peer_closed);
 
 void* worker_thread_main(void* arg) {
 	worker_init_t* init_data = (worker_init_t*) arg;
 
 	worker_context_t ctx = {
 		.worker_id = init_data->worker_id,
+		.listen_fd = init_data->listen_fd,
+		.queue = init_data->queue,
 		.config = init_data->config
 	};
 
-	int pipe_read_fd = init_data->pipe_read_fd;
 	free(init_data);
 
-	ctx.tw = timer_wheel_create(60, 1);
-	ctx.epoll_fd = epoll_create1(0);
-	if (!ctx.tw || ctx.epoll_fd == -1) {
+	ctx.tw = timer_wheel_create();
+	ctx.pools = connection_pools_create();
+	ctx.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (!ctx.tw || !ctx.pools || ctx.epoll_fd == -1) {
 		log_message(NULL, "FATAL: Worker %d: timer_wheel_create failed", ctx.worker_id);
 		if (ctx.tw) timer_wheel_destroy(ctx.tw);
+		connection_pools_destroy(ctx.pools);
 		if (ctx.epoll_fd != -1) close(ctx.epoll_fd);
 		return NULL;
 	}
 
+	routes_reader_online(ctx.worker_id);
+	metrics_attach(ctx.worker_id);
+	access_log_attach(ctx.worker_id);
+	ctx.next_stats = time(NULL) + POOL_STATS_INTERVAL;
+
+	if (ctx.config->io_backend == IO_BACKEND_URING) {
+		if (start_uring(&ctx)) {
+			log_message(NULL, "Worker %d started successfully (io_uring).", ctx.worker_id);
+			run_uring_loop(&ctx);
+			stop_uring(&ctx);
+			goto done;
+		}
+		log_message(NULL, "WARN: Worker %d: io_uring unavailable, falling back to epoll", ctx.worker_id);
+	}
+
 	struct epoll_event event, events[MAX_EVENTS];
 	event.events = EPOLLIN;
-	event.data.fd = pipe_read_fd;
-	epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, pipe_read_fd, &event);
+	event.data.fd = ctx.queue->event_fd;
+	epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, ctx.queue->event_fd, &event);
+
+	event.events = EPOLLIN;
+	event.data.fd = ctx.tw->timer_fd;
+	epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, ctx.tw->timer_fd, &event);
+
+	if (ctx.listen_fd >= 0) {
+		event.events = EPOLLIN;
+		event.data.fd = ctx.listen_fd;
+		epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, ctx.listen_fd, &event);
+	}
+
+	if (ctx.config->busy_poll > 0 && server_busy_poll_epoll(ctx.epoll_fd, ctx.config) != 0) {
+		log_message(NULL, "WARN: Worker %d: epoll busy poll unavailable: %s", ctx.worker_id, strerror(errno));
+	}
 
 	log_message(NULL, "Worker %d started successfully.", ctx.worker_id);
 
-	bool is_running = true;
-	while (is_running) {
+	while (!ctx.draining || ctx.num_connections > 0) {
 		int n_events = epoll_wait(ctx.epoll_fd, events, MAX_EVENTS, 1000);
 		if (n_events < 0) {
 			if (errno == EINTR) continue;
@@ -66,131 +147,1078 @@ void* worker_thread_main(void* arg) {
 		}
 
 		for (int i = 0; i < n_events; i++) {
-			if (events[i].data.fd == pipe_read_fd) {
-				if (!handle_pipe_event(&ctx, pipe_read_fd)) {
-					is_running = false;
-					break;
-				}
+			if (events[i].data.fd == ctx.queue->event_fd) {
+				handle_queue_event(&ctx);
+			} else if (events[i].data.fd == ctx.tw->timer_fd) {
+				handle_timer_event(&ctx);
+			} else if (ctx.listen_fd >= 0 && events[i].data.fd == ctx.listen_fd) {
+				handle_listen_event(&ctx);
 			} else {
-				handle_client_event(&ctx, (connection_t*)events[i].data.ptr);
+				handle_client_event(&ctx, (connection_t*)events[i].data.ptr, events[i].events);
 			}
 		}
 
-		if (!is_running) {
-			break;
+		if (ctx.rebalance_due) {
+			ctx.rebalance_due = false;
+			rebalance_connections(&ctx);
 		}
 
-		timer_node_t* expired_list = timer_wheel_tick(ctx.tw);
-		while (expired_list) {
-			timer_node_t* current_node = expired_list;
-			expired_list = expired_list->next;
-			log_message(((connection_t*)current_node->conn)->client_ip, "Worker %d: Closing connection due to timeout", ctx.worker_id);
-			close_connection(&ctx, (connection_t*)current_node->conn);
-		}
+		// No route_t is held across iterations.
+		routes_quiescent(ctx.worker_id);
 	}
 
+done:
+	routes_reader_offline(ctx.worker_id);
+
+	log_pool_stats(&ctx);
 	log_message(NULL, "Worker %d terminating.", ctx.worker_id);
-	close(pipe_read_fd);
 	close(ctx.epoll_fd);
 	timer_wheel_destroy(ctx.tw);
+	connection_pools_destroy(ctx.pools);
 	return NULL;
 }
 
+static const char* phase_name(conn_phase_t phase) {
+	switch (phase) {
+		case PHASE_HEADER: return "header";
+		case PHASE_IDLE: return "keep-alive";
+		case PHASE_WRITE: return "write";
+	}
+	return "unknown";
+}
+
+static void set_phase(worker_context_t* ctx, connection_t* conn, conn_phase_t phase) {
+	int timeout;
+	switch (phase) {
+		case PHASE_HEADER: timeout = ctx->config->header_timeout; break;
+		case PHASE_IDLE: timeout = ctx->config->keepalive_timeout; break;
+		default: timeout = ctx->config->write_timeout; break;
+	}
+	conn->phase = phase;
+	timer_node_touch(ctx->tw, &conn->timer, timeout);
+}
+
+static void close_all_connections(worker_context_t* ctx) {
+	while (ctx->connections) {
+		close_connection(ctx, ctx->connections);
+	}
+}
+
+static void handle_timer_event(worker_context_t* ctx) {
+	if (ctx->draining && ctx->num_connections > 0 && time(NULL) >= ctx->drain_deadline) {
+		log_message(NULL, "WARN: Worker %d: Drain deadline passed, closing %d connections", ctx->worker_id, ctx->num_connections);
+		close_all_connections(ctx);
+	}
+
+	timer_node_t* expired_list = timer_wheel_advance(ctx->tw);
+	while (expired_list) {
+		connection_t* conn = (connection_t*)expired_list->conn;
+		expired_list = expired_list->next;
+		log_debug(conn->client_ip, "Worker %d: Closing connection due to %s timeout", ctx->worker_id, phase_name(conn->phase));
+		metrics_connection_timed_out();
+		close_connection(ctx, conn);
+	}
+
+	pool_t* pools[] = { ctx->pools->connections, ctx->pools->small_buffers, ctx->pools->large_buffers, ctx->pools->response_blocks,
+			ctx->pools->h2_sessions };
+	metrics_publish_pools(pools, sizeof(pools) / sizeof(pools[0]));
+
+	// Moving a connection off an io_uring worker would race its armed receive.
+	if (ctx->config->rebalance_threshold > 0 && !ctx->uring && !ctx->draining) {
+		ctx->rebalance_due = true;
+	}
+
+	if (time(NULL) >= ctx->next_stats) {
+		log_pool_stats(ctx);
+		ctx->next_stats = time(NULL) + POOL_STATS_INTERVAL;
+	}
+}
+
+static void log_pool_stats(worker_context_t* ctx) {
+	pool_t* pools[] = { ctx->pools->connections, ctx->pools->small_buffers, ctx->pools->large_buffers, ctx->pools->response_blocks,
+			ctx->pools->h2_sessions };
+	for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+		log_info(NULL, "Worker %d: pool %s %zu/%zu in use", ctx->worker_id, pools[i]->name, pools[i]->in_use, pools[i]->capacity);
+	}
+}
+
+static void link_connection(worker_context_t* ctx, connection_t* conn) {
+	conn->next_conn = ctx->connections;
+	if (ctx->connections) ctx->connections->prev_conn = conn;
+	ctx->connections = conn;
+	ctx->num_connections++;
+	metrics_connection_opened();
+}
+
+static void unlink_connection(worker_context_t* ctx, connection_t* conn) {
+	if (conn->prev_conn) conn->prev_conn->next_conn = conn->next_conn;
+	else ctx->connections = conn->next_conn;
+	if (conn->next_conn) conn->next_conn->prev_conn = conn->prev_conn;
+	ctx->num_connections--;
+}
+
 static void close_connection(worker_context_t* ctx, connection_t* conn) {
 	if (!conn) return;
-	epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
-	if (conn->timer_node) {
-		timer_node_remove(ctx->tw, conn->timer_node);
+	if (ctx->uring) {
+		uring_forget_connection(ctx, conn);
+	} else {
+		epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	}
+	timer_node_remove(ctx->tw, &conn->timer);
+	// A ring send may still be reading the responses; its completion drops them.
+	if (!conn->send_armed) {
+		http_response_reset(conn);
+	}
+	if (conn->ssl) {
+		tls_free(conn->ssl);
+		conn->ssl = NULL;
 	}
 	close(conn->fd);
-	log_message(conn->client_ip, "Worker %d: Closed connection on fd %d", ctx->worker_id, conn->fd);
-	free(conn);
+	ratelimit_release(conn->limit);
+	unlink_connection(ctx, conn);
+	dispatch_load_add(ctx->worker_id, -1);
+
+	metrics_connection_closed();
+	log_debug(conn->client_ip, "Worker %d: Closed connection on fd %d", ctx->worker_id, conn->fd);
+
+	// Completions still in flight point at conn; the last of them frees it.
+	if (conn->io_inflight > 0) {
+		conn->closing = 1;
+		return;
+	}
+	connection_destroy(ctx->pools, conn);
 }
 
-static bool handle_pipe_event(worker_context_t* ctx, int pipe_read_fd) {
-	connection_t* conn;
-	ssize_t bytes_read = read(pipe_read_fd, &conn, sizeof(connection_t*));
+static bool connection_is_idle(const connection_t* conn) {
+	return conn->in_len == 0 && conn->resp_count == 0 && conn->held_count == 0 && !conn->write_pending &&
+			(!conn->h2 || h2_is_idle(conn));
+}
+
+// Start reading a connection just linked in. False if it had to be closed.
+static bool watch_connection(worker_context_t* ctx, connection_t* conn) {
+	if (ctx->uring) {
+		uring_arm_recv(ctx, conn);
+		return true;
+	}
 
-	if (bytes_read == sizeof(connection_t*)) {
-		conn->timer_node = timer_node_add(ctx->tw, conn, CONNECTION_TIMEOUT);
+	struct epoll_event event;
+	event.data.ptr = conn;
+	event.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+		close_connection(ctx, conn);
+		return false;
+	}
+	return true;
+}
 
-		make_socket_non_blocking(conn->fd);
+static void add_connection(worker_context_t* ctx, const accepted_conn_t* accepted) {
+	connection_t* conn = connection_create(ctx->pools, accepted);
+	if (!conn) {
+		log_message(NULL, "ERROR: Worker %d: Out of memory for connection on fd %d", ctx->worker_id, accepted->fd);
+		close(accepted->fd);
+		ratelimit_release(accepted->limit);
+		dispatch_load_add(ctx->worker_id, -1);
+		return;
+	}
+	link_connection(ctx, conn);
+	// The header timeout covers the TLS handshake too.
+	set_phase(ctx, conn, PHASE_HEADER);
 
-		struct epoll_event event;
-		event.data.ptr = conn;
-		event.events = EPOLLIN | EPOLLET;
-		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+	if (tls_enabled()) {
+		conn->ssl = tls_new(conn->fd);
+		if (!conn->ssl) {
 			close_connection(ctx, conn);
-		} else {
-			log_message(conn->client_ip, "Worker %d: Received new job (fd: %d)", ctx->worker_id, conn->fd);
+			return;
 		}
-		return true;
-	} else if (bytes_read <= 0) {
-		log_message(NULL, "Worker %d: Pipe closed or error. Shutting down.", ctx->worker_id);
-		return false;
+		conn->tls_handshaking = 1;
+	}
+
+	if (watch_connection(ctx, conn)) {
+		log_debug(conn->client_ip, "Worker %d: Received new job (fd: %d)", ctx->worker_id, conn->fd);
+	}
+}
+
+// An idle keep-alive connection another worker handed over. It keeps the
+// keep-alive deadline it had there.
+static void adopt_connection(worker_context_t* ctx, const migrated_conn_t* moved) {
+	connection_t* conn = connection_adopt(ctx->pools, moved->fd, moved->client_ip, moved->client_addr);
+	if (!conn) {
+		log_message(NULL, "ERROR: Worker %d: Out of memory for connection on fd %d", ctx->worker_id, moved->fd);
+		close(moved->fd);
+		ratelimit_release(moved->limit);
+		dispatch_load_add(ctx->worker_id, -1);
+		return;
 	}
+	conn->limit = moved->limit;
+	link_connection(ctx, conn);
+	conn->phase = PHASE_IDLE;
+	timer_node_set_deadline_ms(ctx->tw, &conn->timer, moved->idle_deadline_ms);
+
+	if (watch_connection(ctx, conn)) {
+		log_debug(conn->client_ip, "Worker %d: Adopted idle connection (fd: %d)", ctx->worker_id, conn->fd);
+	}
+}
+
+// Hand conn to another worker. Only for an idle connection: with nothing
+// buffered or queued, all there is to move is the socket and its deadline.
+static bool migrate_connection(worker_context_t* ctx, connection_t* conn, int target) {
+	migrated_conn_t moved = {
+		.fd = conn->fd,
+		.limit = conn->limit,
+		.idle_deadline_ms = timer_node_deadline_ms(ctx->tw, &conn->timer)
+	};
+	memcpy(moved.client_ip, conn->client_ip, sizeof(moved.client_ip));
+	memcpy(moved.client_addr, conn->client_addr, sizeof(moved.client_addr));
+	if (!dispatch_migrate(ctx->worker_id, target, &moved)) return false;
+
+	log_debug(conn->client_ip, "Worker %d: Moved idle connection (fd: %d) to worker %d", ctx->worker_id, conn->fd, target);
+	epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	timer_node_remove(ctx->tw, &conn->timer);
+	unlink_connection(ctx, conn);
+	metrics_connection_closed();
+	metrics_connection_migrated();
+	connection_destroy(ctx->pools, conn);
 	return true;
 }
 
-static void handle_client_event(worker_context_t* ctx, connection_t* conn) {
-	char buffer[REQUEST_BUFFER_SIZE] = {0};
-	ssize_t total_bytes_read = 0;
-	bool should_close = false;
+// While this worker holds more than rebalance_threshold connections above the
+// average, move idle ones to whichever worker is least loaded.
+static void rebalance_connections(worker_context_t* ctx) {
+	int excess = dispatch_excess(ctx->worker_id, ctx->config->rebalance_threshold);
+	int moved = 0;
+	connection_t* conn = ctx->connections;
+	while (conn && moved < excess && moved < REBALANCE_BATCH) {
+		connection_t* next = conn->next_conn;
+		// A TLS connection stays put: its session may hold decrypted bytes not
+		// yet read. So does an HTTP/2 one, whose HPACK tables cannot move.
+		if (conn->phase == PHASE_IDLE && connection_is_idle(conn) && !conn->ssl && !conn->h2) {
+			int target = dispatch_least_loaded(ctx->worker_id);
+			if (target < 0 || !migrate_connection(ctx, conn, target)) break;
+			moved++;
+		}
+		conn = next;
+	}
+}
 
-	while (total_bytes_read < REQUEST_BUFFER_SIZE - 1) {
-		ssize_t bytes_read = read(conn->fd, buffer + total_bytes_read, REQUEST_BUFFER_SIZE - total_bytes_read - 1);
+// Stop taking connections and let the open ones finish: idle ones are closed
+// now, busy ones once they have answered what they were sent, and whatever is
+// left at the drain deadline is closed then. A zero timeout closes everything.
+static void begin_drain(worker_context_t* ctx) {
+	int timeout = atomic_load(&drain_timeout);
+	ctx->draining = true;
+	ctx->drain_deadline = time(NULL) + timeout;
+	dispatch_close_inbox(ctx->worker_id);
 
+	if (ctx->listen_fd >= 0) {
+		if (ctx->uring) {
+			uring_stop_accepting(ctx);
+		} else {
+			epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, ctx->listen_fd, NULL);
+		}
+	}
+
+	if (timeout <= 0) {
+		close_all_connections(ctx);
+		return;
+	}
+	connection_t* conn = ctx->connections;
+	while (conn) {
+		connection_t* next = conn->next_conn;
+		if (connection_is_idle(conn)) {
+			close_connection(ctx, conn);
+		}
+		conn = next;
+	}
+	log_message(NULL, "Worker %d: Draining %d connections for up to %d seconds", ctx->worker_id, ctx->num_connections, timeout);
+}
+
+// Drain everything the acceptor queued, and other workers moved here, since
+// the last wakeup, and start draining the worker once the acceptor has closed
+// the queue.
+static void handle_queue_event(worker_context_t* ctx) {
+	uint64_t count;
+	read(ctx->queue->event_fd, &count, sizeof(count));
+
+	accepted_conn_t accepted;
+	while (spsc_queue_pop(ctx->queue, &accepted)) {
+		add_connection(ctx, &accepted);
+	}
+	migrated_conn_t moved;
+	while (dispatch_take(ctx->worker_id, &moved)) {
+		adopt_connection(ctx, &moved);
+	}
+
+	if (!ctx->draining && atomic_load_explicit(&ctx->queue->closed, memory_order_acquire)) {
+		log_message(NULL, "Worker %d: Handoff queue closed. Shutting down.", ctx->worker_id);
+		begin_drain(ctx);
+	}
+}
+
+// A client already holding its connection limit is turned away before
+// anything is set up for the connection.
+static bool admit_connection(worker_context_t* ctx, accepted_conn_t* accepted) {
+	if (ratelimit_admit(&accepted->addr, &accepted->limit)) return true;
+
+	if (LOG_LEVEL <= LOG_LEVEL_DEBUG) {
+		char client_ip[INET6_ADDRSTRLEN];
+		connection_format_address(&accepted->addr, client_ip, sizeof(client_ip));
+		log_debug(client_ip, "Worker %d: Refused fd %d over the per-address connection limit", ctx->worker_id, accepted->fd);
+	}
+	close(accepted->fd);
+	return false;
+}
+
+// reuseport mode: drain this worker's own listening socket straight into its epoll set.
+static void handle_listen_event(worker_context_t* ctx) {
+	while (1) {
+		accepted_conn_t accepted;
+		socklen_t addr_len = sizeof(accepted.addr);
+		accepted.fd = accept4(ctx->listen_fd, (struct sockaddr*)&accepted.addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (accepted.fd < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				log_message(NULL, "ERROR: Worker %d: accept4() failed: %s", ctx->worker_id, strerror(errno));
+			}
+			return;
+		}
+		if (!admit_connection(ctx, &accepted)) continue;
+		dispatch_load_add(ctx->worker_id, 1);
+		add_connection(ctx, &accepted);
+	}
+}
+
+static void set_write_interest(worker_context_t* ctx, connection_t* conn, int want_write) {
+	if (ctx->uring) {
+		// A POLLOUT poll is one-shot, so there is nothing to undo afterwards.
+		if (want_write) uring_arm_pollout(ctx, conn);
+		conn->write_pending = want_write;
+		return;
+	}
+
+	struct epoll_event event;
+	event.data.ptr = conn;
+	event.events = (want_write ? EPOLLOUT : EPOLLIN) | EPOLLET;
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+		log_message(conn->client_ip, "ERROR: Worker %d: epoll_ctl(MOD) failed on fd %d: %s", ctx->worker_id, conn->fd, strerror(errno));
+	}
+	conn->write_pending = want_write;
+}
+
+// A plain-text GET asking for "Upgrade: h2c" (RFC 7540 3.2). Over TLS, HTTP/2
+// is only agreed through ALPN.
+static bool wants_h2c(worker_context_t* ctx, connection_t* conn, const char* head) {
+	if (!ctx->config->http2 || conn->ssl || !http_slice_equals(head, conn->parser.method, "GET")) return false;
+	const http_slice_t* upgrade = http_find_header(&conn->parser, head, "Upgrade");
+	return upgrade && http_list_contains(head + upgrade->off, "h2c") && http_find_header(&conn->parser, head, "HTTP2-Settings");
+}
+
+// A session for a connection switching to HTTP/2; NULL when the pool cannot grow.
+static h2_session_t* alloc_h2_session(worker_context_t* ctx, connection_t* conn) {
+	h2_session_t* session = pool_alloc(ctx->pools->h2_sessions);
+	if (!session) {
+		log_message(conn->client_ip, "ERROR: Worker %d: Out of memory for an HTTP/2 session", ctx->worker_id);
+	}
+	return session;
+}
+
+// Answer every complete request sitting in the input buffer, in order, and keep
+// whatever follows the last one for the next read.
+static void process_requests(worker_context_t* ctx, connection_t* conn) {
+	if (conn->h2) {
+		h2_process_input(conn, ctx->config);
+		return;
+	}
+
+	size_t consumed = 0;
+
+	// A connection may open with the HTTP/2 preface instead of a request; once
+	// its first bytes say otherwise, later reads are never looked at again.
+	if (ctx->config->http2 && !conn->protocol_known) {
+		size_t n = conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN;
+		if (memcmp(conn->in_buf, H2_PREFACE, n) == 0) {
+			if (n < H2_PREFACE_LEN) return;
+			h2_session_t* session = alloc_h2_session(ctx, conn);
+			if (!session) {
+				conn->close_after_write = 1;
+				return;
+			}
+			h2_start(conn, session);
+			h2_process_input(conn, ctx->config);
+			return;
+		}
+		conn->protocol_known = 1;
+	}
+
+	// A single request may queue up to HTTP_MAX_RESPONSE_SLOTS responses.
+	while (conn->resp_count + HTTP_MAX_RESPONSE_SLOTS <= MAX_PIPELINE && !conn->close_after_write && consumed < conn->in_len) {
+		// The last request's body is skipped, never taken for a request.
+		if (conn->body_left > 0) {
+			size_t skip = conn->in_len - consumed < conn->body_left ? conn->in_len - consumed : conn->body_left;
+			consumed += skip;
+			conn->body_left -= skip;
+			continue;
+		}
+
+		char* start = conn->in_buf + consumed;
+		parse_result_t result = http_parser_execute(&conn->parser, start, conn->in_len - consumed);
+		if (result == PARSE_INCOMPLETE) break;
+
+		if (result != PARSE_DONE) {
+			metrics_parse_error();
+			send_error_response(conn, http_parse_error_status(result));
+			break;
+		}
+		consumed += conn->parser.head_len;
+
+		size_t body_len;
+		int refuse = http_request_body(&conn->parser, start, &body_len);
+		if (refuse) {
+			metrics_parse_error();
+			send_error_response(conn, refuse);
+			break;
+		}
+
+		if (body_len == 0 && wants_h2c(ctx, conn, start)) {
+			h2_session_t* session = alloc_h2_session(ctx, conn);
+			if (session && h2_upgrade(conn, session, start, ctx->config) == 0) {
+				// What follows is the client's preface and its first frames.
+				memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+				conn->in_len -= consumed;
+				h2_process_input(conn, ctx->config);
+				return;
+			}
+			// Otherwise the Upgrade is ignored, as a server may.
+			pool_free(ctx->pools->h2_sessions, session);
+		}
+
+		if (http_answer(conn, start, ctx->config) != 0) {
+			conn->close_after_write = 1;
+		}
+		conn->body_left = body_len;
+		http_parser_reset(&conn->parser);
+	}
+
+	if (consumed > 0) {
+		memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+		conn->in_len -= consumed;
+
+		// The next request's header clock starts when its first bytes are seen.
+		conn->phase = PHASE_IDLE;
+	} else if (conn->in_len == REQUEST_BUFFER_SIZE && !conn->close_after_write && conn->resp_count + HTTP_MAX_RESPONSE_SLOTS <= MAX_PIPELINE) {
+		metrics_parse_error();
+		send_error_response(conn, 431);
+	}
+}
+
+// Take in whatever the connection has: straight from the socket on epoll, or
+// from buffers the ring already received into on io_uring.
+static int fill_input(worker_context_t* ctx, connection_t* conn, bool* drained, bool* peer_closed) {
+	if (ctx->uring) return uring_fill_input(ctx, conn, drained, peer_closed);
+
+	while (conn->in_len < REQUEST_BUFFER_SIZE) {
+		if (connection_reserve_input(ctx->pools, conn) != 0) {
+			log_message(conn->client_ip, "ERROR: Worker %d: Out of memory for input buffer", ctx->worker_id);
+			return -1;
+		}
+		size_t room = conn->in_cap - conn->in_len;
+		ssize_t bytes_read = conn->ssl ? tls_read(conn->ssl, conn->in_buf + conn->in_len, room) :
+			read(conn->fd, conn->in_buf + conn->in_len, room);
 		if (bytes_read > 0) {
-			total_bytes_read += bytes_read;
+			conn->in_len += bytes_read;
 		} else if (bytes_read == 0) {
-			should_close = true;
+			*peer_closed = true;
+			break;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			*drained = true;
 			break;
 		} else {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				break;
-			} else {
-				should_close = true;
-				break;
-			}
+			return -1;
 		}
 	}
+	return 0;
+}
+
+// On io_uring, in-memory response parts go out as ring sends. File ranges,
+// HTTP/2 frames and TLS stay on the syscalls under http_send_pending().
+static send_status_t send_pending(worker_context_t* ctx, connection_t* conn) {
+	if (ctx->uring && !conn->h2 && !conn->ssl) {
+		return uring_send_pending(ctx, conn);
+	}
+	return http_send_pending(conn);
+}
+
+// Read what the socket has, answer it, and repeat until the socket is drained or
+// the output side fills up. A blocked response waits for EPOLLOUT instead of
+// spinning; reading resumes only once everything queued has been written.
+static void service_connection(worker_context_t* ctx, connection_t* conn) {
+	while (1) {
+		bool drained = false;
+		bool peer_closed = false;
+		bool was_empty = conn->in_len == 0;
+
+		if (fill_input(ctx, conn, &drained, &peer_closed) != 0) {
+			close_connection(ctx, conn);
+			return;
+		}
+		if (was_empty && conn->in_len > 0) {
+			conn->request_start_ns = metrics_now_ns();
+		}
 
-	if (total_bytes_read > 0) {
-		http_request_t req = {0};
-		if (parse_http_request(buffer, &req) == 0) {
-			if (strcmp(req.method, "GET") == 0) {
-				if (serve_static_file(conn->fd, req.uri, ctx->config) != 0) {
-					should_close = true;
-				} else {
-					if (conn->timer_node) timer_node_remove(ctx->tw, conn->timer_node);
-					conn->timer_node = timer_node_add(ctx->tw, conn, CONNECTION_TIMEOUT);
+		if (conn->in_len > 0) {
+			if (connection_reserve_responses(ctx->pools, conn) != 0) {
+				log_message(conn->client_ip, "ERROR: Worker %d: Out of memory for responses", ctx->worker_id);
+				close_connection(ctx, conn);
+				return;
+			}
+			process_requests(ctx, conn);
+		}
+		if (peer_closed) {
+			conn->close_after_write = 1;
+		}
+
+		if (!http_output_ready(conn)) {
+			if (conn->close_after_write) {
+				close_connection(ctx, conn);
+				return;
+			}
+			break;
+		}
+
+		switch (send_pending(ctx, conn)) {
+			case SEND_DONE:
+				break;
+			case SEND_AGAIN:
+				if (!conn->write_pending) {
+					set_write_interest(ctx, conn, 1);
 				}
-			} else {
-				send_error_response(conn->fd, 405);
-				should_close = true;
+				set_phase(ctx, conn, PHASE_WRITE);
+				connection_release_idle(ctx->pools, conn);
+				return;
+			case SEND_QUEUED:
+				set_phase(ctx, conn, PHASE_WRITE);
+				connection_release_idle(ctx->pools, conn);
+				return;
+			case SEND_ERROR:
+				close_connection(ctx, conn);
+				return;
+		}
+
+		if (conn->close_after_write) {
+			close_connection(ctx, conn);
+			return;
+		}
+		if (drained && conn->in_len == 0) {
+			break;
+		}
+	}
+
+	if (conn->write_pending) {
+		set_write_interest(ctx, conn, 0);
+	}
+	if (ctx->draining && connection_is_idle(conn)) {
+		close_connection(ctx, conn);
+		return;
+	}
+	if (conn->h2 && !h2_is_idle(conn)) {
+		// Streams waiting on the client to open their flow-control windows.
+		set_phase(ctx, conn, PHASE_WRITE);
+	} else if (conn->in_len == 0) {
+		set_phase(ctx, conn, PHASE_IDLE);
+	} else if (conn->phase != PHASE_HEADER) {
+		set_phase(ctx, conn, PHASE_HEADER);
+	}
+	connection_release_idle(ctx->pools, conn);
+}
+
+// The socket has room again for a blocked response. Returns true once all of
+// it is out and the connection should go back to reading.
+static bool resume_write(worker_context_t* ctx, connection_t* conn) {
+	switch (send_pending(ctx, conn)) {
+		case SEND_DONE:
+			break;
+		case SEND_AGAIN:
+			if (!conn->write_pending) {
+				set_write_interest(ctx, conn, 1);
 			}
-			free_http_request(&req);
+			// The socket took more bytes, so the stall clock starts over.
+			set_phase(ctx, conn, PHASE_WRITE);
+			return false;
+		case SEND_QUEUED:
+			set_phase(ctx, conn, PHASE_WRITE);
+			return false;
+		case SEND_ERROR:
+			close_connection(ctx, conn);
+			return false;
+	}
+	if (conn->close_after_write) {
+		close_connection(ctx, conn);
+		return false;
+	}
+	return true;
+}
+
+// Drive a TLS handshake as far as the socket allows. Returns true once it is
+// complete and the connection can be read as HTTP.
+static bool advance_handshake(worker_context_t* ctx, connection_t* conn) {
+	switch (tls_handshake(conn->ssl)) {
+		case TLS_WANT_READ:
+			if (conn->write_pending) set_write_interest(ctx, conn, 0);
+			return false;
+		case TLS_WANT_WRITE:
+			if (!conn->write_pending) set_write_interest(ctx, conn, 1);
+			return false;
+		case TLS_FAILED:
+			log_info(conn->client_ip, "Worker %d: TLS handshake failed on fd %d", ctx->worker_id, conn->fd);
+			metrics_tls_failed();
+			close_connection(ctx, conn);
+			return false;
+		case TLS_DONE:
+			break;
+	}
+	conn->tls_handshaking = 0;
+	conn->tls_kernel_send = tls_kernel_send(conn->ssl);
+	metrics_tls_handshake(tls_session_reused(conn->ssl), conn->tls_kernel_send);
+	if (conn->write_pending) set_write_interest(ctx, conn, 0);
+	return true;
+}
+
+static void handle_client_event(worker_context_t* ctx, connection_t* conn, uint32_t events) {
+	if (conn->tls_handshaking) {
+		if (events & EPOLLERR) {
+			close_connection(ctx, conn);
+			return;
+		}
+		if (!advance_handshake(ctx, conn)) return;
+	}
+	if (conn->write_pending) {
+		if (events & (EPOLLERR | EPOLLHUP)) {
+			close_connection(ctx, conn);
+			return;
+		}
+		if (!(events & EPOLLOUT) || !resume_write(ctx, conn)) {
+			return;
+		}
+	}
+
+	service_connection(ctx, conn);
+}
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 256
+#define URING_NUM_BUFS 512
+#define URING_BUF_SIZE 2048
+
+// user_data: small values are the worker's own descriptors. Anything else is a
+// connection, which pools hand out 64-byte aligned, tagged in its low bits with
+// the operation that completed.
+#define UD_QUEUE 1
+#define UD_TIMER 2
+#define UD_ACCEPT 3
+#define UD_IGNORE 4
+#define UD_RECV 1
+#define UD_POLLOUT 2
+#define UD_SEND 3
+#define UD_OP_MASK 63
+
+typedef struct worker_uring_s {
+	uring_t ring;
+	connection_t* starved; // receive stopped for lack of buffers
+	bool recycled;         // buffers went back to the ring this iteration
+	unsigned short held_next[URING_NUM_BUFS];
+	unsigned held_len[URING_NUM_BUFS];
+} worker_uring_t;
+
+static bool start_uring(worker_context_t* ctx) {
+	worker_uring_t* wu = calloc(1, sizeof(worker_uring_t));
+	if (!wu) return false;
+	if (uring_init(&wu->ring, URING_ENTRIES, URING_NUM_BUFS, URING_BUF_SIZE) != 0) {
+		free(wu);
+		return false;
+	}
+	if (ctx->config->busy_poll > 0 && uring_busy_poll(&wu->ring, ctx->config->busy_poll) != 0) {
+		log_message(NULL, "WARN: Worker %d: io_uring busy poll unavailable: %s", ctx->worker_id, strerror(errno));
+	}
+	ctx->uring = wu;
+	return true;
+}
+
+static void stop_uring(worker_context_t* ctx) {
+	uring_destroy(&ctx->uring->ring);
+	free(ctx->uring);
+	ctx->uring = NULL;
+}
+
+static void uring_arm_poll(worker_uring_t* wu, int fd, uint64_t user_data) {
+	struct io_uring_sqe* sqe = uring_get_sqe(&wu->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data;
+}
+
+static void uring_arm_accept(worker_uring_t* wu, int listen_fd) {
+	struct io_uring_sqe* sqe = uring_get_sqe(&wu->ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = UD_ACCEPT;
+}
+
+static void uring_arm_recv(worker_context_t* ctx, connection_t* conn) {
+	struct io_uring_sqe* sqe = uring_get_sqe(&ctx->uring->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = (uintptr_t)conn | UD_RECV;
+	conn->recv_armed = 1;
+	conn->io_inflight++;
+}
+
+static void uring_arm_pollout(worker_context_t* ctx, connection_t* conn) {
+	struct io_uring_sqe* sqe = uring_get_sqe(&ctx->uring->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = conn->fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = (uintptr_t)conn | UD_POLLOUT;
+	conn->io_inflight++;
+}
+
+// Queue the in-memory parts at the head of the response ring as one SENDMSG.
+// The memory they point into stays with conn until the completion, which
+// counts what was sent; a file range after them goes out with sendfile() as
+// before, once the ring send is done.
+static send_status_t uring_send_pending(worker_context_t* ctx, connection_t* conn) {
+	if (conn->send_armed) return SEND_QUEUED;
+
+	while (conn->resp_count > 0) {
+		response_t* head = &conn->responses[conn->resp_head];
+		if (head->header_sent < head->header_len || head->body_sent < head->body_len) {
+			int flags;
+			conn->send_msg = (struct msghdr){ .msg_iov = conn->send_iov };
+			conn->send_msg.msg_iovlen = http_gather_memory(conn, conn->send_iov, &flags);
+
+			struct io_uring_sqe* sqe = uring_get_sqe(&ctx->uring->ring);
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = conn->fd;
+			sqe->addr = (uintptr_t)&conn->send_msg;
+			sqe->len = 1;
+			sqe->msg_flags = flags | MSG_NOSIGNAL;
+			sqe->user_data = (uintptr_t)conn | UD_SEND;
+			conn->send_armed = 1;
+			conn->io_inflight++;
+			return SEND_QUEUED;
+		}
+
+		send_status_t status = http_send_file(conn, head->file_fd, &head->file_offset, head->file_end, head->use_sendfile);
+		if (status != SEND_DONE) return status;
+		// Nothing in memory is left of the head, so this only retires it.
+		http_memory_sent(conn, 0);
+	}
+	return SEND_DONE;
+}
+
+static void uring_cancel(worker_uring_t* wu, uint64_t user_data) {
+	struct io_uring_sqe* sqe = uring_get_sqe(&wu->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = user_data;
+	sqe->user_data = UD_IGNORE;
+}
+
+static void recycle_buffer(worker_uring_t* wu, unsigned bid) {
+	uring_recycle_buffer(&wu->ring, bid);
+	wu->recycled = true;
+}
+
+static void hold_buffer(worker_uring_t* wu, connection_t* conn, unsigned bid, unsigned len) {
+	wu->held_len[bid] = len;
+	if (conn->held_count++ == 0) {
+		conn->held_head = bid;
+		conn->held_off = 0;
+	} else {
+		wu->held_next[conn->held_tail] = bid;
+	}
+	conn->held_tail = bid;
+}
+
+static void drop_held(worker_uring_t* wu, connection_t* conn) {
+	conn->held_off = 0;
+	if (conn->held_count == 0) return;
+
+	recycle_buffer(wu, conn->held_head);
+	unsigned short bid = conn->held_head;
+	conn->held_head = wu->held_next[bid];
+	conn->held_count--;
+}
+
+static void uring_forget_connection(worker_context_t* ctx, connection_t* conn) {
+	worker_uring_t* wu = ctx->uring;
+	while (conn->held_count > 0) {
+		drop_held(wu, conn);
+	}
+	if (conn->recv_armed) uring_cancel(wu, (uintptr_t)conn | UD_RECV);
+	if (conn->write_pending) uring_cancel(wu, (uintptr_t)conn | UD_POLLOUT);
+	if (conn->send_armed) uring_cancel(wu, (uintptr_t)conn | UD_SEND);
+
+	for (connection_t** pp = &wu->starved; *pp; pp = &(*pp)->next_starved) {
+		if (*pp == conn) {
+			*pp = conn->next_starved;
+			break;
+		}
+	}
+}
+
+static int uring_fill_input(worker_context_t* ctx, connection_t* conn, bool* drained, bool* peer_closed) {
+	worker_uring_t* wu = ctx->uring;
+
+	while (conn->in_len < REQUEST_BUFFER_SIZE && conn->held_count > 0) {
+		if (connection_reserve_input(ctx->pools, conn) != 0) {
+			log_message(conn->client_ip, "ERROR: Worker %d: Out of memory for input buffer", ctx->worker_id);
+			return -1;
+		}
+		unsigned bid = conn->held_head;
+		size_t len = wu->held_len[bid] - conn->held_off;
+		if (len > conn->in_cap - conn->in_len) len = conn->in_cap - conn->in_len;
+		memcpy(conn->in_buf + conn->in_len, uring_buffer(&wu->ring, bid) + conn->held_off, len);
+		conn->in_len += len;
+		conn->held_off += len;
+		if (conn->held_off == wu->held_len[bid]) {
+			drop_held(wu, conn);
+		}
+	}
+
+	*drained = conn->held_count == 0;
+	*peer_closed = *drained && conn->peer_closed;
+	return 0;
+}
+
+// Returns true if conn is gone: it was closing and this was its last completion.
+static bool finish_op(worker_context_t* ctx, connection_t* conn) {
+	conn->io_inflight--;
+	if (conn->closing && conn->io_inflight == 0) {
+		connection_destroy(ctx->pools, conn);
+		return true;
+	}
+	return false;
+}
+
+static void handle_recv_completion(worker_context_t* ctx, connection_t* conn, const struct io_uring_cqe* cqe) {
+	worker_uring_t* wu = ctx->uring;
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (cqe->res > 0) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (conn->closing) {
+			recycle_buffer(wu, bid);
 		} else {
-			send_error_response(conn->fd,400);
-			should_close = true;
+			hold_buffer(wu, conn, bid, cqe->res);
 		}
 	}
+	if (!more) {
+		conn->recv_armed = 0;
+		if (finish_op(ctx, conn)) return;
+	}
+	if (conn->closing) return;
+
+	if (cqe->res == 0) {
+		conn->peer_closed = 1;
+	} else if (cqe->res == -ENOBUFS) {
+		// Every buffer is held by some connection; try again once one comes back.
+		conn->next_starved = wu->starved;
+		wu->starved = conn;
+	} else if (cqe->res < 0) {
+		close_connection(ctx, conn);
+		return;
+	} else if (!more) {
+		uring_arm_recv(ctx, conn);
+	}
 
-	if (should_close) {
+	// While a response is blocked or in flight, new requests wait in their buffers.
+	if (!conn->write_pending && !conn->send_armed) {
+		service_connection(ctx, conn);
+	}
+}
+
+static void handle_pollout_completion(worker_context_t* ctx, connection_t* conn, const struct io_uring_cqe* cqe) {
+	if (finish_op(ctx, conn) || conn->closing) return;
+	conn->write_pending = 0;
+
+	if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP))) {
 		close_connection(ctx, conn);
+		return;
+	}
+	if (resume_write(ctx, conn)) {
+		service_connection(ctx, conn);
 	}
 }
 
-static int make_socket_non_blocking(int fd) {
-	int flags = fcntl(fd, F_GETFL, 0);
-	if (flags == -1) {
-		log_message(NULL, "ERROR: fcntl(F_GETFL) failed");
-		return -1;
+static void handle_send_completion(worker_context_t* ctx, connection_t* conn, const struct io_uring_cqe* cqe) {
+	conn->send_armed = 0;
+	if (conn->closing) {
+		http_response_reset(conn);
 	}
-	flags |= O_NONBLOCK;
-	if (fcntl(fd, F_SETFL, flags) == -1) {
-		log_message(NULL, "ERROR: fcntl(F_SETFL) failed");
-		return -1;
+	if (finish_op(ctx, conn) || conn->closing) return;
+
+	if (cqe->res == -EAGAIN) {
+		// The socket is full: wait for room, then queue the rest again.
+		set_write_interest(ctx, conn, 1);
+		return;
 	}
-	return 0;
+	if (cqe->res < 0) {
+		if (cqe->res != -ECONNRESET && cqe->res != -EPIPE) {
+			log_message(conn->client_ip, "ERROR: Failed to write to socket: %s", strerror(-cqe->res));
+		}
+		close_connection(ctx, conn);
+		return;
+	}
+	metrics_bytes_sent(cqe->res);
+	http_memory_sent(conn, cqe->res);
+	if (resume_write(ctx, conn)) {
+		service_connection(ctx, conn);
+	}
+}
+
+static void uring_stop_accepting(worker_context_t* ctx) {
+	uring_cancel(ctx->uring, UD_ACCEPT);
+}
+
+static void handle_accept_completion(worker_context_t* ctx, const struct io_uring_cqe* cqe) {
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !ctx->draining) {
+		uring_arm_accept(ctx->uring, ctx->listen_fd);
+	}
+	if (cqe->res < 0) {
+		if (cqe->res != -EAGAIN && cqe->res != -ECANCELED) {
+			log_message(NULL, "ERROR: Worker %d: accept failed: %s", ctx->worker_id, strerror(-cqe->res));
+		}
+		return;
+	}
+
+	// A multishot accept has nowhere stable to put each peer address.
+	accepted_conn_t accepted;
+	socklen_t addr_len = sizeof(accepted.addr);
+	accepted.fd = cqe->res;
+	if (getpeername(accepted.fd, (struct sockaddr*)&accepted.addr, &addr_len) != 0) {
+		memset(&accepted.addr, 0, sizeof(accepted.addr));
+		accepted.addr.ss_family = AF_INET;
+	}
+	if (!admit_connection(ctx, &accepted)) return;
+	dispatch_load_add(ctx->worker_id, 1);
+	add_connection(ctx, &accepted);
+}
+
+static void handle_completion(worker_context_t* ctx, const struct io_uring_cqe* cqe) {
+	uint64_t user_data = cqe->user_data;
+	bool rearm = !(cqe->flags & IORING_CQE_F_MORE);
+
+	switch (user_data) {
+		case UD_QUEUE:
+			if (rearm) uring_arm_poll(ctx->uring, ctx->queue->event_fd, UD_QUEUE);
+			handle_queue_event(ctx);
+			return;
+		case UD_TIMER:
+			if (rearm) uring_arm_poll(ctx->uring, ctx->tw->timer_fd, UD_TIMER);
+			handle_timer_event(ctx);
+			return;
+		case UD_ACCEPT:
+			handle_accept_completion(ctx, cqe);
+			return;
+		case UD_IGNORE:
+			return;
+	}
+
+	connection_t* conn = (connection_t*)(uintptr_t)(user_data & ~(uint64_t)UD_OP_MASK);
+	switch (user_data & UD_OP_MASK) {
+		case UD_RECV:
+			handle_recv_completion(ctx, conn, cqe);
+			break;
+		case UD_SEND:
+			handle_send_completion(ctx, conn, cqe);
+			break;
+		default:
+			handle_pollout_completion(ctx, conn, cqe);
+			break;
+	}
+}
+
+/*
+ * Completion-driven variant of the epoll loop. Requests arrive through one
+ * multishot receive per connection into the ring's provided buffers, and new
+ * connections through a multishot accept (reuseport) or the handoff queue.
+ * Headers and in-memory bodies (cache hits, pack entries, errors) go out as
+ * ring sends; file bodies still use sendfile(), and a full socket is waited
+ * on with a POLLOUT poll.
+ */
+static void run_uring_loop(worker_context_t* ctx) {
+	worker_uring_t* wu = ctx->uring;
+
+	uring_arm_poll(wu, ctx->queue->event_fd, UD_QUEUE);
+	uring_arm_poll(wu, ctx->tw->timer_fd, UD_TIMER);
+	if (ctx->listen_fd >= 0) {
+		uring_arm_accept(wu, ctx->listen_fd);
+	}
+
+	while (!ctx->draining || ctx->num_connections > 0) {
+		if (uring_submit_and_wait(&wu->ring, 1) != 0) {
+			log_message(NULL, "ERROR: Worker %d: io_uring_enter failed: %s", ctx->worker_id, strerror(errno));
+			break;
+		}
+
+		struct io_uring_cqe* cqe;
+		while ((cqe = uring_peek_cqe(&wu->ring))) {
+			// Copy it out first: handlers queue new work, which may flush the ring.
+			struct io_uring_cqe done = *cqe;
+			uring_cqe_seen(&wu->ring);
+			handle_completion(ctx, &done);
+		}
+
+		if (wu->recycled && wu->starved) {
+			connection_t* starved = wu->starved;
+			wu->starved = NULL;
+			while (starved) {
+				connection_t* next = starved->next_starved;
+				uring_arm_recv(ctx, starved);
+				starved = next;
+			}
+		}
+		wu->recycled = false;
+
+		// No route_t is held across iterations.
+		routes_quiescent(ctx->worker_id);
+	}
+}
+
+#else
+
+static bool start_uring(worker_context_t* ctx) {
+	(void)ctx;
+	log_message(NULL, "WARN: Built without io_uring support (IO_URING=0)");
+	return false;
+}
+
+// Unreachable: ctx->uring is never set without io_uring support.
+static void run_uring_loop(worker_context_t* ctx) { (void)ctx; }
+static void stop_uring(worker_context_t* ctx) { (void)ctx; }
+static void uring_arm_recv(worker_context_t* ctx, connection_t* conn) { (void)ctx; (void)conn; }
+static void uring_arm_pollout(worker_context_t* ctx, connection_t* conn) { (void)ctx; (void)conn; }
+static send_status_t uring_send_pending(worker_context_t* ctx, connection_t* conn) {
+	(void)ctx;
+	(void)conn;
+	return SEND_ERROR;
 }
+static void uring_forget_connection(worker_context_t* ctx, connection_t* conn) { (void)ctx; (void)conn; }
+static void uring_stop_accepting(worker_context_t* ctx) { (void)ctx; }
+static int uring_fill_input(worker_context_t* ctx, connection_t* conn, bool* drained, bool* peer_closed) {
+	(void)ctx;
+	(void)conn;
+	(void)drained;
+	(void)peer_closed;
+	return -1;
+}
+
+#endif
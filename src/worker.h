@@ -1,12 +1,18 @@
 #pragma once
 
 #include "server.h"
+#include "queue.h"
 
 typedef struct {
 	int worker_id;
-	int pipe_read_fd;
+	spsc_queue_t* queue;
+	int listen_fd;
 	server_config* config;
 } worker_init_t;
 
 void* worker_thread_main(void* arg);
 
+// How long workers keep serving their open connections once their handoff
+// queue is closed; 0 closes them at once. Set before closing the queues.
+void worker_set_drain_timeout(int seconds);
+
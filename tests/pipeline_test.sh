@@ -0,0 +1,148 @@
+#!/bin/bash
+# Pipelined requests against a running ./server: each case writes a run of
+# requests on one connection, in pieces where a case needs it, and checks the
+# status lines that come back and whether the server closed the connection.
+# Request bodies must be skipped, never answered as requests of their own, and
+# a connection the client asks to close is closed once its answer is sent.
+#
+# Runs once per I/O backend; PIPELINE_TEST_PORT picks the port.
+
+set -uo pipefail
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SERVER="$ROOT/server"
+PORT=${PIPELINE_TEST_PORT:-18090}
+
+if [ ! -x "$SERVER" ]; then
+	echo "pipeline_test: $SERVER is missing; run make" >&2
+	exit 1
+fi
+
+WORKDIR=$(mktemp -d /tmp/server-pipeline.XXXXXX)
+SERVER_PID=
+cleanup() {
+	if [ -n "$SERVER_PID" ]; then
+		kill -INT "$SERVER_PID" 2>/dev/null || true
+		wait "$SERVER_PID" 2>/dev/null || true
+	fi
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+# A refused request closes the connection, maybe before the rest of it is sent.
+trap '' PIPE
+
+SITE="$WORKDIR/ssg_output"
+mkdir -p "$SITE"
+echo "home" > "$SITE/index.html"
+echo "about" > "$SITE/about.html"
+chmod -R a+rX "$WORKDIR"
+
+start_server() {
+	cat > "$WORKDIR/server.conf" <<EOF
+port = $PORT
+num_workers = 1
+document_root = $SITE
+log_file = $WORKDIR/server.log
+io_backend = $1
+EOF
+	(cd "$WORKDIR" && exec "$SERVER" -d > "$WORKDIR/stdout" 2>&1) &
+	SERVER_PID=$!
+	for _ in $(seq 1 50); do
+		if (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+			return
+		fi
+		sleep 0.1
+	done
+	echo "pipeline_test: server did not start; see below" >&2
+	tail -n 20 "$WORKDIR/server.log" "$WORKDIR/stdout" >&2 || true
+	exit 1
+}
+
+stop_server() {
+	kill -INT "$SERVER_PID" 2>/dev/null || true
+	wait "$SERVER_PID" 2>/dev/null || true
+	SERVER_PID=
+}
+
+failures=0
+cases=0
+
+# check NAME EXPECTED PIECE... sends each piece (printf %b escapes) with a pause
+# between them, then reads until the server closes or a second passes.
+# EXPECTED is the status codes in order, then "closed" or "open".
+check() {
+	local name=$1 expected=$2
+	shift 2
+	cases=$((cases + 1))
+
+	exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+	local first=1
+	for piece in "$@"; do
+		[ $first = 1 ] || sleep 0.2
+		first=0
+		printf '%b' "$piece" >&3 2>/dev/null
+	done
+	local reply state=closed
+	reply=$(timeout 1 cat <&3)
+	[ $? = 124 ] && state=open
+	exec 3>&-
+
+	# A connection the server closes must have said so in its last response.
+	if [ $state = closed ] && ! printf '%s' "$reply" | tr -d '\r' | grep -aq '^Connection: close$'; then
+		state="closed without Connection: close"
+	fi
+
+	local got
+	got="$(printf '%s' "$reply" | grep -ao '^HTTP/1\.1 [0-9]*' | cut -d' ' -f2 | tr '\n' ' ')$state"
+	if [ "$got" != "$expected" ]; then
+		failures=$((failures + 1))
+		echo "FAIL: $name ($BACKEND): got \"$got\", want \"$expected\""
+	fi
+}
+
+GET='GET / HTTP/1.1\r\nHost: localhost\r\n\r\n'
+ABOUT='GET /about HTTP/1.1\r\nHost: localhost\r\n\r\n'
+# A body that is itself a request for a page that does not exist.
+SMUGGLED='GET /missing HTTP/1.1\r\nHost: localhost\r\n\r\n'
+SMUGGLED_LEN=$(printf '%b' "$SMUGGLED" | wc -c)
+
+for BACKEND in epoll io_uring; do
+	start_server $BACKEND
+
+	check "pipelined" "200 200 200 open" "$GET$ABOUT$GET"
+	check "one byte at a time" "200 200 open" "GET / HTTP/1.1\r\n" "Host: localhost\r\n" "\r\n$ABOUT"
+
+	check "body skipped" "200 200 open" \
+		"GET / HTTP/1.1\r\nHost: localhost\r\nContent-Length: $SMUGGLED_LEN\r\n\r\n$SMUGGLED$ABOUT"
+	check "body in pieces" "200 200 open" \
+		"GET / HTTP/1.1\r\nContent-Length: $SMUGGLED_LEN\r\n\r\nGET /missing" " HTTP/1.1\r\nHost: localhost\r\n" "\r\n$ABOUT"
+	check "empty body" "200 200 open" "GET / HTTP/1.1\r\nContent-Length: 0\r\n\r\n$ABOUT"
+	check "same length twice" "200 200 open" \
+		"GET / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc$ABOUT"
+
+	check "transfer-encoding" "400 closed" \
+		"GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n$SMUGGLED"
+	check "length and transfer-encoding" "400 closed" \
+		"GET / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n$SMUGGLED"
+	check "conflicting lengths" "400 closed" \
+		"GET / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n$SMUGGLED"
+	check "malformed length" "400 closed" "GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n$SMUGGLED"
+	check "length too large" "413 closed" \
+		"GET / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n$SMUGGLED"
+	check "requests after a refusal" "200 400 closed" \
+		"$GET""GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n$ABOUT"
+
+	check "connection: close" "200 closed" "GET / HTTP/1.1\r\nConnection: close\r\n\r\n$ABOUT"
+	check "close in a list" "200 200 closed" "$GET""GET / HTTP/1.1\r\nConnection: TE, Close\r\n\r\n$ABOUT"
+	check "not found, close" "404 closed" "GET /missing HTTP/1.1\r\nConnection: close\r\n\r\n$ABOUT"
+	check "not modified, close" "304 closed" \
+		"GET / HTTP/1.1\r\nIf-None-Match: *\r\nConnection: close\r\n\r\n$ABOUT"
+	check "ranges, close" "206 closed" "GET / HTTP/1.1\r\nRange: bytes=0-0,2-2\r\nConnection: close\r\n\r\n$ABOUT"
+	check "http/1.0" "200 closed" "GET / HTTP/1.0\r\n\r\n$ABOUT"
+	check "http/1.0 keep-alive" "200 200 open" "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n$ABOUT"
+
+	stop_server
+done
+
+echo "pipeline_test: $cases cases, $failures failed"
+[ $failures = 0 ]
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "range.h"
+
+/*
+ * Edge cases of Range header parsing (RFC 9110 14.1.2, 14.2). Each case names
+ * the header, the size of the representation and what parse_ranges() must
+ * return: the satisfiable ranges, half-open, or RANGE_UNSATISFIABLE or
+ * RANGE_IGNORE.
+ */
+
+typedef struct {
+	const char* value;
+	off_t size;
+	int count;
+	byte_range_t ranges[HTTP_MAX_RANGES];
+} range_case_t;
+
+static const range_case_t cases[] = {
+	{ "bytes=0-99", 1000, 1, { { 0, 100 } } },
+	{ "bytes=500-", 1000, 1, { { 500, 1000 } } },
+	{ "bytes=-100", 1000, 1, { { 900, 1000 } } },
+	{ " BYTES = 0-0 ", 1000, 1, { { 0, 1 } } },
+	// A last byte past the end is cut to it.
+	{ "bytes=990-5000", 1000, 1, { { 990, 1000 } } },
+
+	// The last zero bytes are none at all.
+	{ "bytes=-0", 1000, RANGE_UNSATISFIABLE, { { 0, 0 } } },
+	// Nothing in an empty representation can be satisfied.
+	{ "bytes=0-", 0, RANGE_UNSATISFIABLE, { { 0, 0 } } },
+	{ "bytes=0-10", 0, RANGE_UNSATISFIABLE, { { 0, 0 } } },
+	{ "bytes=-5", 0, RANGE_UNSATISFIABLE, { { 0, 0 } } },
+	// A suffix longer than the representation is all of it.
+	{ "bytes=-5000", 1000, 1, { { 0, 1000 } } },
+	{ "bytes=1000-", 1000, RANGE_UNSATISFIABLE, { { 0, 0 } } },
+	{ "bytes=2000-3000,5000-", 1000, RANGE_UNSATISFIABLE, { { 0, 0 } } },
+	// Unsatisfiable ranges next to satisfiable ones are dropped.
+	{ "bytes=2000-3000,0-9", 1000, 1, { { 0, 10 } } },
+
+	// Malformed: the header is ignored and the whole representation sent.
+	{ "bytes=5-2", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "bytes=0-9,5-2", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "items=0-9", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "bytes=", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "bytes=-", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "bytes=a-9", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "bytes=0-9;x", 1000, RANGE_IGNORE, { { 0, 0 } } },
+	{ "bytes=99999999999999999999-", 1000, RANGE_IGNORE, { { 0, 0 } } },
+
+	// Up to HTTP_MAX_RANGES distinct ranges, in the order asked for.
+	{ "bytes=70-79,0-9,20-29", 1000, 3, { { 70, 80 }, { 0, 10 }, { 20, 30 } } },
+	{ "bytes=0-0,2-2,4-4,6-6,8-8,10-10,12-12,14-14", 1000, 8,
+		{ { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 8, 9 }, { 10, 11 }, { 12, 13 }, { 14, 15 } } },
+	{ "bytes=0-0,2-2,4-4,6-6,8-8,10-10,12-12,14-14,16-16", 1000, RANGE_IGNORE, { { 0, 0 } } },
+
+	// Overlapping and adjacent ranges are sent once.
+	{ "bytes=0-,0-,0-,0-,0-,0-,0-,0-", 1000, 1, { { 0, 1000 } } },
+	{ "bytes=0-,0-,0-,0-,0-,0-,0-,0-,0-,0-,0-,0-", 1000, 1, { { 0, 1000 } } },
+	{ "bytes=0-9,10-19", 1000, 1, { { 0, 20 } } },
+	{ "bytes=0-9,5-14,-990", 1000, 1, { { 0, 1000 } } },
+	{ "bytes=50-59,0-9,5-54", 1000, 1, { { 0, 60 } } },
+	{ "bytes=50-59,0-9,20-29,8-21", 1000, 2, { { 50, 60 }, { 0, 30 } } },
+	{ "bytes=0-0,2-2,4-4,6-6,8-8,10-10,12-12,14-14,0-15", 1000, 1, { { 0, 16 } } },
+};
+
+static int failures = 0;
+
+static void check_case(const range_case_t* c) {
+	byte_range_t ranges[HTTP_MAX_RANGES];
+	int count = parse_ranges(c->value, c->size, ranges);
+	int ok = count == c->count;
+	for (int i = 0; ok && i < count; i++) {
+		ok = ranges[i].start == c->ranges[i].start && ranges[i].end == c->ranges[i].end;
+	}
+	if (ok) return;
+
+	failures++;
+	printf("FAIL: \"%s\" of %ld bytes: got %d", c->value, (long)c->size, count);
+	for (int i = 0; i < count; i++) {
+		printf(" [%ld,%ld)", (long)ranges[i].start, (long)ranges[i].end);
+	}
+	printf(", want %d\n", c->count);
+}
+
+static void check_content_range(const byte_range_t* range, off_t size, const char* expected) {
+	char buf[CONTENT_RANGE_SIZE];
+	format_content_range(buf, sizeof(buf), range, size);
+	if (strcmp(buf, expected) == 0) return;
+	failures++;
+	printf("FAIL: Content-Range \"%s\", want \"%s\"\n", buf, expected);
+}
+
+int main(void) {
+	size_t num_cases = sizeof(cases) / sizeof(cases[0]);
+	for (size_t i = 0; i < num_cases; i++) {
+		check_case(&cases[i]);
+	}
+
+	// What a 416 says, and what a part says.
+	check_content_range(NULL, 1000, "bytes */1000");
+	check_content_range(NULL, 0, "bytes */0");
+	check_content_range(&(byte_range_t){ 0, 1 }, 1000, "bytes 0-0/1000");
+	check_content_range(&(byte_range_t){ 900, 1000 }, 1000, "bytes 900-999/1000");
+	off_t big = (off_t)1 << 62;
+	check_content_range(&(byte_range_t){ 0, big }, big, "bytes 0-4611686018427387903/4611686018427387904");
+
+	printf("range_test: %zu cases, %d failed\n", num_cases + 5, failures);
+	return failures == 0 ? 0 : 1;
+}
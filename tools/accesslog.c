@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <ftw.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "accesslog.h"
+#include "site.h"
+
+/*
+ * Offline access log decoder: turns the server's binary access log (see
+ * src/accesslog.h) into one text or CSV line per response. Records only carry
+ * a hash of each URI; given the site's document_root, the URIs it would serve
+ * are hashed the same way and printed by name.
+ *
+ * Several files, as left by rotation, are read in the order given; without
+ * any, the log is read from standard input.
+ */
+
+#define READ_BATCH 1024
+
+// URI names by id: open addressing, at most half full.
+static struct {
+	uint64_t* ids;
+	char** uris;
+	size_t mask;
+	size_t count;
+} names;
+
+static size_t root_len;
+static int csv = 0;
+
+static int add_name(uint64_t id, const char* uri, size_t len) {
+	if ((names.count + 1) * 2 > names.mask + 1) {
+		size_t capacity = names.ids ? (names.mask + 1) * 2 : 1024;
+		uint64_t* ids = calloc(capacity, sizeof(uint64_t));
+		char** uris = calloc(capacity, sizeof(char*));
+		if (!ids || !uris) {
+			free(ids);
+			free(uris);
+			return -1;
+		}
+		for (size_t i = 0; names.ids && i <= names.mask; i++) {
+			if (!names.uris[i]) continue;
+			size_t slot = names.ids[i] & (capacity - 1);
+			while (uris[slot]) slot = (slot + 1) & (capacity - 1);
+			ids[slot] = names.ids[i];
+			uris[slot] = names.uris[i];
+		}
+		free(names.ids);
+		free(names.uris);
+		names.ids = ids;
+		names.uris = uris;
+		names.mask = capacity - 1;
+	}
+
+	size_t slot = id & names.mask;
+	while (names.uris[slot]) {
+		if (names.ids[slot] == id) return 0;
+		slot = (slot + 1) & names.mask;
+	}
+	names.uris[slot] = strndup(uri, len);
+	if (!names.uris[slot]) return -1;
+	names.ids[slot] = id;
+	names.count++;
+	return 0;
+}
+
+static const char* name_of(uint64_t id) {
+	if (!names.ids) return NULL;
+	size_t slot = id & names.mask;
+	while (names.uris[slot]) {
+		if (names.ids[slot] == id) return names.uris[slot];
+		slot = (slot + 1) & names.mask;
+	}
+	return NULL;
+}
+
+static void emit_name(const char* uri, size_t len, void* arg) {
+	int* failed = arg;
+	char buf[PATH_MAX];
+	if (len >= sizeof(buf)) return;
+	memcpy(buf, uri, len);
+	buf[len] = '\0';
+	if (add_name(access_log_uri_id(buf), uri, len) != 0) *failed = 1;
+}
+
+static int failed_names = 0;
+
+static int walk_cb(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+	(void)sb;
+	(void)ftwbuf;
+	if (typeflag == FTW_F || typeflag == FTW_SL) {
+		site_file_uris(fpath + root_len, emit_name, &failed_names);
+	}
+	return failed_names;
+}
+
+static void swap_record(access_log_record_t* record) {
+	record->time_ns = __builtin_bswap64(record->time_ns);
+	record->uri_id = __builtin_bswap64(record->uri_id);
+	record->body_bytes = __builtin_bswap64(record->body_bytes);
+	record->latency_us = __builtin_bswap32(record->latency_us);
+	record->status = __builtin_bswap16(record->status);
+}
+
+static void print_record(const access_log_record_t* record) {
+	char client[INET6_ADDRSTRLEN];
+	static const uint8_t v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	if (memcmp(record->addr, v4_mapped, sizeof(v4_mapped)) == 0) {
+		inet_ntop(AF_INET, record->addr + 12, client, sizeof(client));
+	} else {
+		inet_ntop(AF_INET6, record->addr, client, sizeof(client));
+	}
+
+	time_t seconds = record->time_ns / 1000000000ull;
+	unsigned millis = (record->time_ns / 1000000ull) % 1000;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	char id[24];
+	const char* uri = record->uri_id ? name_of(record->uri_id) : "-";
+	if (!uri) {
+		snprintf(id, sizeof(id), "#%016llx", (unsigned long long)record->uri_id);
+		uri = id;
+	}
+	const char* protocol = record->flags & ACCESS_FLAG_HTTP2 ? "h2" : "http/1.1";
+	const char* tls = record->flags & ACCESS_FLAG_TLS ? "tls" : "plain";
+
+	if (csv) {
+		// URIs are the site's own file names or a hash; neither holds a quote.
+		printf("%s.%03uZ,%s,%u,%s,%s,\"%s\",%u,%llu,%u\n", when, millis, client, record->worker, protocol, tls, uri,
+				record->status, (unsigned long long)record->body_bytes, record->latency_us);
+	} else {
+		printf("%s.%03uZ %s w%u %s %s %s %u %llu %.3fms\n", when, millis, client, record->worker, protocol, tls, uri,
+				record->status, (unsigned long long)record->body_bytes, record->latency_us / 1000.0);
+	}
+}
+
+// Returns -1 if the input is not an access log.
+static int decode(FILE* in, const char* name) {
+	access_log_header_t header;
+	size_t got = fread(&header, 1, sizeof(header), in);
+	// An empty file is a log nothing was written to yet.
+	if (got == 0 && !ferror(in)) return 0;
+	if (got != sizeof(header)) {
+		fprintf(stderr, "Error: %s: truncated header\n", name);
+		return -1;
+	}
+	if (memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "Error: %s: not an access log\n", name);
+		return -1;
+	}
+	int swapped = header.byte_order != ACCESS_LOG_BYTE_ORDER;
+	size_t record_size = swapped ? __builtin_bswap32(header.record_size) : header.record_size;
+	// Newer servers may append fields; the known ones stay in front.
+	if (record_size < sizeof(access_log_record_t)) {
+		fprintf(stderr, "Error: %s: records of %zu bytes are too short\n", name, record_size);
+		return -1;
+	}
+
+	char* batch = malloc(record_size * READ_BATCH);
+	if (!batch) {
+		fprintf(stderr, "Error: out of memory\n");
+		return -1;
+	}
+	size_t count;
+	while ((count = fread(batch, record_size, READ_BATCH, in)) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			access_log_record_t record;
+			memcpy(&record, batch + i * record_size, sizeof(record));
+			if (swapped) swap_record(&record);
+			print_record(&record);
+		}
+	}
+	free(batch);
+	if (ferror(in)) {
+		fprintf(stderr, "Error: %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+			"Usage: %s [options] [file...]\n"
+			"  -r dir        document_root to name URIs from; otherwise they print as #hash\n"
+			"  -c            CSV with a header line instead of text\n",
+			prog);
+}
+
+int main(int argc, char* argv[]) {
+	const char* root_arg = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:ch")) != -1) {
+		switch (opt) {
+			case 'r': root_arg = optarg; break;
+			case 'c': csv = 1; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (root_arg) {
+		char root[PATH_MAX];
+		if (!realpath(root_arg, root)) {
+			fprintf(stderr, "Error: invalid document_root %s: %s\n", root_arg, strerror(errno));
+			return 1;
+		}
+		root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+		if (nftw(root, walk_cb, 16, 0) != 0 || failed_names) {
+			fprintf(stderr, "Error: cannot name the URIs under %s\n", root);
+			return 1;
+		}
+	}
+
+	if (csv) {
+		printf("time,client,worker,protocol,tls,uri,status,bytes,latency_us\n");
+	}
+	int result = 0;
+	if (optind == argc) {
+		result = decode(stdin, "stdin");
+	}
+	for (int i = optind; i < argc; i++) {
+		FILE* in = fopen(argv[i], "rb");
+		if (!in) {
+			fprintf(stderr, "Error: cannot open %s: %s\n", argv[i], strerror(errno));
+			result = -1;
+			continue;
+		}
+		if (decode(in, argv[i]) != 0) result = -1;
+		fclose(in);
+	}
+	return result == 0 ? 0 : 1;
+}
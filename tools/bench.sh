@@ -0,0 +1,150 @@
+#!/bin/bash
+# End-to-end benchmark: generate a synthetic site, start ./server on it, and run
+# tools/loadgen through a fixed set of scenarios. Prints one JSON object per
+# scenario on stdout; progress goes to stderr.
+#
+# Tunables (environment): BENCH_PORT, BENCH_WORKERS, BENCH_CONNS, BENCH_THREADS,
+# BENCH_DURATION, BENCH_WARMUP, BENCH_RATE, BENCH_BACKEND (epoll or io_uring).
+#
+# BENCH_TLS=1 adds HTTPS scenarios against a throwaway self-signed certificate,
+# once with kernel TLS allowed and once with every record written by SSL_write,
+# reporting handshake rates (full and resumed) and bulk throughput for both.
+
+set -euo pipefail
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SERVER="$ROOT/server"
+LOADGEN="$ROOT/tools/loadgen"
+
+PORT=${BENCH_PORT:-18080}
+WORKERS=${BENCH_WORKERS:-$(nproc)}
+CONNS=${BENCH_CONNS:-64}
+THREADS=${BENCH_THREADS:-2}
+DURATION=${BENCH_DURATION:-10}
+WARMUP=${BENCH_WARMUP:-2}
+RATE=${BENCH_RATE:-20000}
+BACKEND=${BENCH_BACKEND:-epoll}
+TLS=${BENCH_TLS:-0}
+
+for bin in "$SERVER" "$LOADGEN"; do
+	if [ ! -x "$bin" ]; then
+		echo "bench: $bin is missing; run make bench" >&2
+		exit 1
+	fi
+done
+
+WORKDIR=$(mktemp -d /tmp/server-bench.XXXXXX)
+SERVER_PID=
+cleanup() {
+	if [ -n "$SERVER_PID" ]; then
+		kill -INT "$SERVER_PID" 2>/dev/null || true
+		wait "$SERVER_PID" 2>/dev/null || true
+	fi
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# A small blog: pages reached through clean URLs, a stylesheet and script, and
+# images from thumbnails up to a large hero, so the mix covers the cache, the
+# sendfile path and everything between.
+SITE="$WORKDIR/ssg_output"
+mkdir -p "$SITE/posts" "$SITE/static" "$SITE/images"
+page() {
+	local title=$1 size=$2
+	{
+		printf '<!DOCTYPE html><html><head><title>%s</title></head><body>\n' "$title"
+		head -c "$size" /dev/zero | tr '\0' 'x' | fold -w 72
+		printf '\n</body></html>\n'
+	} > "$3"
+}
+page "home" 1024 "$SITE/index.html"
+for i in $(seq 1 20); do
+	page "post $i" 8192 "$SITE/posts/post-$i.html"
+done
+head -c 16384 /dev/zero | tr '\0' 'a' | fold -w 80 > "$SITE/static/app.css"
+head -c 65536 /dev/zero | tr '\0' 'b' | fold -w 80 > "$SITE/static/app.js"
+head -c 262144 /dev/urandom > "$SITE/images/photo.jpg"
+head -c 2097152 /dev/urandom > "$SITE/images/hero.jpg"
+# Workers serve it after dropping privileges.
+chmod -R a+rX "$WORKDIR"
+
+# Starts the server with the base configuration plus any lines given.
+start_server() {
+	{
+		cat <<EOF
+port = $PORT
+num_workers = $WORKERS
+document_root = $SITE
+log_file = $WORKDIR/server.log
+io_backend = $BACKEND
+metrics_uri = /metrics
+EOF
+		printf '%s\n' "$@"
+	} > "$WORKDIR/server.conf"
+
+	echo "bench: starting server on port $PORT ($WORKERS workers, $BACKEND)" >&2
+	(cd "$WORKDIR" && exec "$SERVER" -d > "$WORKDIR/stdout" 2>&1) &
+	SERVER_PID=$!
+
+	for _ in $(seq 1 50); do
+		if (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+			return
+		fi
+		if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+			echo "bench: server exited during startup; see below" >&2
+			tail -n 20 "$WORKDIR/server.log" "$WORKDIR/stdout" >&2 || true
+			SERVER_PID=
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+stop_server() {
+	kill -INT "$SERVER_PID" 2>/dev/null || true
+	wait "$SERVER_PID" 2>/dev/null || true
+	SERVER_PID=
+}
+
+start_server
+
+MIX="-u /index.html:50 -u /posts/post-1:15 -u /posts/post-7:10 -u /static/app.css:10 -u /static/app.js:8 -u /images/photo.jpg:5 -u /images/hero.jpg:2"
+COMMON="-p $PORT -c $CONNS -t $THREADS -d $DURATION -w $WARMUP"
+
+run() {
+	local name=$1
+	shift
+	echo "bench: $name" >&2
+	# shellcheck disable=SC2086
+	"$LOADGEN" $COMMON -n "$name" "$@"
+}
+
+run small-keepalive -u /index.html
+run small-pipelined -u /index.html -P 16
+run small-close -u /index.html -C
+# shellcheck disable=SC2086
+run mix-keepalive $MIX
+# shellcheck disable=SC2086
+run mix-fixed-rate $MIX -r "$RATE"
+
+[ "$TLS" = 1 ] || exit 0
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 \
+	-subj /CN=localhost -keyout "$WORKDIR/key.pem" -out "$WORKDIR/cert.pem" 2>/dev/null
+chmod a+r "$WORKDIR/key.pem"
+
+for ktls in 1 0; do
+	mode=$([ "$ktls" = 1 ] && echo ktls || echo userspace)
+	stop_server
+	start_server "tls_certificate = $WORKDIR/cert.pem" "tls_certificate_key = $WORKDIR/key.pem" "tls_ktls = $ktls"
+	run "tls-$mode-handshake-full" -s -C -u /index.html
+	run "tls-$mode-handshake-resumed" -s -R -C -u /index.html
+	run "tls-$mode-bulk" -s -u /images/hero.jpg
+	# shellcheck disable=SC2086
+	run "tls-$mode-mix-keepalive" -s $MIX
+	if [ "$ktls" = 1 ] && command -v curl > /dev/null; then
+		# Without the kernel's tls module every connection falls back to SSL_write.
+		offloaded=$(curl -sk "https://127.0.0.1:$PORT/metrics" | awk '/^garage_tls_kernel_send_total/ { n += $2 } END { print n + 0 }')
+		echo "bench: $offloaded connections used kernel TLS" >&2
+	fi
+done
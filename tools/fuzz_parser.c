@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+// The scanners are static; the parser is built into the fuzzer so each of them
+// can be checked against the scalar one.
+#include "parser.c"
+
+/*
+ * Fuzz target for http_parser_execute(). Every input is checked three ways:
+ *
+ *   - the SSE2 and AVX2 control-character scans stop where the scalar one does,
+ *     from every position a line can start at;
+ *   - parsing it in one call and parsing it as it arrives, a few bytes at a
+ *     time on the same parser, give the same result and the same views;
+ *   - a parsed head holds together: its views lie inside it, its request line
+ *     and header names are well formed, and the limits were kept.
+ *
+ * Built with FUZZ_LIBFUZZER this is a libFuzzer target. Otherwise it has a main
+ * of its own: given files (or "-" for stdin, as AFL runs it) it checks each of
+ * them, and without any it mutates a handful of requests for -runs=N inputs.
+ * A failing input is written to fuzz_parser-crash.bin before aborting.
+ */
+
+#define MAX_INPUT (HTTP_MAX_HEAD_SIZE * 2)
+
+static const uint8_t* current_input;
+static size_t current_size;
+
+static void fail(const char* what) {
+	fprintf(stderr, "fuzz_parser: %s (input of %zu bytes)\n", what, current_size);
+#ifndef FUZZ_LIBFUZZER
+	FILE* out = fopen("fuzz_parser-crash.bin", "wb");
+	if (out) {
+		fwrite(current_input, 1, current_size, out);
+		fclose(out);
+		fprintf(stderr, "fuzz_parser: input written to fuzz_parser-crash.bin\n");
+	}
+#endif
+	abort();
+}
+
+#define CHECK(cond) do { if (!(cond)) fail("check failed: " #cond); } while (0)
+
+static unsigned long results[PARSE_HEADERS_TOO_LARGE + 1];
+
+static void check_scanners(const char* buf, size_t len) {
+#ifdef PARSER_HAVE_X86
+	int sse2 = __builtin_cpu_supports("sse2");
+	int avx2 = __builtin_cpu_supports("avx2");
+	const char* end = buf + len;
+	const char* p = buf;
+	while (1) {
+		const char* expected = scan_ctl_scalar(p, end);
+		if (sse2) CHECK(scan_ctl_sse2(p, end) == expected);
+		if (avx2) CHECK(scan_ctl_avx2(p, end) == expected);
+		if (expected == end) break;
+		p = expected + 1;
+	}
+#else
+	(void)buf;
+	(void)len;
+#endif
+}
+
+static int slice_inside(http_slice_t slice, size_t head_len) {
+	return (size_t)slice.off + slice.len < head_len;
+}
+
+static void check_head(const http_parser_t* parser, const char* buf, size_t len) {
+	size_t head_len = parser->head_len;
+	CHECK(head_len > 0 && head_len <= len && head_len <= HTTP_MAX_HEAD_SIZE);
+	CHECK(parser->num_headers >= 0 && parser->num_headers <= HTTP_MAX_HEADERS);
+
+	CHECK(parser->method.len > 0 && slice_inside(parser->method, head_len));
+	CHECK(parser->uri.len > 0 && parser->uri.len <= HTTP_MAX_URI_SIZE && slice_inside(parser->uri, head_len));
+	CHECK(parser->version.len == 8 && slice_inside(parser->version, head_len));
+	CHECK(memcmp(buf + parser->version.off, "HTTP/1.", 7) == 0);
+	CHECK(parser->method.off + parser->method.len < parser->uri.off);
+	CHECK(parser->uri.off + parser->uri.len < parser->version.off);
+	CHECK(!memchr(buf + parser->method.off, ' ', parser->method.len));
+	CHECK(!memchr(buf + parser->uri.off, ' ', parser->uri.len));
+	for (size_t i = 0; i < parser->uri.len; i++) {
+		CHECK(!is_ctl((unsigned char)buf[parser->uri.off + i]));
+	}
+
+	for (int i = 0; i < parser->num_headers; i++) {
+		const http_header_t* header = &parser->headers[i];
+		CHECK(header->name.len > 0 && slice_inside(header->name, head_len) && slice_inside(header->value, head_len));
+		CHECK(header->name.off > parser->version.off);
+		for (size_t j = 0; j < header->name.len; j++) {
+			char c = buf[header->name.off + j];
+			CHECK(c != ' ' && c != '\t' && c != ':' && !is_ctl((unsigned char)c));
+		}
+		for (size_t j = 0; j < header->value.len; j++) {
+			CHECK(!is_ctl((unsigned char)buf[header->value.off + j]));
+		}
+		if (header->value.len > 0) {
+			char first = buf[header->value.off];
+			char last = buf[header->value.off + header->value.len - 1];
+			CHECK(first != ' ' && first != '\t' && last != ' ' && last != '\t');
+		}
+		// Views are NUL-terminated in place.
+		CHECK(buf[header->name.off + header->name.len] == '\0');
+		CHECK(buf[header->value.off + header->value.len] == '\0');
+	}
+	CHECK(buf[parser->uri.off + parser->uri.len] == '\0');
+	CHECK(buf[head_len - 1] == '\n');
+}
+
+static int same_slice(http_slice_t a, http_slice_t b) {
+	return a.off == b.off && a.len == b.len;
+}
+
+static void check_same(const http_parser_t* a, const http_parser_t* b) {
+	CHECK(a->head_len == b->head_len);
+	CHECK(a->num_headers == b->num_headers);
+	CHECK(same_slice(a->method, b->method) && same_slice(a->uri, b->uri) && same_slice(a->version, b->version));
+	for (int i = 0; i < a->num_headers; i++) {
+		CHECK(same_slice(a->headers[i].name, b->headers[i].name));
+		CHECK(same_slice(a->headers[i].value, b->headers[i].value));
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	if (size > MAX_INPUT) return 0;
+	current_input = data;
+	current_size = size;
+	if (scan_ctl == scan_ctl_scalar) http_parser_init();
+
+	check_scanners((const char*)data, size);
+
+	// An allocation of exactly the input, so reading past it is caught.
+	char* whole = malloc(size ? size : 1);
+	char* pieces = malloc(size ? size : 1);
+	if (!whole || !pieces) abort();
+	memcpy(whole, data, size);
+	memcpy(pieces, data, size);
+
+	http_parser_t one_call;
+	http_parser_reset(&one_call);
+	parse_result_t expected = http_parser_execute(&one_call, whole, size);
+	results[expected]++;
+	if (expected == PARSE_DONE) check_head(&one_call, whole, size);
+
+	// The same bytes as they might come off a socket: a read of 1 to 16 bytes
+	// at a time, sized from the input so a run can be replayed.
+	http_parser_t in_pieces;
+	http_parser_reset(&in_pieces);
+	parse_result_t result = PARSE_INCOMPLETE;
+	size_t len = 0;
+	while (len < size && result == PARSE_INCOMPLETE) {
+		len += 1 + (data[len] ^ len) % 16;
+		if (len > size) len = size;
+		result = http_parser_execute(&in_pieces, pieces, len);
+	}
+	CHECK(result == expected);
+	if (result == PARSE_DONE) check_same(&one_call, &in_pieces);
+
+	free(whole);
+	free(pieces);
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+static const char* const seeds[] = {
+	"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"If-None-Match: \"5f2b-18df3cab30397f95\"\r\n"
+	"Range: bytes=0-99,200-\r\n\r\n",
+	"\r\n\nGET /a?b=c HTTP/1.0\nHost:x\n\n",
+	"GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /b HTTP/1.1\r\nHost: x\r\n\r\n",
+	"HEAD /static/app.css HTTP/1.1\r\nHost: x\r\nX-Empty:\r\nX-Tabs:\t v \t\r\n\r\n",
+	"GET / HTTP/1.1\r\nHost: x\r\nUpgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQAoAAAAAIAAAAA\r\n\r\n",
+	"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",
+};
+
+static const char interesting[] = { '\r', '\n', '\0', ' ', '\t', ':', 0x7f, (char)0x80, (char)0xff, 0x1f, 'A' };
+
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static size_t insert(uint8_t* buf, size_t len, size_t at, const uint8_t* what, size_t n) {
+	if (len + n > MAX_INPUT) n = MAX_INPUT - len;
+	memmove(buf + at + n, buf + at, len - at);
+	memcpy(buf + at, what, n);
+	return len + n;
+}
+
+// A few random edits to a seed. Some of them grow the input in big steps, so
+// the URI, head size and header count limits are reached as well.
+static size_t mutate(uint8_t* buf) {
+	const char* seed = seeds[rng() % (sizeof(seeds) / sizeof(seeds[0]))];
+	size_t len = strlen(seed);
+	memcpy(buf, seed, len);
+
+	int edits = 1 + rng() % 8;
+	for (int i = 0; i < edits; i++) {
+		size_t at = len ? rng() % (len + 1) : 0;
+		switch (rng() % 8) {
+			case 0:
+				if (at < len) buf[at] ^= 1 << (rng() % 8);
+				break;
+			case 1:
+				if (at < len) buf[at] = interesting[rng() % sizeof(interesting)];
+				break;
+			case 2:
+				len = insert(buf, len, at, (const uint8_t*)&interesting[rng() % sizeof(interesting)], 1);
+				break;
+			case 3:
+				if (at < len) {
+					size_t n = 1 + rng() % (len - at);
+					memmove(buf + at, buf + at + n, len - at - n);
+					len -= n;
+				}
+				break;
+			case 4: {
+				// Repeat a stretch, as in many copies of one header line.
+				if (at == len) break;
+				size_t n = 1 + rng() % (len - at < 64 ? len - at : 64);
+				uint8_t chunk[64];
+				memcpy(chunk, buf + at, n);
+				int copies = 1 + rng() % 48;
+				for (int c = 0; c < copies; c++) len = insert(buf, len, at, chunk, n);
+				break;
+			}
+			case 5: {
+				// A long run of one byte: an overlong URI, value or line.
+				static uint8_t run[HTTP_MAX_HEAD_SIZE + 64];
+				size_t n = rng() % sizeof(run);
+				memset(run, rng() % 2 ? 'A' : ' ', n);
+				len = insert(buf, len, at, run, n);
+				break;
+			}
+			case 6:
+				len = at;
+				break;
+			default: {
+				static const char* const lines[] = { "\r\n", "X: y\r\n", "\r\n\r\n", ": v\r\n", "N:\r\n" };
+				const char* line = lines[rng() % (sizeof(lines) / sizeof(lines[0]))];
+				len = insert(buf, len, at, (const uint8_t*)line, strlen(line));
+				break;
+			}
+		}
+	}
+	return len;
+}
+
+static int run_file(const char* path) {
+	FILE* in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return -1;
+	}
+	static uint8_t buf[MAX_INPUT + 1];
+	size_t len = fread(buf, 1, sizeof(buf), in);
+	if (in != stdin) fclose(in);
+	LLVMFuzzerTestOneInput(buf, len);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned long runs = 100000;
+	rng_state = (uint64_t)time(NULL) | 1;
+	int files = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-runs=", 6) == 0) {
+			runs = strtoul(argv[i] + 6, NULL, 10);
+		} else if (strncmp(argv[i], "-seed=", 6) == 0) {
+			rng_state = strtoull(argv[i] + 6, NULL, 10) | 1;
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			fprintf(stderr, "Usage: %s [-runs=N] [-seed=N] [file...]\n", argv[0]);
+			return 1;
+		} else {
+			if (run_file(argv[i]) != 0) return 1;
+			files++;
+		}
+	}
+	if (files > 0) return 0;
+
+	printf("fuzz_parser: seed %llu\n", (unsigned long long)rng_state);
+	static uint8_t buf[MAX_INPUT];
+	for (unsigned long i = 0; i < runs; i++) {
+		LLVMFuzzerTestOneInput(buf, mutate(buf));
+	}
+	printf("fuzz_parser: %lu inputs: %lu done, %lu incomplete, %lu bad request (400), %lu URI too long (414), %lu headers too large (431)\n",
+			runs, results[PARSE_DONE], results[PARSE_INCOMPLETE], results[PARSE_BAD_REQUEST],
+			results[PARSE_URI_TOO_LONG], results[PARSE_HEADERS_TOO_LARGE]);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,829 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/*
+ * HTTP/1.1 load generator for the server. Each thread runs its own epoll loop
+ * over its share of the connections and records latencies into a log-linear
+ * histogram; the totals are printed as one line of JSON on stdout.
+ *
+ * Closed loop (the default) keeps -P requests in flight per connection and
+ * times each from when it was written. With -r, requests are scheduled at a
+ * fixed rate instead and timed from when they were due, so a stalled server
+ * is charged for the requests it held up (no coordinated omission).
+ *
+ * With -s every connection speaks TLS and starts with a handshake, which
+ * together with -C measures the handshake rate. -R offers each connection's
+ * last session when it reconnects, so those handshakes are resumptions.
+ */
+
+#define MAX_URLS 32
+#define MAX_DEPTH 64
+#define REQUEST_MAX 512
+#define HEADER_MAX 8192
+#define READ_CHUNK (64 << 10)
+#define RETRY_NS 100000000ull
+
+// Microsecond latency buckets: exact below HIST_EXACT, then HIST_SUB per power
+// of two (about 3% apart), up to 2^HIST_MAX_EXP microseconds.
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_EXACT (2 * HIST_SUB)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+typedef struct {
+	char path[256];
+	unsigned weight;
+	char request[REQUEST_MAX];
+	size_t request_len;
+} url_t;
+
+typedef struct {
+	const char* name;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	const char* host;
+	int connections;
+	int threads;
+	double duration;
+	double warmup;
+	int depth;
+	int keepalive;
+	double rate;
+	bool tls;
+	bool resume;
+#ifdef HAVE_TLS
+	SSL_CTX* tls_ctx;
+#endif
+	url_t urls[MAX_URLS];
+	int num_urls;
+	unsigned total_weight;
+} options_t;
+
+typedef struct {
+	int fd;
+	bool connecting;
+	bool handshaking;
+	uint64_t retry_at;
+#ifdef HAVE_TLS
+	SSL* ssl;
+	SSL_SESSION* session; // offered on the next connect with -R
+#endif
+
+	char out[MAX_DEPTH * REQUEST_MAX];
+	size_t out_len;
+	size_t out_off;
+	bool want_out;
+
+	uint64_t started[MAX_DEPTH]; // ring of in-flight requests
+	int head;
+	int inflight;
+
+	char header[HEADER_MAX + 1];
+	size_t header_len;
+	long body_left;
+	int status;
+	bool server_closes; // the last response said Connection: close
+} client_t;
+
+typedef struct {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+} histogram_t;
+
+typedef struct {
+	const options_t* opts;
+	int id;
+	int num_clients;
+	client_t* clients;
+	int epoll_fd;
+	uint64_t rng;
+
+	uint64_t start_ns;
+	uint64_t measure_ns;
+	uint64_t end_ns;
+	double rate; // this thread's share, requests per second
+	uint64_t next_seq;
+
+	histogram_t hist;
+	uint64_t bytes;
+	uint64_t status_class[6]; // index 1-5: 1xx..5xx
+	uint64_t handshakes;
+	uint64_t resumed;
+	uint64_t connect_errors;
+	uint64_t io_errors;
+	uint64_t parse_errors;
+	uint64_t backlog;
+} thread_state_t;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t us) {
+	if (us < HIST_EXACT) return (int)us;
+	int exp = 63 - __builtin_clzll(us);
+	if (exp > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+	int sub = (us >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// Exclusive upper bound of a bucket, in microseconds.
+static uint64_t hist_bucket_limit(int bucket) {
+	if (bucket < HIST_EXACT) return bucket + 1;
+	int exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	int sub = bucket % HIST_SUB;
+	return (uint64_t)(HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS);
+}
+
+static void hist_record(histogram_t* hist, uint64_t us) {
+	hist->buckets[hist_bucket(us)]++;
+	hist->count++;
+	hist->sum_us += us;
+	if (us > hist->max_us) hist->max_us = us;
+}
+
+static uint64_t hist_percentile(const histogram_t* hist, double q) {
+	if (hist->count == 0) return 0;
+	uint64_t rank = (uint64_t)(q * hist->count + 0.999999);
+	if (rank == 0) rank = 1;
+	uint64_t seen = 0;
+	for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+		seen += hist->buckets[bucket];
+		if (seen >= rank) {
+			uint64_t limit = hist_bucket_limit(bucket) - 1;
+			return limit < hist->max_us ? limit : hist->max_us;
+		}
+	}
+	return hist->max_us;
+}
+
+static uint64_t next_random(thread_state_t* ts) {
+	ts->rng ^= ts->rng << 13;
+	ts->rng ^= ts->rng >> 7;
+	ts->rng ^= ts->rng << 17;
+	return ts->rng;
+}
+
+static const url_t* pick_url(thread_state_t* ts) {
+	const options_t* opts = ts->opts;
+	if (opts->num_urls == 1) return &opts->urls[0];
+	unsigned r = next_random(ts) % opts->total_weight;
+	for (int i = 0; i < opts->num_urls; i++) {
+		if (r < opts->urls[i].weight) return &opts->urls[i];
+		r -= opts->urls[i].weight;
+	}
+	return &opts->urls[opts->num_urls - 1];
+}
+
+static void set_interest(thread_state_t* ts, client_t* c, bool want_out) {
+	if (c->want_out == want_out) return;
+	struct epoll_event event = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c };
+	epoll_ctl(ts->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+	c->want_out = want_out;
+}
+
+static void client_reset(client_t* c) {
+	c->fd = -1;
+	c->connecting = false;
+	c->handshaking = false;
+	c->out_len = 0;
+	c->out_off = 0;
+	c->want_out = false;
+	c->head = 0;
+	c->inflight = 0;
+	c->header_len = 0;
+	c->body_left = -1;
+	c->server_closes = false;
+}
+
+static void client_close(thread_state_t* ts, client_t* c) {
+#ifdef HAVE_TLS
+	if (c->ssl) {
+		// Keep the newest session (TLS 1.3 tickets arrive after the handshake).
+		if (ts->opts->resume && SSL_is_init_finished(c->ssl)) {
+			SSL_SESSION* session = SSL_get1_session(c->ssl);
+			if (session) {
+				SSL_SESSION_free(c->session);
+				c->session = session;
+			}
+		}
+		// Quiet shutdown: nothing is sent, but OpenSSL no longer counts the
+		// connection as failed, which would make its session unresumable.
+		SSL_shutdown(c->ssl);
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+#else
+	(void)ts;
+#endif
+	close(c->fd);
+	c->fd = -1;
+}
+
+#ifdef HAVE_TLS
+// Maps an SSL_read()/SSL_write() failure onto read()/write() conventions.
+static ssize_t tls_failed(client_t* c, int result) {
+	int err = SSL_get_error(c->ssl, result);
+	ERR_clear_error();
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (err == SSL_ERROR_ZERO_RETURN) return 0;
+	if (err != SSL_ERROR_SYSCALL || errno == 0) errno = EPROTO;
+	return -1;
+}
+#endif
+
+static ssize_t client_read(client_t* c, char* buffer, size_t len) {
+#ifdef HAVE_TLS
+	if (c->ssl) {
+		errno = 0;
+		int n = SSL_read(c->ssl, buffer, len);
+		return n > 0 ? n : tls_failed(c, n);
+	}
+#endif
+	return read(c->fd, buffer, len);
+}
+
+static ssize_t client_write(client_t* c, const char* data, size_t len) {
+#ifdef HAVE_TLS
+	if (c->ssl) {
+		errno = 0;
+		int n = SSL_write(c->ssl, data, len);
+		return n > 0 ? n : tls_failed(c, n);
+	}
+#endif
+	return write(c->fd, data, len);
+}
+
+// Returns 1 once the handshake is done, 0 while it waits on the socket.
+static int client_handshake(thread_state_t* ts, client_t* c, uint64_t now) {
+#ifdef HAVE_TLS
+	if (!c->ssl) {
+		c->ssl = SSL_new(ts->opts->tls_ctx);
+		if (!c->ssl || SSL_set_fd(c->ssl, c->fd) != 1) return -1;
+		SSL_set_connect_state(c->ssl);
+		SSL_set_tlsext_host_name(c->ssl, ts->opts->host);
+		if (c->session) SSL_set_session(c->ssl, c->session);
+	}
+	int result = SSL_do_handshake(c->ssl);
+	if (result == 1) {
+		c->handshaking = false;
+		if (now >= ts->measure_ns && now <= ts->end_ns) {
+			ts->handshakes++;
+			if (SSL_session_reused(c->ssl)) ts->resumed++;
+		}
+		return 1;
+	}
+	int err = SSL_get_error(c->ssl, result);
+	ERR_clear_error();
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+		set_interest(ts, c, err == SSL_ERROR_WANT_WRITE);
+		return 0;
+	}
+	return -1;
+#else
+	(void)ts;
+	(void)c;
+	(void)now;
+	return -1;
+#endif
+}
+
+static void client_connect(thread_state_t* ts, client_t* c) {
+	const options_t* opts = ts->opts;
+	client_reset(c);
+	c->fd = socket(opts->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) {
+		ts->connect_errors++;
+		c->retry_at = now_ns() + RETRY_NS;
+		return;
+	}
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(c->fd, (struct sockaddr*)&opts->addr, opts->addr_len) != 0 && errno != EINPROGRESS) {
+		ts->connect_errors++;
+		close(c->fd);
+		c->fd = -1;
+		c->retry_at = now_ns() + RETRY_NS;
+		return;
+	}
+	c->connecting = true;
+	c->want_out = true;
+	struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+	epoll_ctl(ts->epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+// Requests still in flight on a failed connection are lost, not timed.
+static void client_fail(thread_state_t* ts, client_t* c, uint64_t now) {
+	if (c->inflight > 0) ts->io_errors += c->inflight;
+	client_close(ts, c);
+	c->retry_at = now + RETRY_NS;
+}
+
+static int flush_output(thread_state_t* ts, client_t* c) {
+	while (c->out_off < c->out_len) {
+		ssize_t n = client_write(c, c->out + c->out_off, c->out_len - c->out_off);
+		if (n > 0) {
+			c->out_off += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			set_interest(ts, c, true);
+			return 0;
+		} else {
+			return -1;
+		}
+	}
+	c->out_len = 0;
+	c->out_off = 0;
+	set_interest(ts, c, false);
+	return 0;
+}
+
+// Fill the connection's pipeline: up to depth requests in flight, and in
+// fixed-rate mode only requests whose scheduled time has come.
+static int client_fill(thread_state_t* ts, client_t* c, uint64_t now, uint64_t due) {
+	const options_t* opts = ts->opts;
+	int depth = opts->keepalive ? opts->depth : 1;
+	bool queued = false;
+
+	if (c->out_off > 0) {
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	while (c->inflight < depth) {
+		uint64_t started = now;
+		if (ts->rate > 0) {
+			if (ts->next_seq >= due) break;
+			started = ts->start_ns + (uint64_t)(ts->next_seq * 1e9 / ts->rate);
+			ts->next_seq++;
+		}
+		const url_t* url = pick_url(ts);
+		memcpy(c->out + c->out_len, url->request, url->request_len);
+		c->out_len += url->request_len;
+		c->started[(c->head + c->inflight) % MAX_DEPTH] = started;
+		c->inflight++;
+		queued = true;
+		if (!opts->keepalive) break;
+	}
+	if (!queued || c->want_out) return 0;
+	return flush_output(ts, c);
+}
+
+static int parse_header(thread_state_t* ts, client_t* c) {
+	c->header[c->header_len] = '\0';
+	if (c->header_len < 12 || strncmp(c->header, "HTTP/1.", 7) != 0) {
+		ts->parse_errors++;
+		return -1;
+	}
+	c->status = atoi(c->header + 9);
+	c->body_left = 0;
+
+	const char* line = c->header;
+	while ((line = strstr(line, "\r\n")) != NULL) {
+		line += 2;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			c->body_left = atol(line + 15);
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			const char* value = line + 11;
+			while (*value == ' ') value++;
+			if (strncasecmp(value, "close", 5) == 0) c->server_closes = true;
+		}
+	}
+	return 0;
+}
+
+static void complete_response(thread_state_t* ts, client_t* c, uint64_t now) {
+	uint64_t started = c->started[c->head];
+	c->head = (c->head + 1) % MAX_DEPTH;
+	c->inflight--;
+	c->header_len = 0;
+	c->body_left = -1;
+
+	if (started >= ts->measure_ns && now <= ts->end_ns) {
+		hist_record(&ts->hist, (now - started) / 1000);
+		if (c->status >= 100 && c->status < 600) ts->status_class[c->status / 100]++;
+	}
+}
+
+// Walk the bytes read, which may hold any number of pipelined responses and
+// end partway through one.
+static int consume(thread_state_t* ts, client_t* c, const char* data, size_t len, uint64_t now) {
+	size_t off = 0;
+	while (off < len) {
+		if (c->inflight == 0) {
+			ts->parse_errors++;
+			return -1;
+		}
+		if (c->body_left >= 0) {
+			size_t take = len - off;
+			if ((long)take > c->body_left) take = c->body_left;
+			c->body_left -= take;
+			off += take;
+			if (c->body_left == 0) complete_response(ts, c, now);
+			continue;
+		}
+
+		size_t scan_from = c->header_len > 3 ? c->header_len - 3 : 0;
+		size_t take = len - off;
+		if (take > HEADER_MAX - c->header_len) take = HEADER_MAX - c->header_len;
+		memcpy(c->header + c->header_len, data + off, take);
+		c->header_len += take;
+
+		char* end = memmem(c->header + scan_from, c->header_len - scan_from, "\r\n\r\n", 4);
+		if (!end) {
+			if (c->header_len == HEADER_MAX) {
+				ts->parse_errors++;
+				return -1;
+			}
+			off += take;
+			continue;
+		}
+		size_t header_end = end + 4 - c->header;
+		off += take - (c->header_len - header_end);
+		c->header_len = header_end;
+		if (parse_header(ts, c) != 0) return -1;
+		if (c->body_left == 0) complete_response(ts, c, now);
+	}
+	return 0;
+}
+
+static void handle_event(thread_state_t* ts, client_t* c, uint32_t events, char* buffer, uint64_t now, uint64_t due) {
+	const options_t* opts = ts->opts;
+
+	if (c->connecting) {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+		if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+			ts->connect_errors++;
+			client_fail(ts, c, now);
+			return;
+		}
+		c->connecting = false;
+		set_interest(ts, c, false);
+		if (!opts->tls) {
+			if (client_fill(ts, c, now, due) != 0) client_fail(ts, c, now);
+			return;
+		}
+		c->handshaking = true;
+	}
+	if (c->handshaking) {
+		int done = client_handshake(ts, c, now);
+		if (done < 0) {
+			ts->connect_errors++;
+			client_fail(ts, c, now);
+		} else if (done > 0) {
+			set_interest(ts, c, false);
+			if (client_fill(ts, c, now, due) != 0) client_fail(ts, c, now);
+		}
+		return;
+	}
+
+	if ((events & EPOLLOUT) && c->want_out && flush_output(ts, c) != 0) {
+		client_fail(ts, c, now);
+		return;
+	}
+	if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+
+	while (1) {
+		ssize_t n = client_read(c, buffer, READ_CHUNK);
+		if (n > 0) {
+			if (now >= ts->measure_ns) ts->bytes += n;
+			if (consume(ts, c, buffer, n, now) != 0) {
+				client_fail(ts, c, now);
+				return;
+			}
+			// SSL_read() returns a record at a time; only EAGAIN says it is drained.
+			if (n < READ_CHUNK && !opts->tls) break;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else if (n == 0 && c->inflight == 0) {
+			// An idle connection closed by the server; nothing was lost.
+			client_close(ts, c);
+			client_connect(ts, c);
+			return;
+		} else {
+			// The server closed or reset the connection under us.
+			client_fail(ts, c, now);
+			return;
+		}
+	}
+
+	if ((!opts->keepalive && c->inflight == 0) || c->server_closes) {
+		// Anything pipelined behind a Connection: close response is dropped.
+		ts->io_errors += c->inflight;
+		client_close(ts, c);
+		client_connect(ts, c);
+		return;
+	}
+	if (client_fill(ts, c, now, due) != 0) client_fail(ts, c, now);
+}
+
+// Scheduled requests whose time has come, in fixed-rate mode.
+static uint64_t due_requests(thread_state_t* ts, uint64_t now) {
+	if (ts->rate <= 0) return 0;
+	return (uint64_t)((now - ts->start_ns) / 1e9 * ts->rate) + 1;
+}
+
+static void* run_thread(void* arg) {
+	thread_state_t* ts = arg;
+	struct epoll_event events[256];
+	char* buffer = malloc(READ_CHUNK);
+	if (!buffer) return NULL;
+
+	for (int i = 0; i < ts->num_clients; i++) {
+		client_connect(ts, &ts->clients[i]);
+	}
+
+	int cursor = 0;
+	while (1) {
+		uint64_t now = now_ns();
+		if (now >= ts->end_ns) break;
+		uint64_t due = due_requests(ts, now);
+
+		// Reconnect what failed, and hand out scheduled requests that are due,
+		// starting somewhere new each time so no connection is favoured.
+		bool any_down = false;
+		for (int k = 0; k < ts->num_clients; k++) {
+			client_t* c = &ts->clients[(cursor + k) % ts->num_clients];
+			if (c->fd < 0) {
+				if (now >= c->retry_at) client_connect(ts, c);
+				else any_down = true;
+			} else if (ts->rate > 0 && ts->next_seq < due && !c->connecting && !c->handshaking) {
+				if (client_fill(ts, c, now, due) != 0) client_fail(ts, c, now);
+			}
+		}
+		if (ts->num_clients > 0) cursor = (cursor + 1) % ts->num_clients;
+
+		// Fixed-rate sends need a finer wakeup than epoll_wait's milliseconds.
+		uint64_t timeout_ns = any_down ? 10000000ull : 100000000ull;
+		if (ts->rate > 0) {
+			uint64_t next_due = ts->start_ns + (uint64_t)(due * 1e9 / ts->rate);
+			timeout_ns = next_due > now ? next_due - now : 0;
+		}
+		struct timespec timeout = { timeout_ns / 1000000000ull, timeout_ns % 1000000000ull };
+		int n = epoll_pwait2(ts->epoll_fd, events, 256, &timeout, NULL);
+		now = now_ns();
+		due = due_requests(ts, now);
+		for (int i = 0; i < n; i++) {
+			client_t* c = events[i].data.ptr;
+			if (c->fd >= 0) handle_event(ts, c, events[i].events, buffer, now, due);
+		}
+	}
+
+	if (ts->rate > 0) {
+		uint64_t due = due_requests(ts, ts->end_ns - 1);
+		ts->backlog = due > ts->next_seq ? due - ts->next_seq : 0;
+	}
+	for (int i = 0; i < ts->num_clients; i++) {
+		client_t* c = &ts->clients[i];
+		if (c->fd >= 0) client_close(ts, c);
+#ifdef HAVE_TLS
+		SSL_SESSION_free(c->session);
+#endif
+	}
+	free(buffer);
+	return NULL;
+}
+
+static int add_url(options_t* opts, const char* spec) {
+	if (opts->num_urls == MAX_URLS) {
+		fprintf(stderr, "Error: at most %d -u paths\n", MAX_URLS);
+		return -1;
+	}
+	url_t* url = &opts->urls[opts->num_urls];
+	const char* colon = strrchr(spec, ':');
+	size_t path_len = colon ? (size_t)(colon - spec) : strlen(spec);
+	if (path_len == 0 || path_len >= sizeof(url->path) || spec[0] != '/') {
+		fprintf(stderr, "Error: bad path '%s'\n", spec);
+		return -1;
+	}
+	memcpy(url->path, spec, path_len);
+	url->path[path_len] = '\0';
+	url->weight = colon ? (unsigned)atoi(colon + 1) : 1;
+	if (url->weight == 0) {
+		fprintf(stderr, "Error: weight must be positive in '%s'\n", spec);
+		return -1;
+	}
+	opts->total_weight += url->weight;
+	opts->num_urls++;
+	return 0;
+}
+
+static int build_requests(options_t* opts) {
+	for (int i = 0; i < opts->num_urls; i++) {
+		url_t* url = &opts->urls[i];
+		int len = snprintf(url->request, sizeof(url->request),
+				"GET %s HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"%s\r\n",
+				url->path, opts->host, opts->keepalive ? "" : "Connection: close\r\n");
+		if (len >= (int)sizeof(url->request)) return -1;
+		url->request_len = len;
+	}
+	return 0;
+}
+
+static int resolve(options_t* opts, const char* port) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* result;
+	int err = getaddrinfo(opts->host, port, &hints, &result);
+	if (err != 0) {
+		fprintf(stderr, "Error: cannot resolve %s: %s\n", opts->host, gai_strerror(err));
+		return -1;
+	}
+	memcpy(&opts->addr, result->ai_addr, result->ai_addrlen);
+	opts->addr_len = result->ai_addrlen;
+	freeaddrinfo(result);
+	return 0;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -H host       server address (127.0.0.1)\n"
+			"  -p port       server port (8080)\n"
+			"  -c conns      concurrent connections (16)\n"
+			"  -t threads    generator threads (1)\n"
+			"  -d seconds    measured duration (10)\n"
+			"  -w seconds    warm-up before measuring (1)\n"
+			"  -P depth      pipelined requests per connection (1, max %d)\n"
+			"  -C            one request per connection (Connection: close)\n"
+			"  -r rate       fixed total request rate per second (closed loop if unset)\n"
+			"  -u path[:w]   request path with relative weight; repeatable (/)\n"
+			"  -s            HTTPS (the server's certificate is not verified)\n"
+			"  -R            with -s, resume the previous session on reconnect\n"
+			"  -n name       label for the JSON result\n",
+			prog, MAX_DEPTH);
+}
+
+int main(int argc, char* argv[]) {
+	options_t opts = {
+		.name = "",
+		.host = "127.0.0.1",
+		.connections = 16,
+		.threads = 1,
+		.duration = 10,
+		.warmup = 1,
+		.depth = 1,
+		.keepalive = 1,
+		.rate = 0
+	};
+	const char* port = "8080";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:t:d:w:P:Cr:u:sRn:h")) != -1) {
+		switch (opt) {
+			case 'H': opts.host = optarg; break;
+			case 'p': port = optarg; break;
+			case 'c': opts.connections = atoi(optarg); break;
+			case 't': opts.threads = atoi(optarg); break;
+			case 'd': opts.duration = atof(optarg); break;
+			case 'w': opts.warmup = atof(optarg); break;
+			case 'P': opts.depth = atoi(optarg); break;
+			case 'C': opts.keepalive = 0; break;
+			case 'r': opts.rate = atof(optarg); break;
+			case 'u': if (add_url(&opts, optarg) != 0) return 1; break;
+			case 's': opts.tls = true; break;
+			case 'R': opts.resume = true; break;
+			case 'n': opts.name = optarg; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (opts.num_urls == 0) add_url(&opts, "/");
+	if (opts.connections < 1 || opts.threads < 1 || opts.duration <= 0 || opts.warmup < 0 ||
+			opts.depth < 1 || opts.depth > MAX_DEPTH || opts.rate < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (opts.threads > opts.connections) opts.threads = opts.connections;
+	if (resolve(&opts, port) != 0) return 1;
+	if (opts.tls) {
+#ifdef HAVE_TLS
+		opts.tls_ctx = SSL_CTX_new(TLS_client_method());
+		if (!opts.tls_ctx) {
+			fprintf(stderr, "Error: cannot create the TLS context\n");
+			return 1;
+		}
+		SSL_CTX_set_verify(opts.tls_ctx, SSL_VERIFY_NONE, NULL);
+		SSL_CTX_set_quiet_shutdown(opts.tls_ctx, 1);
+		SSL_CTX_set_session_cache_mode(opts.tls_ctx, opts.resume ? SSL_SESS_CACHE_CLIENT : SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_mode(opts.tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#else
+		fprintf(stderr, "Error: built without OpenSSL (TLS=0); -s is unavailable\n");
+		return 1;
+#endif
+	}
+	if (build_requests(&opts) != 0) {
+		fprintf(stderr, "Error: request line too long\n");
+		return 1;
+	}
+
+	thread_state_t* states = calloc(opts.threads, sizeof(thread_state_t));
+	client_t* clients = calloc(opts.connections, sizeof(client_t));
+	pthread_t* threads = calloc(opts.threads, sizeof(pthread_t));
+	if (!states || !clients || !threads) {
+		fprintf(stderr, "Error: out of memory\n");
+		return 1;
+	}
+
+	uint64_t start = now_ns();
+	int assigned = 0;
+	for (int i = 0; i < opts.threads; i++) {
+		thread_state_t* ts = &states[i];
+		ts->opts = &opts;
+		ts->id = i;
+		ts->num_clients = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+		ts->clients = clients + assigned;
+		assigned += ts->num_clients;
+		ts->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		ts->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+		ts->start_ns = start;
+		ts->measure_ns = start + (uint64_t)(opts.warmup * 1e9);
+		ts->end_ns = ts->measure_ns + (uint64_t)(opts.duration * 1e9);
+		ts->rate = opts.rate / opts.threads;
+		if (ts->epoll_fd < 0 || pthread_create(&threads[i], NULL, run_thread, ts) != 0) {
+			fprintf(stderr, "Error: could not start thread %d\n", i);
+			return 1;
+		}
+	}
+
+	histogram_t total;
+	memset(&total, 0, sizeof(total));
+	uint64_t bytes = 0, handshakes = 0, resumed = 0, connect_errors = 0, io_errors = 0, parse_errors = 0, backlog = 0;
+	uint64_t status_class[6] = { 0 };
+	for (int i = 0; i < opts.threads; i++) {
+		pthread_join(threads[i], NULL);
+		thread_state_t* ts = &states[i];
+		for (int b = 0; b < HIST_BUCKETS; b++) total.buckets[b] += ts->hist.buckets[b];
+		total.count += ts->hist.count;
+		total.sum_us += ts->hist.sum_us;
+		if (ts->hist.max_us > total.max_us) total.max_us = ts->hist.max_us;
+		for (int s = 0; s < 6; s++) status_class[s] += ts->status_class[s];
+		bytes += ts->bytes;
+		handshakes += ts->handshakes;
+		resumed += ts->resumed;
+		connect_errors += ts->connect_errors;
+		io_errors += ts->io_errors;
+		parse_errors += ts->parse_errors;
+		backlog += ts->backlog;
+		close(ts->epoll_fd);
+	}
+
+	printf("{\"name\":\"%s\",\"connections\":%d,\"threads\":%d,\"duration_s\":%.3f,"
+			"\"pipeline\":%d,\"keepalive\":%s,\"rate\":%.1f,\"tls\":%s,"
+			"\"requests\":%lu,\"throughput_rps\":%.1f,\"bytes\":%lu,\"throughput_mib_s\":%.2f,"
+			"\"handshakes\":%lu,\"handshake_rate\":%.1f,\"resumed\":%lu,"
+			"\"status\":{\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu},"
+			"\"errors\":{\"connect\":%lu,\"io\":%lu,\"parse\":%lu},\"backlog\":%lu,"
+			"\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+			opts.name, opts.connections, opts.threads, opts.duration,
+			opts.keepalive ? opts.depth : 1, opts.keepalive ? "true" : "false", opts.rate, opts.tls ? "true" : "false",
+			total.count, total.count / opts.duration, bytes, bytes / opts.duration / (1 << 20),
+			handshakes, handshakes / opts.duration, resumed,
+			status_class[2], status_class[3], status_class[4], status_class[5],
+			connect_errors, io_errors, parse_errors, backlog,
+			total.count ? (double)total.sum_us / total.count : 0.0,
+			hist_percentile(&total, 0.50), hist_percentile(&total, 0.90),
+			hist_percentile(&total, 0.99), hist_percentile(&total, 0.999), total.max_us);
+
+#ifdef HAVE_TLS
+	SSL_CTX_free(opts.tls_ctx);
+#endif
+	free(threads);
+	free(clients);
+	free(states);
+	return 0;
+}
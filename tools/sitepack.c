@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "cache.h"
+#include "mime.h"
+#include "pack.h"
+#include "site.h"
+
+/*
+ * Offline site packer: walks document_root with the server's own URI rules and
+ * writes everything it would serve into one pack (see src/pack.h). Headers are
+ * built here, with the cache_control rules from the server's configuration,
+ * so the server only has to look a URI up and send. .br/.gz sidecars next to a
+ * source (see ./server --precompress) become its compressed variants.
+ *
+ * The pack is written beside the output under a temporary name and renamed
+ * over it, so a server whose document_pack is the output switches in one step.
+ */
+
+#define COPY_CHUNK (256 << 10)
+
+typedef struct {
+	int present;
+	uint64_t offset;
+	uint64_t len;
+	uint64_t hash;
+} body_t;
+
+// A file whose bodies are written the first time one of its URIs is emitted.
+typedef struct {
+	const char* path;
+	const mime_type_t* mime;
+	time_t mtime;
+	int encodings;
+	int written;
+	body_t bodies[PACK_VARIANTS];
+} pack_file_t;
+
+static struct {
+	int fd;
+	uint64_t end; // where the next body goes
+	pack_route_t* routes;
+	size_t count;
+	size_t capacity;
+	char* strings;
+	size_t strings_size;
+	size_t strings_capacity;
+	unsigned long files;
+	int failed;
+} out;
+
+static const server_config* config;
+static char root[PATH_MAX];
+static size_t root_len;
+
+static uint64_t align_up(uint64_t value) {
+	return (value + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
+
+static uint32_t add_string(const char* str, size_t len) {
+	if (out.strings_size + len + 1 > UINT32_MAX) {
+		fprintf(stderr, "Error: headers and URIs exceed 4 GiB\n");
+		out.failed = 1;
+		return 0;
+	}
+	if (out.strings_size + len + 1 > out.strings_capacity) {
+		size_t capacity = out.strings_capacity ? out.strings_capacity : 1 << 16;
+		while (capacity < out.strings_size + len + 1) capacity *= 2;
+		char* strings = realloc(out.strings, capacity);
+		if (!strings) {
+			fprintf(stderr, "Error: out of memory\n");
+			out.failed = 1;
+			return 0;
+		}
+		out.strings = strings;
+		out.strings_capacity = capacity;
+	}
+	uint32_t offset = out.strings_size;
+	memcpy(out.strings + offset, str, len);
+	out.strings[offset + len] = '\0';
+	out.strings_size += len + 1;
+	return offset;
+}
+
+// Copies a file into the body area and hashes it on the way, for its ETag.
+static int copy_body(const char* path, body_t* body) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	static char chunk[COPY_CHUNK];
+	uint64_t hash = 14695981039346656037ull;
+	uint64_t len = 0;
+	ssize_t n;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+		for (ssize_t i = 0; i < n; i++) {
+			hash ^= (unsigned char)chunk[i];
+			hash *= 1099511628211ull;
+		}
+		if (pwrite(out.fd, chunk, n, out.end + len) != n) {
+			fprintf(stderr, "Error: cannot write the pack: %s\n", strerror(errno));
+			close(fd);
+			return -1;
+		}
+		len += n;
+	}
+	if (n < 0) {
+		fprintf(stderr, "Error: cannot read %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	body->present = 1;
+	body->offset = out.end;
+	body->len = len;
+	body->hash = hash;
+	out.end = align_up(out.end + len);
+	return 0;
+}
+
+// A sidecar older than its source is left over from a previous deploy.
+static int fresh_sidecar(const char* path, const char* suffix, time_t source_mtime, char* sidecar, size_t size) {
+	struct stat st;
+	snprintf(sidecar, size, "%s.%s", path, suffix);
+	return stat(sidecar, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= source_mtime;
+}
+
+static int write_bodies(pack_file_t* file) {
+	if (copy_body(file->path, &file->bodies[PACK_IDENTITY]) != 0) return -1;
+	if (!file->mime->compressible) return 0;
+
+	char sidecar[PATH_MAX + 4];
+	if (fresh_sidecar(file->path, "br", file->mtime, sidecar, sizeof(sidecar))) {
+		if (copy_body(sidecar, &file->bodies[PACK_BR]) != 0) return -1;
+		file->encodings |= ENCODING_BR;
+	}
+	if (fresh_sidecar(file->path, "gz", file->mtime, sidecar, sizeof(sidecar))) {
+		if (copy_body(sidecar, &file->bodies[PACK_GZIP]) != 0) return -1;
+		file->encodings |= ENCODING_GZIP;
+	}
+	return 0;
+}
+
+static const char* cache_control_for(const char* uri) {
+	const char* value = NULL;
+	size_t best_len = 0;
+	for (int i = 0; i < config->num_cache_control_rules; i++) {
+		const cache_control_rule_t* rule = &config->cache_control_rules[i];
+		size_t len = strlen(rule->prefix);
+		if (len >= best_len && strncmp(uri, rule->prefix, len) == 0) {
+			value = rule->value;
+			best_len = len;
+		}
+	}
+	return value;
+}
+
+// The same 200 and 304 headers serve_static_file() builds, except that the
+// ETag is taken from the content, so it survives a repack of an unchanged file.
+static void build_variant(pack_variant_t* variant, const pack_file_t* file, int which, const char* uri) {
+	static const char* const codings[PACK_VARIANTS] = { NULL, "br", "gzip" };
+	const body_t* body = &file->bodies[which];
+
+	char etag[64];
+	int etag_len = snprintf(etag, sizeof(etag), "\"%016llx-%llx\"",
+			(unsigned long long)body->hash, (unsigned long long)body->len);
+	char last_modified[64];
+	struct tm mtime_tm;
+	gmtime_r(&file->mtime, &mtime_tm);
+	strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &mtime_tm);
+
+	char validators[384];
+	const char* cache_control = cache_control_for(uri);
+	snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s",
+			etag, last_modified,
+			cache_control ? "Cache-Control: " : "", cache_control ? cache_control : "", cache_control ? "\r\n" : "",
+			file->encodings ? "Vary: Accept-Encoding\r\n" : "");
+
+	char encoding_header[48] = "";
+	if (codings[which]) {
+		snprintf(encoding_header, sizeof(encoding_header), "Content-Encoding: %s\r\n", codings[which]);
+	}
+
+	char header[1024];
+	char not_modified[1024];
+	int header_len = snprintf(header, sizeof(header),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %llu\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"%s%s"
+			"X-Content-Type-Options: nosniff\r\n"
+			"X-Frame-Options: DENY\r\n"
+			"Connection: keep-alive\r\n\r\n",
+			file->mime->type, (unsigned long long)body->len, encoding_header, validators);
+	int not_modified_len = snprintf(not_modified, sizeof(not_modified),
+			"HTTP/1.1 304 Not Modified\r\n"
+			"%s"
+			"Connection: keep-alive\r\n\r\n",
+			validators);
+	if (header_len >= (int)sizeof(header) || not_modified_len >= (int)sizeof(not_modified)) {
+		fprintf(stderr, "Error: response header for %s is too long\n", uri);
+		out.failed = 1;
+		return;
+	}
+
+	variant->body_offset = body->offset;
+	variant->body_len = body->len;
+	variant->header = add_string(header, header_len);
+	variant->header_len = header_len;
+	variant->not_modified = add_string(not_modified, not_modified_len);
+	variant->not_modified_len = not_modified_len;
+	variant->etag = add_string(etag, etag_len);
+}
+
+static void emit_route(const char* uri, size_t len, void* arg) {
+	pack_file_t* file = arg;
+	if (out.failed) return;
+	if (!file->written) {
+		file->written = 1;
+		out.files++;
+		if (write_bodies(file) != 0) {
+			out.failed = 1;
+			return;
+		}
+	}
+
+	if (out.count == out.capacity) {
+		size_t capacity = out.capacity ? out.capacity * 2 : 256;
+		pack_route_t* routes = realloc(out.routes, capacity * sizeof(pack_route_t));
+		if (!routes) {
+			fprintf(stderr, "Error: out of memory\n");
+			out.failed = 1;
+			return;
+		}
+		out.routes = routes;
+		out.capacity = capacity;
+	}
+
+	pack_route_t* route = &out.routes[out.count];
+	memset(route, 0, sizeof(*route));
+	route->uri = add_string(uri, len);
+	route->encodings = file->encodings;
+	route->last_modified = file->mtime;
+	// build_variant() wants the URI terminated, for the Cache-Control prefix match.
+	char uri_buf[PATH_MAX];
+	snprintf(uri_buf, sizeof(uri_buf), "%.*s", (int)len, uri);
+	for (int which = 0; which < PACK_VARIANTS; which++) {
+		if (file->bodies[which].present) build_variant(&route->variants[which], file, which, uri_buf);
+	}
+	out.count++;
+}
+
+static void pack_source(const char* rel, const char* path, const struct stat* st) {
+	pack_file_t file;
+	memset(&file, 0, sizeof(file));
+	file.path = path;
+	file.mime = mime_lookup(path);
+	file.mtime = st->st_mtime;
+	site_file_uris(rel, emit_route, &file);
+}
+
+// The same files the server's route table takes: regular ones, and symlinks
+// leading to a regular file inside document_root.
+static int walk_cb(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+	(void)ftwbuf;
+	if (typeflag == FTW_F && S_ISREG(sb->st_mode)) {
+		pack_source(fpath + root_len, fpath, sb);
+	} else if (typeflag == FTW_SL) {
+		char target[PATH_MAX];
+		struct stat st;
+		if (realpath(fpath, target) && strncmp(target, root, root_len) == 0 && target[root_len] == '/' &&
+				stat(target, &st) == 0 && S_ISREG(st.st_mode)) {
+			pack_source(fpath + root_len, target, &st);
+		}
+	}
+	return out.failed;
+}
+
+static int write_all(const void* data, size_t len, uint64_t offset) {
+	const char* p = data;
+	while (len > 0) {
+		ssize_t n = pwrite(out.fd, p, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Error: cannot write the pack: %s\n", strerror(errno));
+			return -1;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+// Index, routes and strings go after the bodies, and the header last of all,
+// so a pack cut short never passes for a whole one.
+static int write_index(void) {
+	uint32_t num_slots = 16;
+	while (num_slots < out.count * 2) num_slots <<= 1;
+	uint32_t* slots = calloc(num_slots, sizeof(uint32_t));
+	if (!slots) {
+		fprintf(stderr, "Error: out of memory\n");
+		return -1;
+	}
+	uint32_t mask = num_slots - 1;
+	size_t duplicates = 0;
+	for (size_t i = 0; i < out.count; i++) {
+		const char* uri = out.strings + out.routes[i].uri;
+		uint32_t slot = pack_hash(uri) & mask;
+		while (slots[slot] && strcmp(out.strings + out.routes[slots[slot] - 1].uri, uri) != 0) {
+			slot = (slot + 1) & mask;
+		}
+		if (slots[slot]) {
+			duplicates++;
+			continue;
+		}
+		slots[slot] = i + 1;
+	}
+	if (duplicates > 0) {
+		fprintf(stderr, "Warning: %zu URIs came from more than one file; the first one walked is kept.\n", duplicates);
+	}
+
+	pack_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.byte_order = PACK_BYTE_ORDER;
+	header.num_routes = out.count;
+	header.num_slots = num_slots;
+	header.routes_offset = out.end;
+	header.slots_offset = header.routes_offset + out.count * sizeof(pack_route_t);
+	header.strings_offset = header.slots_offset + (uint64_t)num_slots * sizeof(uint32_t);
+	header.strings_size = out.strings_size;
+	header.file_size = header.strings_offset + header.strings_size;
+
+	int result = write_all(out.routes, out.count * sizeof(pack_route_t), header.routes_offset) != 0 ||
+			write_all(slots, num_slots * sizeof(uint32_t), header.slots_offset) != 0 ||
+			write_all(out.strings, out.strings_size, header.strings_offset) != 0 ||
+			write_all(&header, sizeof(header), 0) != 0 ? -1 : 0;
+	free(slots);
+	return result;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+			"Usage: %s [options] [output]\n"
+			"  -c file       server configuration to take document_root, cache_control\n"
+			"                and the default output (document_pack) from (server.conf)\n"
+			"  -r dir        document_root to pack instead of the configured one\n",
+			prog);
+}
+
+int main(int argc, char* argv[]) {
+	const char* config_path = NULL;
+	const char* root_arg = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:r:h")) != -1) {
+		switch (opt) {
+			case 'c': config_path = optarg; break;
+			case 'r': root_arg = optarg; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	static server_config server;
+	config_init_defaults(&server);
+	config = &server;
+	if (config_path ? load_config(config_path, &server) != 0 :
+			access("server.conf", R_OK) == 0 && load_config("server.conf", &server) != 0) {
+		free_config(&server);
+		return 1;
+	}
+
+	const char* output = optind < argc ? argv[optind] : server.document_pack;
+	if (!output || optind + 1 < argc) {
+		usage(argv[0]);
+		free_config(&server);
+		return 1;
+	}
+	if (!realpath(root_arg ? root_arg : server.document_root, root)) {
+		fprintf(stderr, "Error: invalid document_root %s: %s\n", root_arg ? root_arg : server.document_root, strerror(errno));
+		free_config(&server);
+		return 1;
+	}
+	root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+
+	// Same directory as the output, so the final rename cannot cross filesystems.
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", output, (int)getpid());
+	out.fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (out.fd < 0) {
+		fprintf(stderr, "Error: cannot create %s: %s\n", tmp_path, strerror(errno));
+		free_config(&server);
+		return 1;
+	}
+	out.end = PACK_ALIGN;
+	// Offset 0 is the empty string, so an unused field always points at one.
+	add_string("", 0);
+
+	int result = -1;
+	if (nftw(root, walk_cb, 16, FTW_PHYS) != 0 || out.failed) {
+		if (!out.failed) fprintf(stderr, "Error: cannot walk %s: %s\n", root, strerror(errno));
+	} else if (write_index() == 0 && fsync(out.fd) == 0) {
+		result = 0;
+	}
+	if (close(out.fd) != 0) result = -1;
+
+	if (result == 0 && rename(tmp_path, output) != 0) {
+		fprintf(stderr, "Error: cannot rename %s to %s: %s\n", tmp_path, output, strerror(errno));
+		result = -1;
+	}
+	if (result != 0) {
+		unlink(tmp_path);
+	} else {
+		// Make the rename itself durable.
+		char dir_buf[PATH_MAX];
+		snprintf(dir_buf, sizeof(dir_buf), "%s", output);
+		int dir_fd = open(dirname(dir_buf), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+		printf("Packed %zu URIs from %lu files under %s into %s\n", out.count, out.files, root, output);
+	}
+
+	free(out.routes);
+	free(out.strings);
+	free_config(&server);
+	return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Built in, so an eager re-arm can use the wheel's own insert.
+#include "timer.c"
+
+/*
+ * Cost of re-arming a connection's timeout once per request, with many
+ * connections open:
+ *
+ *   wheel-lazy   timer_node_touch(), as the workers do: a later deadline is
+ *                only recorded, and the node moves when its old slot comes due
+ *   wheel-eager  the same wheel, but every re-arm unlinks the node and inserts
+ *                it again, as the wheel before it did
+ *   timerfd      one timerfd per connection, re-armed with timerfd_settime()
+ *   floor        only what every wheel re-arm starts with: reaching the node
+ *                and reading the clock
+ *
+ * Requests go to connections picked at random, each seeing one every
+ * REQUEST_INTERVAL_MS on average. The wheels run on a simulated clock, moved on
+ * a tick (by moving start_ms back) after each tick's worth of requests, and
+ * timer_wheel_advance() is timed along with the re-arms, so the work lazy
+ * re-arming puts off is counted. A connection that
+ * expires anyway is armed again, as a new one would be.
+ *
+ * A timerfd is a file descriptor, so that variant arms as many as the open file
+ * limit allows and says how many. Prints one JSON line per variant.
+ *
+ * Usage: timerbench [connections] [rearms]
+ */
+
+#define KEEPALIVE_TIMEOUT 60
+#define REQUEST_INTERVAL_MS 10000
+
+static uint64_t rng_state = 88172645463325292ull;
+
+static inline uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void eager_touch(timer_wheel_t* tw, timer_node_t* node, int timeout_sec) {
+	uint64_t now_tick = (monotonic_ms() - tw->start_ms) / TIMER_TICK_MS;
+	if (now_tick < tw->now) now_tick = tw->now;
+	node->deadline = now_tick + ((uint64_t)timeout_sec * 1000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+	timer_node_remove(tw, node);
+	wheel_insert(tw, node, node->deadline);
+}
+
+static void print_result(const char* method, long connections, long rearms, double elapsed, double advance, long expired) {
+	printf("{\"bench\":\"timer\",\"method\":\"%s\",\"connections\":%ld,\"rearms\":%ld,"
+			"\"ns_per_rearm\":%.1f,\"advance_ns_per_rearm\":%.1f,\"expired\":%ld}\n",
+			method, connections, rearms, elapsed / rearms, advance / rearms, expired);
+}
+
+static int run_wheel(const char* method, int lazy, long connections, long rearms) {
+	timer_wheel_t* tw = timer_wheel_create();
+	timer_node_t* nodes = calloc(connections, sizeof(timer_node_t));
+	if (!tw || !nodes) {
+		fprintf(stderr, "timerbench: cannot create a wheel of %ld nodes\n", connections);
+		timer_wheel_destroy(tw);
+		free(nodes);
+		return -1;
+	}
+	for (long i = 0; i < connections; i++) {
+		timer_node_init(&nodes[i], &nodes[i]);
+		timer_node_touch(tw, &nodes[i], KEEPALIVE_TIMEOUT);
+	}
+
+	long per_tick = connections * TIMER_TICK_MS / REQUEST_INTERVAL_MS;
+	if (per_tick < 1) per_tick = 1;
+	long expired = 0;
+	double advance = 0;
+	double start = now_ns();
+	for (long done = 0; done < rearms; done++) {
+		timer_node_t* node = &nodes[rng() % connections];
+		if (lazy) {
+			timer_node_touch(tw, node, KEEPALIVE_TIMEOUT);
+		} else {
+			eager_touch(tw, node, KEEPALIVE_TIMEOUT);
+		}
+
+		if (done % per_tick == per_tick - 1) {
+			double advance_start = now_ns();
+			tw->start_ms -= TIMER_TICK_MS;
+			timer_node_t* list = timer_wheel_advance(tw);
+			while (list) {
+				timer_node_t* next = list->next;
+				timer_node_touch(tw, list, KEEPALIVE_TIMEOUT);
+				expired++;
+				list = next;
+			}
+			advance += now_ns() - advance_start;
+		}
+	}
+	double elapsed = now_ns() - start;
+	print_result(method, connections, rearms, elapsed, advance, expired);
+
+	timer_wheel_destroy(tw);
+	free(nodes);
+	return 0;
+}
+
+static void run_floor(long connections, long rearms) {
+	timer_node_t* nodes = calloc(connections, sizeof(timer_node_t));
+	if (!nodes) return;
+	double start = now_ns();
+	for (long done = 0; done < rearms; done++) {
+		timer_node_t* node = &nodes[rng() % connections];
+		node->deadline = monotonic_ms();
+	}
+	double elapsed = now_ns() - start;
+	print_result("floor", connections, rearms, elapsed, 0, 0);
+	free(nodes);
+}
+
+static int run_timerfd(long connections, long rearms) {
+	// Room for as many timers as the hard limit on open files allows.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && (rlim_t)connections + 16 > limit.rlim_cur) {
+		connections = (long)limit.rlim_cur - 16;
+	}
+
+	int* fds = malloc(connections * sizeof(int));
+	if (!fds) return -1;
+	struct itimerspec timeout = { .it_value = { KEEPALIVE_TIMEOUT, 0 } };
+	long opened = 0;
+	for (; opened < connections; opened++) {
+		fds[opened] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fds[opened] < 0) break;
+		timerfd_settime(fds[opened], 0, &timeout, NULL);
+	}
+	if (opened == 0) {
+		fprintf(stderr, "timerbench: timerfd_create: %s\n", strerror(errno));
+		free(fds);
+		return -1;
+	}
+
+	double start = now_ns();
+	for (long done = 0; done < rearms; done++) {
+		timerfd_settime(fds[rng() % opened], 0, &timeout, NULL);
+	}
+	double elapsed = now_ns() - start;
+	print_result("timerfd", opened, rearms, elapsed, 0, 0);
+
+	for (long i = 0; i < opened; i++) close(fds[i]);
+	free(fds);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	long connections = argc > 1 ? atol(argv[1]) : 100000;
+	long rearms = argc > 2 ? atol(argv[2]) : 5000000;
+	if (connections <= 0 || rearms <= 0) {
+		fprintf(stderr, "Usage: %s [connections] [rearms]\n", argv[0]);
+		return 1;
+	}
+
+	if (run_wheel("wheel-lazy", 1, connections, rearms) != 0) return 1;
+	if (run_wheel("wheel-eager", 0, connections, rearms) != 0) return 1;
+	if (run_timerfd(connections, rearms) != 0) return 1;
+	run_floor(connections, rearms);
+	return 0;
+}